@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+/*
+Free space allocator
+The on-disk bitmap [sb.bitmap_start..sb.bitmap_end] has one bit per data block,
+bit i set means block sb.data_start + i is in use.
+In memory the bitmap is summarised by a segment tree whose leaves are bitmap
+words, every node knows its free prefix, free suffix and longest free run, so
+the first free run of n blocks is found in O(log n) and marking k words costs
+O(k + log n).
+Blocks are given back to the host filesystem [punched out of the disk file]
+once they are really free, after the commit that freed them and after the
+readers that could still be on them.
+*/
+
+// free blocks covered by a tree node at heap index i
+static uint64_t node_len(const struct store_alloc *a, uint64_t i) {
+    int depth = 63 - __builtin_clzll(i);
+    int leaf_depth = 63 - __builtin_clzll(a->leaves);
+    return 64ull << (leaf_depth - depth);
+}
+
+static void leaf_set(struct store_alloc *a, uint64_t w) {
+    struct alloc_node *n = &a->tree[a->leaves + w];
+    uint64_t used = w < a->n_words ? a->map[w] : ~0ull;
+    if (used == 0) {
+        n->prefix = n->suffix = n->best = 64;
+        return;
+    }
+    n->prefix = __builtin_ctzll(used);
+    n->suffix = __builtin_clzll(used);
+    // longest run of set bits in the free mask
+    uint64_t f = ~used;
+    uint32_t best = 0;
+    while (f) {
+        f &= f << 1;
+        best++;
+    }
+    n->best = best;
+}
+
+static void node_pull(struct store_alloc *a, uint64_t i) {
+    const struct alloc_node *l = &a->tree[2 * i], *r = &a->tree[2 * i + 1];
+    uint64_t half = node_len(a, i) / 2;
+    struct alloc_node *n = &a->tree[i];
+    n->prefix = l->prefix == half ? half + r->prefix : l->prefix;
+    n->suffix = r->suffix == half ? half + l->suffix : r->suffix;
+    n->best = l->best > r->best ? l->best : r->best;
+    if (l->suffix + r->prefix > n->best)
+        n->best = l->suffix + r->prefix;
+}
+
+// refresh leaves for words [lo, hi] and every ancestor above them
+static void tree_update(struct store_alloc *a, uint64_t lo, uint64_t hi) {
+    for (uint64_t w = lo; w <= hi; w++)
+        leaf_set(a, w);
+    lo += a->leaves;
+    hi += a->leaves;
+    while (lo > 1) {
+        lo >>= 1;
+        hi >>= 1;
+        for (uint64_t i = lo; i <= hi; i++)
+            node_pull(a, i);
+    }
+}
+
+static void mark_dirty(struct store_disk *d, uint64_t lo_bit, uint64_t hi_bit) {
+    uint64_t bits = (uint64_t)d->sb.block * 8;
+    for (uint64_t b = lo_bit / bits; b <= hi_bit / bits; b++)
+        d->alloc.dirty[b] = 1;
+}
+
+// set or clear bits [start, start+count)
+static void map_range(struct store_disk *d, uint64_t start, uint64_t count, bool used) {
+    struct store_alloc *a = &d->alloc;
+    uint64_t end = start + count;
+    for (uint64_t bit = start; bit < end; ) {
+        uint64_t w = bit / 64, off = bit % 64;
+        uint64_t n = 64 - off < end - bit ? 64 - off : end - bit;
+        uint64_t mask = (n == 64 ? ~0ull : ((1ull << n) - 1)) << off;
+        if (used)
+            a->map[w] |= mask;
+        else
+            a->map[w] &= ~mask;
+        bit += n;
+    }
+    tree_update(a, start / 64, (end - 1) / 64);
+    mark_dirty(d, start, end - 1);
+}
+
+// first bit of the leftmost free run of n blocks, caller checks root.best >= n
+static uint64_t tree_find(const struct store_alloc *a, uint64_t n) {
+    uint64_t i = 1, base = 0;
+    while (i < a->leaves) {
+        const struct alloc_node *l = &a->tree[2 * i], *r = &a->tree[2 * i + 1];
+        uint64_t half = node_len(a, i) / 2;
+        if (l->best >= n) {
+            i = 2 * i;
+        } else if ((uint64_t)l->suffix + r->prefix >= n) {
+            return base + half - l->suffix;
+        } else {
+            i = 2 * i + 1;
+            base += half;
+        }
+    }
+    // inside a single word
+    uint64_t used = a->map[i - a->leaves];
+    uint64_t run = 0;
+    for (uint64_t b = 0; b < 64; b++) {
+        if (used & (1ull << b)) {
+            run = 0;
+        } else if (++run == n) {
+            return base + b + 1 - n;
+        }
+    }
+    return base;
+}
+
+// free blocks starting exactly at bit, up to max
+static uint64_t free_run_at(const struct store_alloc *a, uint64_t bit, uint64_t max) {
+    uint64_t n = 0;
+    while (n < max && bit + n < a->n_blocks) {
+        uint64_t w = (bit + n) / 64, off = (bit + n) % 64;
+        uint64_t used = a->map[w] >> off;
+        uint64_t avail = used ? (uint64_t)__builtin_ctzll(used) : 64 - off;
+        n += avail;
+        if (avail < 64 - off)
+            break;
+    }
+    return n < max ? n : max;
+}
+
+// qsort order by first block, for pend pairs and retired runs alike [both start with the bit]
+static int cmp_bit(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+Blocks retired by earlier writers are free in the on-disk bitmap but readers
+may still be on them, they stay used here until alloc_reclaim lets them go.
+The runs are only trusted for the disk file and journal seq they were written
+for, a disk made again or rewritten under the same name starts over.
+*/
+static void load_retired(struct store_disk *d) {
+    struct reader_table *t = d->rd.t;
+    struct stat st;
+    if (!t || fstat(d->fd, &st) != 0)
+        return;
+    if (t->dev != (uint64_t)st.st_dev || t->ino != (uint64_t)st.st_ino || t->jseq != d->j.seq ||
+        t->n_retired > RETIRE_MAX) {
+        t->dev = st.st_dev;
+        t->ino = st.st_ino;
+        t->jseq = d->j.seq;
+        t->n_retired = 0;
+    }
+    for (uint32_t i = 0; i < t->n_retired; i++) {
+        struct retired_run *r = &t->retired[i];
+        if (r->bit + r->count > d->alloc.n_blocks) {
+            t->n_retired = 0;
+            return;
+        }
+    }
+    for (uint32_t i = 0; i < t->n_retired; i++) {
+        map_range(d, t->retired[i].bit, t->retired[i].count, true);
+        d->alloc.n_free -= t->retired[i].count;
+    }
+    alloc_reclaim(d);
+}
+
+int alloc_load(struct store_disk *d) {
+    struct store_alloc *a = &d->alloc;
+    memset(a, 0, sizeof(*a));
+    a->n_blocks = d->sb.data_blocks;
+    a->n_words = (a->n_blocks + 63) / 64;
+    a->map_blocks = d->sb.bitmap_end - d->sb.bitmap_start + 1;
+    a->leaves = 1;
+    while (a->leaves < a->n_words)
+        a->leaves <<= 1;
+
+    size_t map_bytes = (size_t)a->map_blocks * d->sb.block;
+    a->map = malloc(map_bytes);
+    a->tree = malloc(2 * a->leaves * sizeof(struct alloc_node));
+    a->dirty = calloc(a->map_blocks, 1);
+    if (!a->map || !a->tree || !a->dirty) {
+        printf("Unable to alloc mem for free-space bitmap\n");
+        alloc_free_mem(a);
+        return 1;
+    }
+    if (pread(d->fd, a->map, map_bytes, (off_t)d->sb.bitmap_start * d->sb.block) != (ssize_t)map_bytes) {
+        printf("Failed to read free-space bitmap\n");
+        alloc_free_mem(a);
+        return 1;
+    }
+    // blocks past the end of the disk are never handed out
+    if (a->n_blocks % 64)
+        a->map[a->n_words - 1] |= ~0ull << (a->n_blocks % 64);
+
+    for (uint64_t w = 0; w < a->n_words; w++)
+        a->n_free += 64 - __builtin_popcountll(a->map[w]);
+    for (uint64_t w = 0; w < a->leaves; w++)
+        leaf_set(a, w);
+    for (uint64_t i = a->leaves - 1; i >= 1; i--)
+        node_pull(a, i);
+    load_retired(d);
+    return 0;
+}
+
+void alloc_free_mem(struct store_alloc *a) {
+    free(a->map);
+    free(a->tree);
+    free(a->dirty);
+    free(a->pend);
+    free(a->log);
+    free(a->shared);
+    memset(a, 0, sizeof(*a));
+}
+
+static int log_alloc(struct store_alloc *a, uint64_t bit, uint64_t count) {
+    if (a->n_log + 1 > a->cap_log) {
+        uint32_t cap = a->cap_log ? a->cap_log * 2 : 16;
+        uint64_t *log = realloc(a->log, cap * 2 * sizeof(*log));
+        if (!log)
+            return 1;
+        a->log = log;
+        a->cap_log = cap;
+    }
+    a->log[2 * a->n_log] = bit;
+    a->log[2 * a->n_log + 1] = count;
+    a->n_log++;
+    return 0;
+}
+
+static void take(struct store_disk *d, uint64_t bit, uint64_t count) {
+    struct store_alloc *a = &d->alloc;
+    map_range(d, bit, count, true);
+    a->n_free -= count;
+    stats_add(SC_ALLOC_CALLS, 1);
+    stats_add(SC_ALLOC_BLOCKS, count);
+    if (a->logging && log_alloc(a, bit, count) != 0)
+        a->log_lost = true;
+}
+
+/*
+Allocates up to want contiguous blocks, preferring the run that starts at goal
+[absolute block, 0 for no preference] so files keep growing in place.
+Falls back to the leftmost run big enough, or the largest run if none is.
+Returns blocks allocated [0 if the disk is full], first block in *pblk
+*/
+uint64_t alloc_extent(struct store_disk *d, uint64_t want, uint64_t goal, uint64_t *pblk) {
+    struct store_alloc *a = &d->alloc;
+    // readers that left since the last commit may have blocks to give back
+    if (a->n_free < want && d->rd.t && d->rd.t->n_retired)
+        alloc_reclaim(d);
+    if (want == 0 || a->n_free == 0)
+        return 0;
+
+    uint64_t bit = 0, got = 0;
+    if (goal >= d->sb.data_start && goal - d->sb.data_start < a->n_blocks) {
+        bit = goal - d->sb.data_start;
+        got = free_run_at(a, bit, want);
+    }
+    if (got == 0) {
+        uint64_t best = a->tree[1].best;
+        got = want < best ? want : best;
+        bit = tree_find(a, got);
+    }
+
+    take(d, bit, got);
+    *pblk = d->sb.data_start + bit;
+    return got;
+}
+
+/*
+Allocates up to want free blocks starting right at goal, for when only blocks
+that continue a file in place are worth having.
+Returns blocks allocated, 0 if goal itself is taken
+*/
+uint64_t alloc_at(struct store_disk *d, uint64_t goal, uint64_t want) {
+    struct store_alloc *a = &d->alloc;
+    if (want == 0 || a->n_free == 0 || goal < d->sb.data_start || goal - d->sb.data_start >= a->n_blocks)
+        return 0;
+    uint64_t bit = goal - d->sb.data_start;
+    uint64_t got = free_run_at(a, bit, want);
+    if (got)
+        take(d, bit, got);
+    return got;
+}
+
+/*
+Tells the host filesystem nothing is kept in the count blocks at bit, they read
+as zeroes from now on. A disk file on a filesystem that can't punch holes
+[or a device that can't discard] just keeps them.
+*/
+static void punch(struct store_disk *d, uint64_t bit, uint64_t count) {
+    struct store_alloc *a = &d->alloc;
+    if (a->no_punch || count == 0)
+        return;
+    off_t off = (off_t)(d->sb.data_start + bit) * d->sb.block;
+    if (fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, (off_t)count * d->sb.block) != 0) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            perror("punch freed blocks");
+        a->no_punch = true;
+        return;
+    }
+    stats_add(SC_PUNCHED_BLOCKS, count);
+}
+
+/*
+Takes a run of exactly count blocks for a copy that goes on across txns
+[defrag.c]. The run stays free in the bitmap written out until alloc_unclaim
+keeps it, so a crash in between loses nothing. One claim at a time.
+Returns 0 with the first block in *pblk, 1 when no free run is that long
+*/
+int alloc_claim(struct store_disk *d, uint64_t count, uint64_t *pblk) {
+    struct store_alloc *a = &d->alloc;
+    if (a->n_free < count && d->rd.t && d->rd.t->n_retired)
+        alloc_reclaim(d);
+    if (a->claim || count == 0 || a->tree[1].best < count)
+        return 1;
+    uint64_t bit = tree_find(a, count);
+    bool logging = a->logging;
+    a->logging = false;
+    take(d, bit, count);
+    a->logging = logging;
+    a->claim_bit = bit;
+    a->claim = count;
+    *pblk = d->sb.data_start + bit;
+    return 0;
+}
+
+// Ends the claim, its blocks are used from the next commit on with keep, else free again right away
+void alloc_unclaim(struct store_disk *d, bool keep) {
+    struct store_alloc *a = &d->alloc;
+    if (!a->claim)
+        return;
+    if (keep) {
+        mark_dirty(d, a->claim_bit, a->claim_bit + a->claim - 1);
+    } else {
+        // nothing committed points at what the claimer wrote there
+        map_range(d, a->claim_bit, a->claim, false);
+        a->n_free += a->claim;
+        punch(d, a->claim_bit, a->claim);
+    }
+    a->claim = 0;
+}
+
+/*
+Frees blocks. The on-disk bitmap shows them free from the next commit on, but
+they are only handed out again once that commit is durable [alloc_settle], so
+a crash can never leave a committed file pointing at blocks reused for new data
+*/
+void alloc_release(struct store_disk *d, uint64_t pblk, uint64_t count) {
+    struct store_alloc *a = &d->alloc;
+    if (count == 0)
+        return;
+    if (a->n_pend + 1 > a->cap_pend) {
+        uint32_t cap = a->cap_pend ? a->cap_pend * 2 : 16;
+        uint64_t *pend = realloc(a->pend, cap * 2 * sizeof(*pend));
+        if (!pend) {
+            // can't defer, leak the blocks rather than risk reusing them early
+            printf("Unable to alloc mem to free %" PRIu64 " blocks\n", count);
+            return;
+        }
+        a->pend = pend;
+        a->cap_pend = cap;
+    }
+    uint64_t bit = pblk - d->sb.data_start;
+    a->pend[2 * a->n_pend] = bit;
+    a->pend[2 * a->n_pend + 1] = count;
+    a->n_pend++;
+    a->pend_blocks += count;
+    mark_dirty(d, bit, bit + count - 1);
+    stats_add(SC_FREED_BLOCKS, count);
+}
+
+/*
+Savepoint for one operation inside a txn shared with others [the daemon].
+alloc_undo hands back everything allocated since alloc_mark right away, nothing
+committed points at those blocks, and forgets frees queued since the mark.
+*/
+void alloc_mark(struct store_disk *d) {
+    struct store_alloc *a = &d->alloc;
+    a->logging = true;
+    a->log_lost = false;
+    a->n_log = 0;
+    a->n_shared = 0;
+    a->mark_pend = a->n_pend;
+}
+
+// Returns 0 if every block taken since alloc_mark is free again, 1 if some were lost
+int alloc_undo(struct store_disk *d) {
+    struct store_alloc *a = &d->alloc;
+    for (uint32_t i = 0; i < a->n_log; i++) {
+        map_range(d, a->log[2 * i], a->log[2 * i + 1], false);
+        a->n_free += a->log[2 * i + 1];
+    }
+    for (uint32_t i = a->mark_pend; i < a->n_pend; i++)
+        a->pend_blocks -= a->pend[2 * i + 1];
+    a->n_pend = a->mark_pend;
+    // blocks the op shared lose the owner it gave them, owners it let go come back
+    for (uint32_t i = a->n_shared; i-- > 0; )
+        if (dedup_revert(d, &a->shared[i]) != 0)
+            a->log_lost = true;
+    a->logging = false;
+    a->n_log = 0;
+    a->n_shared = 0;
+    return a->log_lost;
+}
+
+// Ends the savepoint, keeping everything done since alloc_mark
+void alloc_keep(struct store_disk *d) {
+    d->alloc.logging = false;
+    d->alloc.n_log = 0;
+    d->alloc.n_shared = 0;
+}
+
+// Whether the readers table holds bit, a binary search over the runs sorted by bit
+static bool retired_has(const struct reader_table *t, uint64_t bit) {
+    uint32_t lo = 0, hi = t->n_retired;
+    // first run starting past bit, the one before it is the only one that can hold it
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (t->retired[mid].bit <= bit)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo && bit < t->retired[lo - 1].bit + t->retired[lo - 1].count;
+}
+
+/*
+Block pblk belongs to a file and stays that way through the open txn: set in
+the bitmap and neither among the frees waiting for the commit nor retired
+*/
+bool alloc_owned(struct store_disk *d, uint64_t pblk) {
+    struct store_alloc *a = &d->alloc;
+    if (pblk < d->sb.data_start || pblk - d->sb.data_start >= a->n_blocks)
+        return false;
+    uint64_t bit = pblk - d->sb.data_start;
+    if (!(a->map[bit / 64] & (1ull << (bit % 64))))
+        return false;
+    if (a->claim && bit >= a->claim_bit && bit < a->claim_bit + a->claim)
+        return false;
+    for (uint32_t i = 0; i < a->n_pend; i++)
+        if (bit >= a->pend[2 * i] && bit < a->pend[2 * i] + a->pend[2 * i + 1])
+            return false;
+    return !d->rd.t || !retired_has(d->rd.t, bit);
+}
+
+/*
+Hands the blocks freed in the open txn to the readers table before it commits,
+tagged with the epoch its checkpoint ends, see readers.c. They stay used here
+after alloc_settle until no reader from before that epoch is left.
+The table has room for RETIRE_MAX runs, a commit waits up to RETIRE_WAIT_MS
+for readers to make room, runs that still don't fit are freed as before.
+The runs go in sorted, merged from the back into the sorted table.
+Returns 0, a commit never fails over this
+*/
+int alloc_retire(struct store_disk *d) {
+    struct store_alloc *a = &d->alloc;
+    struct reader_table *t = d->rd.t;
+    a->kept = 0;
+    if (!t)
+        return 0;
+    if (a->map && a->n_pend > RETIRE_MAX - t->n_retired)
+        alloc_reclaim(d);
+    // only readers still in can make room
+    for (int ms = 0; a->map && a->n_pend > RETIRE_MAX - t->n_retired && t->n_retired && ms < RETIRE_WAIT_MS; ms++) {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+        alloc_reclaim(d);
+    }
+    a->retired = true;
+    a->table_jseq = t->jseq;
+    // the runs are good for the journal seq this txn leaves behind [a crash halfway through the merge
+    // leaves a table the next writer won't trust]
+    t->jseq = d->j.seq + 1;
+    uint64_t epoch = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST) + 1;
+    if (a->map)
+        a->kept = a->n_pend < RETIRE_MAX - t->n_retired ? a->n_pend : RETIRE_MAX - t->n_retired;
+    if (a->kept)
+        qsort(a->pend, a->kept, 2 * sizeof(*a->pend), cmp_bit);
+    uint32_t i = t->n_retired, w = t->n_retired + a->kept;
+    for (uint32_t j = a->kept; j > 0; ) {
+        if (i > 0 && t->retired[i - 1].bit > a->pend[2 * (j - 1)])
+            t->retired[--w] = t->retired[--i];
+        else {
+            j--;
+            t->retired[--w] = (struct retired_run){ a->pend[2 * j], a->pend[2 * j + 1], epoch };
+        }
+    }
+    t->n_retired += a->kept;
+    if (a->kept < a->n_pend && reader_oldest(d) != UINT64_MAX)
+        printf("Readers table is full, %" PRIu32 " runs of blocks are freed without waiting for readers\n",
+               a->n_pend - a->kept);
+    return 0;
+}
+
+// Frees retired runs no reader can be on any more
+void alloc_reclaim(struct store_disk *d) {
+    struct store_alloc *a = &d->alloc;
+    struct reader_table *t = d->rd.t;
+    if (!t || !a->map || t->n_retired == 0)
+        return;
+    uint64_t oldest = reader_oldest(d);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < t->n_retired; i++) {
+        struct retired_run r = t->retired[i];
+        if (r.epoch <= oldest) {
+            map_range(d, r.bit, r.count, false);
+            a->n_free += r.count;
+            punch(d, r.bit, r.count);
+        } else {
+            t->retired[n++] = r;
+        }
+    }
+    t->n_retired = n;
+}
+
+// Makes blocks freed in the last txn allocatable once it committed, forgets them if it didn't
+void alloc_settle(struct store_disk *d, bool committed) {
+    struct store_alloc *a = &d->alloc;
+    // a txn that didn't make it takes back what alloc_retire put in the table, both are sorted
+    if (a->retired && !committed) {
+        struct reader_table *t = d->rd.t;
+        uint32_t n = 0, j = 0;
+        for (uint32_t i = 0; i < t->n_retired; i++) {
+            if (j < a->kept && t->retired[i].bit == a->pend[2 * j])
+                j++;
+            else
+                t->retired[n++] = t->retired[i];
+        }
+        t->n_retired = n;
+        t->jseq = a->table_jseq;
+    }
+    a->retired = false;
+    if (!a->map)
+        return;
+    // runs the readers table took stay used until alloc_reclaim
+    for (uint32_t i = a->kept; committed && i < a->n_pend; i++) {
+        map_range(d, a->pend[2 * i], a->pend[2 * i + 1], false);
+        a->n_free += a->pend[2 * i + 1];
+        punch(d, a->pend[2 * i], a->pend[2 * i + 1]);
+    }
+    if (committed)
+        alloc_reclaim(d);
+    // the bitmap blocks were dirtied by map_range again, they flush with the next txn
+    a->kept = 0;
+    a->n_pend = 0;
+    a->mark_pend = 0;
+    a->pend_blocks = 0;
+    d->sb.data_space_left = a->n_free * d->sb.block;
+}
+
+// clears bits [lo, lo + count) in img, the bitmap block holding bits [first, first + bits)
+static void clear_bits(uint64_t *img, uint64_t first, uint64_t bits, uint64_t lo, uint64_t count) {
+    uint64_t hi = lo + count;
+    if (lo < first)
+        lo = first;
+    if (hi > first + bits)
+        hi = first + bits;
+    for (uint64_t bit = lo; bit < hi; bit++)
+        img[(bit - first) / 64] &= ~(1ull << (bit % 64));
+}
+
+// puts bitmap blocks touched since the last flush into the open txn
+int alloc_flush(struct store_disk *d) {
+    struct store_alloc *a = &d->alloc;
+    uint64_t bits = (uint64_t)d->sb.block * 8;
+    uint64_t *img = malloc(d->sb.block);
+    if (!img)
+        return 1;
+    for (uint32_t b = 0; b < a->map_blocks; b++) {
+        if (!a->dirty[b])
+            continue;
+        memcpy(img, (const char *)a->map + (size_t)b * d->sb.block, d->sb.block);
+        // pending frees already count as free on disk, so do retired ones
+        for (uint32_t i = 0; i < a->n_pend; i++)
+            clear_bits(img, b * bits, bits, a->pend[2 * i], a->pend[2 * i + 1]);
+        for (uint32_t i = 0; d->rd.t && i < d->rd.t->n_retired; i++)
+            clear_bits(img, b * bits, bits, d->rd.t->retired[i].bit, d->rd.t->retired[i].count);
+        if (a->claim)
+            clear_bits(img, b * bits, bits, a->claim_bit, a->claim);
+        if (disk_write_meta(d, (off_t)(d->sb.bitmap_start + b) * d->sb.block, img, d->sb.block) != 0) {
+            free(img);
+            return 1;
+        }
+        a->dirty[b] = 0;
+    }
+    free(img);
+    d->sb.data_space_left = (a->n_free + a->pend_blocks + a->claim) * d->sb.block;
+    return 0;
+}
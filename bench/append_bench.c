@@ -0,0 +1,141 @@
+#include "bench.h"
+
+/*
+Sustained appends to one file vs a plain file
+Usage: bench/append_bench [disk_path]   [run from the repo root, needs ./store]
+For each record size appends records to a single file, committing after every
+append [each one durable] and then every BATCH appends, and does the same with
+write + fdatasync on a plain file next to the disk, the way dd conv=fdatasync
+would. Reports throughput, data syscalls and journaled metadata blocks per
+append [the superblock goes in every commit, the bitmap only when the file took
+blocks] and the extents the file ended up in.
+*/
+
+#define RECORDS 20000
+#define TOTAL (64 << 20)        // bytes appended per run at most
+#define BATCH 64
+
+static const uint64_t sizes[] = { 100, 1000, 4096, 65536 };
+
+struct result {
+    double mb_s;
+    double ops;
+    double syscalls;            // per append
+    double meta;                // journaled blocks per append
+    uint32_t extents;
+    uint64_t reserved;          // blocks past EOF
+};
+
+// blocks the next commit journals: what the txn holds, dirty bitmap blocks and the superblock
+static uint64_t txn_blocks(const struct store_disk *d) {
+    uint64_t n = d->j.txn.n + 1;
+    for (uint32_t b = 0; b < d->alloc.map_blocks; b++)
+        n += d->alloc.dirty[b] != 0;
+    return n;
+}
+
+static int run_store(const char *path, uint64_t size, int n, int batch, const char *data, struct result *res) {
+    struct store_disk d;
+    if (bench_disk(path, "-ds 256MB", &d) != 0)
+        return 1;
+    struct data_src empty = { .kind = D_STR, .mem = data, .size = 0, .size_known = true };
+    struct write_stats ws = {0};
+    if (op_write(&d, "log", &empty, false, -1, -1, &ws) != ST_OK || disk_commit(&d) != 0)
+        return 1;
+    uint64_t meta = 0;
+    ws = (struct write_stats){0};
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < n; i++) {
+        struct data_src src = { .kind = D_STR, .mem = data + i % 64, .size = size, .size_known = true };
+        if (op_write(&d, "log", &src, true, -1, -1, &ws) != ST_OK)
+            return 1;
+        if ((i + 1) % batch == 0 || i + 1 == n) {
+            meta += txn_blocks(&d);
+            if (disk_commit(&d) != 0)
+                return 1;
+        }
+    }
+    double secs = (now_ns() - t0) / 1e9;
+    res->mb_s = n * size / secs / 1048576.0;
+    res->ops = n / secs;
+    res->syscalls = ws.syscalls / (double)n;
+    res->meta = meta / (double)n;
+
+    struct store_file f;
+    if (op_open(&d, "log", &f) != ST_OK)
+        return 1;
+    if (f.ino.size != n * size) {
+        printf("log is %" PRIu64 " bytes, wanted %" PRIu64 "\n", f.ino.size, n * size);
+        file_put(&f);
+        return 1;
+    }
+    res->extents = f.n_ext;
+    res->reserved = f.ino.block_count - (f.ino.size + d.sb.block - 1) / d.sb.block;
+    file_put(&f);
+    disk_close(&d);
+    unlink(path);
+    return 0;
+}
+
+static int run_plain(const char *path, uint64_t size, int n, int batch, const char *data, struct result *res) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("open plain file");
+        return 1;
+    }
+    uint64_t calls = 0;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < n; i++) {
+        calls++;
+        if (write(fd, data + i % 64, size) != (ssize_t)size) {
+            close(fd);
+            return 1;
+        }
+        if ((i + 1) % batch == 0 || i + 1 == n) {
+            calls++;
+            if (fdatasync(fd) != 0) {
+                close(fd);
+                return 1;
+            }
+        }
+    }
+    double secs = (now_ns() - t0) / 1e9;
+    res->mb_s = n * size / secs / 1048576.0;
+    res->ops = n / secs;
+    res->syscalls = calls / (double)n;
+    res->meta = 0;
+    res->extents = 0;
+    res->reserved = 0;
+    close(fd);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/append_bench.disk";
+    char plain[PATH_MAX];
+    snprintf(plain, sizeof(plain), "%s.plain", path);
+    char *data = malloc(65536 + 64);
+    if (!data)
+        return 1;
+    for (int i = 0; i < 65536 + 64; i++)
+        data[i] = (char)(i * 2654435761u >> 13);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        int n = TOTAL / sizes[s] < RECORDS ? (int)(TOTAL / sizes[s]) : RECORDS;
+        for (int batch = 1; batch <= BATCH; batch *= BATCH) {
+            struct result st, pl;
+            if (run_store(path, sizes[s], n, batch, data, &st) != 0 ||
+                run_plain(plain, sizes[s], n, batch, data, &pl) != 0) {
+                printf("%" PRIu64 " byte appends failed\n", sizes[s]);
+                return 1;
+            }
+            printf("%6" PRIu64 " B x %5d  commit every %2d  store %8.2f MB/s %8.0f ops/s %5.2f data syscalls "
+                   "%5.2f meta blocks/append, %" PRIu32 " extents %" PRIu64 " blocks reserved\n",
+                   sizes[s], n, batch, st.mb_s, st.ops, st.syscalls, st.meta, st.extents, st.reserved);
+            printf("%40s  plain %8.2f MB/s %8.0f ops/s %5.2f syscalls\n", "", pl.mb_s, pl.ops, pl.syscalls);
+        }
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "../store.h"
+
+/*
+What the benches share: a seeded xorshift, latency sorting, making a disk with
+./store init [bench_disk] and writing a file through op_write. All static
+inline, a bench only gets what it calls. Include it instead of ../store.h
+[after _GNU_SOURCE when a bench needs it].
+*/
+
+static uint64_t rng = 88172645463325252ull;
+
+// xorshift64 on s, the same sequence every run for the same seed
+static inline uint64_t rng_next(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static inline uint64_t next_rand() {
+    return rng_next(&rng);
+}
+
+// len bytes from next_rand [the tail past the last whole word is left as is]
+static inline void fill(char *buf, uint64_t len) {
+    for (uint64_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t x = next_rand();
+        memcpy(buf + i, &x, 8);
+    }
+}
+
+// qsort order for latencies
+static inline int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+A fresh disk at path from ./store init <args> [-ds and any other init flags],
+opened into d with its allocator loaded, or only made when d is NULL. Returns 0,
+or 1 once it said what failed
+*/
+static inline int bench_disk(const char *path, const char *args, struct store_disk *d) {
+    char cmd[PATH_MAX * 4];
+    unlink(path);
+    snprintf(cmd, sizeof(cmd), "./store init %s -dn %s > /dev/null", args, path);
+    if (system(cmd) != 0 || (d && (disk_open(d, path, O_RDWR) != 0 || alloc_load(d) != 0))) {
+        printf("Unable to create %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// -co SMALLFILES_CONF in bench_disk's args makes a smallfiles disk, once smallfiles_conf wrote it
+#define SMALLFILES_CONF "/tmp/bench_smallfiles.toml"
+
+static inline int smallfiles_conf(void) {
+    FILE *f = fopen(SMALLFILES_CONF, "w");
+    if (!f)
+        return 1;
+    fprintf(f, "[storage]\nprofile = \"smallfiles\"\n");
+    return fclose(f) != 0;
+}
+
+// Writes [or appends] n bytes at p to name with the disk's defaults, returns the ST_* of op_write
+static inline int put(struct store_disk *d, const char *name, const void *p, uint64_t n, bool append) {
+    struct data_src src = { .kind = D_STR, .mem = p, .size = n, .size_known = true };
+    struct write_stats ws = {0};
+    return data_src_open(&src) != 0 ? ST_ERR : op_write(d, name, &src, append, -1, -1, &ws);
+}
+
+#endif
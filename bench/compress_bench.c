@@ -0,0 +1,122 @@
+#include "bench.h"
+
+/*
+Compression on vs off, CPU cost vs disk savings
+Usage: bench/compress_bench [disk_path]   [run from the repo root, needs ./store]
+Writes the same data sets to a plain and an lz4 disk and reports write and read
+throughput, CPU time spent, random 4KB read latency and the disk space used.
+*/
+
+#define DATA_SIZE (64 << 20)
+#define RAND_READS 2000
+
+// words from a small vocabulary, compresses about like prose
+static void gen_text(char *p, uint64_t n) {
+    static const char *words[] = { "store", "block", "inode", "extent", "the", "of", "disk", "a", "journal",
+                                   "write", "read", "commit", "data", "and", "cluster", "file", "to", "in" };
+    for (uint64_t i = 0; i < n; ) {
+        const char *w = words[next_rand() % (sizeof(words) / sizeof(words[0]))];
+        for (; *w && i < n; w++)
+            p[i++] = *w;
+        if (i < n)
+            p[i++] = next_rand() % 16 ? ' ' : '\n';
+    }
+}
+
+// structured log lines, very repetitive
+static void gen_logs(char *p, uint64_t n) {
+    char line[128];
+    for (uint64_t i = 0, seq = 0; i < n; seq++) {
+        int len = snprintf(line, sizeof(line), "2024-01-01T00:%02" PRIu64 ":%02" PRIu64 " INFO req=%" PRIu64
+                           " status=%d latency_us=%" PRIu64 "\n", seq / 60 % 60, seq % 60, seq,
+                           next_rand() % 8 ? 200 : 500, next_rand() % 5000);
+        for (int j = 0; j < len && i < n; j++)
+            p[i++] = line[j];
+    }
+}
+
+static void gen_random(char *p, uint64_t n) {
+    for (uint64_t i = 0; i + 8 <= n; i += 8) {
+        uint64_t v = next_rand();
+        memcpy(p + i, &v, 8);
+    }
+}
+
+static uint64_t cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int run(const char *path, const char *set, const char *data, int comp, int out) {
+    struct store_disk d;
+    if (bench_disk(path, comp ? "-ds 1GB -cm lz4" : "-ds 1GB -cm off", &d) != 0)
+        return 1;
+    uint64_t free_before = d.sb.data_space_left;
+
+    struct store_file f = {0};
+    f.ino.inode_id = inode_alloc(&d);
+    f.ino.compression = d.sb.compression;
+    strcpy(f.ino.name, set);
+    struct data_src src = { .kind = D_STR, .mem = data, .size = DATA_SIZE, .size_known = true };
+    struct write_stats ws = {0};
+    uint64_t c0 = cpu_ns(), t0 = now_ns();
+    if (data_src_open(&src) || data_write(&d, &f, 0, &src, &ws) || file_store(&d, &f) ||
+        index_insert(&d, set, f.ino.inode_id) || disk_commit(&d))
+        return 1;
+    uint64_t w_ns = now_ns() - t0, w_cpu = cpu_ns() - c0;
+    uint64_t used = free_before - d.sb.data_space_left;
+
+    // whole file, mmap path
+    ftruncate(out, 0);
+    struct read_stats rs = {0};
+    c0 = cpu_ns();
+    t0 = now_ns();
+    if (data_read(&d, &f, 0, UINT64_MAX, out, READ_MMAP, &rs) != 0)
+        return 1;
+    uint64_t r_ns = now_ns() - t0, r_cpu = cpu_ns() - c0;
+
+    // random 4KB records, each one has to decompress its whole cluster
+    uint64_t rand_ns = 0;
+    for (int i = 0; i < RAND_READS; i++) {
+        uint64_t off = next_rand() % (DATA_SIZE / 4096) * 4096;
+        ftruncate(out, 0);
+        lseek(out, 0, SEEK_SET);
+        struct read_stats rr = {0};
+        t0 = now_ns();
+        if (data_read(&d, &f, off, 4096, out, READ_AUTO, &rr) != 0)
+            return 1;
+        rand_ns += now_ns() - t0;
+    }
+
+    printf("%-7s %-4s write %7.1f MB/s cpu %7.1f ms  read %7.1f MB/s cpu %6.1f ms  4K rand %6.2f us  "
+           "disk %6.1f MB (%5.1f%%) raw clusters %" PRIu64 "\n",
+           set, comp ? "lz4" : "off", DATA_SIZE / (w_ns / 1e9) / (1 << 20), w_cpu / 1e6,
+           DATA_SIZE / (r_ns / 1e9) / (1 << 20), r_cpu / 1e6, rand_ns / 1e3 / RAND_READS,
+           used / (double)(1 << 20), 100.0 * used / DATA_SIZE, ws.raw_clusters);
+    file_put(&f);
+    disk_close(&d);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/compress_bench.disk";
+    const char *out_path = "/tmp/compress_bench.out";
+    static const char *sets[] = { "text", "logs", "random" };
+    void (*gen[])(char *, uint64_t) = { gen_text, gen_logs, gen_random };
+    char *data = malloc(DATA_SIZE);
+    int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (!data || out < 0)
+        return 1;
+    for (int s = 0; s < 3; s++) {
+        gen[s](data, DATA_SIZE);
+        for (int comp = 0; comp < 2; comp++)
+            if (run(path, sets[s], data, comp, out) != 0)
+                return 1;
+    }
+    close(out);
+    unlink(out_path);
+    free(data);
+    return 0;
+}
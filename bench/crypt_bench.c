@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include "bench.h"
+
+/*
+Encrypted files against plain ones
+Usage: bench/crypt_bench [disk_path]   [run from the repo root, needs ./store]
+Writes FILES files of FILE_SIZE random bytes in the clear, then the same with
+key 1 [from a key file made for the run], and reads them all back into a pipe
+a thread drains into a buffer, the way a client takes them. [To /dev/null a
+plain read off the map never touches its pages, there is nothing to compare
+decrypting with.] Prints MB/s for each and what encryption keeps of the plain
+rate.
+*/
+
+#define DISK_SIZE "2GB"
+#define FILES 4
+#define FILE_SIZE (64 << 20)
+#define ROUNDS 3
+
+// Reads the pipe until the write end is closed
+static void *drain(void *arg) {
+    int fd = *(int *)arg;
+    char *buf = malloc(1 << 20);
+    while (buf && read(fd, buf, 1 << 20) > 0)
+        ;
+    free(buf);
+    return NULL;
+}
+
+// Best of ROUNDS writes of every file [key 0 = plain] and reads of them, in MB/s
+static int run(const char *path, char *buf, int key, double *wr, double *rd) {
+    *wr = *rd = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        struct store_disk d;
+        if (bench_disk(path, "-ds " DISK_SIZE, &d) != 0)
+            return 1;
+        char name[INODE_NAME];
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < FILES; i++) {
+            struct data_src src = { .kind = D_STR, .mem = buf + (uint64_t)i * FILE_SIZE, .size = FILE_SIZE,
+                                    .size_known = true };
+            struct write_stats ws = {0};
+            snprintf(name, sizeof(name), "file.%d", i);
+            if (data_src_open(&src) != 0 || op_write(&d, name, &src, false, -1, key, &ws) != ST_OK ||
+                disk_commit(&d) != 0)
+                return 1;
+        }
+        double w = (double)FILES * FILE_SIZE / 1048576.0 / ((now_ns() - t0) / 1e9);
+        int pfd[2];
+        pthread_t th;
+        if (pipe(pfd) != 0 || pthread_create(&th, NULL, drain, &pfd[0]) != 0)
+            return 1;
+        fcntl(pfd[1], F_SETPIPE_SZ, 1 << 20);
+        int out = pfd[1];
+        t0 = now_ns();
+        for (int i = 0; i < FILES; i++) {
+            struct store_file f;
+            struct read_stats rs = {0};
+            snprintf(name, sizeof(name), "file.%d", i);
+            if (op_open(&d, name, &f) != ST_OK)
+                return 1;
+            int ret = data_read(&d, &f, 0, FILE_SIZE, out, READ_AUTO, &rs);
+            file_put(&f);
+            if (ret != 0 || rs.bytes != FILE_SIZE)
+                return 1;
+        }
+        close(out);
+        pthread_join(th, NULL);
+        close(pfd[0]);
+        double rdm = (double)FILES * FILE_SIZE / 1048576.0 / ((now_ns() - t0) / 1e9);
+        disk_close(&d);
+        *wr = w > *wr ? w : *wr;
+        *rd = rdm > *rd ? rdm : *rd;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/crypt_bench.disk";
+    char keys[PATH_MAX + 8];
+    snprintf(keys, sizeof(keys), "%s.keys", path);
+    FILE *kf = fopen(keys, "w");
+    if (!kf)
+        return 1;
+    fprintf(kf, "1 ");
+    for (int i = 0; i < 4; i++)
+        fprintf(kf, "%016" PRIx64, next_rand());
+    fprintf(kf, "\n");
+    fclose(kf);
+    char *buf = malloc((uint64_t)FILES * FILE_SIZE);
+    if (!buf || crypt_load(keys) != 0)
+        return 1;
+    fill(buf, (uint64_t)FILES * FILE_SIZE);
+
+    double pw, pr, ew, er;
+    if (run(path, buf, 0, &pw, &pr) != 0 || run(path, buf, 1, &ew, &er) != 0) {
+        printf("Bench failed\n");
+        return 1;
+    }
+    printf("%d files of %d MB, best of %d, AES via %s\n", FILES, FILE_SIZE >> 20, ROUNDS, crypt_impl());
+    printf("plain      write %8.1f MB/s  read %8.1f MB/s\n", pw, pr);
+    printf("encrypted  write %8.1f MB/s  read %8.1f MB/s\n", ew, er);
+    printf("encrypted / plain  write %5.1f%%  read %5.1f%%\n", 100 * ew / pw, 100 * er / pr);
+    unlink(path);
+    unlink(keys);
+    free(buf);
+    return 0;
+}
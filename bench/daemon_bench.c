@@ -0,0 +1,167 @@
+#include "bench.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+Small file ops through the daemon vs one process per op
+Usage: bench/daemon_bench [disk_path]   [run from the repo root, needs ./store]
+Times 256 byte writes and reads done by spawning ./store, then the same through
+a running daemon: async writes, sync writes from one client and from several at
+once [those share commits], reads and a list of every file.
+*/
+
+#define SPAWNS 50
+#define OPS 5000
+#define WRITERS 8
+#define RECORD 256
+
+static void report(const char *what, uint64_t *lat, int n) {
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    uint64_t sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += lat[i];
+    printf("%-22s avg %9.2f us  p50 %9.2f us  p99 %9.2f us\n", what, sum / (double)n / 1e3,
+           lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3);
+}
+
+static int spawn_ops(const char *path, uint64_t *lat) {
+    char cmd[1024];
+    for (int i = 0; i < SPAWNS; i++) {
+        snprintf(cmd, sizeof(cmd), "./store write spawn%d --data %0*d -ds %s > /dev/null", i, RECORD, i, path);
+        uint64_t t0 = now_ns();
+        if (system(cmd) != 0)
+            return 1;
+        lat[i] = now_ns() - t0;
+    }
+    report("spawn write", lat, SPAWNS);
+    for (int i = 0; i < SPAWNS; i++) {
+        snprintf(cmd, sizeof(cmd), "./store read spawn%d -ds %s > /dev/null", i, path);
+        uint64_t t0 = now_ns();
+        if (system(cmd) != 0)
+            return 1;
+        lat[i] = now_ns() - t0;
+    }
+    report("spawn read", lat, SPAWNS);
+    return 0;
+}
+
+static int write_ops(int s, const char *prefix, int n, int flags, uint64_t *lat) {
+    char name[INODE_NAME], data[RECORD];
+    memset(data, 'x', sizeof(data));
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%s%d", prefix, i);
+        uint64_t t0 = now_ns();
+        if (client_write(s, name, data, RECORD, OP_WRITE, flags) != ST_OK)
+            return 1;
+        lat[i] = now_ns() - t0;
+    }
+    return 0;
+}
+
+// WRITERS clients doing sync writes at the same time, returns ops/s
+static double parallel_sync(const char *sock) {
+    uint64_t t0 = now_ns();
+    pid_t pids[WRITERS];
+    for (int w = 0; w < WRITERS; w++) {
+        if ((pids[w] = fork()) == 0) {
+            int s = client_connect(sock);
+            uint64_t *lat = malloc(OPS / WRITERS * sizeof(*lat));
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "par%d_", w);
+            _exit(s < 0 || !lat || write_ops(s, prefix, OPS / WRITERS, RQ_SYNC, lat) != 0);
+        }
+    }
+    int ok = 1, status;
+    for (int w = 0; w < WRITERS; w++)
+        ok &= waitpid(pids[w], &status, 0) == pids[w] && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return ok ? (OPS / WRITERS * WRITERS) / ((now_ns() - t0) / 1e9) : 0;
+}
+
+static int count_file(const struct store_inode *ino, void *arg) {
+    (void)ino;
+    (*(uint64_t *)arg)++;
+    return ST_OK;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/daemon_bench.disk";
+    char sock[PATH_MAX];
+    snprintf(sock, sizeof(sock), "%s.sock", path);
+    // the daemon shares our stdout
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    uint64_t *lat = malloc(OPS * sizeof(*lat));
+    if (!lat || smallfiles_conf() != 0 || bench_disk(path, "-co " SMALLFILES_CONF " -ds 256MB", NULL) != 0)
+        return 1;
+    if (spawn_ops(path, lat) != 0)
+        return 1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("./store", "store", "daemon", "-ds", path, (char *)NULL);
+        _exit(127);
+    }
+    int s = -1;
+    for (int i = 0; i < 500 && s < 0; i++) {
+        nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+        s = client_connect(sock);
+    }
+    if (s < 0) {
+        printf("Daemon did not come up on %s\n", sock);
+        kill(pid, SIGTERM);
+        return 1;
+    }
+    int ret = 1;
+    if (write_ops(s, "async", OPS, 0, lat) != 0)
+        goto out;
+    report("daemon write", lat, OPS);
+    if (write_ops(s, "sync", OPS / 10, RQ_SYNC, lat) != 0)
+        goto out;
+    report("daemon write sync", lat, OPS / 10);
+    double par = parallel_sync(sock);
+    if (par == 0)
+        goto out;
+    printf("%-22s %9.0f ops/s with %d clients\n", "daemon write sync", par, WRITERS);
+
+    char name[INODE_NAME], buf[RECORD];
+    for (int i = 0; i < OPS; i++) {
+        uint64_t got;
+        snprintf(name, sizeof(name), "async%d", i);
+        uint64_t t0 = now_ns();
+        if (client_read(s, name, 0, buf, sizeof(buf), &got) != ST_OK || got != RECORD)
+            goto out;
+        lat[i] = now_ns() - t0;
+    }
+    report("daemon read", lat, OPS);
+
+    struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_LIST };
+    struct proto_resp resp;
+    uint64_t t0 = now_ns();
+    char *list = NULL;
+    if (client_call(s, &rq, "", -1, NULL, &resp) != 0 || resp.status != ST_OK ||
+        !(list = malloc(resp.len)) || client_recv(s, list, resp.len) != 0)
+        goto out;
+    printf("%-22s %9.2f ms for %" PRIu64 " bytes of names\n", "daemon list", (now_ns() - t0) / 1e6, resp.len);
+    free(list);
+    ret = 0;
+out:
+    close(s);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (ret == 0) {
+        // everything the daemon acked is on disk after it shut down
+        struct store_disk d;
+        uint64_t files = 0;
+        if (disk_open(&d, path, O_RDONLY) == 0) {
+            op_list(&d, count_file, &files);
+            disk_close(&d);
+        }
+        printf("%" PRIu64 " files on disk after shutdown, expected %d\n", files,
+               SPAWNS + OPS + OPS / 10 + OPS / WRITERS * WRITERS);
+    } else {
+        printf("Daemon request failed\n");
+    }
+    unlink(path);
+    free(lat);
+    return ret;
+}
@@ -0,0 +1,120 @@
+#include "bench.h"
+
+/*
+Near duplicate files with dedup on vs off
+Usage: bench/dedup_bench [disk_path]   [run from the repo root, needs ./store]
+Writes VERSIONS copies of a BASE_SIZE file, each with CHANGED of its blocks
+rewritten the way successive backups or VM images differ, first on a disk with
+--dedup on then on one with it off. Reports ingest MB/s, the data blocks the
+copies took and the dedup ratio [bytes written / bytes stored], then reads every
+copy back and checks it.
+*/
+
+#define BASE_SIZE (16 << 20)
+#define VERSIONS 16
+#define CHANGED 0.02
+#define BATCH 4
+
+struct result {
+    double write_mbs;
+    double read_mbs;
+    uint64_t used;              // data bytes taken from the allocator
+    uint64_t shared;            // blocks that went in as references
+};
+
+// Version v of the payload in buf: the base with some of its blocks changed, the same every run
+static void make_version(char *buf, const char *base, int v, uint32_t block) {
+    memcpy(buf, base, BASE_SIZE);
+    rng = 88172645463325252ull + v;
+    uint64_t blocks = BASE_SIZE / block;
+    for (uint64_t i = 0; i < blocks * CHANGED * v && v; i++) {
+        uint64_t b = next_rand() % blocks;
+        for (uint32_t j = 0; j < block; j += 8) {
+            uint64_t x = next_rand();
+            memcpy(buf + b * block + j, &x, 8);
+        }
+    }
+}
+
+static int run(const char *path, bool dedup, const char *base, char *buf, int out, struct result *res) {
+    char name[INODE_NAME];
+    struct store_disk d;
+    if (bench_disk(path, dedup ? "-ds 512MB -dd on" : "-ds 512MB -dd off", &d) != 0)
+        return 1;
+    uint64_t free_before = d.alloc.n_free;
+    uint64_t ns = 0;
+    memset(res, 0, sizeof(*res));
+    for (int v = 0; v < VERSIONS; v++) {
+        make_version(buf, base, v, d.sb.block);
+        snprintf(name, sizeof(name), "image.%d", v);
+        struct data_src src = { .kind = D_STR, .mem = buf, .size = BASE_SIZE, .size_known = true };
+        struct write_stats ws = {0};
+        uint64_t t0 = now_ns();
+        if (data_src_open(&src) != 0 || op_write(&d, name, &src, false, -1, -1, &ws) != ST_OK ||
+            ((v + 1) % BATCH == 0 && disk_commit(&d) != 0))
+            return 1;
+        ns += now_ns() - t0;
+        res->shared += ws.shared;
+    }
+    if (disk_commit(&d) != 0)
+        return 1;
+    res->write_mbs = (double)VERSIONS * BASE_SIZE / (1 << 20) / (ns / 1e9);
+    res->used = (free_before - d.alloc.n_free) * d.sb.block;
+
+    ns = 0;
+    char *back = malloc(BASE_SIZE);
+    for (int v = 0; v < VERSIONS && back; v++) {
+        snprintf(name, sizeof(name), "image.%d", v);
+        struct store_file f;
+        struct read_stats rs = {0};
+        uint64_t t0 = now_ns();
+        if (op_open(&d, name, &f) != ST_OK || ftruncate(out, 0) != 0 || lseek(out, 0, SEEK_SET) != 0)
+            return 1;
+        int ret = data_read(&d, &f, 0, UINT64_MAX, out, READ_AUTO, &rs);
+        file_put(&f);
+        ns += now_ns() - t0;
+        make_version(buf, base, v, d.sb.block);
+        if (ret != 0 || rs.bytes != BASE_SIZE || pread(out, back, BASE_SIZE, 0) != BASE_SIZE ||
+            memcmp(back, buf, BASE_SIZE) != 0) {
+            printf("%s came back wrong\n", name);
+            free(back);
+            return 1;
+        }
+    }
+    free(back);
+    res->read_mbs = (double)VERSIONS * BASE_SIZE / (1 << 20) / (ns / 1e9);
+    disk_close(&d);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/dedup_bench.disk";
+    const char *out_path = "/tmp/dedup_bench.out";
+    int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char *base = malloc(BASE_SIZE), *buf = malloc(BASE_SIZE);
+    if (out < 0 || !base || !buf)
+        return 1;
+    for (uint64_t i = 0; i < BASE_SIZE; i += 8) {
+        uint64_t x = next_rand();
+        memcpy(base + i, &x, 8);
+    }
+
+    printf("%d versions of a %d MB file, %.0f%% of the blocks changed per version\n", VERSIONS,
+           BASE_SIZE >> 20, CHANGED * 100);
+    for (int dedup = 1; dedup >= 0; dedup--) {
+        struct result r;
+        if (run(path, dedup, base, buf, out, &r) != 0) {
+            printf("Run with dedup %s failed\n", dedup ? "on" : "off");
+            return 1;
+        }
+        printf("dedup %-3s  write %8.1f MB/s  read %8.1f MB/s  disk %8.2f MB  ratio %5.2fx  %" PRIu64
+               " blocks shared\n", dedup ? "on" : "off", r.write_mbs, r.read_mbs, r.used / 1048576.0,
+               r.used ? (double)VERSIONS * BASE_SIZE / r.used : 0.0, r.shared);
+    }
+    close(out);
+    unlink(out_path);
+    free(base);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include "bench.h"
+
+#include <sys/stat.h>
+
+/*
+Deleting and defragmenting a disk that went through many small writes and deletes
+Usage: bench/defrag_bench [disk_path]   [run from the repo root, needs ./store]
+Fragments a 256MB disk the way churn does: a pad file, then 64KB files until
+the disk is full, every other one deleted, then a 64MB file written into the
+64KB holes they left. The rest of the small files and the pad go, so there is
+room for the big file in one run. Then:
+  reads the big file cold [its pages dropped from the host cache] before and
+  after store defrag, and times the defrag itself
+  defrags the big file again at DEFRAG_RATE with 64KB reads of other files
+  in between its steps, the way the daemon serves requests, and compares those
+  reads' latency to the same reads with nothing else going on
+  deletes everything and checks what the disk file takes on the host
+The big file is checked byte for byte after every move.
+*/
+
+#define DISK "256MB"
+#define SMALL (64 << 10)
+#define BIG (64 << 20)
+#define PAD (80 << 20)
+#define KEEP 64                 // small files kept for the foreground reads
+#define FG_READS 2000
+
+// Runs of adjacent disk blocks name is in
+static uint64_t runs(struct store_disk *d, const char *name) {
+    struct store_file f;
+    if (op_open(d, name, &f) != ST_OK)
+        return 0;
+    uint64_t n = 0, end = 0;
+    for (uint32_t i = 0; i < f.n_ext; i++) {
+        n += f.ext[i].pblk != end;
+        end = f.ext[i].pblk + ext_blocks(d, &f.ext[i]);
+    }
+    file_put(&f);
+    return n;
+}
+
+// Reads len bytes of name from off into out [or just times it when out is NULL], returns ns or 0 on failure
+static uint64_t timed_read(struct store_disk *d, const char *name, uint64_t off, uint64_t len, int out) {
+    struct store_file f;
+    uint64_t t0 = now_ns();
+    if (op_open(d, name, &f) != ST_OK)
+        return 0;
+    struct read_stats rs = {0};
+    int ret = data_read(d, &f, off, len, out, READ_PREAD, &rs);
+    file_put(&f);
+    return ret == 0 && rs.bytes == len ? now_ns() - t0 : 0;
+}
+
+// Cold read of the big file, MB/s, checked against want
+static double cold_read(struct store_disk *d, const char *want) {
+    posix_fadvise(d->fd, 0, 0, POSIX_FADV_DONTNEED);
+    FILE *tmp = tmpfile();
+    uint64_t ns = tmp ? timed_read(d, "big", 0, BIG, fileno(tmp)) : 0;
+    char *got = malloc(BIG);
+    bool same = ns && got && pread(fileno(tmp), got, BIG, 0) == BIG && memcmp(got, want, BIG) == 0;
+    free(got);
+    if (tmp)
+        fclose(tmp);
+    if (!same) {
+        printf("big doesn't read back as written\n");
+        return 0;
+    }
+    return BIG / (ns / 1e9) / (1 << 20);
+}
+
+static void print_lat(const char *what, uint64_t *lat, int n) {
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    printf("%-26s p50 %7.1f us  p99 %7.1f us  max %7.1f us\n", what, lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3,
+           lat[n - 1] / 1e3);
+}
+
+/*
+FG_READS 64KB reads of the kept files, with a defrag step before each one when
+df is set, the way a daemon request waits for the step in front of it.
+The latency of each is from the start of its round. Returns 0 on success else 1
+*/
+static int foreground(struct store_disk *d, struct store_defrag *df, uint64_t *lat) {
+    char name[INODE_NAME];
+    int out = open("/dev/null", O_WRONLY);
+    for (int i = 0; i < FG_READS; i++) {
+        uint64_t t0 = now_ns();
+        if (df && df->active) {
+            int more = defrag_step(df, d);
+            if (more < 0 || (d->j.txn.n && disk_commit(d) != 0))
+                return 1;
+            if (more == 0)
+                defrag_stop(df, d);
+        }
+        snprintf(name, sizeof(name), "s%d", 2 * (i % KEEP) + 1);
+        uint64_t ns = timed_read(d, name, 0, SMALL, out);
+        if (!ns)
+            return 1;
+        lat[i] = now_ns() - t0;
+        // the pace of a busy but not saturated client
+        nanosleep(&(struct timespec){ 0, 200000 }, NULL);
+    }
+    close(out);
+    return 0;
+}
+
+static uint64_t host_kb(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_blocks / 2 : 0;
+}
+
+/*
+Formats the disk at path and fragments it as above, big holds what the big file
+gets. Returns the number of small files written, -1 on failure
+*/
+static int fragment(struct store_disk *d, const char *path, const char *big) {
+    char name[INODE_NAME], *pad = calloc(1, PAD);
+    if (!pad || bench_disk(path, "-ds " DISK, d) != 0) {
+        free(pad);
+        return -1;
+    }
+    int st = put(d, "pad", pad, PAD, false), n = 0;
+    free(pad);
+    while (st == ST_OK) {
+        snprintf(name, sizeof(name), "s%d", n);
+        st = put(d, name, big + (n * 4096) % (BIG - SMALL), SMALL, false);
+        if (st == ST_OK && ++n % 100 == 0 && disk_commit(d) != 0)
+            st = ST_ERR;
+    }
+    if (st != ST_NOSPC)
+        return -1;
+    for (int i = 0; i < n; i += 2) {
+        snprintf(name, sizeof(name), "s%d", i);
+        if (op_delete(d, name) != ST_OK)
+            return -1;
+    }
+    if (disk_commit(d) != 0 || put(d, "big", big, BIG, false) != ST_OK || disk_commit(d) != 0) {
+        printf("Unable to write big into the holes\n");
+        return -1;
+    }
+    for (int i = 1 + 2 * KEEP; i < n; i += 2) {
+        snprintf(name, sizeof(name), "s%d", i);
+        if (op_delete(d, name) != ST_OK)
+            return -1;
+    }
+    return op_delete(d, "pad") != ST_OK || disk_commit(d) != 0 ? -1 : n;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/defrag_bench.disk";
+    struct store_disk d;
+    char *big = malloc(BIG), name[INODE_NAME];
+    if (!big)
+        return 1;
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < BIG; i += 8) {
+        rng_next(&seed);
+        memcpy(big + i, &seed, 8);
+    }
+
+    // as fast as it goes
+    int n = fragment(&d, path, big);
+    if (n < 0)
+        return 1;
+    printf("%d 64KB files written, big is in %" PRIu64 " runs\n", n, runs(&d, "big"));
+    double before = cold_read(&d, big);
+    struct store_defrag df;
+    uint64_t t0 = now_ns();
+    if (before == 0 || defrag_start(&df, 0) != 0)
+        return 1;
+    int more;
+    while ((more = defrag_step(&df, &d)) > 0)
+        if (d.j.txn.n && disk_commit(&d) != 0)
+            return 1;
+    if (more < 0 || disk_commit(&d) != 0)
+        return 1;
+    defrag_stop(&df, &d);
+    double secs = (now_ns() - t0) / 1e9;
+    double after = cold_read(&d, big);
+    if (after == 0)
+        return 1;
+    printf("defrag %.3f s (%.0f MB/s), big is in %" PRIu64 " runs\n", secs, BIG / secs / (1 << 20), runs(&d, "big"));
+    printf("cold read of big: %.0f MB/s fragmented, %.0f MB/s after defrag\n", before, after);
+    disk_close(&d);
+
+    // throttled, with reads going on
+    uint64_t *idle = malloc(FG_READS * sizeof(*idle)), *busy = malloc(FG_READS * sizeof(*busy));
+    if (!idle || !busy || fragment(&d, path, big) < 0 || foreground(&d, NULL, idle) != 0)
+        return 1;
+    uint64_t frag = runs(&d, "big");
+    if (defrag_start(&df, DEFRAG_RATE) != 0 || foreground(&d, &df, busy) != 0)
+        return 1;
+    while (df.active && (more = defrag_step(&df, &d)) != 0) {
+        if (more < 0 || (d.j.txn.n && disk_commit(&d) != 0))
+            return 1;
+        uint64_t now = now_ns();
+        if (df.next_at > now)
+            nanosleep(&(struct timespec){ 0, (long)(df.next_at - now) % 1000000000 }, NULL);
+    }
+    defrag_stop(&df, &d);
+    if (disk_commit(&d) != 0 || cold_read(&d, big) == 0)
+        return 1;
+    printf("throttled at %d MB/s, big went from %" PRIu64 " runs to %" PRIu64 "\n", DEFRAG_RATE >> 20, frag,
+           runs(&d, "big"));
+    print_lat("64KB reads, idle", idle, FG_READS);
+    print_lat("64KB reads, during defrag", busy, FG_READS);
+
+    // give it all back
+    uint64_t held = host_kb(path);
+    int bad = op_delete(&d, "big") != ST_OK;
+    for (int i = 1; i < 1 + 2 * KEEP; i += 2) {
+        snprintf(name, sizeof(name), "s%d", i);
+        bad |= op_delete(&d, name) != ST_OK;
+    }
+    if (bad || disk_commit(&d) != 0)
+        return 1;
+    printf("host holds %" PRIu64 " KB with the files, %" PRIu64 " KB once they are deleted\n", held,
+           host_kb(path));
+    free(idle);
+    free(busy);
+    free(big);
+    disk_close(&d);
+    unlink(path);
+    return 0;
+}
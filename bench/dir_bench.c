@@ -0,0 +1,133 @@
+#include "bench.h"
+
+/*
+Listing one directory of a disk with many files
+Usage: bench/dir_bench [disk_path]   [run from the repo root, needs ./store]
+Makes a sparse 64GB smallfiles disk [about 10M inode slots] with directories of
+1K, 10K, 100K and 1M files, then lists each ROUNDS times with dir_list and times it
+against op_list picking the same files out of the inode table [what listing a
+directory cost before directories]. Every listing is checked to have each name
+once, again after every other file of each directory is deleted.
+*/
+
+#define ROUNDS 5
+
+static const int sizes[] = { 1000, 10000, 100000, 1000000 };
+#define N_DIRS (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+struct seen {
+    const char *prefix;     // "d<n>/" for op_list
+    int n;
+    uint8_t *hits;
+    uint64_t entries;
+};
+
+static void hit(struct seen *s, const char *leaf) {
+    int i = atoi(leaf + 1);
+    if (leaf[0] == 'f' && i >= 0 && i < s->n)
+        s->hits[i]++;
+    s->entries++;
+}
+
+static int from_dir(const struct store_dirent *e, void *arg) {
+    hit(arg, e->name);
+    return ST_OK;
+}
+
+static int from_table(const struct store_inode *ino, void *arg) {
+    struct seen *s = arg;
+    size_t n = strlen(s->prefix);
+    if (strncmp(ino->name, s->prefix, n) == 0)
+        hit(s, ino->name + n);
+    return ST_OK;
+}
+
+// Names of s that showed up other than once, every other one is gone when halved
+static int bad(const struct seen *s, bool halved) {
+    int wrong = 0;
+    for (int i = 0; i < s->n; i++)
+        wrong += s->hits[i] != (halved && i % 2 ? 0 : 1);
+    return wrong + (s->entries != (uint64_t)(halved ? (s->n + 1) / 2 : s->n));
+}
+
+// Lists directory k both ways, adds the ms per listing to *dir_ms and *scan_ms
+static int run(struct store_disk *d, int k, bool halved, double *dir_ms, double *scan_ms) {
+    char path[INODE_NAME], prefix[INODE_NAME];
+    snprintf(path, sizeof(path), "d%d", sizes[k]);
+    snprintf(prefix, sizeof(prefix), "d%d/", sizes[k]);
+    struct seen s = { .prefix = prefix, .n = sizes[k], .hits = malloc(sizes[k]) };
+    struct store_file dir;
+    int wrong = 0;
+    for (int r = 0; r < ROUNDS && s.hits; r++) {
+        memset(s.hits, 0, s.n);
+        s.entries = 0;
+        uint64_t t0 = now_ns();
+        if (dir_open(d, path, &dir) != ST_OK || dir_list(d, &dir, from_dir, &s) != ST_OK)
+            return 1;
+        file_put(&dir);
+        *dir_ms += (now_ns() - t0) / 1e6 / ROUNDS;
+        wrong += bad(&s, halved);
+        memset(s.hits, 0, s.n);
+        s.entries = 0;
+        t0 = now_ns();
+        if (op_list(d, from_table, &s) != ST_OK)
+            return 1;
+        *scan_ms += (now_ns() - t0) / 1e6 / ROUNDS;
+        wrong += bad(&s, halved);
+    }
+    free(s.hits);
+    if (wrong)
+        printf("%s: %d names listed wrong\n", path, wrong);
+    return !s.hits || wrong;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/dir_bench.disk";
+    struct store_disk d;
+    char name[INODE_NAME];
+    if (smallfiles_conf() != 0 || bench_disk(path, "-co " SMALLFILES_CONF " -ds 64GB", &d) != 0)
+        return 1;
+    uint64_t t0 = now_ns();
+    int files = 0;
+    for (int k = 0; k < N_DIRS; k++) {
+        for (int i = 0; i < sizes[k]; i++, files++) {
+            snprintf(name, sizeof(name), "d%d/f%d", sizes[k], i);
+            if (put(&d, name, name, strlen(name), false) != 0 || ((i + 1) % 1000 == 0 && disk_commit(&d) != 0)) {
+                printf("Fill failed at %s\n", name);
+                return 1;
+            }
+        }
+    }
+    if (disk_commit(&d) != 0)
+        return 1;
+    printf("%" PRIu64 " inode slots, %d files in %.1f s\n", d.sb.inode_count, files, (now_ns() - t0) / 1e9);
+
+    for (int pass = 0; pass < 2; pass++) {
+        bool halved = pass == 1;
+        if (halved) {
+            for (int k = 0; k < N_DIRS; k++) {
+                for (int i = 1; i < sizes[k]; i += 2) {
+                    snprintf(name, sizeof(name), "d%d/f%d", sizes[k], i);
+                    if (op_delete(&d, name) != ST_OK || (i % 2000 == 1 && disk_commit(&d) != 0)) {
+                        printf("Delete failed at %s\n", name);
+                        return 1;
+                    }
+                }
+            }
+            if (disk_commit(&d) != 0)
+                return 1;
+            printf("every other file deleted\n");
+        }
+        for (int k = 0; k < N_DIRS; k++) {
+            double dir_ms = 0, scan_ms = 0;
+            if (run(&d, k, halved, &dir_ms, &scan_ms) != 0)
+                return 1;
+            int n = halved ? (sizes[k] + 1) / 2 : sizes[k];
+            printf("%7d entries  dir_list %9.3f ms  %6.0f ns/entry   inode table scan %9.3f ms\n", n, dir_ms,
+                   dir_ms * 1e6 / n, scan_ms);
+        }
+    }
+    disk_close(&d);
+    unlink(path);
+    return 0;
+}
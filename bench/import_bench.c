@@ -0,0 +1,86 @@
+#include "bench.h"
+
+/*
+Bulk import against one store write per file
+Usage: bench/import_bench [disk_path]   [run from the repo root, needs ./store]
+Makes a tree of FILES small files [256 bytes to 16KB] plus a few big ones,
+writes the first PER_FILE of them with one ./store write each, the way a load
+script would, then imports the whole tree in one run. Prints files/s for both.
+*/
+
+#define DISK_SIZE "2GB"
+#define FILES 50000
+#define DIRS 16
+#define BIG 4
+#define BIG_SIZE (32 << 20)
+#define PER_FILE 500
+
+static int write_file(const char *path, const char *buf, uint64_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ret = fd < 0 || write(fd, buf, len) != (ssize_t)len;
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/import_bench.disk";
+    char dir[PATH_MAX], p[PATH_MAX + 32], cmd[2048];
+    snprintf(dir, sizeof(dir), "%s.tree", path);
+    char *buf = malloc(BIG_SIZE);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (!buf || system(cmd) != 0 || mkdir(dir, 0755) != 0)
+        return 1;
+    for (int i = 0; i < DIRS; i++) {
+        snprintf(p, sizeof(p), "%s/d%02d", dir, i);
+        if (mkdir(p, 0755) != 0)
+            return 1;
+    }
+    uint64_t bytes = 0;
+    for (int i = 0; i < FILES + BIG; i++) {
+        uint64_t len = i < FILES ? 256 + next_rand() % (16 << 10) : BIG_SIZE;
+        fill(buf, len);
+        snprintf(p, sizeof(p), "%s/d%02d/f%06d", dir, i % DIRS, i);
+        if (write_file(p, buf, len) != 0) {
+            printf("Unable to make %s\n", p);
+            return 1;
+        }
+        bytes += len;
+    }
+    printf("%d files, %.1f MB in %d directories\n", FILES + BIG, bytes / 1048576.0, DIRS);
+
+    // the way a script loads a tree today
+    if (bench_disk(path, "-ds " DISK_SIZE, NULL) != 0)
+        return 1;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < PER_FILE; i++) {
+        snprintf(cmd, sizeof(cmd), "./store write d%02d/f%06d --file %s/d%02d/f%06d -ds %s > /dev/null",
+                 i % DIRS, i, dir, i % DIRS, i, path);
+        if (system(cmd) != 0) {
+            printf("store write %d failed\n", i);
+            return 1;
+        }
+    }
+    double per_s = (now_ns() - t0) / 1e9;
+    printf("store write per file  %6d files  %8.3f s  %10.0f files/s\n", PER_FILE, per_s, PER_FILE / per_s);
+
+    // the import opens the disk itself, that is part of its time
+    if (bench_disk(path, "-ds " DISK_SIZE, NULL) != 0)
+        return 1;
+    struct store_disk d;
+    struct import_stats is = {0};
+    t0 = now_ns();
+    if (disk_open(&d, path, O_RDWR) != 0 || import_run(&d, dir, &is) != ST_OK || disk_commit(&d) != 0) {
+        printf("Import failed\n");
+        return 1;
+    }
+    double imp_s = (now_ns() - t0) / 1e9;
+    disk_close(&d);
+    printf("store import          %6" PRIu64 " files  %8.3f s  %10.0f files/s  %8.1f MB/s  %.0fx\n", is.files,
+           imp_s, is.files / imp_s, is.bytes / imp_s / 1048576.0, (is.files / imp_s) / (PER_FILE / per_s));
+
+    unlink(path);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    free(buf);
+    return system(cmd) != 0;
+}
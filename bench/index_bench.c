@@ -0,0 +1,73 @@
+#include "bench.h"
+
+/*
+Name index lookup latency vs number of files
+Usage: bench/index_bench [max_files] [disk_path]   [run from the repo root, needs ./store]
+Creates a "smallfiles" disk big enough for each size, indexes that many files
+and times random hit and miss lookups. Latency should stay flat as files grow.
+*/
+
+#define LOOKUPS 20000
+
+// A smallfiles disk with room for files inodes, opened into d
+static int make_disk(const char *path, uint64_t files, struct store_disk *d) {
+    // smallfiles puts 4% of the disk in inodes, leave some headroom
+    uint64_t size = files * sizeof(struct store_inode) * 25 * 11 / 10 + (64ull << 20);
+    char args[64];
+    snprintf(args, sizeof(args), "-co " SMALLFILES_CONF " -ds %" PRIu64, size);
+    return smallfiles_conf() != 0 || bench_disk(path, args, d) != 0;
+}
+
+static void report(uint64_t files, uint64_t *lat, const char *kind) {
+    qsort(lat, LOOKUPS, sizeof(*lat), cmp_u64);
+    uint64_t sum = 0;
+    for (int i = 0; i < LOOKUPS; i++)
+        sum += lat[i];
+    printf("%10" PRIu64 "  %-4s  avg %7.2f us  p50 %7.2f us  p99 %7.2f us\n", files, kind,
+           sum / (double)LOOKUPS / 1e3, lat[LOOKUPS / 2] / 1e3, lat[LOOKUPS * 99 / 100] / 1e3);
+}
+
+int main(int argc, char **argv) {
+    uint64_t max_files = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    const char *path = argc > 2 ? argv[2] : "/tmp/index_bench.disk";
+    uint64_t *lat = malloc(LOOKUPS * sizeof(*lat));
+    if (!lat)
+        return 1;
+
+    for (uint64_t files = 1000; files <= max_files; files *= 10) {
+        struct store_disk d;
+        if (make_disk(path, files, &d) != 0)
+            return 1;
+        struct store_inode ino = {0};
+        for (uint64_t i = 0; i < files; i++) {
+            ino.inode_id = i + 1;
+            snprintf(ino.name, INODE_NAME, "file-%010" PRIu64, i);
+            if (inode_write(&d, &ino) != 0 || index_insert(&d, ino.name, ino.inode_id) != 0 ||
+                (journal_full(&d) && disk_commit(&d) != 0))
+                return 1;
+        }
+
+        char name[INODE_NAME];
+        srand(42);
+        for (int i = 0; i < LOOKUPS; i++) {
+            snprintf(name, INODE_NAME, "file-%010" PRIu64, (uint64_t)rand() % files);
+            uint64_t t = now_ns();
+            if (index_lookup(&d, name, &ino) != 0)
+                return 1;
+            lat[i] = now_ns() - t;
+        }
+        report(files, lat, "hit");
+        for (int i = 0; i < LOOKUPS; i++) {
+            snprintf(name, INODE_NAME, "miss-%010d", rand());
+            uint64_t t = now_ns();
+            if (index_lookup(&d, name, NULL) != 1)
+                return 1;
+            lat[i] = now_ns() - t;
+        }
+        report(files, lat, "miss");
+        disk_close(&d);
+        unlink(path);
+    }
+    free(lat);
+    return 0;
+}
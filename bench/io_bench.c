@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "bench.h"
+
+/*
+Random 4K reads through the I/O engine
+Usage: bench/io_bench [disk_path]   [run from the repo root, needs ./store]
+Fills a disk with one big file, then reads random blocks of the disk file at
+queue depths 1, 4, 16 and 64 with each backend. One thread per core, each with
+its own queue. The disk file is opened with O_DIRECT when the filesystem
+allows it, otherwise the numbers are page cache reads [dropped first if we can].
+*/
+
+#define DATA_MB 256
+#define IO_SIZE 4096
+#define SECONDS 2
+
+struct worker {
+    enum io_backend backend;
+    unsigned depth;
+    int fd;
+    uint64_t blocks;            // IO_SIZE blocks in the disk file
+    uint64_t seed;
+    uint64_t ops;
+    uint64_t *lat;              // ns per op, first cap_lat of them
+    uint64_t cap_lat;
+    int ret;
+};
+
+static void *run(void *arg) {
+    struct worker *w = arg;
+    struct io_queue q;
+    if (io_queue_init(&q, w->depth, w->backend) != 0 || q.backend != w->backend) {
+        w->ret = 1;
+        return NULL;
+    }
+    struct io_req *reqs = calloc(w->depth, sizeof(*reqs));
+    uint64_t *start = calloc(w->depth, sizeof(*start));
+    char *bufs = aligned_alloc(IO_SIZE, (size_t)w->depth * IO_SIZE);
+    if (!reqs || !start || !bufs) {
+        w->ret = 1;
+        goto out;
+    }
+    uint64_t end = now_ns() + SECONDS * 1000000000ull;
+    for (unsigned i = 0; i < w->depth; i++) {
+        reqs[i] = (struct io_req){ .fd = w->fd, .buf = bufs + (size_t)i * IO_SIZE, .len = IO_SIZE,
+                                   .off = (off_t)(rng_next(&w->seed) % w->blocks) * IO_SIZE };
+        start[i] = now_ns();
+        io_push(&q, &reqs[i]);
+    }
+    io_submit(&q);
+    // takes whatever finished, puts the same slots back with new offsets in one submit
+    for (struct io_req *r = io_reap(&q, true); r && w->ret == 0; r = io_reap(&q, true)) {
+        do {
+            uint64_t t = now_ns();
+            size_t i = r - reqs;
+            if (r->res != IO_SIZE) {
+                printf("Read at %" PRIu64 " returned %zd\n", (uint64_t)r->off, r->res);
+                w->ret = 1;
+                break;
+            }
+            if (w->ops < w->cap_lat)
+                w->lat[w->ops] = t - start[i];
+            w->ops++;
+            if (t >= end)
+                continue;
+            r->off = (off_t)(rng_next(&w->seed) % w->blocks) * IO_SIZE;
+            start[i] = t;
+            io_push(&q, r);
+        } while ((r = io_reap(&q, false)));
+        io_submit(&q);
+    }
+out:
+    io_queue_free(&q);
+    free(reqs);
+    free(start);
+    free(bufs);
+    return NULL;
+}
+
+static int bench(enum io_backend backend, unsigned depth, int fd, uint64_t blocks, int cores) {
+    struct worker w[cores];
+    pthread_t th[cores];
+    uint64_t t0 = now_ns();
+    for (int c = 0; c < cores; c++) {
+        w[c] = (struct worker){ .backend = backend, .depth = depth, .fd = fd, .blocks = blocks,
+                                .seed = 0x9e3779b97f4a7c15ull * (c + 1), .cap_lat = 1 << 20 };
+        w[c].lat = malloc(w[c].cap_lat * sizeof(uint64_t));
+        if (!w[c].lat || pthread_create(&th[c], NULL, run, &w[c]) != 0)
+            return 1;
+    }
+    uint64_t ops = 0, n_lat = 0;
+    int ret = 0;
+    for (int c = 0; c < cores; c++) {
+        pthread_join(th[c], NULL);
+        ret |= w[c].ret;
+        ops += w[c].ops;
+        n_lat += w[c].ops < w[c].cap_lat ? w[c].ops : w[c].cap_lat;
+    }
+    double secs = (now_ns() - t0) / 1e9;
+    uint64_t *lat = malloc((n_lat ? n_lat : 1) * sizeof(uint64_t)), k = 0, sum = 0;
+    for (int c = 0; c < cores; c++) {
+        for (uint64_t i = 0; lat && i < w[c].ops && i < w[c].cap_lat; i++)
+            lat[k++] = w[c].lat[i];
+        free(w[c].lat);
+    }
+    if (ret != 0 || !lat || n_lat == 0) {
+        free(lat);
+        printf("%-9s QD %2u failed\n", io_backend_name(backend), depth);
+        return 1;
+    }
+    qsort(lat, n_lat, sizeof(*lat), cmp_u64);
+    for (uint64_t i = 0; i < n_lat; i++)
+        sum += lat[i];
+    printf("%-9s QD %2u  %9.0f IOPS  %8.1f MB/s  avg %8.2f us  p99 %8.2f us\n", io_backend_name(backend),
+           depth, ops / secs, ops * (double)IO_SIZE / secs / (1 << 20), sum / (double)n_lat / 1e3,
+           lat[n_lat * 99 / 100] / 1e3);
+    free(lat);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/io_bench.disk";
+    const char *data_path = "/tmp/io_bench.data";
+    char args[64], cmd[1024];
+    FILE *f = fopen(data_path, "w");
+    char *chunk = malloc(1 << 20);
+    if (!f || !chunk)
+        return 1;
+    uint64_t s = 42;
+    for (int mb = 0; mb < DATA_MB; mb++) {
+        for (size_t i = 0; i < (1 << 20) / sizeof(uint64_t); i++)
+            ((uint64_t *)chunk)[i] = rng_next(&s);
+        fwrite(chunk, 1, 1 << 20, f);
+    }
+    fclose(f);
+    free(chunk);
+    snprintf(args, sizeof(args), "-ds %dMB -ck off", DATA_MB + 64);
+    snprintf(cmd, sizeof(cmd), "./store write big --file %s -ds %s > /dev/null", data_path, path);
+    int ret = bench_disk(path, args, NULL) != 0 || system(cmd) != 0;
+    unlink(data_path);
+    if (ret != 0) {
+        printf("Unable to write %s\n", path);
+        return 1;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    bool direct = fd >= 0;
+    if (!direct) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+            return 1;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cores = cores < 1 ? 1 : cores;
+    printf("%s, %" PRIu64 " MB, %s, %ld thread%s\n", path, (uint64_t)st.st_size >> 20,
+           direct ? "O_DIRECT" : "buffered", cores, cores > 1 ? "s" : "");
+
+    static const unsigned depths[] = { 1, 4, 16, 64 };
+    static const enum io_backend backends[] = { IO_URING, IO_THREADS };
+    ret = 0;
+    for (size_t b = 0; b < sizeof(backends) / sizeof(*backends); b++) {
+        struct io_queue probe;
+        if (io_queue_init(&probe, 1, backends[b]) != 0) {
+            printf("%-9s not available\n", io_backend_name(backends[b]));
+            continue;
+        }
+        io_queue_free(&probe);
+        for (size_t i = 0; i < sizeof(depths) / sizeof(*depths); i++)
+            ret |= bench(backends[b], depths[i], fd, st.st_size / IO_SIZE, cores);
+    }
+    close(fd);
+    unlink(path);
+    return ret;
+}
@@ -0,0 +1,63 @@
+#include "bench.h"
+
+/*
+Opening a disk with millions of inode slots
+Usage: bench/open_bench [disk_path]   [run from the repo root, needs ./store]
+Makes a sparse 64GB smallfiles disk [about 10M inode slots], fills FILES of
+them, then opens it ROUNDS times the way a command does [disk_hold for the
+checks, disk_take for the command] and creates CREATES files on each open.
+Prints the open time, the first create [which reads the inode table group
+sb.ino_next points at and loads the block allocator] and the creates after it.
+*/
+
+#define FILES 200000
+#define ROUNDS 10
+#define CREATES 1000
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/open_bench.disk";
+    struct store_disk d;
+    char name[INODE_NAME];
+    if (smallfiles_conf() != 0 || bench_disk(path, "-co " SMALLFILES_CONF " -ds 64GB", &d) != 0)
+        return 1;
+    uint64_t slots = d.sb.inode_count;
+    for (int i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "f%07d", i);
+        if (put(&d, name, name, strlen(name), false) != 0 || ((i + 1) % 1000 == 0 && disk_commit(&d) != 0)) {
+            printf("Fill failed at %d\n", i);
+            return 1;
+        }
+    }
+    if (disk_commit(&d) != 0)
+        return 1;
+    disk_close(&d);
+    printf("%" PRIu64 " inode slots, %d used\n", slots, FILES);
+
+    double open_ms = 0, first_ms = 0, create_us = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        uint64_t t0 = now_ns();
+        if (disk_hold(path) != 0 || disk_take(&d, path, O_RDWR) != 0)
+            return 1;
+        uint64_t t1 = now_ns();
+        snprintf(name, sizeof(name), "r%02d.first", r);
+        if (put(&d, name, name, strlen(name), false) != 0)
+            return 1;
+        uint64_t t2 = now_ns();
+        for (int i = 0; i < CREATES; i++) {
+            snprintf(name, sizeof(name), "r%02d.%05d", r, i);
+            if (put(&d, name, name, strlen(name), false) != 0)
+                return 1;
+        }
+        uint64_t t3 = now_ns();
+        if (disk_commit(&d) != 0)
+            return 1;
+        disk_close(&d);
+        open_ms += (t1 - t0) / 1e6 / ROUNDS;
+        first_ms += (t2 - t1) / 1e6 / ROUNDS;
+        create_us += (t3 - t2) / 1e3 / CREATES / ROUNDS;
+    }
+    printf("open %8.3f ms  first create %8.3f ms  then %8.2f us per create  [mean of %d opens]\n", open_ms,
+           first_ms, create_us, ROUNDS);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "bench.h"
+
+/*
+Small records packed vs one block per file
+Usage: bench/pack_bench [disk_path]   [run from the repo root, needs ./store]
+For each record size writes RECORDS files on a smallfiles disk with packing on
+and on one with --packing off, committing every BATCH writes the way the daemon
+groups them, then reads every file back [name lookup included] and reports the
+data blocks the records ended up taking.
+*/
+
+#define RECORDS 20000
+#define BATCH 256
+
+static const uint64_t sizes[] = { 100, 200, 1000, 3000 };
+
+struct result {
+    double write_ops;
+    double read_ops;
+    uint64_t used;              // data bytes taken from the allocator
+};
+
+static int run(const char *path, bool packing, uint64_t size, const char *data, int out, struct result *res) {
+    char name[INODE_NAME];
+    struct store_disk d;
+    if (bench_disk(path, packing ? "-co " SMALLFILES_CONF " -ds 256MB -pk on"
+                                 : "-co " SMALLFILES_CONF " -ds 256MB -pk off", &d) != 0)
+        return 1;
+    uint64_t free_before = d.alloc.n_free;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < RECORDS; i++) {
+        snprintf(name, sizeof(name), "rec%d", i);
+        struct data_src src = { .kind = D_STR, .mem = data + i % 64, .size = size, .size_known = true };
+        struct write_stats ws = {0};
+        if (op_write(&d, name, &src, false, -1, -1, &ws) != ST_OK ||
+            ((i + 1) % BATCH == 0 && disk_commit(&d) != 0))
+            return 1;
+    }
+    if (disk_commit(&d) != 0)
+        return 1;
+    res->write_ops = RECORDS / ((now_ns() - t0) / 1e9);
+    res->used = (free_before - d.alloc.n_free) * d.sb.block;
+
+    t0 = now_ns();
+    for (int i = 0; i < RECORDS; i++) {
+        snprintf(name, sizeof(name), "rec%d", i);
+        struct store_file f;
+        struct read_stats rs = {0};
+        if (op_open(&d, name, &f) != ST_OK)
+            return 1;
+        lseek(out, 0, SEEK_SET);
+        int ret = data_read(&d, &f, 0, UINT64_MAX, out, READ_AUTO, &rs);
+        file_put(&f);
+        if (ret != 0 || rs.bytes != size)
+            return 1;
+    }
+    res->read_ops = RECORDS / ((now_ns() - t0) / 1e9);
+    disk_close(&d);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/pack_bench.disk";
+    const char *out_path = "/tmp/pack_bench.out";
+    if (smallfiles_conf() != 0)
+        return 1;
+    int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char *data = malloc(4096 + 64);
+    if (out < 0 || !data)
+        return 1;
+    for (int i = 0; i < 4096 + 64; i++)
+        data[i] = (char)(i * 2654435761u >> 13);
+
+    printf("%d records per size, commit every %d\n", RECORDS, BATCH);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        for (int packing = 1; packing >= 0; packing--) {
+            struct result r;
+            if (run(path, packing, sizes[s], data, out, &r) != 0) {
+                printf("%" PRIu64 " byte records with packing %s failed\n", sizes[s], packing ? "on" : "off");
+                return 1;
+            }
+            printf("%6" PRIu64 " B  packing %-3s  write %8.0f ops/s  read %8.0f ops/s  disk %8.2f MB  ",
+                   sizes[s], packing ? "on" : "off", r.write_ops, r.read_ops, r.used / 1048576.0);
+            if (r.used)
+                printf("%7.1f B/record  %5.1f%% of it data\n", r.used / (double)RECORDS,
+                       100.0 * sizes[s] * RECORDS / r.used);
+            else
+                printf("all inline\n");
+        }
+    }
+    close(out);
+    unlink(out_path);
+    unlink(SMALLFILES_CONF);
+    free(data);
+    return 0;
+}
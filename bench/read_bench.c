@@ -0,0 +1,96 @@
+#include "bench.h"
+
+/*
+Read latency for small vs large records, mmap vs pread
+Usage: bench/read_bench [disk_path] [crc32c|xxhash64|off]   [run from the repo root, needs ./store]
+Writes one record per size and times data_read into a scratch file, both on an
+already resolved file [read] and including the name lookup [lookup+read].
+*/
+
+static const uint64_t sizes[] = { 128, 4 << 10, 64 << 10, 1 << 20, 64 << 20 };
+
+static int put_file(struct store_disk *d, const char *name, const char *data, uint64_t size) {
+    struct store_file f = {0};
+    f.ino.inode_id = inode_alloc(d);
+    f.ino.data_cksum = d->sb.csum_blocks ? d->sb.checksum : CK_NONE;
+    strcpy(f.ino.name, name);
+    struct data_src src = { .kind = D_STR, .mem = data, .size = size, .size_known = true };
+    struct write_stats ws = {0};
+    int ret = data_src_open(&src) || data_write(d, &f, 0, &src, &ws) || file_store(d, &f) ||
+              index_insert(d, name, f.ino.inode_id);
+    file_put(&f);
+    return ret;
+}
+
+static void report(uint64_t size, const char *what, enum read_mode mode, uint64_t *lat, int n) {
+    qsort(lat, n, sizeof(*lat), cmp_u64);
+    uint64_t sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += lat[i];
+    double avg = sum / (double)n;
+    printf("%10" PRIu64 "  %-12s %-6s avg %9.2f us  p50 %9.2f us  p99 %9.2f us  %8.1f MB/s\n", size, what,
+           mode == READ_MMAP ? "mmap" : "pread", avg / 1e3, lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3,
+           size / (avg / 1e9) / (1 << 20));
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/read_bench.disk";
+    const char *cksum = argc > 2 ? argv[2] : "crc32c";
+    const char *out_path = "/tmp/read_bench.out";
+    char args[64];
+    snprintf(args, sizeof(args), "-ds 1GB -ck %s", cksum);
+    struct store_disk d;
+    if (bench_disk(path, args, &d) != 0)
+        return 1;
+    char *data = malloc(sizes[4]);
+    for (uint64_t i = 0; i < sizes[4]; i++)
+        data[i] = (char)(i * 2654435761u >> 13);
+    char name[INODE_NAME];
+    for (int s = 0; s < 5; s++) {
+        snprintf(name, sizeof(name), "rec-%" PRIu64, sizes[s]);
+        if (put_file(&d, name, data, sizes[s]) != 0)
+            return 1;
+    }
+    disk_commit(&d);
+
+    int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+        return 1;
+    enum read_mode modes[] = { READ_MMAP, READ_PREAD };
+    for (int s = 0; s < 5; s++) {
+        int iters = sizes[s] >= (1 << 20) ? 50 : 2000;
+        uint64_t *lat = malloc(iters * sizeof(*lat));
+        snprintf(name, sizeof(name), "rec-%" PRIu64, sizes[s]);
+        for (int m = 0; m < 2; m++) {
+            for (int with_lookup = 0; with_lookup < 2; with_lookup++) {
+                struct store_inode ino;
+                struct store_file f;
+                index_lookup(&d, name, &ino);
+                file_load(&d, ino.inode_id, &f);
+                for (int i = 0; i < iters; i++) {
+                    ftruncate(out, 0);
+                    lseek(out, 0, SEEK_SET);
+                    struct read_stats rs = {0};
+                    uint64_t t = now_ns();
+                    if (with_lookup) {
+                        file_put(&f);
+                        if (index_lookup(&d, name, &ino) != 0 || file_load(&d, ino.inode_id, &f) != 0)
+                            return 1;
+                    }
+                    if (data_read(&d, &f, 0, UINT64_MAX, out, modes[m], &rs) != 0)
+                        return 1;
+                    lat[i] = now_ns() - t;
+                }
+                file_put(&f);
+                report(sizes[s], with_lookup ? "lookup+read" : "read", modes[m], lat, iters);
+            }
+        }
+        free(lat);
+    }
+    close(out);
+    unlink(out_path);
+    disk_close(&d);
+    unlink(path);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <sys/mman.h>
+
+/*
+Readers while the writer is at it
+Usage: bench/reader_bench [disk_path]   [run from the repo root, needs ./store]
+One writer thread rewrites FILES files of FILE_SIZE whole and appends to a log,
+a commit after each, while 1, 2, 4 and 8 reader threads [each with its own
+read-only handle, as separate `store read` processes would have] read random
+files start to end. Every word of file i is i << 32 | the version it was
+written at, and word j of the log is j, so a read that mixes two versions or
+sees a block handed out again is a mismatch.
+Prints reads/s, MB/s and commits/s for each count, mismatches should be 0.
+*/
+
+#define DISK_SIZE "1GB"
+#define FILES 16
+#define FILE_SIZE (1 << 20)
+#define LOG_APPEND 4096
+#define RUN_MS 2000
+
+static const char *path;
+static volatile bool stop;
+static uint64_t commits, mismatches;
+static uint64_t log_words, version = 1;   // carry over from one run's writer to the next
+
+struct reader_arg {
+    int id;
+    uint64_t reads, bytes;
+};
+
+static void *writer(void *arg) {
+    struct store_disk *d = arg;
+    uint64_t *buf = malloc(FILE_SIZE);
+    char name[INODE_NAME];
+    while (buf && !stop) {
+        version++;
+        for (int i = 0; i < FILES && !stop; i++) {
+            for (uint64_t j = 0; j < FILE_SIZE / 8; j++)
+                buf[j] = (uint64_t)i << 32 | version;
+            snprintf(name, sizeof(name), "file.%d", i);
+            if (put(d, name, buf, FILE_SIZE, false) != 0 || disk_commit(d) != 0)
+                goto fail;
+            __atomic_add_fetch(&commits, 1, __ATOMIC_RELAXED);
+            for (uint64_t j = 0; j < LOG_APPEND / 8; j++)
+                buf[j] = log_words++;
+            if (put(d, "log", buf, LOG_APPEND, true) != 0 || disk_commit(d) != 0)
+                goto fail;
+            __atomic_add_fetch(&commits, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buf);
+    return NULL;
+fail:
+    printf("Writer failed\n");
+    free(buf);
+    stop = true;
+    return NULL;
+}
+
+// Words of a read that don't fit what was written under name
+static uint64_t check(const uint64_t *w, uint64_t n, int file) {
+    uint64_t bad = 0;
+    for (uint64_t j = 0; j < n; j++)
+        bad += file < 0 ? w[j] != j : (w[j] >> 32 != (uint64_t)file || w[j] != w[0]);
+    return bad;
+}
+
+static void *reader(void *arg) {
+    struct reader_arg *a = arg;
+    struct store_disk d;
+    int out = memfd_create("reader_bench", 0);
+    if (out < 0 || disk_open(&d, path, O_RDONLY) != 0) {
+        printf("Reader %d can't open %s\n", a->id, path);
+        stop = true;
+        return NULL;
+    }
+    uint64_t seed = 0x9e3779b97f4a7c15ull * (a->id + 1);
+    char name[INODE_NAME];
+    while (!stop) {
+        int file = (int)(rng_next(&seed) % (FILES + 1)) - 1;
+        if (file < 0)
+            snprintf(name, sizeof(name), "log");
+        else
+            snprintf(name, sizeof(name), "file.%d", file);
+        struct store_file f;
+        struct read_stats rs = {0};
+        reader_enter(&d);
+        int st = reader_open(&d, name, &f);
+        if (st == ST_OK) {
+            if (ftruncate(out, 0) != 0 || lseek(out, 0, SEEK_SET) != 0 ||
+                data_read(&d, &f, 0, f.ino.size, out, READ_AUTO, &rs) != 0 || rs.bytes != f.ino.size)
+                __atomic_add_fetch(&mismatches, 1, __ATOMIC_RELAXED);
+            else if (rs.bytes) {
+                uint64_t *w = mmap(NULL, rs.bytes, PROT_READ, MAP_SHARED, out, 0);
+                if (w == MAP_FAILED || check(w, rs.bytes / 8, file) != 0)
+                    __atomic_add_fetch(&mismatches, 1, __ATOMIC_RELAXED);
+                if (w != MAP_FAILED)
+                    munmap(w, rs.bytes);
+            }
+            file_put(&f);
+            a->reads++;
+            a->bytes += rs.bytes;
+        } else if (st != ST_NOENT) {
+            __atomic_add_fetch(&mismatches, 1, __ATOMIC_RELAXED);
+        }
+        reader_exit(&d);
+    }
+    disk_close(&d);
+    close(out);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    path = argc > 1 ? argv[1] : "/tmp/reader_bench.disk";
+    struct store_disk w;
+    if (bench_disk(path, "-ds " DISK_SIZE, &w) != 0)
+        return 1;
+    // the log is there from the start, appends need it
+    if (put(&w, "log", "", 0, false) != 0 || disk_commit(&w) != 0)
+        return 1;
+    printf("%d files of %d KB rewritten and a log appended %d bytes at a time, %d ms per run\n", FILES,
+           FILE_SIZE >> 10, LOG_APPEND, RUN_MS);
+    int counts[] = { 1, 2, 4, 8 };
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]) && !mismatches; c++) {
+        int n = counts[c];
+        struct reader_arg args[8] = {0};
+        pthread_t rt[8], wt;
+        stop = false;
+        commits = 0;
+        if (pthread_create(&wt, NULL, writer, &w) != 0)
+            return 1;
+        for (int i = 0; i < n; i++) {
+            args[i].id = i;
+            if (pthread_create(&rt[i], NULL, reader, &args[i]) != 0)
+                return 1;
+        }
+        uint64_t t0 = now_ns();
+        usleep(RUN_MS * 1000);
+        stop = true;
+        pthread_join(wt, NULL);
+        uint64_t reads = 0, bytes = 0;
+        for (int i = 0; i < n; i++) {
+            pthread_join(rt[i], NULL);
+            reads += args[i].reads;
+            bytes += args[i].bytes;
+        }
+        double s = (now_ns() - t0) / 1e9;
+        printf("%d readers  %9.0f reads/s  %8.1f MB/s  writer %7.0f commits/s  mismatches %" PRIu64 "\n", n,
+               reads / s, bytes / 1048576.0 / s, commits / s, mismatches);
+    }
+    disk_close(&w);
+    unlink(path);
+    char tp[PATH_MAX + 16];
+    snprintf(tp, sizeof(tp), "%s.readers", path);
+    unlink(tp);
+    return mismatches != 0;
+}
@@ -0,0 +1,97 @@
+#include "bench.h"
+
+/*
+Snapshot and clone cost as the data grows
+Usage: bench/snap_bench [disk_path]   [run from the repo root, needs ./store]
+Fills a disk with FILES files of growing size, then times a snapshot of it, a
+clone of the biggest file and a whole copy of that file through the memfd for
+comparison. Then appends CHANGED of its size to one file and times the diff
+between snapshots before and after, which only sends the blocks that changed.
+Snapshot and clone should stay flat while the copy grows with the data.
+*/
+
+#define FILES 8
+#define CHANGED 0.01
+
+static const uint64_t sizes[] = { 4 << 20, 16 << 20, 64 << 20 };
+
+static int run(const char *path, uint64_t size, char *buf, int out) {
+    char args[64], name[INODE_NAME];
+    snprintf(args, sizeof(args), "-ds %" PRIu64 "MB", (size * FILES * 3 / 2 >> 20) + 64);
+    struct store_disk d;
+    if (bench_disk(path, args, &d) != 0)
+        return 1;
+    for (int i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "file.%d", i);
+        fill(buf, size);
+        if (put(&d, name, buf, size, false) != 0 || disk_commit(&d) != 0)
+            return 1;
+    }
+
+    uint64_t t0 = now_ns();
+    if (snap_create(&d, "a") != ST_OK || disk_commit(&d) != 0)
+        return 1;
+    double snap_ms = (now_ns() - t0) / 1e6;
+
+    t0 = now_ns();
+    if (snap_clone(&d, "file.0", "clone", NULL) != ST_OK || disk_commit(&d) != 0)
+        return 1;
+    double clone_ms = (now_ns() - t0) / 1e6;
+
+    struct store_file f;
+    struct read_stats rs = {0};
+    t0 = now_ns();
+    if (op_open(&d, "file.0", &f) != ST_OK || ftruncate(out, 0) != 0 || lseek(out, 0, SEEK_SET) != 0 ||
+        data_read(&d, &f, 0, UINT64_MAX, out, READ_AUTO, &rs) != 0 || lseek(out, 0, SEEK_SET) != 0)
+        return 1;
+    file_put(&f);
+    struct data_src src = { .kind = D_FIL, .fd = out, .size = rs.bytes, .size_known = true };
+    struct write_stats ws = {0};
+    if (data_src_open(&src) != 0 || op_write(&d, "copy", &src, false, -1, -1, &ws) != ST_OK || disk_commit(&d) != 0)
+        return 1;
+    double copy_ms = (now_ns() - t0) / 1e6;
+
+    // one file grows a little, the next snapshot only differs in its last blocks
+    uint64_t grow = size * CHANGED;
+    fill(buf, grow);
+    src = (struct data_src){ .kind = D_STR, .mem = buf, .size = grow, .size_known = true };
+    if (snap_create(&d, "b") != ST_OK || data_src_open(&src) != 0 ||
+        op_write(&d, "file.1", &src, true, -1, -1, &ws) != ST_OK || snap_create(&d, "c") != ST_OK ||
+        disk_commit(&d) != 0)
+        return 1;
+    struct diff_stats ds = {0};
+    if (ftruncate(out, 0) != 0 || lseek(out, 0, SEEK_SET) != 0)
+        return 1;
+    t0 = now_ns();
+    if (snap_diff(&d, "b", "c", 0, out, &ds) != ST_OK)
+        return 1;
+    double diff_ms = (now_ns() - t0) / 1e6;
+
+    printf("%5" PRIu64 " MB of data  snapshot %7.3f ms  clone %7.3f ms  copy %9.3f ms  "
+           "diff %8.3f ms  %8.2f MB sent\n", size * FILES >> 20, snap_ms, clone_ms, copy_ms, diff_ms,
+           ds.bytes / 1048576.0);
+    disk_close(&d);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/snap_bench.disk";
+    const char *out_path = "/tmp/snap_bench.out";
+    int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char *buf = malloc(sizes[sizeof(sizes) / sizeof(*sizes) - 1]);
+    if (out < 0 || !buf)
+        return 1;
+    printf("%d files per disk, copy is a read and write of the biggest, diff after one file grew by %.0f%%\n",
+           FILES, CHANGED * 100);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        if (run(path, sizes[i], buf, out) != 0) {
+            printf("Run with %" PRIu64 " MB files failed\n", sizes[i] >> 20);
+            return 1;
+        }
+    }
+    close(out);
+    unlink(out_path);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,375 @@
+#include "bench.h"
+
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+/*
+Benchmark suite, what `make bench` runs
+Usage: bench/suite [-f json|csv] [-o out_file] [-d scratch_dir]   [run from the repo root, needs ./store]
+Runs every case a few times [or times every op] and writes one row per series:
+count, mean, min, p50, p90, p99 and max, as JSON [default] or CSV, so results
+from two trees can be diffed or plotted. Cases:
+  init      ./store init across disk sizes and profiles, sparse and full
+  seq       one 64MB file written and read back, and the same through a plain file
+  rand      4KB reads at random offsets, 4KB files rewritten at random
+  small     256 byte file creates, committed every BATCH like the daemon does
+  append    1KB appends to one file, committed every BATCH
+  compress  log lines with lz4 on and off, throughput and the space they took
+  rss       peak resident set of the whole run
+Throughput series have one sample per run, latency series one per op.
+*/
+
+#define REPS 5
+#define SEQ_SIZE (64 << 20)
+#define RAND_FILES 1024
+#define RAND_OPS 4096
+#define SMALL_FILES 10000
+#define APPENDS 10000
+#define BATCH 64
+
+static FILE *out;
+static bool csv;
+static int rows;
+static const char *dir = "/tmp";
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank on sorted v
+static double pct(const double *v, int n, int p) {
+    int i = (p * n + 99) / 100 - 1;
+    return v[i < 0 ? 0 : i];
+}
+
+// One row of results, sorts v
+static void emit(const char *bench, const char *name, const char *unit, double *v, int n) {
+    if (n == 0)
+        return;
+    qsort(v, n, sizeof(*v), cmp_double);
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += v[i];
+    if (csv) {
+        fprintf(out, "%s,%s,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", bench, name, unit, n, sum / n, v[0],
+                pct(v, n, 50), pct(v, n, 90), pct(v, n, 99), v[n - 1]);
+    } else {
+        fprintf(out, "%s\n    {\"bench\": \"%s\", \"case\": \"%s\", \"unit\": \"%s\", \"n\": %d, \"mean\": %.3f, "
+                "\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}", rows ? "," : "",
+                bench, name, unit, n, sum / n, v[0], pct(v, n, 50), pct(v, n, 90), pct(v, n, 99), v[n - 1]);
+    }
+    rows++;
+    fflush(out);
+}
+
+static void emit1(const char *bench, const char *name, const char *unit, double v) {
+    emit(bench, name, unit, &v, 1);
+}
+
+static double mb_s(uint64_t bytes, uint64_t ns) {
+    return bytes / (ns / 1e9) / 1048576.0;
+}
+
+// put, counting into ws
+static int put_ws(struct store_disk *d, const char *name, const char *data, uint64_t size, bool append,
+                  struct write_stats *ws) {
+    struct data_src src = { .kind = D_STR, .mem = data, .size = size, .size_known = true };
+    return op_write(d, name, &src, append, -1, -1, ws) != ST_OK;
+}
+
+// Reads len bytes of name at off into out_fd
+static int get(struct store_disk *d, const char *name, uint64_t off, uint64_t len, int out_fd,
+               struct read_stats *rs) {
+    struct store_file f;
+    if (op_open(d, name, &f) != ST_OK)
+        return 1;
+    int ret = data_read(d, &f, off, len, out_fd, READ_AUTO, rs);
+    file_put(&f);
+    return ret;
+}
+
+static int bench_init(void) {
+    static const char *sizes[] = { "64MB", "1GB", "16GB" };
+    static const char *profiles[] = { "balanced", "smallfiles", "largefiles" };
+    char path[PATH_MAX], cfg[PATH_MAX], args[PATH_MAX * 2], name[64];
+    snprintf(path, sizeof(path), "%s/suite_init.disk", dir);
+    snprintf(cfg, sizeof(cfg), "%s/suite_init.toml", dir);
+    double v[REPS];
+    for (int p = 0; p < 3; p++) {
+        FILE *f = fopen(cfg, "w");
+        if (!f)
+            return 1;
+        fprintf(f, "[storage]\nprofile = \"%s\"\n", profiles[p]);
+        fclose(f);
+        for (int s = 0; s < 3; s++) {
+            for (int full = 0; full < 2; full++) {
+                // writing out a 16GB inode table is a different benchmark
+                if (full && s == 2)
+                    continue;
+                snprintf(args, sizeof(args), "-ds %s -co %s -im %s", sizes[s], cfg, full ? "full" : "sparse");
+                for (int r = 0; r < REPS; r++) {
+                    uint64_t t0 = now_ns();
+                    if (bench_disk(path, args, NULL) != 0)
+                        return 1;
+                    v[r] = (now_ns() - t0) / 1e6;
+                }
+                snprintf(name, sizeof(name), "%s %s %s", sizes[s], profiles[p], full ? "full" : "sparse");
+                emit("init", name, "ms", v, REPS);
+            }
+        }
+    }
+    unlink(path);
+    unlink(cfg);
+    return 0;
+}
+
+static int bench_seq(const char *data, int null_fd) {
+    char path[PATH_MAX], plain[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/suite_seq.disk", dir);
+    snprintf(plain, sizeof(plain), "%s/suite_seq.plain", dir);
+    double w[REPS], r[REPS], wsys[REPS], rsys[REPS], pw[REPS];
+    for (int i = 0; i < REPS; i++) {
+        struct store_disk d;
+        if (bench_disk(path, "-ds 256MB", &d) != 0)
+            return 1;
+        struct write_stats ws = {0};
+        uint64_t t0 = now_ns();
+        if (put_ws(&d, "seq", data, SEQ_SIZE, false, &ws) != 0 || disk_commit(&d) != 0)
+            return 1;
+        w[i] = mb_s(SEQ_SIZE, now_ns() - t0);
+        wsys[i] = ws.syscalls;
+        struct read_stats rs = {0};
+        t0 = now_ns();
+        if (get(&d, "seq", 0, UINT64_MAX, null_fd, &rs) != 0 || rs.bytes != SEQ_SIZE)
+            return 1;
+        r[i] = mb_s(SEQ_SIZE, now_ns() - t0);
+        rsys[i] = rs.syscalls;
+        disk_close(&d);
+
+        // what dd conv=fdatasync bs=1M would do
+        int fd = open(plain, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return 1;
+        t0 = now_ns();
+        for (uint64_t off = 0; off < SEQ_SIZE; off += 1 << 20)
+            if (write(fd, data + off, 1 << 20) != 1 << 20) {
+                close(fd);
+                return 1;
+            }
+        if (fdatasync(fd) != 0) {
+            close(fd);
+            return 1;
+        }
+        pw[i] = mb_s(SEQ_SIZE, now_ns() - t0);
+        close(fd);
+    }
+    emit("seq", "write 64MB", "MB/s", w, REPS);
+    emit("seq", "write 64MB", "syscalls", wsys, REPS);
+    emit("seq", "read 64MB", "MB/s", r, REPS);
+    emit("seq", "read 64MB", "syscalls", rsys, REPS);
+    emit("seq", "plain write 64MB", "MB/s", pw, REPS);
+    unlink(path);
+    unlink(plain);
+    return 0;
+}
+
+static int bench_rand(const char *data, int null_fd) {
+    char path[PATH_MAX], name[INODE_NAME];
+    snprintf(path, sizeof(path), "%s/suite_rand.disk", dir);
+    struct store_disk d;
+    double *lat = malloc(RAND_OPS * sizeof(*lat));
+    if (!lat || bench_disk(path, "-ds 512MB", &d) != 0) {
+        free(lat);
+        return 1;
+    }
+    struct write_stats ws = {0};
+    int ret = put_ws(&d, "big", data, SEQ_SIZE, false, &ws) != 0;
+    for (int i = 0; i < RAND_FILES && ret == 0; i++) {
+        snprintf(name, sizeof(name), "r%d", i);
+        ret = put_ws(&d, name, data + i, 4096, false, &ws);
+    }
+    if (ret == 0)
+        ret = disk_commit(&d);
+
+    for (int i = 0; i < RAND_OPS && ret == 0; i++) {
+        struct read_stats rs = {0};
+        uint64_t t0 = now_ns();
+        ret = get(&d, "big", next_rand() % (SEQ_SIZE / 4096) * 4096, 4096, null_fd, &rs);
+        lat[i] = (now_ns() - t0) / 1e3;
+    }
+    if (ret == 0)
+        emit("rand", "read 4KB", "us", lat, RAND_OPS);
+
+    for (int i = 0; i < RAND_OPS && ret == 0; i++) {
+        snprintf(name, sizeof(name), "r%d", (int)(next_rand() % RAND_FILES));
+        uint64_t t0 = now_ns();
+        ret = put_ws(&d, name, data + i % 64, 4096, false, &ws) || ((i + 1) % BATCH == 0 && disk_commit(&d));
+        lat[i] = (now_ns() - t0) / 1e3;
+    }
+    if (ret == 0)
+        emit("rand", "rewrite 4KB file", "us", lat, RAND_OPS);
+    free(lat);
+    disk_close(&d);
+    unlink(path);
+    return ret;
+}
+
+static int bench_small(const char *data) {
+    char path[PATH_MAX], name[INODE_NAME];
+    snprintf(path, sizeof(path), "%s/suite_small.disk", dir);
+    struct store_disk d;
+    double *lat = malloc(SMALL_FILES * sizeof(*lat));
+    if (!lat || bench_disk(path, "-ds 256MB", &d) != 0) {
+        free(lat);
+        return 1;
+    }
+    int ret = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < SMALL_FILES && ret == 0; i++) {
+        snprintf(name, sizeof(name), "s%d", i);
+        struct write_stats ws = {0};
+        uint64_t t0 = now_ns();
+        ret = put_ws(&d, name, data + i % 64, 256, false, &ws) || ((i + 1) % BATCH == 0 && disk_commit(&d));
+        lat[i] = (now_ns() - t0) / 1e3;
+    }
+    if (ret == 0 && (ret = disk_commit(&d)) == 0) {
+        emit1("small", "create 256B", "ops/s", SMALL_FILES / ((now_ns() - start) / 1e9));
+        emit("small", "create 256B", "us", lat, SMALL_FILES);
+    }
+    free(lat);
+    disk_close(&d);
+    unlink(path);
+    return ret;
+}
+
+static int bench_append(const char *data) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/suite_append.disk", dir);
+    struct store_disk d;
+    double *lat = malloc(APPENDS * sizeof(*lat));
+    struct write_stats ws = {0};
+    if (!lat || bench_disk(path, "-ds 256MB", &d) != 0 ||
+        put_ws(&d, "log", data, 0, false, &ws) != 0) {
+        free(lat);
+        return 1;
+    }
+    int ret = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < APPENDS && ret == 0; i++) {
+        uint64_t t0 = now_ns();
+        ret = put_ws(&d, "log", data + i % 64, 1024, true, &ws) || ((i + 1) % BATCH == 0 && disk_commit(&d));
+        lat[i] = (now_ns() - t0) / 1e3;
+    }
+    if (ret == 0 && (ret = disk_commit(&d)) == 0) {
+        emit1("append", "1KB", "MB/s", mb_s((uint64_t)APPENDS * 1024, now_ns() - start));
+        emit("append", "1KB", "us", lat, APPENDS);
+    }
+    free(lat);
+    disk_close(&d);
+    unlink(path);
+    return ret;
+}
+
+// structured log lines, compress about as well as real ones
+static void gen_logs(char *p, uint64_t n) {
+    char line[128];
+    for (uint64_t i = 0, seq = 0; i < n; seq++) {
+        int len = snprintf(line, sizeof(line), "2024-01-01T00:%02" PRIu64 ":%02" PRIu64 " INFO req=%" PRIu64
+                           " status=%d latency_us=%" PRIu64 "\n", seq / 60 % 60, seq % 60, seq,
+                           next_rand() % 8 ? 200 : 500, next_rand() % 5000);
+        for (int j = 0; j < len && i < n; j++)
+            p[i++] = line[j];
+    }
+}
+
+static int bench_compress(int null_fd) {
+    char path[PATH_MAX], name[64];
+    snprintf(path, sizeof(path), "%s/suite_comp.disk", dir);
+    char *logs = malloc(SEQ_SIZE);
+    if (!logs)
+        return 1;
+    gen_logs(logs, SEQ_SIZE);
+    int ret = 0;
+    for (int comp = 0; comp < 2 && ret == 0; comp++) {
+        double w[REPS], r[REPS], used = 0;
+        for (int i = 0; i < REPS && ret == 0; i++) {
+            struct store_disk d;
+            if (bench_disk(path, comp ? "-ds 256MB -cm lz4" : "-ds 256MB -cm off", &d) != 0) {
+                ret = 1;
+                break;
+            }
+            uint64_t free_before = d.alloc.n_free;
+            struct write_stats ws = {0};
+            struct read_stats rs = {0};
+            uint64_t t0 = now_ns();
+            ret = put_ws(&d, "logs", logs, SEQ_SIZE, false, &ws) || disk_commit(&d);
+            w[i] = mb_s(SEQ_SIZE, now_ns() - t0);
+            used = 100.0 * (free_before - d.alloc.n_free) * d.sb.block / SEQ_SIZE;
+            t0 = now_ns();
+            if (ret == 0)
+                ret = get(&d, "logs", 0, UINT64_MAX, null_fd, &rs);
+            r[i] = mb_s(SEQ_SIZE, now_ns() - t0);
+            disk_close(&d);
+        }
+        if (ret)
+            break;
+        snprintf(name, sizeof(name), "logs %s write", comp ? "lz4" : "off");
+        emit("compress", name, "MB/s", w, REPS);
+        snprintf(name, sizeof(name), "logs %s read", comp ? "lz4" : "off");
+        emit("compress", name, "MB/s", r, REPS);
+        snprintf(name, sizeof(name), "logs %s", comp ? "lz4" : "off");
+        emit1("compress", name, "% of data on disk", used);
+    }
+    free(logs);
+    unlink(path);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    const char *out_path = NULL;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-f") == 0) {
+            csv = strcmp(argv[i + 1], "csv") == 0;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            out_path = argv[i + 1];
+        } else if (strcmp(argv[i], "-d") == 0) {
+            dir = argv[i + 1];
+        } else {
+            printf("Usage: %s [-f json|csv] [-o out_file] [-d scratch_dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    out = out_path ? fopen(out_path, "w") : stdout;
+    int null_fd = open("/dev/null", O_WRONLY);
+    char *data = malloc(SEQ_SIZE + 64);
+    if (!out || null_fd < 0 || !data) {
+        fprintf(stderr, "Unable to set up the suite\n");
+        return 1;
+    }
+    for (uint64_t i = 0; i < SEQ_SIZE + 64; i++)
+        data[i] = (char)(next_rand() >> 29);
+
+    struct utsname u;
+    uname(&u);
+    if (csv) {
+        fprintf(out, "bench,case,unit,n,mean,min,p50,p90,p99,max\n");
+    } else {
+        fprintf(out, "{\n  \"kernel\": \"%s %s\",\n  \"machine\": \"%s\",\n  \"cpus\": %ld,\n  \"results\": [",
+                u.sysname, u.release, u.machine, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    int ret = bench_init() || bench_seq(data, null_fd) || bench_rand(data, null_fd) || bench_small(data) ||
+              bench_append(data) || bench_compress(null_fd);
+    if (ret)
+        fprintf(stderr, "Benchmark failed\n");
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    emit1("rss", "peak", "KB", ru.ru_maxrss);
+    if (!csv)
+        fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    close(null_fd);
+    free(data);
+    return ret;
+}
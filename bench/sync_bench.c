@@ -0,0 +1,63 @@
+#include "bench.h"
+
+/*
+Incremental sync against a full copy
+Usage: bench/sync_bench [disk_path]   [run from the repo root, needs ./store]
+Fills a 1GB disk with FILES files, syncs it whole into a second disk, then
+changes CHANGED bytes [an append to one file, a rewrite of a small one] and
+syncs again. Prints what each sync moved and how long it took, the second
+should move about CHANGED bytes however much is on the disk.
+*/
+
+#define DISK_SIZE "1GB"
+#define FILES 12
+#define FILE_SIZE (64 << 20)
+#define CHANGED (1 << 20)
+
+// One sync from snapshot from to to, the way store sync does it, prints what it moved
+static int sync_once(struct store_disk *d, struct store_disk *t, const char *from, const char *to) {
+    struct diff_stats ds = {0};
+    uint64_t t0 = now_ns();
+    if (snap_create(d, to) != ST_OK || disk_commit(d) != 0 ||
+        sync_send(d, from, to, t, -1, &ds) != ST_OK || disk_commit(t) != 0)
+        return 1;
+    if (from && (snap_delete(d, from) != ST_OK || disk_commit(d) != 0))
+        return 1;
+    double ms = (now_ns() - t0) / 1e6;
+    printf("%-12s %4" PRIu64 " files  %10.2f MB moved  %9.3f ms  %8.1f MB/s  %7" PRIu64 " blocks kept\n",
+           from ? "incremental" : "full", ds.files, ds.bytes / 1048576.0, ms,
+           ms > 0 ? ds.bytes / 1048576.0 / (ms / 1e3) : 0.0, ds.shared);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "/tmp/sync_bench.disk";
+    char to_path[PATH_MAX], name[INODE_NAME];
+    snprintf(to_path, sizeof(to_path), "%s.target", path);
+    char *buf = malloc(FILE_SIZE);
+    struct store_disk d, t;
+    if (!buf || bench_disk(path, "-ds " DISK_SIZE, &d) != 0 || bench_disk(to_path, "-ds " DISK_SIZE, &t) != 0)
+        return 1;
+    for (int i = 0; i < FILES; i++) {
+        snprintf(name, sizeof(name), "file.%d", i);
+        fill(buf, FILE_SIZE);
+        if (put(&d, name, buf, FILE_SIZE, false) != 0 || disk_commit(&d) != 0)
+            return 1;
+    }
+    printf("%d files of %d MB on a " DISK_SIZE " disk, then %d KB of changes\n", FILES, FILE_SIZE >> 20,
+           CHANGED >> 10);
+    if (sync_once(&d, &t, NULL, "a") != 0)
+        return 1;
+
+    fill(buf, CHANGED);
+    if (put(&d, "file.3", buf, CHANGED - 4096, true) != 0 || put(&d, "small", buf, 4096, false) != 0 ||
+        disk_commit(&d) != 0 || sync_once(&d, &t, "a", "b") != 0)
+        return 1;
+
+    disk_close(&d);
+    disk_close(&t);
+    unlink(path);
+    unlink(to_path);
+    free(buf);
+    return 0;
+}
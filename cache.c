@@ -0,0 +1,260 @@
+#include "store.h"
+
+/*
+Block cache
+A fixed number of block sized frames holding home copies of disk blocks:
+superblock, inodes, bitmap, index buckets, pack blocks and small data reads.
+Lookups go through an open addressing table of (block, frame) pairs, linear
+probing, deletes shift the rest of the probe back so there are no tombstones.
+Eviction is clock: every hit sets the frame's bit, the hand clears bits until
+it finds a frame without one.
+The cache only ever holds what is on disk. Metadata changes sit in the open txn
+[disk_read_meta lays them over the cached copy] and reach the cache when the
+checkpoint writes them home, data writes drop the blocks they cover.
+Read-ahead: a miss right after the block last asked for doubles the window of
+blocks read along with it [up to CACHE_RA_MAX], any other miss resets it, so
+only a sequential reader pays for the extra blocks.
+*/
+
+#define EMPTY UINT64_MAX
+
+static uint32_t slot_of(const struct block_cache *c, uint64_t blk) {
+    return (uint32_t)((blk * 0x9E3779B97F4A7C15ull) >> 32) & c->mask;
+}
+
+static uint32_t find(const struct block_cache *c, uint64_t blk) {
+    for (uint32_t s = slot_of(c, blk); c->table[s].frame; s = (s + 1) & c->mask)
+        if (c->table[s].blk == blk)
+            return c->table[s].frame;
+    return 0;
+}
+
+static void insert(struct block_cache *c, uint64_t blk, uint32_t frame) {
+    uint32_t s = slot_of(c, blk);
+    while (c->table[s].frame)
+        s = (s + 1) & c->mask;
+    c->table[s].blk = blk;
+    c->table[s].frame = frame;
+}
+
+static void erase(struct block_cache *c, uint64_t blk) {
+    uint32_t s = slot_of(c, blk);
+    while (c->table[s].frame && c->table[s].blk != blk)
+        s = (s + 1) & c->mask;
+    if (!c->table[s].frame)
+        return;
+    // pull back every later entry of the run that may sit at or before the hole
+    uint32_t hole = s;
+    for (uint32_t n = (s + 1) & c->mask; c->table[n].frame; n = (n + 1) & c->mask) {
+        uint32_t home = slot_of(c, c->table[n].blk);
+        if (((n - home) & c->mask) >= ((n - hole) & c->mask)) {
+            c->table[hole] = c->table[n];
+            hole = n;
+        }
+    }
+    c->table[hole].frame = 0;
+}
+
+/*
+Sets up a cache of bytes [rounded down to whole blocks] for d, 0 bytes leaves
+the disk uncached. readahead turns on the sequential window.
+Returns 0 on success else 1
+*/
+int cache_init(struct store_disk *d, uint64_t bytes, bool readahead) {
+    uint64_t frames = bytes / d->sb.block;
+    if (frames == 0)
+        return 0;
+    if (frames > UINT32_MAX / 4)
+        frames = UINT32_MAX / 4;
+    struct block_cache *c = calloc(1, sizeof(*c));
+    if (!c)
+        return 1;
+    uint32_t slots = 1;
+    while (slots < 2 * frames)
+        slots *= 2;
+    c->n_frames = frames;
+    c->mask = slots - 1;
+    c->readahead = readahead;
+    c->last = EMPTY;
+    // frames are only touched once used, a big budget costs nothing until then
+    c->data = calloc(frames, d->sb.block);
+    c->frame_blk = malloc(frames * sizeof(*c->frame_blk));
+    c->ref = calloc(frames, 1);
+    c->table = calloc(slots, sizeof(*c->table));
+    c->ra_buf = readahead ? malloc((size_t)(CACHE_RA_MAX + 1) * d->sb.block) : NULL;
+    if (!c->data || !c->frame_blk || !c->ref || !c->table || (readahead && !c->ra_buf)) {
+        printf("Unable to alloc mem for a %" PRIu64 " byte cache\n", bytes);
+        d->cache = c;
+        cache_free(d);
+        return 1;
+    }
+    for (uint64_t i = 0; i < frames; i++)
+        c->frame_blk[i] = EMPTY;
+    d->cache = c;
+    return 0;
+}
+
+void cache_free(struct store_disk *d) {
+    struct block_cache *c = d->cache;
+    if (!c)
+        return;
+    stats_add(SC_CACHE_HITS, c->hits);
+    stats_add(SC_CACHE_MISSES, c->misses);
+    stats_add(SC_CACHE_EVICTIONS, c->evictions);
+    free(c->data);
+    free(c->frame_blk);
+    free(c->ref);
+    free(c->table);
+    free(c->ra_buf);
+    free(c);
+    d->cache = NULL;
+}
+
+static char *frame_data(const struct store_disk *d, uint32_t frame) {
+    return d->cache->data + (size_t)(frame - 1) * d->sb.block;
+}
+
+// Takes a frame for blk, evicting whatever the clock hand settles on
+static uint32_t claim(struct store_disk *d, uint64_t blk) {
+    struct block_cache *c = d->cache;
+    while (c->ref[c->hand]) {
+        c->ref[c->hand] = 0;
+        c->hand = c->hand + 1 == c->n_frames ? 0 : c->hand + 1;
+    }
+    uint32_t frame = c->hand + 1;
+    c->hand = c->hand + 1 == c->n_frames ? 0 : c->hand + 1;
+    if (c->frame_blk[frame - 1] != EMPTY) {
+        erase(c, c->frame_blk[frame - 1]);
+        c->evictions++;
+    }
+    c->frame_blk[frame - 1] = blk;
+    insert(c, blk, frame);
+    return frame;
+}
+
+// Reads blk plus whatever the read-ahead window asks for, returns blk's frame, 0 on error
+static uint32_t fill(struct store_disk *d, uint64_t blk) {
+    struct block_cache *c = d->cache;
+    uint32_t block = d->sb.block;
+    uint64_t n = 1;
+    if (c->readahead) {
+        if (blk == c->last + 1)
+            c->window = c->window ? (c->window * 2 < CACHE_RA_MAX ? c->window * 2 : CACHE_RA_MAX) : 4;
+        else
+            c->window = 0;
+        // never past the disk end or over a block we already have, nor more than a quarter of the frames
+        uint64_t total = d->sb.disk_size / block;
+        while (n <= c->window && n < c->n_frames / 4 && blk + n < total && !find(c, blk + n))
+            n++;
+    }
+    char *dst = n > 1 ? c->ra_buf : NULL;
+    uint32_t frame = 0;
+    if (n == 1) {
+        frame = claim(d, blk);
+        dst = frame_data(d, frame);
+    }
+    if (pread(d->fd, dst, n * block, (off_t)blk * block) != (ssize_t)(n * block)) {
+        if (frame) {
+            erase(c, blk);
+            c->frame_blk[frame - 1] = EMPTY;
+        }
+        return 0;
+    }
+    c->misses++;
+    if (n > 1) {
+        c->ra_blocks += n - 1;
+        for (uint64_t i = 0; i < n; i++) {
+            uint32_t f = claim(d, blk + i);
+            memcpy(frame_data(d, f), c->ra_buf + i * block, block);
+            if (i == 0)
+                frame = f;
+        }
+    }
+    return frame;
+}
+
+/*
+Home copy of disk block blk, read in on a miss. The pointer is good until the
+next cache call.
+Returns NULL if the block couldn't be read
+*/
+const char *cache_get(struct store_disk *d, uint64_t blk) {
+    struct block_cache *c = d->cache;
+    uint32_t frame = find(c, blk);
+    if (frame) {
+        c->hits++;
+        c->ref[frame - 1] = 1;
+    } else {
+        frame = fill(d, blk);
+        if (!frame)
+            return NULL;
+    }
+    c->last = blk;
+    return frame_data(d, frame);
+}
+
+// Copies len bytes at disk offset off out of the cache, returns 0 on success else 1
+int cache_read(struct store_disk *d, off_t off, void *buf, size_t len) {
+    uint32_t block = d->sb.block;
+    for (char *dst = buf; len > 0; ) {
+        const char *p = cache_get(d, off / block);
+        if (!p)
+            return 1;
+        size_t in = off % block;
+        size_t n = block - in < len ? block - in : len;
+        memcpy(dst, p + in, n);
+        dst += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// blk was written home with buf, a cached copy follows
+void cache_update(struct store_disk *d, uint64_t blk, const void *buf) {
+    if (!d->cache)
+        return;
+    uint32_t frame = find(d->cache, blk);
+    if (frame)
+        memcpy(frame_data(d, frame), buf, d->sb.block);
+}
+
+// Something is about to write [off, off + len) behind the cache's back, drops the blocks it covers
+void cache_drop(struct store_disk *d, off_t off, uint64_t len) {
+    struct block_cache *c = d->cache;
+    if (!c || len == 0)
+        return;
+    uint64_t first = off / d->sb.block, last = (off + len - 1) / d->sb.block;
+    // a big range is cheaper to check frame by frame
+    if (last - first >= c->n_frames) {
+        for (uint32_t i = 0; i < c->n_frames; i++) {
+            if (c->frame_blk[i] != EMPTY && c->frame_blk[i] >= first && c->frame_blk[i] <= last) {
+                erase(c, c->frame_blk[i]);
+                c->frame_blk[i] = EMPTY;
+                c->ref[i] = 0;
+            }
+        }
+        return;
+    }
+    for (uint64_t blk = first; blk <= last; blk++) {
+        uint32_t frame = find(c, blk);
+        if (frame) {
+            erase(c, blk);
+            c->frame_blk[frame - 1] = EMPTY;
+            c->ref[frame - 1] = 0;
+        }
+    }
+}
+
+void cache_report(const struct store_disk *d) {
+    const struct block_cache *c = d->cache;
+    if (!c)
+        return;
+    uint64_t used = 0;
+    for (uint32_t i = 0; i < c->n_frames; i++)
+        used += c->frame_blk[i] != EMPTY;
+    uint64_t looks = c->hits + c->misses;
+    printf("Cache: %" PRIu64 "/%" PRIu32 " blocks used, %" PRIu64 " hits %" PRIu64 " misses (%.1f%% hit), %" PRIu64
+           " evictions, %" PRIu64 " blocks read ahead\n", used, c->n_frames, c->hits, c->misses,
+           looks ? 100.0 * c->hits / looks : 0.0, c->evictions, c->ra_blocks);
+}
@@ -0,0 +1,491 @@
+#include "store.h"
+
+#include <immintrin.h>
+
+/*
+Checksums
+CRC32C [Castagnoli] runs on the SSE4.2 crc32 instruction when the CPU has it,
+three independent streams at a time so the instruction's latency is hidden,
+the three partial crcs are joined with precomputed shift tables [data blocks
+each have their own crc, so there three blocks simply run side by side]. Without
+SSE4.2 it falls back to slicing-by-8 tables. With AVX-512 and VPCLMULQDQ
+runs of 256 bytes or more are folded instead, carry-less multiplies by x^n mod P
+move 64 bytes at a time onto the data further on, a few times faster than the
+crc32 instruction can go. xxHash64 is plain C and fast everywhere. The pick is
+made once, on first use.
+*/
+
+#define CRC32C_POLY 0x82f63b78      // reflected
+#define CRC_LONG 8192               // bytes per stream in the big loop
+#define CRC_SHORT 256               // ... and in the small one
+
+static uint32_t crc_table[8][256];
+static uint32_t crc_long[4][256];   // shifts a crc over CRC_LONG zero bytes
+static uint32_t crc_short[4][256];  // ... over CRC_SHORT zero bytes
+static uint32_t (*crc_impl)(uint32_t crc, const uint8_t *p, size_t len);
+/*
+Folding constants, pairs of (x^(D+63) mod P, x^(D-1) mod P) bit reversed into
+64 bits for a fold over D bits, see crc_fold. The odd exponents make up for
+the one bit clmul of two reflected operands comes out short
+*/
+static uint64_t fold_2048[2], fold_512[2], fold_384[2], fold_256[2], fold_128[2];
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_times(mat, mat[n]);
+}
+
+// operator matrix that appends len zero bytes to a crc
+static void zeros_op(uint32_t *even, size_t len) {
+    uint32_t odd[32];
+    odd[0] = CRC32C_POLY;
+    for (uint32_t n = 1, row = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+    gf2_square(even, odd);  // 2 zero bits
+    gf2_square(odd, even);  // 4 zero bits
+    // each square doubles the zeros, 8 bits to a byte
+    do {
+        gf2_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_square(odd, even);
+        len >>= 1;
+    } while (len);
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void zeros_table(uint32_t zeros[][256], size_t len) {
+    uint32_t op[32];
+    zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 0; k < 4; k++)
+            zeros[k][n] = gf2_times(op, n << (8 * k));
+}
+
+static uint32_t crc_shift(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^
+           zeros[3][crc >> 24];
+}
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len && ((uintptr_t)p & 7); len--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff] ^ crc_table[5][(w >> 16) & 0xff] ^
+              crc_table[4][(w >> 24) & 0xff] ^ crc_table[3][(w >> 32) & 0xff] ^
+              crc_table[2][(w >> 40) & 0xff] ^ crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+    }
+    for (; len; len--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c0 = crc;
+    for (; len && ((uintptr_t)p & 7); len--)
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    // three streams of stride bytes each, then fold c1 and c2 into c0
+    for (size_t stride = CRC_LONG; stride >= CRC_SHORT; stride = stride == CRC_LONG ? CRC_SHORT : 0) {
+        uint32_t (*zeros)[256] = stride == CRC_LONG ? crc_long : crc_short;
+        while (len >= 3 * stride) {
+            uint64_t c1 = 0, c2 = 0, w0, w1, w2;
+            for (const uint8_t *end = p + stride; p < end; p += 8) {
+                memcpy(&w0, p, 8);
+                memcpy(&w1, p + stride, 8);
+                memcpy(&w2, p + 2 * stride, 8);
+                c0 = _mm_crc32_u64(c0, w0);
+                c1 = _mm_crc32_u64(c1, w1);
+                c2 = _mm_crc32_u64(c2, w2);
+            }
+            c0 = crc_shift(zeros, (uint32_t)c0) ^ (uint32_t)c1;
+            c0 = crc_shift(zeros, (uint32_t)c0) ^ (uint32_t)c2;
+            p += 2 * stride;
+            len -= 3 * stride;
+        }
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c0 = _mm_crc32_u64(c0, w);
+    }
+    for (; len; len--)
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    return (uint32_t)c0;
+}
+
+#define FOLD __attribute__((target("sse4.2,pclmul,avx512f,avx512bw,vpclmulqdq")))
+
+// x folded over the bits its pair of constants is for, ready to xor into the lanes that far on
+FOLD static inline __m512i fold512(__m512i x, __m512i k) {
+    return _mm512_xor_si512(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11));
+}
+
+FOLD static inline __m128i fold128(__m128i x, const uint64_t *k) {
+    __m128i kk = _mm_loadu_si128((const __m128i *)k);
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, kk, 0x00), _mm_clmulepi64_si128(x, kk, 0x11));
+}
+
+/*
+Four zmm registers take 256 bytes per round, each folded 2048 bits on onto the
+next 256. At the end they fold into one register and its four lanes into the
+last, which is congruent to everything before it mod P: its crc with a zero
+start is the crc of the lot, and the crc32 instruction does that and the rest
+*/
+FOLD static uint32_t crc_fold(uint32_t crc, const uint8_t *p, size_t len) {
+    if (len < 256)
+        return crc_hw(crc, p, len);
+    __m512i k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)fold_2048));
+    __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(p), _mm512_castsi128_si512(_mm_cvtsi32_si128((int)crc)));
+    __m512i x1 = _mm512_loadu_si512(p + 64), x2 = _mm512_loadu_si512(p + 128), x3 = _mm512_loadu_si512(p + 192);
+    for (p += 256, len -= 256; len >= 256; p += 256, len -= 256) {
+        x0 = _mm512_xor_si512(fold512(x0, k), _mm512_loadu_si512(p));
+        x1 = _mm512_xor_si512(fold512(x1, k), _mm512_loadu_si512(p + 64));
+        x2 = _mm512_xor_si512(fold512(x2, k), _mm512_loadu_si512(p + 128));
+        x3 = _mm512_xor_si512(fold512(x3, k), _mm512_loadu_si512(p + 192));
+    }
+    k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)fold_512));
+    x1 = _mm512_xor_si512(x1, fold512(x0, k));
+    x2 = _mm512_xor_si512(x2, fold512(x1, k));
+    x3 = _mm512_xor_si512(x3, fold512(x2, k));
+    for (; len >= 64; p += 64, len -= 64)
+        x3 = _mm512_xor_si512(fold512(x3, k), _mm512_loadu_si512(p));
+    __m128i x = _mm512_extracti32x4_epi32(x3, 3);
+    x = _mm_xor_si128(x, fold128(_mm512_extracti32x4_epi32(x3, 0), fold_384));
+    x = _mm_xor_si128(x, fold128(_mm512_extracti32x4_epi32(x3, 1), fold_256));
+    x = _mm_xor_si128(x, fold128(_mm512_extracti32x4_epi32(x3, 2), fold_128));
+    uint64_t c = _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(x));
+    c = _mm_crc32_u64(c, (uint64_t)_mm_extract_epi64(x, 1));
+    return crc_hw((uint32_t)c, p, len);
+}
+
+// x^n mod P bit reversed into 64 bits [bit 63 - i for x^i]
+static uint64_t xpow_rev(uint32_t n) {
+    uint64_t v = 1;
+    for (; n; n--)
+        v = v & 0x80000000u ? (v << 1 & 0xffffffffu) ^ 0x1edc6f41u : v << 1;
+    uint64_t r = 0;
+    for (int i = 0; i < 32; i++)
+        r |= (v >> i & 1) << (63 - i);
+    return r;
+}
+
+static void fold_pair(uint64_t *k, uint32_t bits) {
+    k[0] = xpow_rev(bits + 63);
+    k[1] = xpow_rev(bits - 1);
+}
+
+// three independent crcs of len bytes [a multiple of 8] in one pass, for block checksums
+__attribute__((target("sse4.2")))
+static void crc_hw_x3(const uint8_t *a, const uint8_t *b, const uint8_t *c, size_t len, uint32_t *out) {
+    uint64_t c0 = ~0u, c1 = ~0u, c2 = ~0u, w0, w1, w2;
+    for (size_t i = 0; i < len; i += 8) {
+        memcpy(&w0, a + i, 8);
+        memcpy(&w1, b + i, 8);
+        memcpy(&w2, c + i, 8);
+        c0 = _mm_crc32_u64(c0, w0);
+        c1 = _mm_crc32_u64(c1, w1);
+        c2 = _mm_crc32_u64(c2, w2);
+    }
+    out[0] = ~(uint32_t)c0;
+    out[1] = ~(uint32_t)c1;
+    out[2] = ~(uint32_t)c2;
+}
+
+static void crc_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            crc_table[k][n] = crc_table[0][crc_table[k - 1][n] & 0xff] ^ (crc_table[k - 1][n] >> 8);
+    zeros_table(crc_long, CRC_LONG);
+    zeros_table(crc_short, CRC_SHORT);
+    fold_pair(fold_2048, 2048);
+    fold_pair(fold_512, 512);
+    fold_pair(fold_384, 384);
+    fold_pair(fold_256, 256);
+    fold_pair(fold_128, 128);
+    __builtin_cpu_init();
+    crc_impl = __builtin_cpu_supports("sse4.2") ? crc_hw : crc_sw;
+    if (crc_impl == crc_hw && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("vpclmulqdq"))
+        crc_impl = crc_fold;
+}
+
+// CRC32C of buf continuing from crc [0 to start]
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    if (!crc_impl)
+        crc_init();
+    return ~crc_impl(~crc, buf, len);
+}
+
+// which CRC32C implementation this CPU gets
+const char *crc32c_impl() {
+    if (!crc_impl)
+        crc_init();
+    return crc_impl == crc_fold ? "vpclmulqdq" : crc_impl == crc_hw ? "sse4.2" : "table";
+}
+
+#define XXH_P1 0x9E3779B185EBCA87ull
+#define XXH_P2 0xC2B2AE3D27D4EB4Full
+#define XXH_P3 0x165667B19E3779F9ull
+#define XXH_P4 0x85EBCA77C2B2AE63ull
+#define XXH_P5 0x27D4EB2F165667C5ull
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t in) {
+    acc += in * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+// xxHash64 of buf with seed
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed) {
+    const uint8_t *p = buf, *end = p + len;
+    uint64_t h, w;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        for (const uint8_t *limit = end - 32; p <= limit; p += 32) {
+            memcpy(&w, p, 8);
+            v1 = xxh_round(v1, w);
+            memcpy(&w, p + 8, 8);
+            v2 = xxh_round(v2, w);
+            memcpy(&w, p + 16, 8);
+            v3 = xxh_round(v3, w);
+            memcpy(&w, p + 24, 8);
+            v4 = xxh_round(v4, w);
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        memcpy(&w, p, 8);
+        h ^= xxh_round(0, w);
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        h ^= (uint64_t)v * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// checksum of buf with the algorithm type [enum store_checksum], CRC32C when off
+uint64_t cksum_buf(int type, const void *buf, size_t len) {
+    return type == CK_XXH64 ? xxh64(buf, len, 0) : crc32c(0, buf, len);
+}
+
+// what goes in sb_cksum, everything before it
+uint64_t sb_cksum(const struct store_super_block *sb) {
+    return cksum_buf(sb->checksum, sb, offsetof(struct store_super_block, sb_cksum));
+}
+
+// what goes in inode.checksum, the inode with the field zeroed
+uint64_t inode_cksum(const struct store_disk *d, const struct store_inode *ino) {
+    struct store_inode tmp = *ino;
+    tmp.checksum = 0;
+    return cksum_buf(d->sb.checksum, &tmp, sizeof(tmp));
+}
+
+// stored checksum of one data block
+uint32_t block_cksum(const struct store_disk *d, const void *buf) {
+    return (uint32_t)cksum_buf(d->sb.checksum, buf, d->sb.block);
+}
+
+// checksums of n consecutive blocks at p, crc32c on the crc32 instruction does three blocks per pass
+static void blocks_cksum(const struct store_disk *d, const char *p, uint64_t n, uint32_t *out) {
+    uint64_t i = 0;
+    uint32_t block = d->sb.block;
+    if (!crc_impl)
+        crc_init();
+    if (d->sb.checksum == CK_CRC32C && crc_impl == crc_hw) {
+        for (; i + 3 <= n; i += 3)
+            crc_hw_x3((const uint8_t *)p + i * block, (const uint8_t *)p + (i + 1) * block,
+                      (const uint8_t *)p + (i + 2) * block, block, out + i);
+    }
+    for (; i < n; i++)
+        out[i] = block_cksum(d, p + i * block);
+}
+
+/*
+Data block checksum table
+[sb.csum_start, +sb.csum_blocks) holds one 32 bit checksum per data block, in
+the same order as the bitmap. Entries go through the journal like any other
+metadata, one table block covers block/4 data blocks so a 4KB table block
+describes 4MB of data. A cursor keeps the table block it is on.
+*/
+
+static int table_seek(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk) {
+    uint64_t per = d->sb.block / sizeof(uint32_t);
+    uint64_t tblk = d->sb.csum_start + (pblk - d->sb.data_start) / per;
+    if (c->ent && c->tblk == tblk)
+        return 0;
+    if (cksum_cursor_flush(d, c) != 0)
+        return 1;
+    if (!c->ent && !(c->ent = malloc(d->sb.block)))
+        return 1;
+    if (disk_read_meta(d, (off_t)tblk * d->sb.block, c->ent, d->sb.block) != 0) {
+        printf("Failed to read checksum block %" PRIu64 "\n", tblk);
+        c->tblk = 0;
+        return 1;
+    }
+    c->tblk = tblk;
+    return 0;
+}
+
+static uint32_t *table_entry(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk) {
+    if (table_seek(d, c, pblk) != 0)
+        return NULL;
+    return &c->ent[(pblk - d->sb.data_start) % (d->sb.block / sizeof(uint32_t))];
+}
+
+#define CKSUM_BATCH 48         // blocks checksummed per blocks_cksum call
+
+/*
+A file's last block is summed over its bytes before EOF only, the rest counts
+as zeroes. An append fills that block in place, until the new size is committed
+the bytes it wrote sit past the old EOF and the old checksum still holds.
+*/
+static int tail_cksum(struct store_disk *d, struct cksum_cursor *c, const char *p, uint32_t tail, uint32_t *out) {
+    if (!c->tail && !(c->tail = malloc(d->sb.block)))
+        return 1;
+    memcpy(c->tail, p, tail);
+    memset(c->tail + tail, 0, d->sb.block - tail);
+    *out = block_cksum(d, c->tail);
+    return 0;
+}
+
+// checksums of blocks i.. of a run of n, tail as in cksum_record
+static int batch_cksum(struct store_disk *d, struct cksum_cursor *c, const char *p, uint64_t i, uint64_t n,
+                       uint32_t tail, uint32_t *sums) {
+    uint64_t k = n - i < CKSUM_BATCH ? n - i : CKSUM_BATCH;
+    blocks_cksum(d, p + i * d->sb.block, k, sums);
+    if (tail && i + k == n)
+        return tail_cksum(d, c, p + (n - 1) * d->sb.block, tail, &sums[k - 1]);
+    return 0;
+}
+
+/*
+Puts n checksums worked out elsewhere into the table for the blocks from pblk
+on, encrypted blocks get their MACs this way [see crypt.c].
+*/
+int cksum_put(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, const uint32_t *sums, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t *e = table_entry(d, c, pblk + i);
+        if (!e)
+            return 1;
+        *e = sums[i];
+        c->dirty = true;
+    }
+    return 0;
+}
+
+// Checks n checksums worked out elsewhere against the table, returns 0 if they match else 1
+int cksum_check(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, const uint32_t *sums, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t *e = table_entry(d, c, pblk + i);
+        if (!e)
+            return 1;
+        // a reader checks a tail an append may be filling against the sum it had with the inode
+        uint32_t want = c->pin_blk && pblk + i == c->pin_blk ? c->pin_sum : *e;
+        if (want != sums[i]) {
+            fprintf(stderr, "Checksum mismatch in data block %" PRIu64 "\n", pblk + i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Checksum the table has for pblk, returns 0 on success else 1
+int cksum_get(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, uint32_t *sum) {
+    uint32_t *e = table_entry(d, c, pblk);
+    if (!e)
+        return 1;
+    *sum = *e;
+    return 0;
+}
+
+/*
+Records the checksums of n blocks at pblk whose data is at p. tail is how many
+bytes of the last one are before EOF, 0 when all of them are.
+*/
+int cksum_record(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, const char *p, uint64_t n,
+                 uint32_t tail) {
+    uint32_t sums[CKSUM_BATCH];
+    for (uint64_t i = 0; i < n; i += CKSUM_BATCH) {
+        uint64_t k = n - i < CKSUM_BATCH ? n - i : CKSUM_BATCH;
+        if (batch_cksum(d, c, p, i, n, tail, sums) != 0 || cksum_put(d, c, pblk + i, sums, k) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+Checks n blocks at pblk whose data is at p against the table, tail as in cksum_record
+Returns 0 if they match else 1
+*/
+int cksum_verify(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, const char *p, uint64_t n,
+                 uint32_t tail) {
+    uint32_t sums[CKSUM_BATCH];
+    for (uint64_t i = 0; i < n; i += CKSUM_BATCH) {
+        uint64_t k = n - i < CKSUM_BATCH ? n - i : CKSUM_BATCH;
+        if (batch_cksum(d, c, p, i, n, tail, sums) != 0 || cksum_check(d, c, pblk + i, sums, k) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Puts a modified table block into the open txn
+int cksum_cursor_flush(struct store_disk *d, struct cksum_cursor *c) {
+    if (!c->dirty)
+        return 0;
+    c->dirty = false;
+    return disk_write_meta(d, (off_t)c->tblk * d->sb.block, c->ent, d->sb.block);
+}
+
+void cksum_cursor_free(struct cksum_cursor *c) {
+    free(c->ent);
+    free(c->tail);
+    memset(c, 0, sizeof(*c));
+}
@@ -0,0 +1,139 @@
+#include "store.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/*
+Client end of the daemon protocol [see daemon.c and struct proto_req].
+One request at a time per connection, the reply comes back before the next
+request goes out. Files and pipes are handed to the daemon as fds, so their
+data never passes through this process.
+*/
+
+// Returns a connected socket, -1 when no daemon listens on sock_path
+int client_connect(const char *sock_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sock_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, sock_path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0)
+        return -1;
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static int send_all(int s, const void *buf, size_t len) {
+    for (const char *p = buf; len > 0; ) {
+        ssize_t n = send(s, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads exactly len bytes, returns 0 on success else 1 [error or the other end went away]
+int client_recv(int s, void *buf, size_t len) {
+    for (char *p = buf; len > 0; ) {
+        ssize_t n = recv(s, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+Sends rq with name, fd [if >= 0, as SCM_RIGHTS] and rq->len bytes of data [if
+not NULL], then waits for the reply header. Any reply payload is left on the
+socket for the caller.
+Returns 0 if the exchange went through, resp->status says how the op went
+*/
+int client_call(int s, const struct proto_req *rq, const char *name, int fd, const void *data,
+                struct proto_resp *resp) {
+    struct iovec iov[2] = { { (void *)rq, sizeof(*rq) }, { (void *)name, rq->name_len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    char ctl[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        memset(ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl;
+        msg.msg_controllen = sizeof(ctl);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    ssize_t n;
+    do {
+        n = sendmsg(s, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return 1;
+    // the fd went with the first byte, whatever didn't fit goes plain
+    size_t sent = n;
+    if (sent < sizeof(*rq) && send_all(s, (const char *)rq + sent, sizeof(*rq) - sent) != 0)
+        return 1;
+    size_t name_sent = sent > sizeof(*rq) ? sent - sizeof(*rq) : 0;
+    if (send_all(s, name + name_sent, rq->name_len - name_sent) != 0)
+        return 1;
+    if (data && rq->len && send_all(s, data, rq->len) != 0)
+        return 1;
+    if (client_recv(s, resp, sizeof(*resp)) != 0 || resp->magic != PROTO_MAGIC)
+        return 1;
+    return 0;
+}
+
+static int make_req(struct proto_req *rq, const char *name, int op, int flags, uint64_t off, uint64_t len) {
+    size_t name_len = strlen(name);
+    if (name_len >= INODE_NAME)
+        return 1;
+    *rq = (struct proto_req){ .magic = PROTO_MAGIC, .op = op, .flags = flags, .name_len = name_len,
+                              .off = off, .len = len };
+    return 0;
+}
+
+/*
+Writes [OP_WRITE] or appends [OP_APPEND] len bytes of data to name, flags are RQ_*.
+Returns an enum op_status, -1 when the daemon couldn't be reached
+*/
+int client_write(int s, const char *name, const void *data, uint64_t len, int op, int flags) {
+    struct proto_req rq;
+    struct proto_resp resp;
+    if (make_req(&rq, name, op, flags & ~RQ_FD, 0, len) != 0)
+        return ST_INVAL;
+    if (client_call(s, &rq, name, -1, data, &resp) != 0)
+        return -1;
+    return resp.status;
+}
+
+/*
+Reads up to len bytes of name from off into buf, *got gets how many there were.
+Returns an enum op_status, -1 when the daemon couldn't be reached
+*/
+int client_read(int s, const char *name, uint64_t off, void *buf, uint64_t len, uint64_t *got) {
+    struct proto_req rq;
+    struct proto_resp resp;
+    *got = 0;
+    if (make_req(&rq, name, OP_READ, 0, off, len) != 0)
+        return ST_INVAL;
+    if (client_call(s, &rq, name, -1, NULL, &resp) != 0)
+        return -1;
+    if (resp.status != ST_OK)
+        return resp.status;
+    if (resp.len > len || client_recv(s, buf, resp.len) != 0)
+        return -1;
+    *got = resp.len;
+    return ST_OK;
+}
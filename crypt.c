@@ -0,0 +1,683 @@
+#include "store.h"
+
+#include <immintrin.h>
+
+/*
+Encryption
+Data blocks of FLAG_ENCRYPTED files are encrypted whole with XTS-AES-128, the
+data unit is one disk block and its tweak the block's number on disk, so a
+block shared by snapshots and clones [dedup.c] reads the same for every owner
+and nothing per file has to go with it. Equal plaintext in two blocks looks
+different on disk, a block rewritten with the same bytes looks the same.
+Every encrypted block also gets a MAC where a plain one has its checksum [in
+the checksum table, see cksum.c]: GHASH of the block number and the
+ciphertext, encrypted with a third key and cut to 32 bits, so a block that was
+changed, moved or put back from an older copy of the disk fails to read. The
+MAC is as long as the table entry, a forgery gets through once in 2^32 tries.
+A disk without checksums [-ck off] has nowhere to keep MACs, so nothing is
+encrypted there: init refuses -en with it and writes refuse encrypted files.
+Keys come from a key file, one per line as an id [1-255] and 64 hex digits
+[the XTS data key, then the tweak key], the GHASH and MAC keys are derived from
+the tweak key. Files name their key by id [inode.key], a file whose key isn't
+loaded can't be read or written. Keys are loaded once per process and kept,
+expanded, for its whole life.
+AES-NI and PCLMUL do the work when the CPU has them, eight AES blocks at a time
+so the instruction latency is hidden, with GHASH over the same eight blocks in
+the same loop [one reduction for all of them]. CPUs with VAES and VPCLMULQDQ on
+AVX-512 take four blocks per instruction, sixteen per turn. Without any of it a
+byte-wise AES and a bit-wise GHASH give the same results, slowly. The pick is
+made once, on first use.
+*/
+
+#define AES_ROUNDS 10
+#define GHASH_SPAN 256          // 16 byte blocks hashed with a single reduction, H^1 to H^GHASH_SPAN are kept
+
+struct crypt_key {
+    uint8_t id;
+    uint8_t rk[AES_ROUNDS + 1][16];      // data key schedule
+    uint8_t dk[AES_ROUNDS + 1][16];      // its inverse for aesdec, hardware only
+    uint8_t tk[AES_ROUNDS + 1][16];      // tweak key schedule
+    uint8_t mk[AES_ROUNDS + 1][16];      // MAC key schedule
+    uint8_t h[16];                       // GHASH key
+    uint8_t hp[GHASH_SPAN][16];          // H^GHASH_SPAN down to H^1 byte reversed, hardware only
+    uint8_t hk[GHASH_SPAN][16];          // their two halves xored, for Karatsuba
+};
+
+static struct crypt_key *keys[256];
+static bool hw_checked, hw, wide;
+static uint8_t sbox[256], inv_sbox[256];
+
+// ---- software AES ----
+
+static uint8_t xtime(uint8_t x) {
+    return (uint8_t)(x << 1) ^ (x & 0x80 ? 0x1b : 0);
+}
+
+static uint8_t gmul(uint8_t a, uint8_t b) {
+    uint8_t p = 0;
+    for (; b; b >>= 1, a = xtime(a))
+        if (b & 1)
+            p ^= a;
+    return p;
+}
+
+// S-box from the multiplicative inverse and the affine map, no table to get wrong
+static void sbox_init() {
+    for (int i = 0; i < 256; i++) {
+        uint8_t inv = 0;
+        for (int j = 1; j < 256 && i; j++)
+            if (gmul(i, j) == 1)
+                inv = j;
+        uint8_t s = inv;
+        for (int k = 1; k < 5; k++)
+            s ^= (uint8_t)(inv << k | inv >> (8 - k));
+        sbox[i] = s ^ 0x63;
+        inv_sbox[s ^ 0x63] = i;
+    }
+}
+
+static void expand_key(const uint8_t *key, uint8_t (*rk)[16]) {
+    uint8_t rcon = 1;
+    memcpy(rk[0], key, 16);
+    for (int r = 1; r <= AES_ROUNDS; r++) {
+        uint8_t t[4] = { sbox[rk[r - 1][13]] ^ rcon, sbox[rk[r - 1][14]], sbox[rk[r - 1][15]], sbox[rk[r - 1][12]] };
+        rcon = xtime(rcon);
+        for (int i = 0; i < 16; i++) {
+            rk[r][i] = rk[r - 1][i] ^ t[i % 4];
+            t[i % 4] = rk[r][i];
+        }
+    }
+}
+
+static void add_round_key(uint8_t *s, const uint8_t *k) {
+    for (int i = 0; i < 16; i++)
+        s[i] ^= k[i];
+}
+
+static void aes_encrypt_sw(const uint8_t *rk, uint8_t *s) {
+    add_round_key(s, rk);
+    for (int r = 1; r <= AES_ROUNDS; r++) {
+        uint8_t t[16];
+        // SubBytes and ShiftRows, the state is column major
+        for (int i = 0; i < 16; i++)
+            t[i] = sbox[s[(i + 4 * (i % 4)) % 16]];
+        if (r < AES_ROUNDS) {
+            for (int c = 0; c < 4; c++) {
+                uint8_t *col = t + 4 * c, a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+                uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+                col[0] ^= all ^ xtime(a0 ^ a1);
+                col[1] ^= all ^ xtime(a1 ^ a2);
+                col[2] ^= all ^ xtime(a2 ^ a3);
+                col[3] ^= all ^ xtime(a3 ^ a0);
+            }
+        }
+        memcpy(s, t, 16);
+        add_round_key(s, rk + 16 * r);
+    }
+}
+
+static void aes_decrypt_sw(const uint8_t *rk, uint8_t *s) {
+    add_round_key(s, rk + 16 * AES_ROUNDS);
+    for (int r = AES_ROUNDS - 1; r >= 0; r--) {
+        uint8_t t[16];
+        for (int i = 0; i < 16; i++)
+            t[(i + 4 * (i % 4)) % 16] = inv_sbox[s[i]];
+        add_round_key(t, rk + 16 * r);
+        if (r > 0) {
+            for (int c = 0; c < 4; c++) {
+                uint8_t *col = t + 4 * c, a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+                col[0] = gmul(a0, 14) ^ gmul(a1, 11) ^ gmul(a2, 13) ^ gmul(a3, 9);
+                col[1] = gmul(a0, 9) ^ gmul(a1, 14) ^ gmul(a2, 11) ^ gmul(a3, 13);
+                col[2] = gmul(a0, 13) ^ gmul(a1, 9) ^ gmul(a2, 14) ^ gmul(a3, 11);
+                col[3] = gmul(a0, 11) ^ gmul(a1, 13) ^ gmul(a2, 9) ^ gmul(a3, 14);
+            }
+        }
+        memcpy(s, t, 16);
+    }
+}
+
+// tweak * x in GF(2^128), XTS takes the 16 bytes as a little endian number
+static void xts_next(uint64_t *t) {
+    uint64_t carry = t[1] >> 63;
+    t[1] = t[1] << 1 | t[0] >> 63;
+    t[0] = t[0] << 1 ^ (carry ? 0x87 : 0);
+}
+
+static void xts_first(const struct crypt_key *k, uint64_t pblk, uint64_t *t) {
+    uint8_t b[16] = {0};
+    memcpy(b, &pblk, 8);
+    aes_encrypt_sw(k->tk[0], b);
+    memcpy(t, b, 16);
+}
+
+static void xts_sw(const struct crypt_key *k, uint64_t pblk, const uint8_t *src, uint8_t *p, uint32_t len,
+                   bool enc) {
+    uint64_t t[2];
+    xts_first(k, pblk, t);
+    for (uint32_t i = 0; i < len; i += 16) {
+        uint8_t *s = p + i;
+        memmove(s, src + i, 16);
+        add_round_key(s, (const uint8_t *)t);
+        if (enc)
+            aes_encrypt_sw(k->rk[0], s);
+        else
+            aes_decrypt_sw(k->rk[0], s);
+        add_round_key(s, (const uint8_t *)t);
+        xts_next(t);
+    }
+}
+
+// GHASH multiply, GCM's bit order [bit 0 is the top bit of byte 0]
+static void gf_mul_sw(uint8_t *x, const uint8_t *h) {
+    uint64_t z0 = 0, z1 = 0, v0, v1, x0, x1;
+    memcpy(&v0, h, 8);
+    memcpy(&v1, h + 8, 8);
+    memcpy(&x0, x, 8);
+    memcpy(&x1, x + 8, 8);
+    v0 = __builtin_bswap64(v0);
+    v1 = __builtin_bswap64(v1);
+    x0 = __builtin_bswap64(x0);
+    x1 = __builtin_bswap64(x1);
+    for (int i = 0; i < 128; i++) {
+        uint64_t bit = i < 64 ? x0 >> (63 - i) & 1 : x1 >> (127 - i) & 1;
+        if (bit) {
+            z0 ^= v0;
+            z1 ^= v1;
+        }
+        uint64_t lsb = v1 & 1;
+        v1 = v1 >> 1 | v0 << 63;
+        v0 >>= 1;
+        if (lsb)
+            v0 ^= 0xe1ull << 56;
+    }
+    z0 = __builtin_bswap64(z0);
+    z1 = __builtin_bswap64(z1);
+    memcpy(x, &z0, 8);
+    memcpy(x + 8, &z1, 8);
+}
+
+static void ghash_sw(const struct crypt_key *k, uint8_t *y, const uint8_t *p, uint32_t len) {
+    for (uint32_t i = 0; i < len; i += 16) {
+        add_round_key(y, p + i);
+        gf_mul_sw(y, k->h);
+    }
+}
+
+// MAC of the encrypted block at p that sits at disk block pblk: its number, then its bytes
+static uint32_t crypt_mac_sw(const struct crypt_key *k, uint64_t pblk, const uint8_t *p, uint32_t block) {
+    uint8_t y[16] = {0}, b[16] = {0};
+    memcpy(b, &pblk, 8);
+    ghash_sw(k, y, b, 16);
+    ghash_sw(k, y, p, block);
+    aes_encrypt_sw(k->mk[0], y);
+    uint32_t tag;
+    memcpy(&tag, y, 4);
+    return tag;
+}
+
+// ---- AES-NI and PCLMUL ----
+
+#define HW __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+// small helpers go inline everywhere, the wide kernel must not run into their SSE encodings
+#define HW_INLINE HW __attribute__((always_inline)) inline
+// the eight lanes only stay in registers with these loops written out
+#define UNROLL _Pragma("GCC unroll 10")
+
+HW_INLINE static __m128i bswap128(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// a * b unreduced, added into lo:hi
+HW_INLINE static void clmul(__m128i a, __m128i b, __m128i *lo, __m128i *hi) {
+    __m128i l = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i h = _mm_clmulepi64_si128(a, b, 0x11);
+    __m128i m = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(l, _mm_slli_si128(m, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(h, _mm_srli_si128(m, 8)));
+}
+
+// lo:hi shifted one bit for the reflected order and reduced mod x^128 + x^7 + x^2 + x + 1
+HW_INLINE static __m128i reduce(__m128i lo, __m128i hi) {
+    __m128i a = _mm_srli_epi32(lo, 31), b = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i c = _mm_srli_si128(a, 12);
+    b = _mm_slli_si128(b, 4);
+    a = _mm_slli_si128(a, 4);
+    lo = _mm_or_si128(lo, a);
+    hi = _mm_or_si128(_mm_or_si128(hi, b), c);
+    a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    b = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, _mm_xor_si128(c, b)));
+}
+
+HW_INLINE static __m128i gf_mul_hw(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    clmul(a, b, &lo, &hi);
+    return reduce(lo, hi);
+}
+
+/*
+GHASH of a span of m blocks is y H^m + x1 H^m + x2 H^(m-1) + ... + xm H, so
+every block is multiplied by its own power and the products are summed
+unreduced, one reduction per span [GHASH_SPAN blocks, 4KB]. Nothing waits on
+the block before it, the multiplies overlap with the AES rounds.
+Adds the eight byte swapped blocks at x times the powers from hp on into
+lo:hi:mid, Karatsuba, three multiplies per block.
+*/
+HW_INLINE static void ghash8(const struct crypt_key *k, uint32_t hp, const __m128i *x, __m128i *acc) {
+    UNROLL
+    for (int j = 0; j < 8; j++) {
+        __m128i a = x[j], h = _mm_loadu_si128((const __m128i *)k->hp[hp + j]);
+        acc[0] = _mm_xor_si128(acc[0], _mm_clmulepi64_si128(a, h, 0x00));
+        acc[1] = _mm_xor_si128(acc[1], _mm_clmulepi64_si128(a, h, 0x11));
+        a = _mm_xor_si128(a, _mm_shuffle_epi32(a, 0x4e));
+        acc[2] = _mm_xor_si128(acc[2], _mm_clmulepi64_si128(a, _mm_loadu_si128((const __m128i *)k->hk[hp + j]),
+                                                            0x00));
+    }
+}
+
+// the sum ghash8 built up, reduced
+HW_INLINE static __m128i ghash_fold(__m128i lo, __m128i hi, __m128i mid) {
+    mid = _mm_xor_si128(mid, _mm_xor_si128(lo, hi));
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+    return reduce(lo, hi);
+}
+
+// tweak * x, the SIMD way: carries out of each 64 bit half go in with a shuffle
+HW_INLINE static __m128i xts_mul(__m128i t) {
+    __m128i c = _mm_and_si128(_mm_srai_epi32(t, 31), _mm_set_epi32(0x87, 0, 1, 0));
+    return _mm_xor_si128(_mm_add_epi64(t, t), _mm_shuffle_epi32(c, 0x93));
+}
+
+/*
+Eight blocks through the cipher side by side, their rounds overlap in the
+pipeline. Written out twice so neither loop has a branch in it.
+*/
+HW static void aes8_enc(const uint8_t *rk, __m128i *x) {
+    __m128i r = _mm_loadu_si128((const __m128i *)rk);
+    UNROLL
+    for (int j = 0; j < 8; j++)
+        x[j] = _mm_xor_si128(x[j], r);
+    UNROLL
+    for (int i = 1; i < AES_ROUNDS; i++) {
+        r = _mm_loadu_si128((const __m128i *)(rk + 16 * i));
+        UNROLL
+    for (int j = 0; j < 8; j++)
+            x[j] = _mm_aesenc_si128(x[j], r);
+    }
+    r = _mm_loadu_si128((const __m128i *)(rk + 16 * AES_ROUNDS));
+    UNROLL
+    for (int j = 0; j < 8; j++)
+        x[j] = _mm_aesenclast_si128(x[j], r);
+}
+
+HW static void aes8_dec(const uint8_t *rk, __m128i *x) {
+    __m128i r = _mm_loadu_si128((const __m128i *)rk);
+    UNROLL
+    for (int j = 0; j < 8; j++)
+        x[j] = _mm_xor_si128(x[j], r);
+    UNROLL
+    for (int i = 1; i < AES_ROUNDS; i++) {
+        r = _mm_loadu_si128((const __m128i *)(rk + 16 * i));
+        UNROLL
+    for (int j = 0; j < 8; j++)
+            x[j] = _mm_aesdec_si128(x[j], r);
+    }
+    r = _mm_loadu_si128((const __m128i *)(rk + 16 * AES_ROUNDS));
+    UNROLL
+    for (int j = 0; j < 8; j++)
+        x[j] = _mm_aesdeclast_si128(x[j], r);
+}
+
+HW_INLINE static __m128i aes1(const uint8_t *rk, __m128i x) {
+    x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)rk));
+    for (int i = 1; i < AES_ROUNDS; i++)
+        x = _mm_aesenc_si128(x, _mm_loadu_si128((const __m128i *)(rk + 16 * i)));
+    return _mm_aesenclast_si128(x, _mm_loadu_si128((const __m128i *)(rk + 16 * AES_ROUNDS)));
+}
+
+/*
+XTS over one data unit of len bytes at src into p [a multiple of 128, every
+block size is, p may be src], and its MAC into *mac unless that is NULL. GHASH
+takes the ciphertext eight blocks at a time in the same loop as the AES rounds,
+see ghash8, so the AES and the carry-less multiply units work side by side.
+*/
+HW static void xts_hw(const struct crypt_key *k, uint64_t pblk, const uint8_t *src, uint8_t *p, uint32_t len, bool enc,
+                      uint32_t *mac) {
+    __m128i t = aes1(k->tk[0], _mm_set_epi64x(0, (long long)pblk));
+    __m128i y = _mm_setzero_si128(), acc[3], c[8];
+    // the block number goes first, see crypt_mac_sw
+    if (mac)
+        y = gf_mul_hw(bswap128(_mm_set_epi64x(0, (long long)pblk)),
+                      _mm_loadu_si128((const __m128i *)k->hp[GHASH_SPAN - 1]));
+    for (uint32_t span = 0; span < len; span += 16 * GHASH_SPAN) {
+        uint32_t end = len - span < 16 * GHASH_SPAN ? len : span + 16 * GHASH_SPAN;
+        // block b of the span is multiplied by H^(m - b)
+        uint32_t hp = GHASH_SPAN - (end - span) / 16;
+        acc[0] = acc[1] = acc[2] = _mm_setzero_si128();
+        for (uint32_t i = span; i < end; i += 128) {
+            __m128i x[8], tws[8];
+            UNROLL
+            for (int j = 0; j < 8; j++) {
+                __m128i in = _mm_loadu_si128((const __m128i *)(src + i + 16 * j));
+                c[j] = bswap128(in);
+                tws[j] = t;
+                x[j] = _mm_xor_si128(in, t);
+                t = xts_mul(t);
+            }
+            // the running hash goes in with the span's first block
+            if (i == span)
+                c[0] = _mm_xor_si128(c[0], y);
+            if (mac && !enc)
+                ghash8(k, hp + (i - span) / 16, c, acc);
+            if (enc)
+                aes8_enc(k->rk[0], x);
+            else
+                aes8_dec(k->dk[0], x);
+            UNROLL
+            for (int j = 0; j < 8; j++) {
+                x[j] = _mm_xor_si128(x[j], tws[j]);
+                _mm_storeu_si128((__m128i *)(p + i + 16 * j), x[j]);
+            }
+            if (mac && enc) {
+                UNROLL
+                for (int j = 0; j < 8; j++)
+                    c[j] = bswap128(x[j]);
+                if (i == span)
+                    c[0] = _mm_xor_si128(c[0], y);
+                ghash8(k, hp + (i - span) / 16, c, acc);
+            }
+        }
+        if (mac)
+            y = ghash_fold(acc[0], acc[1], acc[2]);
+    }
+    if (mac)
+        *mac = (uint32_t)_mm_cvtsi128_si32(aes1(k->mk[0], bswap128(y)));
+}
+
+// ---- VAES and VPCLMULQDQ ----
+
+#define WIDE __attribute__((target("aes,pclmul,ssse3,sse4.1,avx512f,avx512bw,vaes,vpclmulqdq")))
+// called rather than inlined, ghash16 would pass its registers through memory
+#define WIDE_INLINE WIDE __attribute__((always_inline)) inline
+// bytes xts_wide loads ahead, reads out of the disk map otherwise wait on memory between blocks
+#define WIDE_AHEAD 8192
+
+WIDE_INLINE static __m512i bswap512(__m512i x) {
+    return _mm512_shuffle_epi8(x, _mm512_broadcast_i32x4(_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+                                                                        13, 14, 15)));
+}
+
+// every lane's tweak times x^16, the bits shifted out of a lane come back in through 0x87
+WIDE_INLINE static __m512i xts_mul16(__m512i t) {
+    __m512i c = _mm512_srli_epi64(t, 48);
+    __m512i r = _mm512_clmulepi64_epi128(c, _mm512_set1_epi64(0x87), 0x01);
+    return _mm512_xor_si512(_mm512_xor_si512(_mm512_slli_epi64(t, 16), _mm512_bslli_epi128(c, 8)), r);
+}
+
+// ghash8 for sixteen byte swapped blocks in x, four lanes each
+WIDE_INLINE static void ghash16(const struct crypt_key *k, uint32_t hp, const __m512i *x, __m512i *acc) {
+    UNROLL
+    for (int j = 0; j < 4; j++) {
+        __m512i a = x[j], h = _mm512_loadu_si512(k->hp[hp + 4 * j]);
+        acc[0] = _mm512_xor_si512(acc[0], _mm512_clmulepi64_epi128(a, h, 0x00));
+        acc[1] = _mm512_xor_si512(acc[1], _mm512_clmulepi64_epi128(a, h, 0x11));
+        a = _mm512_xor_si512(a, _mm512_shuffle_epi32(a, _MM_PERM_BADC));
+        acc[2] = _mm512_xor_si512(acc[2], _mm512_clmulepi64_epi128(a, _mm512_loadu_si512(k->hk[hp + 4 * j]), 0x00));
+    }
+}
+
+// the lanes ghash16 built up, summed and reduced
+WIDE_INLINE static __m128i ghash16_fold(const __m512i *acc) {
+    __m512i lo = acc[0], hi = acc[1], mid = _mm512_xor_si512(acc[2], _mm512_xor_si512(lo, hi));
+    lo = _mm512_xor_si512(lo, _mm512_bslli_epi128(mid, 8));
+    hi = _mm512_xor_si512(hi, _mm512_bsrli_epi128(mid, 8));
+    __m256i l = _mm256_xor_si256(_mm512_castsi512_si256(lo), _mm512_extracti64x4_epi64(lo, 1));
+    __m256i h = _mm256_xor_si256(_mm512_castsi512_si256(hi), _mm512_extracti64x4_epi64(hi, 1));
+    return reduce(_mm_xor_si128(_mm256_castsi256_si128(l), _mm256_extracti128_si256(l, 1)),
+                  _mm_xor_si128(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1)));
+}
+
+// xts_hw four blocks to a register, len a multiple of 256 [every block size is]
+WIDE static void xts_wide(const struct crypt_key *k, uint64_t pblk, const uint8_t *src, uint8_t *p, uint32_t len,
+                          bool enc, uint32_t *mac) {
+    const uint8_t *rk = enc ? k->rk[0] : k->dk[0];
+    __m512i r[AES_ROUNDS + 1], t[4], c[4];
+    for (int i = 0; i <= AES_ROUNDS; i++)
+        r[i] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(rk + 16 * i)));
+    __m128i t1[4] = { aes1(k->tk[0], _mm_set_epi64x(0, (long long)pblk)) };
+    for (int j = 1; j < 4; j++)
+        t1[j] = xts_mul(t1[j - 1]);
+    t[0] = _mm512_loadu_si512(t1);
+    // lane j of register i holds the tweak of block 4i + j
+    for (int i = 1; i < 4; i++) {
+        __m512i c4 = _mm512_srli_epi64(t[i - 1], 60);
+        t[i] = _mm512_xor_si512(_mm512_xor_si512(_mm512_slli_epi64(t[i - 1], 4), _mm512_bslli_epi128(c4, 8)),
+                                _mm512_clmulepi64_epi128(c4, _mm512_set1_epi64(0x87), 0x01));
+    }
+    __m128i y = _mm_setzero_si128();
+    if (mac)
+        y = gf_mul_hw(bswap128(_mm_set_epi64x(0, (long long)pblk)),
+                      _mm_loadu_si128((const __m128i *)k->hp[GHASH_SPAN - 1]));
+    for (uint32_t span = 0; span < len; span += 16 * GHASH_SPAN) {
+        uint32_t end = len - span < 16 * GHASH_SPAN ? len : span + 16 * GHASH_SPAN;
+        uint32_t hp = GHASH_SPAN - (end - span) / 16;
+        __m512i acc[3] = { _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512() };
+        // the running hash goes in with the span's first block
+        __m512i y0 = _mm512_zextsi128_si512(y);
+        for (uint32_t i = span; i < end; i += 256) {
+            __m512i x[4];
+            UNROLL
+            for (int j = 0; j < 4; j++) {
+                __m512i in = _mm512_loadu_si512(src + i + 64 * j);
+                _mm_prefetch((const char *)src + i + 64 * j + WIDE_AHEAD, _MM_HINT_T0);
+                c[j] = bswap512(in);
+                x[j] = _mm512_xor_si512(_mm512_xor_si512(in, t[j]), r[0]);
+            }
+            if (mac && !enc) {
+                c[0] = i == span ? _mm512_xor_si512(c[0], y0) : c[0];
+                ghash16(k, hp + (i - span) / 16, c, acc);
+            }
+            if (enc) {
+                UNROLL
+                for (int n = 1; n < AES_ROUNDS; n++)
+                    UNROLL
+                    for (int j = 0; j < 4; j++)
+                        x[j] = _mm512_aesenc_epi128(x[j], r[n]);
+                UNROLL
+                for (int j = 0; j < 4; j++)
+                    x[j] = _mm512_aesenclast_epi128(x[j], r[AES_ROUNDS]);
+            } else {
+                UNROLL
+                for (int n = 1; n < AES_ROUNDS; n++)
+                    UNROLL
+                    for (int j = 0; j < 4; j++)
+                        x[j] = _mm512_aesdec_epi128(x[j], r[n]);
+                UNROLL
+                for (int j = 0; j < 4; j++)
+                    x[j] = _mm512_aesdeclast_epi128(x[j], r[AES_ROUNDS]);
+            }
+            UNROLL
+            for (int j = 0; j < 4; j++) {
+                x[j] = _mm512_xor_si512(x[j], t[j]);
+                if (mac && enc)
+                    c[j] = bswap512(x[j]);
+                _mm512_storeu_si512(p + i + 64 * j, x[j]);
+                t[j] = xts_mul16(t[j]);
+            }
+            if (mac && enc) {
+                c[0] = i == span ? _mm512_xor_si512(c[0], y0) : c[0];
+                ghash16(k, hp + (i - span) / 16, c, acc);
+            }
+        }
+        if (mac)
+            y = ghash16_fold(acc);
+    }
+    if (mac)
+        *mac = (uint32_t)_mm_cvtsi128_si32(aes1(k->mk[0], bswap128(y)));
+}
+
+HW static void key_hw(struct crypt_key *k) {
+    memcpy(k->dk[0], k->rk[AES_ROUNDS], 16);
+    for (int i = 1; i < AES_ROUNDS; i++)
+        _mm_storeu_si128((__m128i *)k->dk[i], _mm_aesimc_si128(_mm_loadu_si128((const __m128i *)k->rk[AES_ROUNDS - i])));
+    memcpy(k->dk[AES_ROUNDS], k->rk[0], 16);
+    __m128i h = bswap128(_mm_loadu_si128((const __m128i *)k->h)), hp = h;
+    for (int i = GHASH_SPAN - 1; i >= 0; i--) {
+        _mm_storeu_si128((__m128i *)k->hp[i], hp);
+        _mm_storeu_si128((__m128i *)k->hk[i], _mm_xor_si128(hp, _mm_shuffle_epi32(hp, 0x4e)));
+        hp = gf_mul_hw(hp, h);
+    }
+}
+
+static void crypt_init() {
+    sbox_init();
+    __builtin_cpu_init();
+    hw = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3") &&
+         __builtin_cpu_supports("sse4.1");
+    wide = hw && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq");
+    hw_checked = true;
+}
+
+// which implementation this CPU gets
+const char *crypt_impl() {
+    if (!hw_checked)
+        crypt_init();
+    return wide ? "vaes" : hw ? "aes-ni" : "table";
+}
+
+// ---- keys ----
+
+static int hex_val(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Expands the 32 key bytes into k, the GHASH and MAC keys come out of the tweak key
+static void key_setup(struct crypt_key *k, const uint8_t *raw) {
+    expand_key(raw, k->rk);
+    expand_key(raw + 16, k->tk);
+    // tweaks are block numbers below 2^64, these never are one
+    uint8_t c[16] = { 'H' };
+    c[15] = 0xff;
+    aes_encrypt_sw(k->tk[0], c);
+    memcpy(k->h, c, 16);
+    uint8_t m[16] = { 'M' };
+    m[15] = 0xff;
+    aes_encrypt_sw(k->tk[0], m);
+    expand_key(m, k->mk);
+    if (hw)
+        key_hw(k);
+}
+
+/*
+Loads the key file at path into the keys this process knows, see the top of
+this file for its lines, blank ones and ones starting with # are skipped.
+Returns 0 on success else 1
+*/
+int crypt_load(const char *path) {
+    if (!hw_checked)
+        crypt_init();
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Unable to open key file %s\n", path);
+        return 1;
+    }
+    char line[256];
+    int ret = 0, n = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f)) {
+        n++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        char *end;
+        unsigned long id = strtoul(p, &end, 10);
+        while (*end == ' ' || *end == '\t')
+            end++;
+        uint8_t raw[32];
+        int i = 0;
+        for (; i < 32 && hex_val(end[2 * i]) >= 0 && hex_val(end[2 * i + 1]) >= 0; i++)
+            raw[i] = hex_val(end[2 * i]) << 4 | hex_val(end[2 * i + 1]);
+        if (id == 0 || id > 255 || end == p || i < 32 || hex_val(end[64]) >= 0) {
+            printf("Line %d of key file %s isn't an id [1-255] and 64 hex digits\n", n, path);
+            ret = 1;
+            break;
+        }
+        struct crypt_key *k = keys[id] ? keys[id] : malloc(sizeof(*k));
+        if (!k) {
+            ret = 1;
+            break;
+        }
+        k->id = id;
+        key_setup(k, raw);
+        keys[id] = k;
+        memset(raw, 0, sizeof(raw));
+    }
+    fclose(f);
+    memset(line, 0, sizeof(line));
+    return ret;
+}
+
+// The loaded key with that id, NULL if there is none
+const struct crypt_key *crypt_key(uint8_t id) {
+    return id ? keys[id] : NULL;
+}
+
+/*
+Key of an encrypted inode, NULL for a plain one. *missing is set when the inode
+is encrypted with a key this process doesn't have [the message is printed].
+*/
+const struct crypt_key *crypt_file_key(const struct store_inode *ino, bool *missing) {
+    *missing = false;
+    if (!(ino->flags & FLAG_ENCRYPTED))
+        return NULL;
+    const struct crypt_key *k = crypt_key(ino->key);
+    if (!k) {
+        fprintf(stderr, "%s is encrypted with key %u, which isn't loaded [--key_file, [crypto] key_file "
+                "or <disk>.keys]\n", ino->name, ino->key);
+        *missing = true;
+    }
+    return k;
+}
+
+/*
+Encrypts [or decrypts] n blocks of block bytes at src into dst, the first one
+is disk block pblk and the rest follow it on disk. dst may be src, a read out
+of the disk map decrypts straight into the buffer it hands on. With macs each
+block's MAC goes there, taken over the ciphertext either way.
+*/
+void crypt_blocks_to(const struct crypt_key *k, uint64_t pblk, const void *src, void *dst, uint64_t n,
+                     uint32_t block, bool enc, uint32_t *macs) {
+    for (uint64_t i = 0; i < n; i++) {
+        const uint8_t *s = (const uint8_t *)src + i * block;
+        uint8_t *b = (uint8_t *)dst + i * block;
+        if (wide && block % 256 == 0) {
+            xts_wide(k, pblk + i, s, b, block, enc, macs ? &macs[i] : NULL);
+            continue;
+        }
+        if (hw) {
+            xts_hw(k, pblk + i, s, b, block, enc, macs ? &macs[i] : NULL);
+            continue;
+        }
+        if (macs && !enc)
+            macs[i] = crypt_mac_sw(k, pblk + i, s, block);
+        xts_sw(k, pblk + i, s, b, block, enc);
+        if (macs && enc)
+            macs[i] = crypt_mac_sw(k, pblk + i, b, block);
+    }
+}
+
+// crypt_blocks_to in place
+void crypt_blocks(const struct crypt_key *k, uint64_t pblk, void *p, uint64_t n, uint32_t block, bool enc,
+                  uint32_t *macs) {
+    crypt_blocks_to(k, pblk, p, p, n, block, enc, macs);
+}
@@ -0,0 +1,574 @@
+#include "store.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/*
+store daemon
+Opens the disk once and serves write, append, read, list and delete requests from
+clients on a Unix socket [protocol in store.h, client end in client.c]. The
+superblock and allocator stay in memory, inode, index and pack blocks stay in
+the block cache [cache.c] and the disk map is set up once, so a small op costs a
+round trip over the socket instead of a process spawn plus disk_open and alloc_load.
+
+One thread polls the listening socket and every client. Writes are applied to
+the open txn as they come in, and commits are shared (group commit):
+  RQ_SYNC writes get their reply after the commit that made them durable, every
+  sync write that came in during the same poll round shares that one commit
+  other writes get their reply once applied [reads see them right away], they
+  are committed within COMMIT_MS, or sooner once the txn gets big
+A crash loses at most the unsynced writes of the last COMMIT_MS, the journal
+keeps the disk consistent either way.
+*/
+
+struct client {
+    int fd;                      // -1 once dropped
+    bool waiting;                // sync reply held back until the next commit
+    struct proto_resp resp;
+};
+
+struct daemon {
+    struct store_disk d;
+    int ls;                      // listening socket
+    struct pollfd *pfd;          // pfd[0] is ls, pfd[i] goes with cl[i]
+    struct client *cl;
+    nfds_t n;
+    nfds_t cap;
+    bool dirty;                  // open txn holds applied writes
+    uint64_t dirty_since;
+    uint64_t requests;
+    uint64_t commits;
+    struct store_rewrite rw;     // copy into a new layout going on in between requests
+    struct store_defrag df;      // files being moved into one run each in between requests
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static int send_all(int s, const void *buf, size_t len) {
+    for (const char *p = buf; len > 0; ) {
+        ssize_t n = send(s, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int reply(struct client *c, int status, uint64_t len, const void *payload) {
+    struct proto_resp resp = { .magic = PROTO_MAGIC, .status = status, .len = len };
+    if (send_all(c->fd, &resp, sizeof(resp)) != 0)
+        return 1;
+    return payload && len ? send_all(c->fd, payload, len) : 0;
+}
+
+// Binds sock_path, a stale socket left by a dead daemon is replaced, a live one is not
+static int listen_on(const char *sock_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is longer than %zu chars\n", sock_path, sizeof(addr.sun_path) - 1);
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    int s = client_connect(sock_path);
+    if (s >= 0) {
+        printf("A daemon is already serving %s\n", sock_path);
+        close(s);
+        return -1;
+    }
+    unlink(sock_path);
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(s, SOMAXCONN) != 0) {
+        perror("listen on socket");
+        if (s >= 0)
+            close(s);
+        return -1;
+    }
+    return s;
+}
+
+static int add_client(struct daemon *dm, int fd) {
+    if (dm->n + 1 > dm->cap) {
+        nfds_t cap = dm->cap ? dm->cap * 2 : 16;
+        struct pollfd *pfd = realloc(dm->pfd, cap * sizeof(*pfd));
+        if (pfd)
+            dm->pfd = pfd;
+        struct client *cl = realloc(dm->cl, cap * sizeof(*cl));
+        if (cl)
+            dm->cl = cl;
+        if (!pfd || !cl)
+            return 1;
+        dm->cap = cap;
+    }
+    dm->pfd[dm->n] = (struct pollfd){ .fd = fd, .events = POLLIN };
+    dm->cl[dm->n] = (struct client){ .fd = fd };
+    dm->n++;
+    return 0;
+}
+
+/*
+Reads a request header and name, plus the fd that may ride along with them.
+Returns 0 on success, 1 when the client went away or broke the protocol
+*/
+static int recv_req(struct client *c, struct proto_req *rq, char *name, int *fd) {
+    struct iovec iov = { rq, sizeof(*rq) };
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    *fd = -1;
+    ssize_t n;
+    do {
+        n = recvmsg(c->fd, &msg, MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len >= CMSG_LEN(sizeof(int)))
+            memcpy(fd, CMSG_DATA(cm), sizeof(int));
+    if (n != sizeof(*rq) || rq->magic != PROTO_MAGIC || rq->name_len >= INODE_NAME ||
+        client_recv(c->fd, name, rq->name_len) != 0 || (*fd >= 0) != ((rq->flags & RQ_FD) != 0)) {
+        if (*fd >= 0)
+            close(*fd);
+        return 1;
+    }
+    name[rq->name_len] = '\0';
+    return 0;
+}
+
+// Throws away inline data an op didn't consume, keeps the stream in step
+static int drain(int s, uint64_t len) {
+    char buf[16 << 10];
+    while (len > 0) {
+        size_t want = len < sizeof(buf) ? len : sizeof(buf);
+        if (client_recv(s, buf, want) != 0)
+            return 1;
+        len -= want;
+    }
+    return 0;
+}
+
+// Replies to a change once it is in the open txn, a sync one waits for the commit
+static int applied(struct daemon *dm, struct client *c, int st, uint64_t len, bool sync) {
+    if (dm->d.j.txn.n && !dm->dirty) {
+        dm->dirty = true;
+        dm->dirty_since = now_ns();
+    }
+    if (st == ST_OK && sync) {
+        c->waiting = true;
+        c->resp = (struct proto_resp){ .magic = PROTO_MAGIC, .status = st, .len = len };
+        return 0;
+    }
+    return reply(c, st, len, NULL);
+}
+
+static int serve_write(struct daemon *dm, struct client *c, const struct proto_req *rq, const char *name, int fd) {
+    // inline data is spliced straight off the socket into the data blocks
+    struct data_src src = { .kind = D_FIL, .fd = fd };
+    if (!(rq->flags & RQ_FD)) {
+        src.fd = c->fd;
+        src.size = rq->len;
+        src.size_known = true;
+    }
+    int compression = rq->flags & RQ_LZ4 ? COMP_LZ4 : rq->flags & RQ_RAW ? COMP_NONE : -1;
+    int key = rq->flags & RQ_KEY ? (rq->off > 255 ? 256 : (int)rq->off) : -1;
+    struct write_stats ws = {0};
+    int st = op_write(&dm->d, name, &src, rq->op == OP_APPEND, compression, key, &ws);
+    if (!(rq->flags & RQ_FD) && (uint64_t)src.off < rq->len && drain(c->fd, rq->len - src.off) != 0)
+        return 1;
+    struct store_inode ino;
+    if (st == ST_OK && dm->rw.active && index_lookup(&dm->d, name, &ino) == 0)
+        rewrite_touch(&dm->rw, ino.inode_id);
+    return applied(dm, c, st, ws.bytes, rq->flags & RQ_SYNC);
+}
+
+static int serve_read(struct daemon *dm, struct client *c, const struct proto_req *rq, const char *name, int fd) {
+    struct store_file f;
+    int st = op_open(&dm->d, name, &f);
+    if (st != ST_OK)
+        return reply(c, st, 0, NULL);
+    struct read_stats rs = {0};
+    int ret;
+    if (rq->flags & RQ_FD) {
+        // straight into the client's file or pipe
+        st = data_read(&dm->d, &f, rq->off, rq->len, fd, READ_AUTO, &rs) == 0 ? ST_OK : ST_ERR;
+        ret = reply(c, st, rs.bytes, NULL);
+    } else {
+        uint64_t len = rq->off >= f.ino.size ? 0 : f.ino.size - rq->off;
+        if (len > rq->len)
+            len = rq->len;
+        // the reply promised len bytes, a read failing halfway can only drop the client
+        ret = reply(c, ST_OK, len, NULL);
+        if (ret == 0 && len)
+            ret = data_read(&dm->d, &f, rq->off, len, c->fd, READ_AUTO, &rs);
+    }
+    file_put(&f);
+    return ret;
+}
+
+struct list_buf {
+    char *p;
+    size_t len;
+    size_t cap;
+};
+
+static int list_one(const struct store_inode *ino, void *arg) {
+    struct list_buf *b = arg;
+    uint8_t name_len = strnlen(ino->name, INODE_NAME - 1);
+    size_t need = sizeof(uint64_t) + 1 + name_len;
+    if (b->len + need > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        char *p = realloc(b->p, cap);
+        if (!p)
+            return ST_ERR;
+        b->p = p;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->len, &ino->size, sizeof(uint64_t));
+    b->p[b->len + sizeof(uint64_t)] = name_len;
+    memcpy(b->p + b->len + sizeof(uint64_t) + 1, ino->name, name_len);
+    b->len += need;
+    return ST_OK;
+}
+
+static int serve_list(struct daemon *dm, struct client *c) {
+    struct list_buf b = {0};
+    int st = op_list(&dm->d, list_one, &b);
+    int ret = reply(c, st, st == ST_OK ? b.len : 0, b.p);
+    free(b.p);
+    return ret;
+}
+
+// Everything recorded since the daemon started, the cache's counters only land at disk_close so they go in here
+static int serve_stats(struct daemon *dm, struct client *c) {
+    struct store_stats *s = malloc(sizeof(*s));
+    if (!s)
+        return reply(c, ST_ERR, 0, NULL);
+    stats_snapshot(s);
+    if (dm->d.cache) {
+        s->ctr[SC_CACHE_HITS] += dm->d.cache->hits;
+        s->ctr[SC_CACHE_MISSES] += dm->d.cache->misses;
+        s->ctr[SC_CACHE_EVICTIONS] += dm->d.cache->evictions;
+    }
+    int ret = reply(c, ST_OK, sizeof(*s), s);
+    free(s);
+    return ret;
+}
+
+// Takes snapshot name, or deletes it with off set, replies once committed
+static int serve_snapshot(struct daemon *dm, struct client *c, const struct proto_req *rq, const char *name) {
+    // the rewrite can't copy snapshots, it would fail on the one taken behind its cursor
+    if (dm->rw.active) {
+        printf("A rewrite is going, snapshot %s has to wait for it\n", name);
+        return reply(c, ST_INVAL, 0, NULL);
+    }
+    int st = rq->off ? snap_delete(&dm->d, name) : snap_create(&dm->d, name);
+    return applied(dm, c, st, 0, true);
+}
+
+// Clones the file named by the data [and '\0' snapshot] into name, see snap_clone
+static int serve_clone(struct daemon *dm, struct client *c, const struct proto_req *rq, const char *name) {
+    char src[2 * INODE_NAME];
+    if (rq->len >= sizeof(src))
+        return drain(c->fd, rq->len) || reply(c, ST_INVAL, 0, NULL);
+    if (client_recv(c->fd, src, rq->len) != 0)
+        return 1;
+    src[rq->len] = '\0';
+    size_t n = strlen(src);
+    const char *snap = n < rq->len ? src + n + 1 : NULL;
+    int st = snap_clone(&dm->d, src, name, snap);
+    struct store_inode ino;
+    if (st == ST_OK && dm->rw.active && index_lookup(&dm->d, name, &ino) == 0)
+        rewrite_touch(&dm->rw, ino.inode_id);
+    return applied(dm, c, st, 0, rq->flags & RQ_SYNC);
+}
+
+// Removes name, a rewrite going on lets go of its copy too
+static int serve_delete(struct daemon *dm, struct client *c, const struct proto_req *rq, const char *name) {
+    struct store_inode ino;
+    bool copied = dm->rw.active && index_lookup(&dm->d, name, &ino) == 0;
+    int st = op_delete(&dm->d, name);
+    if (st == ST_OK && copied)
+        rewrite_forget(&dm->rw, ino.inode_id, name);
+    return applied(dm, c, st, 0, rq->flags & RQ_SYNC);
+}
+
+// Starts moving fragmented files in between requests, see defrag.c
+static int serve_defrag(struct daemon *dm, struct client *c, const struct proto_req *rq) {
+    // the rewrite leaves every file in one run anyway
+    if (dm->rw.active || dm->df.active) {
+        printf("A %s is already going, defrag has to wait for it\n", dm->rw.active ? "rewrite" : "defrag");
+        return reply(c, ST_INVAL, 0, NULL);
+    }
+    if (defrag_start(&dm->df, rq->off) != 0)
+        return reply(c, ST_ERR, 0, NULL);
+    printf("Defragmenting in between requests\n");
+    return reply(c, ST_OK, 0, NULL);
+}
+
+// Starts copying the disk into the new disk file whose path follows, see rewrite.c
+static int serve_rewrite(struct daemon *dm, struct client *c, const struct proto_req *rq) {
+    char path[PATH_MAX];
+    if (rq->len >= sizeof(path))
+        return drain(c->fd, rq->len) || reply(c, ST_INVAL, 0, NULL);
+    if (client_recv(c->fd, path, rq->len) != 0)
+        return 1;
+    path[rq->len] = '\0';
+    if (dm->rw.active || dm->df.active) {
+        printf("A %s is already going, %s is left alone\n", dm->rw.active ? "rewrite" : "defrag", path);
+        return reply(c, ST_INVAL, 0, NULL);
+    }
+    if (snap_count(&dm->d) != 0) {
+        printf("Snapshots can't be rewritten, delete them first, %s is left alone\n", path);
+        return reply(c, ST_INVAL, 0, NULL);
+    }
+    if (rewrite_start(&dm->rw, &dm->d, path, rq->off) != 0)
+        return reply(c, ST_ERR, 0, NULL);
+    printf("Rewriting into %s\n", path);
+    return reply(c, ST_OK, 0, NULL);
+}
+
+// Serves one request, returns nonzero when the client has to go
+static int serve(struct daemon *dm, struct client *c) {
+    struct proto_req rq;
+    char name[INODE_NAME];
+    int fd;
+    if (recv_req(c, &rq, name, &fd) != 0)
+        return 1;
+    dm->requests++;
+    int ret;
+    switch (rq.op) {
+    case OP_WRITE:
+    case OP_APPEND:
+        ret = serve_write(dm, c, &rq, name, fd);
+        break;
+    case OP_READ:
+        ret = serve_read(dm, c, &rq, name, fd);
+        break;
+    case OP_LIST:
+        ret = serve_list(dm, c);
+        break;
+    case OP_STATS:
+        ret = serve_stats(dm, c);
+        break;
+    case OP_REWRITE:
+        ret = serve_rewrite(dm, c, &rq);
+        break;
+    case OP_SNAPSHOT:
+        ret = serve_snapshot(dm, c, &rq, name);
+        break;
+    case OP_CLONE:
+        ret = serve_clone(dm, c, &rq, name);
+        break;
+    case OP_DELETE:
+        ret = serve_delete(dm, c, &rq, name);
+        break;
+    case OP_DEFRAG:
+        ret = serve_defrag(dm, c, &rq);
+        break;
+    default:
+        ret = reply(c, ST_INVAL, 0, NULL);
+        break;
+    }
+    if (fd >= 0)
+        close(fd);
+    return ret;
+}
+
+/*
+Commits the open txn and releases the sync replies waiting on it.
+A failed commit dropped the txn, the allocator is reloaded from disk so blocks
+taken by the lost writes aren't leaked.
+*/
+static void commit(struct daemon *dm) {
+    int st = ST_OK;
+    if (dm->dirty) {
+        dm->commits++;
+        if (disk_commit(&dm->d) != 0) {
+            printf("Commit failed, writes since the last commit are lost\n");
+            st = ST_ERR;
+            alloc_free_mem(&dm->d.alloc);
+            if (pread(dm->d.fd, &dm->d.sb, sizeof(dm->d.sb), 0) != sizeof(dm->d.sb) || alloc_load(&dm->d) != 0)
+                stop = 1;
+        }
+    }
+    dm->dirty = false;
+    for (nfds_t i = 1; i < dm->n; i++) {
+        struct client *c = &dm->cl[i];
+        if (!c->waiting)
+            continue;
+        c->waiting = false;
+        if (st != ST_OK)
+            c->resp.status = st;
+        if (send_all(c->fd, &c->resp, sizeof(c->resp)) != 0) {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+}
+
+// Drops clients marked -1, keeping pfd and cl in step
+static void compact(struct daemon *dm) {
+    nfds_t j = 1;
+    for (nfds_t i = 1; i < dm->n; i++) {
+        if (dm->cl[i].fd < 0)
+            continue;
+        dm->pfd[j] = dm->pfd[i];
+        dm->cl[j] = dm->cl[i];
+        j++;
+    }
+    dm->n = j;
+}
+
+// Opens the disk with everything the daemon keeps around, returns 0 on success else 1
+static int open_served(struct daemon *dm, const char *disk_path, uint64_t cache_size, bool readahead) {
+    // the handle verify_disk opened, if it is this disk
+    if (disk_take(&dm->d, disk_path, O_RDWR) != 0)
+        return 1;
+    if (cache_init(&dm->d, cache_size, readahead) != 0 || alloc_load(&dm->d) != 0 || disk_map(&dm->d) != 0) {
+        disk_close(&dm->d);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+One rewrite step, once everything is across the open txn is committed and the
+new disk takes the old one's place [and path].
+Returns 0 on success, 1 when the disk couldn't be opened again
+*/
+static int rewrite(struct daemon *dm, const char *disk_path, uint64_t cache_size, bool readahead) {
+    int more = rewrite_step(&dm->rw, &dm->d);
+    if (more < 0) {
+        printf("Rewrite failed, the disk is left as it was\n");
+        rewrite_abort(&dm->rw);
+        return 0;
+    }
+    if (more)
+        return 0;
+    commit(dm);
+    if (rewrite_finish(&dm->rw, disk_path) != 0)
+        return 0;
+    disk_close(&dm->d);
+    if (open_served(dm, disk_path, cache_size, readahead) != 0) {
+        dm->d.fd = -1;
+        printf("Unable to open the rewritten disk\n");
+        return 1;
+    }
+    return 0;
+}
+
+// One defrag step, the files it moved are committed with the writes around them
+static void defrag(struct daemon *dm) {
+    int more = defrag_step(&dm->df, &dm->d);
+    if (dm->d.j.txn.n && !dm->dirty) {
+        dm->dirty = true;
+        dm->dirty_since = now_ns();
+    }
+    if (more < 0)
+        printf("Defrag failed, files not moved yet stay where they are\n");
+    if (more <= 0)
+        defrag_stop(&dm->df, &dm->d);
+}
+
+/*
+Serves the disk on sock_path until SIGINT or SIGTERM, then commits whatever is
+still open and removes the socket. cache_size and readahead go to cache_init.
+Returns 0 on a clean shutdown else 1
+*/
+int daemon_run(const char *disk_path, const char *sock_path, uint64_t cache_size, bool readahead) {
+    struct daemon dm = {0};
+    if (open_served(&dm, disk_path, cache_size, readahead) != 0)
+        return 1;
+    dm.ls = listen_on(sock_path);
+    if (dm.ls < 0 || add_client(&dm, dm.ls) != 0) {
+        if (dm.ls >= 0)
+            close(dm.ls);
+        disk_close(&dm.d);
+        return 1;
+    }
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("Serving %s on %s\n", disk_path, sock_path);
+
+    int ret = 0;
+    while (!stop) {
+        int timeout = -1;
+        if (dm.dirty) {
+            uint64_t age = now_ns() - dm.dirty_since, limit = COMMIT_MS * 1000000ull;
+            timeout = age >= limit ? 0 : (int)((limit - age + 999999) / 1000000);
+        }
+        if (dm.rw.active || dm.df.active) {
+            // a throttled rewrite or defrag sleeps until its next step
+            uint64_t now = now_ns(), next_at = dm.rw.active ? dm.rw.next_at : dm.df.next_at;
+            int wait = next_at > now ? (int)((next_at - now + 999999) / 1000000) : 0;
+            if (timeout < 0 || wait < timeout)
+                timeout = wait;
+        }
+        if (poll(dm.pfd, dm.n, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            ret = 1;
+            break;
+        }
+        if (dm.pfd[0].revents & POLLIN) {
+            int fd = accept(dm.ls, NULL, NULL);
+            if (fd >= 0 && add_client(&dm, fd) != 0)
+                close(fd);
+        }
+        bool waiting = false;
+        for (nfds_t i = 1; i < dm.n; i++) {
+            struct client *c = &dm.cl[i];
+            // a client pipelining behind a held reply waits for the commit
+            if (!dm.pfd[i].revents || c->waiting) {
+                waiting |= c->waiting;
+                continue;
+            }
+            // a txn has to fit the journal, the writes so far go out before the next one
+            if (dm.dirty && journal_full(&dm.d))
+                commit(&dm);
+            if (serve(&dm, c) != 0) {
+                close(c->fd);
+                c->fd = -1;
+                continue;
+            }
+            waiting |= c->waiting;
+        }
+        if (waiting || (dm.dirty && (now_ns() - dm.dirty_since >= COMMIT_MS * 1000000ull ||
+                                     journal_full(&dm.d))))
+            commit(&dm);
+        compact(&dm);
+        if (dm.rw.active && rewrite(&dm, disk_path, cache_size, readahead) != 0) {
+            ret = 1;
+            break;
+        }
+        if (dm.df.active)
+            defrag(&dm);
+    }
+    // an unfinished rewrite starts over next time, a defrag just stops
+    rewrite_abort(&dm.rw);
+    defrag_stop(&dm.df, &dm.d);
+    commit(&dm);
+    for (nfds_t i = 1; i < dm.n; i++)
+        if (dm.cl[i].fd >= 0)
+            close(dm.cl[i].fd);
+    close(dm.ls);
+    unlink(sock_path);
+    printf("Served %" PRIu64 " requests in %" PRIu64 " commits\n", dm.requests, dm.commits);
+    cache_report(&dm.d);
+    free(dm.pfd);
+    free(dm.cl);
+    disk_close(&dm.d);
+    return ret;
+}
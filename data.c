@@ -0,0 +1,1165 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+/*
+Data path
+Bytes move from the source straight into the file's data blocks. Regular files
+go through copy_file_range [falling back to sendfile], pipes through splice,
+and anything else [or a kernel that refuses] through an aligned buffer of
+WRITE_BUF bytes, so nothing ever holds a whole file in memory.
+Reads go the other way out of an mmap of the disk, see data_read.
+*/
+
+static const char *xfer_names[] = {
+    [XM_COPY_RANGE] = "copy_file_range",
+    [XM_SENDFILE] = "sendfile",
+    [XM_SPLICE] = "splice",
+    [XM_BUFFERED] = "pwrite",
+    [XM_MEMORY] = "pwrite",
+};
+
+const char *xfer_name(enum xfer_method m) {
+    return xfer_names[m];
+}
+
+// Picks the cheapest way to move bytes out of src, src->fd must already be open
+int data_src_open(struct data_src *src) {
+    src->off = 0;
+    if (src->kind == D_STR) {
+        src->method = XM_MEMORY;
+        return 0;
+    }
+    struct stat st;
+    if (fstat(src->fd, &st) != 0) {
+        perror("stat data source");
+        return 1;
+    }
+    src->seekable = S_ISREG(st.st_mode);
+    if (S_ISREG(st.st_mode)) {
+        src->method = XM_COPY_RANGE;
+        // stdin redirected from a file may not start at 0
+        off_t cur = lseek(src->fd, 0, SEEK_CUR);
+        src->off = cur > 0 ? cur : 0;
+        if (!src->size_known) {
+            src->size = st.st_size > src->off ? st.st_size - src->off : 0;
+            src->size_known = true;
+        }
+    } else if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+        src->method = XM_SPLICE;
+    } else {
+        src->method = XM_BUFFERED;
+    }
+    return 0;
+}
+
+static bool fall_back(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+static ssize_t xfer_buffered(struct store_disk *d, struct data_src *src, off_t dst, size_t len,
+                             struct write_stats *ws) {
+    if (!src->buf && posix_memalign((void **)&src->buf, d->sb.block, WRITE_BUF) != 0) {
+        src->buf = NULL;
+        printf("Unable to alloc mem for write buffer\n");
+        return -1;
+    }
+    size_t want = len < WRITE_BUF ? len : WRITE_BUF;
+    ssize_t n;
+    ws->syscalls++;
+    if (src->seekable)
+        n = pread(src->fd, src->buf, want, src->off);
+    else
+        n = read(src->fd, src->buf, want);
+    if (n <= 0) {
+        if (n < 0)
+            perror("read data source");
+        return n;
+    }
+    for (ssize_t done = 0; done < n; ) {
+        ws->syscalls++;
+        ssize_t w = pwrite(d->fd, src->buf + done, n - done, dst + done);
+        if (w <= 0) {
+            perror("write data");
+            return -1;
+        }
+        done += w;
+    }
+    src->off += n;
+    return n;
+}
+
+/*
+Moves up to len bytes from src to disk offset dst with the best method that works,
+downgrading src->method when the kernel refuses one.
+Returns bytes moved, 0 at end of source, -1 on errors
+*/
+static ssize_t xfer(struct store_disk *d, struct data_src *src, off_t dst, size_t len, struct write_stats *ws) {
+    cache_drop(d, dst, len);
+    for (;;) {
+        ssize_t n = -1;
+        loff_t in_off = src->off, out_off = dst;
+        switch (src->method) {
+        case XM_MEMORY:
+            ws->syscalls++;
+            n = pwrite(d->fd, src->mem + src->off, len, dst);
+            if (n < 0)
+                break;
+            src->off += n;
+            return n;
+        case XM_COPY_RANGE:
+            ws->syscalls++;
+            n = copy_file_range(src->fd, &in_off, d->fd, &out_off, len, 0);
+            if (n >= 0) {
+                src->off = in_off;
+                return n;
+            }
+            if (!fall_back(errno))
+                break;
+            src->method = XM_SENDFILE;
+            continue;
+        case XM_SENDFILE:
+            // sendfile writes at the current position of the disk fd
+            ws->syscalls += 2;
+            if (lseek(d->fd, dst, SEEK_SET) != dst)
+                break;
+            n = sendfile(d->fd, src->fd, &in_off, len);
+            if (n >= 0) {
+                src->off = in_off;
+                return n;
+            }
+            if (!fall_back(errno))
+                break;
+            src->method = XM_BUFFERED;
+            continue;
+        case XM_SPLICE:
+            ws->syscalls++;
+            n = splice(src->fd, NULL, d->fd, &out_off, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n >= 0) {
+                src->off += n;
+                return n;
+            }
+            if (!fall_back(errno))
+                break;
+            src->method = XM_BUFFERED;
+            continue;
+        case XM_BUFFERED:
+            return xfer_buffered(d, src, dst, len, ws);
+        }
+        perror("write data");
+        return -1;
+    }
+}
+
+// bytes compressed as one unit on this disk
+static uint64_t cluster_size(const struct store_disk *d) {
+    return CLUSTER > d->sb.block ? CLUSTER : d->sb.block;
+}
+
+// Reads up to len bytes of src into buf, short only at the end of the source
+static ssize_t src_read(struct data_src *src, char *buf, size_t len, struct write_stats *ws) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n;
+        if (src->method == XM_MEMORY) {
+            n = len - done;
+            memcpy(buf + done, src->mem + src->off, n);
+        } else {
+            ws->syscalls++;
+            if (src->seekable)
+                n = pread(src->fd, buf + done, len - done, src->off);
+            else
+                n = read(src->fd, buf + done, len - done);
+        }
+        if (n < 0) {
+            perror("read data source");
+            return -1;
+        }
+        if (n == 0)
+            break;
+        src->off += n;
+        done += n;
+    }
+    return done;
+}
+
+/*
+Compressed data on its way out, clusters that land next to each other go in one write.
+With an I/O queue there are two buffers, one is written out asynchronously while
+the next clusters are compressed into the other.
+*/
+struct lz4_out {
+    char *buf;                   // bufs[cur]
+    char *bufs[2];
+    struct io_req req[2];
+    bool busy[2];                // req in flight
+    unsigned cur;
+    struct io_queue *q;          // NULL writes synchronously
+    size_t cap;
+    off_t off;
+    size_t len;
+    char *cbuf;                  // compressor output for one cluster
+    uint32_t misses;             // clusters in a row that didn't compress
+    bool compress;               // clusters are tried with lz4, else they all go in raw
+    const struct crypt_key *key; // blocks are encrypted on their way out
+    struct cksum_cursor *c;      // ... and their MACs go here, NULL without checksums
+};
+
+// key f's blocks are encrypted with, NULL for plain files [data_write/data_read check it's loaded]
+static const struct crypt_key *key_of(const struct store_file *f) {
+    return f->ino.flags & FLAG_ENCRYPTED ? crypt_key(f->ino.key) : NULL;
+}
+
+#define CRYPT_BATCH 48         // blocks whose MACs are put or checked at a time
+#define CRYPT_CHUNK (256 << 10) // decrypted out of the map at a time, still in L2 when it's written out
+
+/*
+Encrypts [or decrypts] the n blocks at src that sit at disk block pblk on into
+p [which may be src]. With a cursor the MACs come out of the same pass and go
+in the checksum table on the way out, or get checked against it on the way in.
+*/
+static int crypt_run(struct store_disk *d, const struct crypt_key *key, struct cksum_cursor *c, uint64_t pblk,
+                     const char *src, char *p, uint64_t n, bool enc) {
+    uint32_t block = d->sb.block, sums[CRYPT_BATCH];
+    for (uint64_t i = 0; i < n; i += CRYPT_BATCH) {
+        uint64_t k = n - i < CRYPT_BATCH ? n - i : CRYPT_BATCH;
+        crypt_blocks_to(key, pblk + i, src + i * block, p + i * block, k, block, enc, c ? sums : NULL);
+        if (c && (enc ? cksum_put(d, c, pblk + i, sums, k) : cksum_check(d, c, pblk + i, sums, k)) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int write_all(struct store_disk *d, const char *p, size_t len, off_t off, struct write_stats *ws) {
+    cache_drop(d, off, len);
+    for (size_t done = 0; done < len; ) {
+        ws->syscalls++;
+        ssize_t w = pwrite(d->fd, p + done, len - done, off + done);
+        if (w <= 0) {
+            perror("write data");
+            return 1;
+        }
+        done += w;
+    }
+    return 0;
+}
+
+// Waits for the write of bufs[i], a short one is finished synchronously
+static int out_wait(struct store_disk *d, struct lz4_out *o, unsigned i, struct write_stats *ws) {
+    struct io_req *r = &o->req[i];
+    if (!o->busy[i])
+        return 0;
+    while (!r->done && io_reap(o->q, true))
+        ;
+    o->busy[i] = false;
+    if (!r->done || r->res < 0) {
+        printf("Write of compressed data failed: %s\n", r->done ? strerror((int)-r->res) : "lost request");
+        return 1;
+    }
+    return write_all(d, (char *)r->buf + r->res, r->len - r->res, r->off + r->res, ws);
+}
+
+static int out_flush(struct store_disk *d, struct lz4_out *o, struct write_stats *ws) {
+    if (o->len == 0)
+        return 0;
+    if (o->key) {
+        // out_put pads to whole blocks, o->off is where the first one goes
+        uint64_t pblk = o->off / d->sb.block, n = o->len / d->sb.block;
+        if (crypt_run(d, o->key, o->c, pblk, o->buf, o->buf, n, true) != 0)
+            return 1;
+    }
+    if (!o->q) {
+        size_t len = o->len;
+        o->len = 0;
+        return write_all(d, o->buf, len, o->off, ws);
+    }
+    struct io_req *r = &o->req[o->cur];
+    *r = (struct io_req){ .fd = d->fd, .write = true, .buf = o->buf, .len = o->len, .off = o->off };
+    cache_drop(d, r->off, r->len);
+    ws->syscalls++;
+    if (io_push(o->q, r) != 0 || io_submit(o->q) != 0) {
+        o->len = 0;
+        return write_all(d, r->buf, r->len, r->off, ws);
+    }
+    o->busy[o->cur] = true;
+    o->cur ^= 1;
+    o->buf = o->bufs[o->cur];
+    o->len = 0;
+    // the other buffer gets reused next
+    return out_wait(d, o, o->cur, ws);
+}
+
+// Queues len bytes for disk block pblk, padding to whole blocks
+static int out_put(struct store_disk *d, struct lz4_out *o, uint64_t pblk, const char *p, size_t len,
+                   struct write_stats *ws) {
+    size_t padded = (len + d->sb.block - 1) / d->sb.block * d->sb.block;
+    off_t off = (off_t)(pblk * d->sb.block);
+    if (o->len && (o->off + (off_t)o->len != off || o->len + padded > o->cap) && out_flush(d, o, ws) != 0)
+        return 1;
+    if (o->len == 0)
+        o->off = off;
+    memcpy(o->buf + o->len, p, len);
+    memset(o->buf + o->len + len, 0, padded - len);
+    o->len += padded;
+    ws->stored += padded;
+    return 0;
+}
+
+/*
+Stores one cluster [len <= cluster_size bytes] at the end of f.
+It is kept compressed only when that saves at least an eighth of its blocks,
+otherwise it goes in raw as plain blocks. After CLUSTER_SKIP misses in a row
+only every CLUSTER_SKIP-th cluster is tried, so incompressible data costs
+next to no CPU, one hit turns compression back on for every cluster.
+*/
+static int put_cluster(struct store_disk *d, struct store_file *f, struct lz4_out *o, const char *p,
+                       size_t len, struct write_stats *ws) {
+    uint64_t block = d->sb.block;
+    uint64_t blocks = (len + block - 1) / block;
+    uint64_t save = blocks / 8 ? blocks / 8 : 1;
+    bool try = o->compress && (o->misses < CLUSTER_SKIP || o->misses % CLUSTER_SKIP == 0);
+    size_t csize = try && blocks > save ? lz4_compress(p, len, o->cbuf, (blocks - save) * block) : 0;
+
+    if (csize) {
+        uint64_t need = (csize + block - 1) / block;
+        struct store_extent *last = f->n_ext ? &f->ext[f->n_ext - 1] : NULL;
+        uint64_t pblk;
+        uint64_t got = alloc_extent(d, need, last ? last->pblk + ext_blocks(d, last) : 0, &pblk);
+        if (got == need) {
+            o->misses = 0;
+            if (file_add_extent(f, pblk, blocks, csize) != 0) {
+                alloc_release(d, pblk, got);
+                return 1;
+            }
+            return out_put(d, o, pblk, o->cbuf, csize, ws);
+        }
+        // no run big enough left, the cluster can still go in raw across several extents
+        alloc_release(d, pblk, got);
+    }
+
+    o->misses++;
+    ws->raw_clusters += o->compress;
+    uint64_t lblk = f->ino.block_count;
+    if (file_grow(d, f, blocks) != 0)
+        return 1;
+    for (uint64_t b = 0; b < blocks; ) {
+        uint64_t run;
+        uint64_t pblk = file_map(f, lblk + b, &run);
+        if (run > blocks - b)
+            run = blocks - b;
+        size_t n = b + run < blocks ? run * block : len - b * block;
+        if (out_put(d, o, pblk, p + b * block, n, ws) != 0)
+            return 1;
+        b += run;
+    }
+    return 0;
+}
+
+/*
+Copies bytes [off, off + len) of f into buf, decrypting and decompressing as
+needed. Used to pick up a partial last cluster [or block] before appending to
+a compressed or encrypted file, len is at most a cluster.
+*/
+static int file_pread(struct store_disk *d, struct store_file *f, uint64_t off, size_t len, char *buf) {
+    uint64_t block = d->sb.block;
+    const struct crypt_key *key = key_of(f);
+    char *cbuf = NULL, *dbuf = NULL;
+    int ret = 0;
+    for (size_t done = 0; done < len && ret == 0; ) {
+        uint64_t pos = off + done;
+        const struct store_extent *e = file_extent(f, pos / block);
+        if (!e) {
+            ret = 1;
+            break;
+        }
+        uint64_t start = e->lblk * block, end = start + (uint64_t)e->count * block;
+        size_t n = end - pos < len - done ? end - pos : len - done;
+        if (!e->csize && !key) {
+            if (pread(d->fd, buf + done, n, (off_t)(e->pblk * block + pos - start)) != (ssize_t)n)
+                ret = 1;
+        } else if (!e->csize) {
+            // encrypted blocks only decrypt whole
+            uint64_t pblk = e->pblk + (pos - start) / block, skip = pos % block;
+            size_t want = (skip + n + block - 1) / block * block;
+            if ((!cbuf && !(cbuf = malloc(cluster_size(d) + block))) ||
+                pread(d->fd, cbuf, want, (off_t)(pblk * block)) != (ssize_t)want) {
+                ret = 1;
+            } else {
+                crypt_blocks(key, pblk, cbuf, want / block, block, false, NULL);
+                memcpy(buf + done, cbuf + skip, n);
+            }
+        } else {
+            size_t cap = (size_t)e->count * block;
+            size_t want = key ? ext_blocks(d, e) * block : e->csize;
+            if ((!cbuf && !(cbuf = malloc(cluster_size(d) + block))) || (!dbuf && !(dbuf = malloc(cluster_size(d)))) ||
+                pread(d->fd, cbuf, want, (off_t)(e->pblk * block)) != (ssize_t)want) {
+                ret = 1;
+            } else {
+                if (key)
+                    crypt_blocks(key, e->pblk, cbuf, want / block, block, false, NULL);
+                if (lz4_decompress(cbuf, e->csize, dbuf, cap) < (ssize_t)(pos - start + n))
+                    ret = 1;
+                else
+                    memcpy(buf + done, dbuf + (pos - start), n);
+            }
+        }
+        done += n;
+    }
+    free(cbuf);
+    free(dbuf);
+    if (ret)
+        printf("Failed to read back the tail of %s\n", f->ino.name);
+    return ret;
+}
+
+/*
+Compressed variant of data_write, writes always go to the end of the file.
+The source is read WRITE_BUF at a time and cut into clusters that are compressed
+one by one, a partial last cluster is read back and rewritten with the new data.
+Encrypted files come here too, compressed or not: every block is encrypted as
+it goes out [out_flush] and gets its MAC there, an uncompressed one has its
+partial last block read back and rewritten the same way, to a new block.
+*/
+static int data_write_lz4(struct store_disk *d, struct store_file *f, uint64_t pos, struct data_src *src,
+                          struct write_stats *ws) {
+    bool lz4 = f->ino.compression == COMP_LZ4 && cluster_size(d) > d->sb.block;
+    uint64_t cl = lz4 ? cluster_size(d) : d->sb.block;
+    if (pos != f->ino.size) {
+        printf("Compressed and encrypted files only take writes at their end\n");
+        return 1;
+    }
+    size_t buf_sz = WRITE_BUF > cl ? WRITE_BUF / cl * cl : cl;
+    // what put_cluster gets at a time, plain blocks go in as long runs
+    size_t piece = lz4 ? cl : buf_sz;
+    const struct crypt_key *key = key_of(f);
+    struct cksum_cursor c = {0};
+    struct lz4_out o = { .cap = buf_sz, .q = disk_io(d), .compress = lz4, .key = key,
+                         .c = key && f->ino.data_cksum && d->sb.csum_blocks ? &c : NULL };
+    char *in = malloc(buf_sz);
+    o.buf = o.bufs[0] = malloc(buf_sz);
+    o.bufs[1] = o.q ? malloc(buf_sz) : NULL;
+    o.cbuf = lz4 ? malloc(cl) : NULL;
+    int ret = 0;
+    if (!in || !o.buf || (o.q && !o.bufs[1]) || (lz4 && !o.cbuf)) {
+        printf("Unable to alloc mem for compression buffers\n");
+        ret = 1;
+    }
+
+    // a partial last cluster gets rewritten together with the new data
+    size_t fill = pos % cl;
+    if (ret == 0 && fill) {
+        ret = file_pread(d, f, pos - fill, fill, in);
+        if (ret == 0)
+            file_truncate(d, f, (pos - fill) / d->sb.block);
+        pos -= fill;
+        if (ret == 0 && f->ino.block_count * d->sb.block != pos) {
+            printf("Unable to reopen the last cluster of %s\n", f->ino.name);
+            ret = 1;
+        }
+    }
+
+    if (src->method != XM_MEMORY)
+        src->method = XM_BUFFERED;
+    uint64_t remaining = src->size;
+    while (ret == 0) {
+        size_t want = buf_sz - fill;
+        if (src->size_known && remaining < want)
+            want = remaining;
+        ssize_t n = src_read(src, in + fill, want, ws);
+        if (n < 0) {
+            ret = 1;
+            break;
+        }
+        if (src->size_known && (size_t)n < want) {
+            printf("Data source ended %" PRIu64 " bytes early\n", remaining - n);
+            ret = 1;
+        }
+        remaining -= src->size_known ? (uint64_t)n : 0;
+        ws->bytes += n;
+        fill += n;
+        bool eof = (size_t)n < want || (src->size_known && remaining == 0);
+
+        size_t done = 0;
+        for (; done < fill && ret == 0; done += piece) {
+            size_t len = fill - done < piece ? fill - done : piece;
+            ret = put_cluster(d, f, &o, in + done, len, ws);
+            if (ret == 0 && f->ino.size < pos + len)
+                f->ino.size = pos + len;
+            pos += len;
+        }
+        fill = 0;
+        if (eof)
+            break;
+    }
+    if (ret == 0)
+        ret = out_flush(d, &o, ws);
+    // nothing gets freed under a write in flight, even after an error
+    for (unsigned i = 0; i < 2; i++)
+        ret |= out_wait(d, &o, i, ws);
+    if (ret == 0 && o.c)
+        ret = cksum_cursor_flush(d, o.c);
+    cksum_cursor_free(&c);
+    ws->method = src->method;
+    free(in);
+    free(o.bufs[0]);
+    free(o.bufs[1]);
+    free(o.cbuf);
+    return ret;
+}
+
+// what cksum_record/verify take as tail for a run of f's blocks ending before file block end
+static uint32_t tail_of(const struct store_disk *d, const struct store_file *f, uint64_t end) {
+    return end == (f->ino.size + d->sb.block - 1) / d->sb.block ? f->ino.size % d->sb.block : 0;
+}
+
+/*
+Records checksums for the disk blocks behind file blocks lblk.. of f.
+Data reaches the disk without passing through us [copy_file_range, splice], so
+the blocks are read back through the disk map, straight from the page cache.
+Blocks reserved past EOF hold nothing yet and are left out.
+*/
+static int record_cksums(struct store_disk *d, struct store_file *f, uint64_t lblk) {
+    if (!d->sb.csum_blocks)
+        return 0;
+    if (disk_map(d) != 0)
+        return 1;
+    struct cksum_cursor c = {0};
+    uint64_t eof = (f->ino.size + d->sb.block - 1) / d->sb.block;
+    int ret = 0;
+    for (uint32_t i = 0; i < f->n_ext && ret == 0 && f->ext[i].lblk < eof; i++) {
+        const struct store_extent *e = &f->ext[i];
+        if (e->lblk + e->count <= lblk)
+            continue;
+        // a compressed cluster is rewritten whole
+        uint64_t skip = !e->csize && lblk > e->lblk ? lblk - e->lblk : 0;
+        uint64_t pblk = e->pblk + skip;
+        uint64_t n = ext_blocks(d, e) - skip;
+        uint32_t tail = 0;
+        if (!e->csize && e->lblk + e->count >= eof) {
+            n = eof - e->lblk - skip;
+            tail = tail_of(d, f, eof);
+        }
+        ret = cksum_record(d, &c, pblk, d->map + pblk * d->sb.block, n, tail);
+    }
+    if (ret == 0)
+        ret = cksum_cursor_flush(d, &c);
+    cksum_cursor_free(&c);
+    return ret;
+}
+
+/*
+Blocks an append that ran past the file's blocks reserves beyond EOF, blocks is
+the file's size in blocks after it. Every window a file fills doubles the next
+one [ino.prealloc], so a log that keeps growing goes to the allocator and its
+bitmap and extent list ever less often, while a file appended to now and then
+keeps small ones. Never more than APPEND_WINDOW_MAX, nor more than the file
+already holds, a file that stops growing wastes at most half its blocks.
+*/
+static uint64_t append_window(const struct store_disk *d, struct store_file *f, uint64_t blocks) {
+    uint64_t max = APPEND_WINDOW_MAX / d->sb.block;
+    if ((1ull << f->ino.prealloc) < max)
+        f->ino.prealloc++;
+    uint64_t w = 1ull << f->ino.prealloc;
+    if (w > max)
+        w = max;
+    return w < blocks ? w : blocks;
+}
+
+// Whether disk block pblk holds block bytes p, looking at the writes not yet on disk first
+static bool same_block(struct store_disk *d, struct lz4_out *o, uint64_t pblk, const char *p, char *cmp) {
+    uint64_t block = d->sb.block;
+    off_t off = (off_t)(pblk * block);
+    if (o->len && off >= o->off && off < o->off + (off_t)o->len)
+        return memcmp(o->buf + (off - o->off), p, block) == 0;
+    for (unsigned i = 0; i < 2; i++) {
+        const struct io_req *r = &o->req[i];
+        if (o->busy[i] && off >= r->off && off < r->off + (off_t)r->len)
+            return memcmp((char *)r->buf + (off - r->off), p, block) == 0;
+    }
+    return pread(d->fd, cmp, block, off) == (ssize_t)block && memcmp(cmp, p, block) == 0;
+}
+
+/*
+Adds len bytes [one block, or the end of the file] to f: a full block already
+on disk becomes another reference to it, anything else gets a block of its own
+at *goal or wherever the allocator has one.
+*/
+static int dedup_block(struct store_disk *d, struct store_file *f, struct lz4_out *o, struct cksum_cursor *c,
+                       const char *p, size_t len, uint64_t *goal, char *cmp, struct write_stats *ws) {
+    uint64_t block = d->sb.block;
+    uint64_t hash = 0;
+    if (len == block) {
+        hash = xxh64(p, block, 0);
+        uint64_t cand[DEDUP_CAND];
+        uint32_t n = dedup_lookup(d, hash, cand, DEDUP_CAND);
+        for (uint32_t i = 0; i < n; i++) {
+            if (!same_block(d, o, cand[i], p, cmp))
+                continue;
+            // the share is logged, a failed write takes it back in alloc_undo
+            if (dedup_share(d, cand[i], 1) != 0 || file_add_extent(f, cand[i], 1, 0) != 0)
+                return 1;
+            stats_add(SC_DEDUP_BLOCKS, 1);
+            ws->shared++;
+            return 0;
+        }
+    }
+    uint64_t pblk;
+    if (alloc_extent(d, 1, *goal, &pblk) == 0) {
+        printf("Out of data blocks\n");
+        return 1;
+    }
+    if (file_add_extent(f, pblk, 1, 0) != 0) {
+        alloc_release(d, pblk, 1);
+        return 1;
+    }
+    *goal = pblk + 1;
+    if (out_put(d, o, pblk, p, len, ws) != 0 || (c && cksum_record(d, c, pblk, p, 1, len % block) != 0))
+        return 1;
+    return len == block ? dedup_insert(d, hash, pblk) : 0;
+}
+
+/*
+Dedup variant of write_blocks for writes that start right after the file's
+last block [see dedup.c]. The source is read WRITE_BUF at a time and goes
+block by block through dedup_block, the new blocks go out in as few writes as
+they allow [out_put].
+*/
+static int data_write_dedup(struct store_disk *d, struct store_file *f, struct data_src *src,
+                            struct write_stats *ws) {
+    uint64_t block = d->sb.block;
+    size_t buf_sz = WRITE_BUF / block * block;
+    struct lz4_out o = { .cap = buf_sz, .q = disk_io(d) };
+    char *in = malloc(buf_sz);
+    char *cmp = malloc(block);
+    o.buf = o.bufs[0] = malloc(buf_sz);
+    o.bufs[1] = o.q ? malloc(buf_sz) : NULL;
+    int ret = 0;
+    if (!in || !cmp || !o.buf || (o.q && !o.bufs[1])) {
+        printf("Unable to alloc mem for dedup buffers\n");
+        ret = 1;
+    }
+    struct cksum_cursor c = {0};
+    struct cksum_cursor *cp = f->ino.data_cksum && d->sb.csum_blocks ? &c : NULL;
+    struct store_extent *last = f->n_ext ? &f->ext[f->n_ext - 1] : NULL;
+    uint64_t goal = last ? last->pblk + ext_blocks(d, last) : 0;
+
+    if (src->method != XM_MEMORY)
+        src->method = XM_BUFFERED;
+    uint64_t remaining = src->size;
+    while (ret == 0) {
+        size_t want = src->size_known && remaining < buf_sz ? remaining : buf_sz;
+        ssize_t n = src_read(src, in, want, ws);
+        if (n < 0) {
+            ret = 1;
+            break;
+        }
+        if (src->size_known && (size_t)n < want) {
+            printf("Data source ended %" PRIu64 " bytes early\n", remaining - n);
+            ret = 1;
+        }
+        remaining -= src->size_known ? (uint64_t)n : 0;
+        ws->bytes += n;
+        bool eof = (size_t)n < want || (src->size_known && remaining == 0);
+        for (size_t done = 0; done < (size_t)n && ret == 0; done += block) {
+            size_t len = n - done < block ? n - done : block;
+            ret = dedup_block(d, f, &o, cp, in + done, len, &goal, cmp, ws);
+            if (ret == 0)
+                f->ino.size += len;
+        }
+        if (eof)
+            break;
+    }
+    if (ret == 0)
+        ret = out_flush(d, &o, ws);
+    // nothing gets freed under a write in flight, even after an error
+    for (unsigned i = 0; i < 2; i++)
+        ret |= out_wait(d, &o, i, ws);
+    if (ret == 0 && cp)
+        ret = cksum_cursor_flush(d, cp);
+    cksum_cursor_free(&c);
+    ws->method = src->method;
+    free(in);
+    free(cmp);
+    free(o.bufs[0]);
+    free(o.bufs[1]);
+    return ret;
+}
+
+/*
+Moves the partial last block of f [pos bytes long] to a block of its own before
+an append fills it, when a snapshot or clone still has it. Shared blocks never
+change, see dedup.c. Returns 0 on success else 1
+*/
+static int unshare_tail(struct store_disk *d, struct store_file *f, uint64_t pos, struct write_stats *ws) {
+    uint64_t block = d->sb.block, lblk = pos / block;
+    char *buf = malloc(block);
+    int ret = !buf || file_pread(d, f, lblk * block, pos % block, buf) != 0;
+    if (ret == 0) {
+        // lets go of the shared block and the window reserved after it
+        file_truncate(d, f, lblk);
+        ret = file_grow(d, f, 1) != 0 ||
+              write_all(d, buf, pos % block, (off_t)(file_map(f, lblk, NULL) * block), ws) != 0;
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+Writes src into f starting at byte pos [<= f->ino.size], allocating blocks as it goes.
+Known sizes are allocated in one go so the data lands in as few extents as possible,
+streams grow by STREAM_CHUNK doubling up to STREAM_CHUNK_MAX and are trimmed at EOF.
+An append fills the partial last block in place [its checksum only covers bytes
+before EOF, see cksum.c] and goes on into the blocks the last append reserved,
+once those run out the file gets a new window past EOF [append_window] right
+after its last extent, so a log stays one extent and most appends cost one data
+write plus the inode and checksum entry.
+Files with LZ4 compression or encryption go through data_write_lz4 instead, with
+dedup on writes with no partial block or reserved blocks to fill go through
+data_write_dedup.
+Returns 0 on success else 1, f->ino.size covers whatever was written
+*/
+static int write_blocks(struct store_disk *d, struct store_file *f, uint64_t pos, struct data_src *src,
+                        struct write_stats *ws) {
+    uint64_t block = d->sb.block;
+    uint64_t t_start = now_ns();
+    uint64_t first = pos / block;
+    bool enc = f->ino.flags & FLAG_ENCRYPTED;
+    if (enc || (f->ino.compression == COMP_LZ4 && cluster_size(d) > block)) {
+        // a partial last cluster is written again from its start, maybe raw
+        first = pos / cluster_size(d) * cluster_size(d) / block;
+        int ret = data_write_lz4(d, f, pos, src, ws);
+        // encrypted blocks got their MACs on the way out
+        if (ret == 0 && f->ino.data_cksum && !enc)
+            ret = record_cksums(d, f, first);
+        ws->ns += now_ns() - t_start;
+        return ret;
+    }
+    if (d->sb.dedup_blocks && pos == f->ino.block_count * block) {
+        int ret = data_write_dedup(d, f, src, ws);
+        ws->ns += now_ns() - t_start;
+        return ret;
+    }
+    uint64_t chunk = STREAM_CHUNK;
+    uint64_t remaining = src->size;
+    int ret = 0;
+    bool append = pos > 0 && pos == f->ino.size;
+    uint64_t tail = append && pos % block ? file_map(f, pos / block, NULL) : 0;
+    if (tail && dedup_refs(d, tail) && unshare_tail(d, f, pos, ws) != 0)
+        return 1;
+    // blocks already there, a rewrite starts with none
+    uint64_t room = f->ino.block_count;
+
+    if (src->size_known) {
+        uint64_t need = (pos + src->size + block - 1) / block;
+        if (need > f->ino.block_count && file_grow(d, f, need - f->ino.block_count) != 0)
+            return 1;
+    }
+
+    while (!src->size_known || remaining > 0) {
+        if (pos == f->ino.block_count * block) {
+            // only streams get here, known sizes were allocated up front
+            if (file_grow(d, f, chunk / block) != 0) {
+                ret = 1;
+                break;
+            }
+            if (chunk < STREAM_CHUNK_MAX)
+                chunk *= 2;
+        }
+        uint64_t run;
+        uint64_t pblk = file_map(f, pos / block, &run);
+        uint64_t len = run * block - pos % block;
+        if (src->size_known && remaining < len)
+            len = remaining;
+        if (len > XFER_MAX)
+            len = XFER_MAX;
+
+        ssize_t n = xfer(d, src, (off_t)(pblk * block + pos % block), len, ws);
+        if (n < 0) {
+            ret = 1;
+            break;
+        }
+        if (n == 0) {
+            if (src->size_known) {
+                printf("Data source ended %" PRIu64 " bytes early\n", remaining);
+                ret = 1;
+            }
+            break;
+        }
+        pos += n;
+        ws->bytes += n;
+        ws->stored += n;
+        if (src->size_known)
+            remaining -= n;
+        if (pos > f->ino.size)
+            f->ino.size = pos;
+    }
+
+    // give back whatever a stream over-allocated, an append that used up its window gets a new one
+    uint64_t eof = (f->ino.size + block - 1) / block;
+    uint64_t keep = eof > room ? eof + (append ? append_window(d, f, eof) : 0) : room;
+    file_truncate(d, f, keep);
+    if (ret == 0 && f->ino.block_count < keep)
+        file_reserve(d, f, keep - f->ino.block_count);
+    if (ret == 0 && f->ino.data_cksum)
+        ret = record_cksums(d, f, first);
+    ws->method = src->method;
+    ws->ns += now_ns() - t_start;
+    free(src->buf);
+    src->buf = NULL;
+    return ret;
+}
+
+/*
+Writes a file that ends up at most sb.pack_max bytes long through pack_store,
+bytes before pos come from where the file is now [inline or packed].
+Compression is skipped, there is nothing to gain on a few slots.
+*/
+static int write_small(struct store_disk *d, struct store_file *f, uint64_t pos, struct data_src *src,
+                       struct write_stats *ws) {
+    uint64_t block = d->sb.block;
+    char *buf = malloc(2 * block);
+    if (!buf)
+        return 1;
+    int ret = 0;
+    if (pos > 0) {
+        const char *old = pack_data(d, &f->ino, buf + block);
+        if (!old)
+            ret = 1;
+        else
+            memmove(buf, old, pos);
+    }
+    ssize_t n = ret ? -1 : src_read(src, buf + pos, src->size, ws);
+    if (n >= 0 && (uint64_t)n < src->size)
+        printf("Data source ended %" PRIu64 " bytes early\n", src->size - n);
+    if (n < 0 || (uint64_t)n < src->size || pack_store(d, &f->ino, buf, pos + n) != 0)
+        ret = 1;
+    if (ret == 0) {
+        ws->bytes += n;
+        ws->stored += n;
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+Moves an inline or packed file into data blocks so it can grow past sb.pack_max,
+its slots are left for the caller to free [see op_write].
+*/
+static int unpack(struct store_disk *d, struct store_file *f, struct write_stats *ws) {
+    char *buf = malloc(2 * d->sb.block);
+    const char *p = buf ? pack_data(d, &f->ino, buf + d->sb.block) : NULL;
+    if (!p) {
+        free(buf);
+        return 1;
+    }
+    // inline bytes sit in the union that is about to hold extents
+    memmove(buf, p, f->ino.size);
+    struct data_src mem = { .kind = D_STR, .mem = buf, .size = f->ino.size, .size_known = true };
+    struct write_stats tmp = {0};
+    f->ino.flags &= ~(FLAG_INLINE | FLAG_PACKED);
+    memset(f->ino.extents, 0, sizeof(f->ino.extents));
+    f->ino.size = 0;
+    int ret = data_src_open(&mem) != 0 || write_blocks(d, f, 0, &mem, &tmp) != 0;
+    ws->syscalls += tmp.syscalls;
+    free(buf);
+    return ret;
+}
+
+/*
+Writes src into f starting at byte pos [<= f->ino.size].
+Files that stay within sb.pack_max bytes are inlined or packed [see pack.c],
+the rest get data blocks, an inline/packed file that grows past it is moved
+to blocks first. Encrypted files always get data blocks.
+Returns 0 on success else 1, f->ino.size covers whatever was written
+*/
+int data_write(struct store_disk *d, struct store_file *f, uint64_t pos, struct data_src *src,
+               struct write_stats *ws) {
+    bool small = f->ino.flags & (FLAG_INLINE | FLAG_PACKED), missing;
+    bool enc = crypt_file_key(&f->ino, &missing) != NULL;
+    if (missing)
+        return 1;
+    if (enc && !d->sb.csum_blocks) {
+        printf("%s can't be encrypted, the disk has no checksum table to keep MACs in [-ck off]\n", f->ino.name);
+        return 1;
+    }
+    // encrypted data only ever sits in blocks of its own
+    if (!enc && (small || f->ino.block_count == 0) && src->size_known && pos + src->size <= d->sb.pack_max) {
+        uint64_t t_start = now_ns();
+        int ret = write_small(d, f, pos, src, ws);
+        ws->method = src->method == XM_MEMORY ? XM_MEMORY : XM_BUFFERED;
+        ws->ns += now_ns() - t_start;
+        return ret;
+    }
+    if (small && unpack(d, f, ws) != 0)
+        return 1;
+    return write_blocks(d, f, pos, src, ws);
+}
+
+// Maps the whole disk read-only, reads then work straight out of the page cache
+int disk_map(struct store_disk *d) {
+    if (d->map)
+        return 0;
+    void *m = mmap(NULL, d->sb.disk_size, PROT_READ, MAP_SHARED, d->fd, 0);
+    if (m == MAP_FAILED) {
+        perror("mmap disk");
+        return 1;
+    }
+    d->map = m;
+    return 0;
+}
+
+// Hints the kernel about the range we are about to stream out of the map
+static void advise(struct store_disk *d, off_t off, size_t len, bool large) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start = off & ~(off_t)(page - 1);
+    len += off - start;
+    madvise((char *)d->map + start, len, MADV_WILLNEED);
+    if (large)
+        madvise((char *)d->map + start, len, MADV_SEQUENTIAL);
+}
+
+static ssize_t out_write(int out, const char *p, size_t len, bool pipe_out, struct read_stats *rs) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t n;
+        rs->syscalls++;
+        if (pipe_out) {
+            // hands the mapped pages to the pipe instead of copying them
+            struct iovec iov = { (void *)(p + done), len - done };
+            n = vmsplice(out, &iov, 1, 0);
+        } else {
+            n = write(out, p + done, len - done);
+        }
+        if (n <= 0) {
+            perror("write output");
+            return -1;
+        }
+        done += n;
+    }
+    return len;
+}
+
+// State of one data_read, buffers are allocated on first use
+struct read_ctx {
+    enum read_mode mode;
+    char *cbuf;                  // compressed cluster read with pread
+    char *dbuf;                  // decompressed cluster
+    bool verify;                 // check blocks against the checksum table
+    bool cached;                 // preads go through the block cache
+    const struct crypt_key *key; // blocks are decrypted once they are checked
+    struct cksum_cursor c;
+};
+
+/*
+Decompresses the cluster e into r->dbuf, the compressed bytes come straight out
+of the disk map or are pread into r->cbuf. With checksums on, the cluster's disk
+blocks are checked before the decompressor sees them, encrypted ones are
+decrypted in r->cbuf after that.
+*/
+static int read_cluster(struct store_disk *d, const struct store_extent *e, struct read_ctx *r,
+                        struct read_stats *rs) {
+    uint64_t cl = cluster_size(d);
+    size_t cap = (size_t)e->count * d->sb.block;
+    size_t disk_len = ext_blocks(d, e) * d->sb.block;
+    off_t disk_off = (off_t)(e->pblk * d->sb.block);
+    const char *src;
+    if (e->csize > cl || cap > cl) {
+        printf("Corrupt compressed extent at block %" PRIu64 "\n", e->pblk);
+        return 1;
+    }
+    if ((!r->dbuf && !(r->dbuf = malloc(cl))) || (r->mode != READ_MMAP && !r->cbuf && !(r->cbuf = malloc(cl)))) {
+        printf("Unable to alloc mem for decompression\n");
+        return 1;
+    }
+    if (r->mode == READ_MMAP) {
+        src = d->map + disk_off;
+    } else {
+        size_t want = r->verify || r->key ? disk_len : e->csize;
+        rs->syscalls += !r->cached;
+        if (r->cached ? cache_read(d, disk_off, r->cbuf, want) != 0
+                      : pread(d->fd, r->cbuf, want, disk_off) != (ssize_t)want) {
+            perror("read data");
+            return 1;
+        }
+        src = r->cbuf;
+    }
+    if (r->key ? crypt_run(d, r->key, r->verify ? &r->c : NULL, e->pblk, r->cbuf, r->cbuf, ext_blocks(d, e), false) != 0
+               : r->verify && cksum_verify(d, &r->c, e->pblk, src, ext_blocks(d, e), 0) != 0)
+        return 1;
+    ssize_t n = lz4_decompress(src, e->csize, r->dbuf, cap);
+    if (n < 0 || (size_t)n + d->sb.block <= cap) {
+        printf("Corrupt compressed cluster at block %" PRIu64 "\n", e->pblk);
+        return 1;
+    }
+    // a short last cluster reads as zeroes past its data, like plain blocks past EOF
+    memset(r->dbuf + n, 0, cap - n);
+    return 0;
+}
+
+// data_read for inline and packed files, one block read at most
+static int read_small(struct store_disk *d, struct store_file *f, uint64_t off, uint64_t len, int out_fd,
+                      struct read_stats *rs) {
+    uint64_t t_start = now_ns();
+    // reader_open may have the bytes already
+    char *blk = (f->ino.flags & FLAG_PACKED) && !f->data ? malloc(d->sb.block) : NULL;
+    const char *p = f->data ? f->data : (f->ino.flags & FLAG_INLINE) || blk ? pack_data(d, &f->ino, blk) : NULL;
+    if (blk)
+        rs->syscalls++;
+    int ret = !p || out_write(out_fd, p + off, len, false, rs) < 0;
+    if (ret == 0)
+        rs->bytes += len;
+    free(blk);
+    rs->mode = READ_PREAD;
+    rs->ns += now_ns() - t_start;
+    return ret;
+}
+
+/*
+Streams len bytes of f starting at off into out_fd.
+READ_MMAP walks the extents in the disk map, READ_PREAD goes through a
+bounce buffer, READ_AUTO takes pread for reads of at most READ_SMALL bytes
+where mmap setup and the page fault cost more than a copy.
+Compressed clusters are decompressed one at a time into a buffer and written out.
+Files with data checksums have every block they touch verified before it goes
+out, READ_BUF at a time so the check and the copy see the same cached bytes.
+Encrypted files are always read with pread, whole blocks, checked and then
+decrypted in the buffer.
+Returns 0 on success else 1
+*/
+int data_read(struct store_disk *d, struct store_file *f, uint64_t off, uint64_t len, int out_fd,
+              enum read_mode mode, struct read_stats *rs) {
+    uint64_t t_start = now_ns();
+    uint64_t block = d->sb.block;
+    uint64_t bytes = rs->bytes, syscalls = rs->syscalls;
+    if (off >= f->ino.size)
+        len = 0;
+    else if (len > f->ino.size - off)
+        len = f->ino.size - off;
+    if (f->ino.flags & (FLAG_INLINE | FLAG_PACKED)) {
+        int ret = read_small(d, f, off, len, out_fd, rs);
+        stats_op(SO_READ, now_ns() - t_start, rs->bytes - bytes, rs->syscalls - syscalls);
+        return ret;
+    }
+    bool missing;
+    const struct crypt_key *key = crypt_file_key(&f->ino, &missing);
+    if (missing)
+        return 1;
+    if (mode == READ_AUTO)
+        mode = len <= READ_SMALL ? READ_PREAD : READ_MMAP;
+    // the map only has ciphertext to hand out, big encrypted reads decrypt out of it into the buffer
+    bool from_map = key && mode == READ_MMAP && disk_map(d) == 0;
+    if ((mode == READ_MMAP && disk_map(d) != 0) || key)
+        mode = READ_PREAD;
+
+    // big reads would only push everything else out of the cache
+    struct read_ctx r = { .mode = mode, .verify = f->ino.data_cksum != CK_NONE && d->sb.csum_blocks,
+                          .cached = d->cache && len <= CACHE_BYPASS, .key = key,
+                          .c = { .pin_blk = f->tail_blk, .pin_sum = f->tail_sum } };
+    bool whole = r.verify || key;
+    from_map = from_map && !r.cached;
+    struct stat st;
+    bool pipe_out = mode == READ_MMAP && fstat(out_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    char *buf = NULL;
+    // verified and encrypted reads pread whole blocks, so a range may need one block more
+    size_t buf_sz = (len + (whole ? block : 0) + block - 1) / block * block;
+    if (buf_sz > READ_BUF)
+        buf_sz = READ_BUF;
+    if (mode == READ_PREAD && len && posix_memalign((void **)&buf, block, buf_sz) != 0) {
+        printf("Unable to alloc mem for read buffer\n");
+        return 1;
+    }
+
+    int ret = 0;
+    for (uint64_t pos = off, end = off + len; pos < end; ) {
+        const struct store_extent *e = file_extent(f, pos / block);
+        if (e && e->csize) {
+            // only the clusters the range touches get decompressed
+            if (read_cluster(d, e, &r, rs) != 0) {
+                ret = 1;
+                break;
+            }
+            uint64_t start = e->lblk * block;
+            uint64_t n = start + (uint64_t)e->count * block - pos;
+            if (n > end - pos)
+                n = end - pos;
+            if (out_write(out_fd, r.dbuf + (pos - start), n, false, rs) < 0) {
+                ret = 1;
+                break;
+            }
+            pos += n;
+            rs->bytes += n;
+            continue;
+        }
+        if (!e) {
+            printf("File %s has no block for offset %" PRIu64 "\n", f->ino.name, pos);
+            ret = 1;
+            break;
+        }
+        uint64_t n = (e->lblk + e->count) * block - pos;
+        if (n > end - pos)
+            n = end - pos;
+        uint64_t in = pos % block;
+        uint64_t pblk = e->pblk + (pos / block - e->lblk);
+        off_t disk_off = (off_t)(pblk * block + in);
+
+        if (mode == READ_MMAP) {
+            if (r.verify && n > READ_BUF)
+                n = READ_BUF;
+            advise(d, disk_off, n, len > READ_SMALL);
+            rs->syscalls += len > READ_SMALL ? 2 : 1;
+            if (r.verify && cksum_verify(d, &r.c, pblk, d->map + pblk * block, (in + n + block - 1) / block,
+                                         tail_of(d, f, (pos + n + block - 1) / block)) != 0) {
+                ret = 1;
+                break;
+            }
+            if (out_write(out_fd, d->map + disk_off, n, pipe_out, rs) < 0) {
+                ret = 1;
+                break;
+            }
+        } else {
+            // with checksums the whole blocks around the range are read and checked
+            size_t skip = whole ? in : 0;
+            size_t cap = from_map && buf_sz > CRYPT_CHUNK ? CRYPT_CHUNK : buf_sz;
+            if (skip + n > cap)
+                n = cap - skip;
+            size_t want = whole ? (in + n + block - 1) / block * block : n;
+            const char *src = buf;
+            if (from_map) {
+                // no bounce through a pread copy, the decrypt pass is the only one over the data
+                advise(d, disk_off - skip, want, true);
+                rs->syscalls += 2;
+                src = d->map + (disk_off - skip);
+            } else if (r.cached ? cache_read(d, disk_off - skip, buf, want) != 0
+                                : pread(d->fd, buf, want, disk_off - skip) != (ssize_t)want) {
+                perror("read data");
+                ret = 1;
+                break;
+            } else {
+                rs->syscalls += !r.cached;
+            }
+            // encrypted blocks are checked against their MACs as they decrypt
+            if (key ? crypt_run(d, key, r.verify ? &r.c : NULL, pblk, src, buf, want / block, false) != 0
+                    : r.verify && cksum_verify(d, &r.c, pblk, buf, want / block,
+                                               tail_of(d, f, (pos + n + block - 1) / block)) != 0) {
+                ret = 1;
+                break;
+            }
+            if (out_write(out_fd, buf + skip, n, false, rs) < 0) {
+                ret = 1;
+                break;
+            }
+        }
+        pos += n;
+        rs->bytes += n;
+    }
+    free(buf);
+    free(r.cbuf);
+    free(r.dbuf);
+    cksum_cursor_free(&r.c);
+    rs->mode = mode;
+    rs->ns += now_ns() - t_start;
+    stats_op(SO_READ, now_ns() - t_start, rs->bytes - bytes, rs->syscalls - syscalls);
+    return ret;
+}
@@ -0,0 +1,202 @@
+#include "store.h"
+
+/*
+Block level dedup
+With sb.dedup_blocks set, a file written from scratch without compression goes
+through data_write_dedup [data.c]: every full block is fingerprinted with
+xxh64, one that matches a block already on disk byte for byte becomes another
+reference to it instead of being written.
+Fingerprint index [sb.dedup_start..]: one bucket per block of (hash, block)
+pairs, the hash picks the bucket. A full bucket drops an entry picked by the
+hash, so the index never grows past its region and only ever costs the cache
+frames it is read through, at the price of missing some duplicates. Entries
+are hints, a match only counts when the block is still owned and holds the
+same bytes, so nothing has to be removed when a block is freed.
+Reference counts [sb.refs_start..]: 16 bits per data block, the owners it has
+besides the first. Releasing a block with a count only drops the count.
+Clones and snapshots [snap.c] share blocks through the same counts.
+Nothing writes a block in place once a file is past it: a file that is
+rewritten gets fresh blocks and releases the old ones, an append into a shared
+partial last block copies it first [see write_blocks], so shared blocks never
+change under their other owners.
+*/
+
+static uint32_t per_bucket(const struct store_disk *d) {
+    return d->sb.block / sizeof(struct dedup_entry);
+}
+
+static off_t bucket_off(const struct store_disk *d, uint64_t hash) {
+    return (off_t)(d->sb.dedup_start + hash % d->sb.dedup_blocks) * d->sb.block;
+}
+
+static off_t refs_off(const struct store_disk *d, uint64_t pblk) {
+    return (off_t)d->sb.refs_start * d->sb.block + (off_t)(pblk - d->sb.data_start) * sizeof(uint16_t);
+}
+
+static int bucket_read(struct store_disk *d, uint64_t hash, struct dedup_entry **e) {
+    *e = malloc(d->sb.block);
+    if (!*e || disk_read_meta(d, bucket_off(d, hash), *e, d->sb.block) != 0) {
+        printf("Failed to read fingerprint index\n");
+        free(*e);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Blocks whose fingerprint is hash that are still owned and can take another
+reference, up to max of them in cand. The caller compares the bytes.
+Returns how many there are
+*/
+uint32_t dedup_lookup(struct store_disk *d, uint64_t hash, uint64_t *cand, uint32_t max) {
+    struct dedup_entry *e;
+    if (!d->sb.dedup_blocks || bucket_read(d, hash, &e) != 0)
+        return 0;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < per_bucket(d) && n < max; i++) {
+        uint16_t refs;
+        if (e[i].pblk && e[i].hash == hash && alloc_owned(d, e[i].pblk) &&
+            disk_read_meta(d, refs_off(d, e[i].pblk), &refs, sizeof(refs)) == 0 && refs < UINT16_MAX)
+            cand[n++] = e[i].pblk;
+    }
+    free(e);
+    return n;
+}
+
+// Adds pblk to the index under hash, returns 0 on success else 1
+int dedup_insert(struct store_disk *d, uint64_t hash, uint64_t pblk) {
+    struct dedup_entry *e;
+    if (bucket_read(d, hash, &e) != 0)
+        return 1;
+    uint32_t per = per_bucket(d), slot = per;
+    for (uint32_t i = 0; i < per && slot == per; i++)
+        if (!e[i].pblk || e[i].hash == hash || !alloc_owned(d, e[i].pblk))
+            slot = i;
+    if (slot == per)
+        slot = (uint32_t)(hash >> 32) % per;
+    free(e);
+    struct dedup_entry ent = { .hash = hash, .pblk = pblk };
+    return disk_write_meta(d, bucket_off(d, hash) + (off_t)slot * sizeof(ent), &ent, sizeof(ent));
+}
+
+// Extra owners of pblk
+uint32_t dedup_refs(struct store_disk *d, uint64_t pblk) {
+    uint16_t refs = 0;
+    if (disk_read_meta(d, refs_off(d, pblk), &refs, sizeof(refs)) != 0) {
+        // can't tell, taking it for shared keeps it from being written over
+        printf("Failed to read the reference count of block %" PRIu64 "\n", pblk);
+        return UINT16_MAX;
+    }
+    return refs;
+}
+
+/*
+Adds delta to the counts of count blocks at pblk, a table block at a time.
+The first pass only checks, so nothing changes unless every count stays in
+range. Returns 0 on success else 1
+*/
+static int refs_add(struct store_disk *d, uint64_t pblk, uint64_t count, int delta) {
+    uint32_t per = d->sb.block / sizeof(uint16_t);
+    uint16_t *refs = malloc(d->sb.block);
+    int ret = refs == NULL;
+    for (int apply = 0; apply < 2 && ret == 0; apply++) {
+        for (uint64_t p = pblk, left = count; ret == 0 && left > 0; ) {
+            uint64_t n = per - (p - d->sb.data_start) % per;
+            if (n > left)
+                n = left;
+            ret = disk_read_meta(d, refs_off(d, p), refs, n * sizeof(*refs));
+            for (uint64_t i = 0; i < n && ret == 0; i++) {
+                if (delta > 0 ? refs[i] == UINT16_MAX : refs[i] == 0) {
+                    printf("Block %" PRIu64 " has %s owners\n", p + i, delta > 0 ? "too many" : "no other");
+                    ret = 1;
+                }
+                refs[i] += delta;
+            }
+            if (ret == 0 && apply)
+                ret = disk_write_meta(d, refs_off(d, p), refs, n * sizeof(*refs));
+            p += n;
+            left -= n;
+        }
+    }
+    free(refs);
+    return ret;
+}
+
+// Notes a change for alloc_undo to take back, returns 0 on success else 1
+static int log_change(struct store_alloc *a, uint64_t pblk, uint64_t count, int delta) {
+    if (!a->logging)
+        return 0;
+    struct refs_change *last = a->n_shared ? &a->shared[a->n_shared - 1] : NULL;
+    if (last && last->delta == delta && last->pblk + last->count == pblk && last->count + count <= UINT32_MAX) {
+        last->count += count;
+        return 0;
+    }
+    if (a->n_shared + 1 > a->cap_shared) {
+        uint32_t cap = a->cap_shared ? a->cap_shared * 2 : 64;
+        struct refs_change *shared = realloc(a->shared, cap * sizeof(*shared));
+        if (!shared)
+            return 1;
+        a->shared = shared;
+        a->cap_shared = cap;
+    }
+    a->shared[a->n_shared++] = (struct refs_change){ .pblk = pblk, .count = count, .delta = delta };
+    return 0;
+}
+
+/*
+Gives count blocks at pblk one more owner each, undone by alloc_undo if the op
+fails. Returns 0 on success else 1
+*/
+int dedup_share(struct store_disk *d, uint64_t pblk, uint64_t count) {
+    if (count > UINT32_MAX || refs_add(d, pblk, count, 1) != 0)
+        return 1;
+    // a change alloc_undo doesn't know about can't be taken back
+    if (log_change(&d->alloc, pblk, count, 1) != 0) {
+        refs_add(d, pblk, count, -1);
+        return 1;
+    }
+    return 0;
+}
+
+// Takes back a change alloc_undo found in the log, returns 0 on success else 1
+int dedup_revert(struct store_disk *d, const struct refs_change *c) {
+    return refs_add(d, c->pblk, c->count, -c->delta);
+}
+
+/*
+alloc_release for file data: blocks with other owners lose one, the rest are
+freed. Reads the counts a table block at a time, a run nobody shares is freed
+in one go.
+*/
+void dedup_release(struct store_disk *d, uint64_t pblk, uint64_t count) {
+    uint32_t per = d->sb.block / sizeof(uint16_t);
+    uint16_t *refs = malloc(d->sb.block);
+    while (count > 0) {
+        uint64_t n = per - (pblk - d->sb.data_start) % per;
+        if (n > count)
+            n = count;
+        if (!refs || disk_read_meta(d, refs_off(d, pblk), refs, n * sizeof(*refs)) != 0) {
+            // unsure who else owns them, leaking beats freeing a shared block
+            printf("Failed to read reference counts, %" PRIu64 " blocks stay used\n", count);
+            break;
+        }
+        uint64_t run = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            if (!refs[i]) {
+                run++;
+                continue;
+            }
+            alloc_release(d, pblk + i - run, run);
+            run = 0;
+            refs[i]--;
+            if (disk_write_meta(d, refs_off(d, pblk + i), &refs[i], sizeof(refs[i])) != 0)
+                printf("Lost a reference to block %" PRIu64 ", it stays used\n", pblk + i);
+            else if (log_change(&d->alloc, pblk + i, 1, -1) != 0)
+                d->alloc.log_lost = true;
+        }
+        alloc_release(d, pblk + n - run, run);
+        pblk += n;
+        count -= n;
+    }
+    free(refs);
+}
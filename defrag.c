@@ -0,0 +1,283 @@
+#include "store.h"
+
+/*
+Online defrag
+Moves files whose blocks are spread over many short runs [an append heavy
+disk, or files written into the holes deletes left] into one run each, while
+the disk stays in use. One file at a time:
+  a run as long as all of its blocks is claimed [alloc_claim], it stays free
+  on disk until the file is switched over, so a crash leaves nothing behind
+  its blocks are copied over raw in DEFRAG_BATCH pieces, read run by run and
+  written out in one go. Encrypted blocks are tweaked by where they sit, they
+  are decrypted [MACs checked] and encrypted again for the new place.
+  Checksums and MACs are kept aside and go in the table at the switch
+  once everything is across the inode is loaded again, if it is still what was
+  copied its extents are pointed at the new run and the old blocks are freed
+  [retired while readers may still be on them, then punched, see alloc.c].
+  A file written while it was copied is left where it is
+Steps are spaced so the copy stays under rate bytes/s, the daemon serves
+requests in between. Files with shared blocks [clones, snapshots, dedup]
+are left alone, moving them would copy them apart and use more space, and so
+are inline, packed and directories. A step never commits, the caller does.
+*/
+
+// Sets df up to go through the inode table, returns 0 on success else 1
+int defrag_start(struct store_defrag *df, uint64_t rate) {
+    memset(df, 0, sizeof(*df));
+    df->buf = malloc(DEFRAG_BATCH);
+    if (!df->buf) {
+        printf("Unable to alloc mem for defrag\n");
+        return 1;
+    }
+    df->rate = rate;
+    df->next = 1;
+    df->t_start = now_ns();
+    df->active = true;
+    return 0;
+}
+
+// Runs of adjacent disk blocks f is in, *blocks gets how many blocks that is
+static uint64_t runs_of(const struct store_disk *d, const struct store_file *f, uint64_t *blocks) {
+    uint64_t runs = 0, end = 0;
+    *blocks = 0;
+    for (uint32_t i = 0; i < f->n_ext; i++) {
+        runs += f->ext[i].pblk != end;
+        end = f->ext[i].pblk + ext_blocks(d, &f->ext[i]);
+        *blocks += ext_blocks(d, &f->ext[i]);
+    }
+    return runs;
+}
+
+// Some block of f has other owners
+static bool shared(struct store_disk *d, const struct store_file *f) {
+    for (uint32_t i = 0; i < f->n_ext; i++)
+        for (uint64_t b = 0; b < ext_blocks(d, &f->ext[i]); b++)
+            if (dedup_refs(d, f->ext[i].pblk + b))
+                return true;
+    return false;
+}
+
+// Lets go of the file being moved and its run
+static void drop(struct store_defrag *df, struct store_disk *d) {
+    if (d->alloc.claim && d->alloc.claim_bit + d->sb.data_start == df->to)
+        alloc_unclaim(d, false);
+    file_put(&df->f);
+    memset(&df->f, 0, sizeof(df->f));
+    free(df->sums);
+    df->sums = NULL;
+}
+
+// The run is still ours [a daemon whose commit failed starts the allocator over]
+static bool claimed(const struct store_defrag *df, const struct store_disk *d) {
+    return d->alloc.claim == df->blocks && d->alloc.claim_bit + d->sb.data_start == df->to;
+}
+
+/*
+Takes inode slot id for moving if it is worth it and there is room for it.
+Returns 0 whether it was taken or not, 1 on errors
+*/
+static int pick(struct store_defrag *df, struct store_disk *d, uint32_t id) {
+    struct store_inode ino;
+    if (inode_read(d, id, &ino) != 0)
+        return 1;
+    if (ino.inode_id == 0 || ino.n_extents < 2 ||
+        (ino.flags & (FLAG_SNAPSHOT | FLAG_DIRECTORY | FLAG_INLINE | FLAG_PACKED)))
+        return 0;
+    // its blocks can't be read without the key
+    if ((ino.flags & FLAG_ENCRYPTED) && !crypt_key(ino.key))
+        return 0;
+    struct store_file f;
+    if (file_load(d, id, &f) != 0)
+        return 1;
+    uint64_t blocks, runs = runs_of(d, &f, &blocks);
+    if (runs < 2 || blocks * d->sb.block / runs >= DEFRAG_RUN || shared(d, &f)) {
+        file_put(&f);
+        return 0;
+    }
+    if ((f.ino.data_cksum && d->sb.csum_blocks && !(df->sums = malloc(blocks * sizeof(*df->sums)))) ||
+        alloc_claim(d, blocks, &df->to) != 0) {
+        free(df->sums);
+        df->sums = NULL;
+        file_put(&f);
+        df->skipped++;
+        return 0;
+    }
+    df->f = f;
+    df->blocks = blocks;
+    df->done = 0;
+    df->ext = 0;
+    df->in = 0;
+    return 0;
+}
+
+/*
+Copies the next blocks of the file, up to what is left of the batch after
+*moved bytes. A block whose checksum doesn't match gives the file up.
+Returns 0 on success else 1
+*/
+static int copy(struct store_defrag *df, struct store_disk *d, uint64_t *moved) {
+    uint32_t block = d->sb.block;
+    uint64_t room = (DEFRAG_BATCH - *moved) / block;
+    if (room == 0)
+        room = 1;
+    const struct crypt_key *key = df->f.ino.flags & FLAG_ENCRYPTED ? crypt_key(df->f.ino.key) : NULL;
+    struct cksum_cursor c = {0};
+    uint64_t n = 0;
+    bool bad = false;
+    while (n < room && df->ext < df->f.n_ext && !bad) {
+        const struct store_extent *e = &df->f.ext[df->ext];
+        uint64_t left = ext_blocks(d, e) - df->in, k = left < room - n ? left : room - n;
+        uint64_t from = e->pblk + df->in, at = df->done + n;
+        char *p = df->buf + n * block;
+        uint32_t *sums = df->sums ? df->sums + at : NULL;
+        if (pread(d->fd, p, k * block, (off_t)(from * block)) != (ssize_t)(k * block)) {
+            perror("read blocks to move");
+            cksum_cursor_free(&c);
+            return 1;
+        }
+        if (key) {
+            crypt_blocks(key, from, p, k, block, false, sums);
+            bad = sums && cksum_check(d, &c, from, sums, k) != 0;
+            crypt_blocks(key, df->to + at, p, k, block, true, sums);
+        } else {
+            for (uint64_t i = 0; sums && i < k && !bad; i++)
+                bad = cksum_get(d, &c, from + i, &sums[i]) != 0;
+        }
+        n += k;
+        df->in += k;
+        if (df->in == ext_blocks(d, e)) {
+            df->ext++;
+            df->in = 0;
+        }
+    }
+    cksum_cursor_free(&c);
+    if (bad) {
+        printf("%s stays where it is\n", df->f.ino.name);
+        df->skipped++;
+        drop(df, d);
+        return 0;
+    }
+    off_t off = (off_t)((df->to + df->done) * block);
+    cache_drop(d, off, n * block);
+    for (size_t done = 0; done < n * block; ) {
+        ssize_t w = pwrite(d->fd, df->buf + done, n * block - done, off + done);
+        if (w <= 0) {
+            perror("write moved blocks");
+            return 1;
+        }
+        done += w;
+    }
+    df->done += n;
+    *moved += n * block;
+    return 0;
+}
+
+/*
+Points the file at the run once all of it is across, unless it changed since
+it was picked. Returns 0 on success else 1
+*/
+static int place(struct store_defrag *df, struct store_disk *d) {
+    struct store_file now;
+    if (file_load(d, df->f.ino.inode_id, &now) != 0) {
+        df->changed++;
+        drop(df, d);
+        return 0;
+    }
+    bool same = memcmp(&now.ino, &df->f.ino, sizeof(now.ino)) == 0 && now.n_ext == df->f.n_ext &&
+                memcmp(now.ext, df->f.ext, now.n_ext * sizeof(*now.ext)) == 0 && !shared(d, &now);
+    if (!same) {
+        df->changed++;
+        file_put(&now);
+        drop(df, d);
+        return 0;
+    }
+    uint64_t blocks, runs = runs_of(d, &df->f, &blocks);
+    now.n_ext = 0;
+    now.ino.block_count = 0;
+    int ret = 0;
+    uint64_t at = 0;
+    for (uint32_t i = 0; i < df->f.n_ext && ret == 0; i++) {
+        const struct store_extent *e = &df->f.ext[i];
+        ret = file_add_extent(&now, df->to + at, e->count, e->csize);
+        at += ext_blocks(d, e);
+    }
+    struct cksum_cursor c = {0};
+    if (ret == 0 && df->sums)
+        ret = cksum_put(d, &c, df->to, df->sums, blocks) != 0 || cksum_cursor_flush(d, &c) != 0;
+    cksum_cursor_free(&c);
+    // the extent chain is allocated fresh, handed back if the inode can't be written
+    alloc_mark(d);
+    if (ret == 0)
+        ret = file_store(d, &now);
+    if (ret != 0) {
+        if (alloc_undo(d) != 0)
+            printf("Lost track of blocks taken for %s, they stay used\n", now.ino.name);
+        printf("Unable to move %s\n", now.ino.name);
+        file_put(&now);
+        drop(df, d);
+        return 1;
+    }
+    alloc_keep(d);
+    alloc_unclaim(d, true);
+    for (uint32_t i = 0; i < df->f.n_ext; i++)
+        dedup_release(d, df->f.ext[i].pblk, ext_blocks(d, &df->f.ext[i]));
+    df->files++;
+    df->runs += runs;
+    file_put(&now);
+    drop(df, d);
+    return 0;
+}
+
+/*
+Looks at the next inode slots and copies up to DEFRAG_BATCH bytes, switching
+files over as they get across, does nothing until df->next_at when throttled.
+Returns 1 while there is more to look at, 0 once the table is done, -1 on errors
+*/
+int defrag_step(struct store_defrag *df, struct store_disk *d) {
+    uint64_t t_start = now_ns();
+    if (t_start < df->next_at)
+        return 1;
+    if (!d->alloc.map && alloc_load(d) != 0)
+        return -1;
+    uint64_t moved = 0;
+    bool more = true;
+    for (uint32_t looked = 0; moved < DEFRAG_BATCH && looked < REWRITE_SCAN && !journal_full(d); ) {
+        if (!df->f.ino.inode_id) {
+            if (df->next > d->sb.inode_count) {
+                more = false;
+                break;
+            }
+            looked++;
+            if (pick(df, d, df->next++) != 0)
+                return -1;
+        } else if (!claimed(df, d)) {
+            drop(df, d);
+        } else if (df->done < df->blocks) {
+            if (copy(df, d, &moved) != 0)
+                return -1;
+        } else if (place(df, d) != 0) {
+            return -1;
+        }
+    }
+    df->bytes += moved;
+    if (df->rate)
+        df->next_at = t_start + moved * 1000000000ull / df->rate;
+    stats_op(SO_DEFRAG, now_ns() - t_start, moved, 0);
+    return more || df->f.ino.inode_id;
+}
+
+// Ends the defrag, a file half copied stays where it was
+void defrag_stop(struct store_defrag *df, struct store_disk *d) {
+    if (!df->active)
+        return;
+    drop(df, d);
+    double secs = (now_ns() - df->t_start) / 1e9;
+    printf("Defragmented %" PRIu64 " files from %" PRIu64 " runs into one each, %" PRIu64 " bytes moved in %.2f s"
+           " (%.1f MB/s)", df->files, df->runs, df->bytes, secs, secs > 0 ? df->bytes / secs / (1 << 20) : 0.0);
+    if (df->skipped || df->changed)
+        printf(", %" PRIu64 " left for lack of room or bad blocks, %" PRIu64 " changed while moving", df->skipped,
+               df->changed);
+    printf("\n");
+    free(df->buf);
+    memset(df, 0, sizeof(*df));
+}
@@ -0,0 +1,558 @@
+#include "store.h"
+
+/*
+Directories
+A name with '/' in it is a path. Every directory on the way is a FLAG_DIRECTORY
+inode named by its own path ["/" is the root, made at init], made the first
+time a name needs it and kept after its last entry goes, until it is deleted
+empty [dir_remove]. Names stay whole in
+the name index, so opening a file is still one lookup, directories are what
+lets `store ls` read the entries of one directory instead of the inode table.
+
+A directory's data is a B+tree of blocks keyed by the name_hash of the last
+part of each entry's path. Block 0 is the root, leaves hold entries sorted by
+hash, index blocks the lowest hash under each child. A full block is split in
+two at a hash boundary [entries of one hash stay in one leaf], the root moves
+down into two new blocks when it splits, nothing is merged back. The blocks are
+metadata, written through the journal with a crc32c each. A directory grows by
+windows of blocks that double with it [up to DIR_GROW_MAX], so its extents stay
+few and a split never has to allocate.
+
+Parent directories resolve through the dentry cache [path -> the directory with
+its extents loaded, DCACHE_SLOTS per handle], a run that writes many files into
+one directory looks it up and loads it once.
+Directories are only made by the writer, so the cache needs dropping only when a
+txn is thrown away [disk_commit] or a reader's view moves on [reader_enter].
+*/
+
+#define DIR_GROW_MAX 256        // blocks a directory grows by at most at a time
+#define DIR_BATCH 64            // blocks dir_list reads at a time
+
+static uint32_t leaf_max(const struct store_disk *d) {
+    return (d->sb.block - sizeof(struct store_dir_block)) / sizeof(struct store_dirent);
+}
+
+static uint32_t node_max(const struct store_disk *d) {
+    return (d->sb.block - sizeof(struct store_dir_block)) / sizeof(struct store_dir_node);
+}
+
+static uint32_t dir_cksum(const struct store_disk *d, struct store_dir_block *b) {
+    uint32_t saved = b->cksum;
+    b->cksum = 0;
+    uint32_t c = crc32c(0, b, d->sb.block);
+    b->cksum = saved;
+    return c;
+}
+
+// Entries of b, leaves and index blocks alike start every entry with its hash
+static char *items(struct store_dir_block *b) {
+    return (char *)(b + 1);
+}
+
+static uint64_t key_at(struct store_dir_block *b, size_t esz, uint32_t i) {
+    uint64_t k;
+    memcpy(&k, items(b) + i * esz, sizeof(k));
+    return k;
+}
+
+static int read_blk(struct store_disk *d, const struct store_file *f, uint64_t lblk, struct store_dir_block *b) {
+    uint64_t pblk = file_map(f, lblk, NULL);
+    if (!pblk || disk_read_meta(d, (off_t)pblk * d->sb.block, b, d->sb.block) != 0)
+        return 1;
+    if (b->magic != DIR_MAGIC || b->cksum != dir_cksum(d, b) || b->level >= DIR_LEVELS ||
+        b->n > (b->level ? node_max(d) : leaf_max(d))) {
+        printf("Directory %s has a bad block %" PRIu64 "\n", f->ino.name, lblk);
+        return 1;
+    }
+    return 0;
+}
+
+static int write_blk(struct store_disk *d, const struct store_file *f, uint64_t lblk, struct store_dir_block *b) {
+    uint64_t pblk = file_map(f, lblk, NULL);
+    if (!pblk)
+        return 1;
+    b->magic = DIR_MAGIC;
+    b->cksum = dir_cksum(d, b);
+    return disk_write_meta(d, (off_t)pblk * d->sb.block, b, d->sb.block);
+}
+
+// Last part of the path
+static const char *leaf_of(const char *name) {
+    const char *s = strrchr(name, '/');
+    return s ? s + 1 : name;
+}
+
+// Directory name is in ["/" for top level names], out holds INODE_NAME
+static void parent_of(const char *name, char *out) {
+    const char *s = strrchr(name, '/');
+    if (!s) {
+        strcpy(out, "/");
+        return;
+    }
+    memcpy(out, name, s - name);
+    out[s - name] = '\0';
+}
+
+// A path has no empty parts: no leading, trailing or doubled '/'
+static bool path_ok(const char *name) {
+    if (name[0] == '\0' || name[0] == '/')
+        return false;
+    size_t n = strlen(name);
+    return name[n - 1] != '/' && !strstr(name, "//");
+}
+
+// Names whose last part starts with '.' are hidden, ls leaves them out by default
+bool dir_hidden(const char *name) {
+    return leaf_of(name)[0] == '.';
+}
+
+void dcache_drop(struct store_disk *d) {
+    if (!d->dcache)
+        return;
+    for (uint32_t i = 0; i < DCACHE_SLOTS; i++)
+        file_put(&d->dcache[i].f);
+    free(d->dcache);
+    d->dcache = NULL;
+}
+
+/*
+Points *f at the directory at path, loaded in the dentry cache. It stays valid
+until the next resolve, changes to it go through it so the cached copy keeps up.
+Returns 0 if it is there, 1 if nothing is, 2 if path is a file, -1 on errors
+*/
+static int resolve(struct store_disk *d, const char *path, struct store_file **f) {
+    if (!d->dcache && !(d->dcache = calloc(DCACHE_SLOTS, sizeof(*d->dcache)))) {
+        printf("Unable to alloc mem for the dentry cache\n");
+        return -1;
+    }
+    uint64_t h = name_hash(path);
+    struct dcache_slot *s = &d->dcache[h % DCACHE_SLOTS];
+    *f = &s->f;
+    if (s->f.ino.inode_id && s->hash == h && strncmp(s->f.ino.name, path, INODE_NAME) == 0)
+        return 0;
+    file_put(&s->f);
+    s->f.ino.inode_id = 0;
+    struct store_inode ino;
+    int found = index_lookup(d, path, &ino);
+    if (found != 0)
+        return found;
+    if (!(ino.flags & FLAG_DIRECTORY))
+        return 2;
+    if (file_load(d, ino.inode_id, &s->f) != 0) {
+        s->f.ino.inode_id = 0;
+        return -1;
+    }
+    s->hash = h;
+    return 0;
+}
+
+/*
+Makes sure f has need unused blocks past the ones its tree takes, growing it
+by a window when it doesn't. Returns 0 on success else 1
+*/
+static int reserve(struct store_disk *d, struct store_file *f, uint64_t need) {
+    uint64_t used = f->ino.size / d->sb.block;
+    if (f->ino.block_count - used >= need)
+        return 0;
+    if (!d->alloc.map && alloc_load(d) != 0)
+        return 1;
+    uint64_t grow = used / 4 < 4 ? 4 : used / 4;
+    if (grow > DIR_GROW_MAX)
+        grow = DIR_GROW_MAX;
+    if (grow < need)
+        grow = need;
+    // blocks a directory takes stay with it whatever happens to the op it grew for [alloc_undo]
+    bool logging = d->alloc.logging;
+    d->alloc.logging = false;
+    uint64_t got = file_reserve(d, f, grow);
+    int ret = got < grow ? file_grow(d, f, grow - got) : 0;
+    // whatever was added is the directory's now, even when not all of it could be
+    ret = file_store(d, f) != 0 || ret != 0;
+    d->alloc.logging = logging;
+    return ret;
+}
+
+// Next unused block of f, reserve made sure there is one
+static uint64_t take_blk(struct store_disk *d, struct store_file *f) {
+    uint64_t lblk = f->ino.size / d->sb.block;
+    f->ino.size += d->sb.block;
+    return lblk;
+}
+
+// Puts item [esz bytes] in b at its place by hash, after the ones with the same hash
+static void put_item(struct store_dir_block *b, size_t esz, const void *item) {
+    uint64_t k;
+    memcpy(&k, item, sizeof(k));
+    uint32_t i = b->n;
+    while (i > 0 && key_at(b, esz, i - 1) > k)
+        i--;
+    memmove(items(b) + (i + 1) * esz, items(b) + i * esz, (b->n - i) * esz);
+    memcpy(items(b) + i * esz, item, esz);
+    b->n++;
+}
+
+/*
+Moves the upper half of the full block b into nb, between two hashes, and puts
+item where it belongs. Returns 0 and the lowest hash of nb in *sep, 1 when every
+entry has one hash and there is nowhere to split
+*/
+static int split(struct store_dir_block *b, struct store_dir_block *nb, uint64_t block, size_t esz,
+                 const void *item, uint64_t *sep) {
+    uint32_t mid = b->n / 2;
+    while (mid < b->n && key_at(b, esz, mid) == key_at(b, esz, mid - 1))
+        mid++;
+    if (mid == b->n) {
+        mid = b->n / 2;
+        while (mid > 0 && key_at(b, esz, mid) == key_at(b, esz, mid - 1))
+            mid--;
+    }
+    if (mid == 0)
+        return 1;
+    uint64_t k;
+    memcpy(&k, item, sizeof(k));
+    memset(nb, 0, block);
+    nb->level = b->level;
+    nb->n = b->n - mid;
+    memcpy(items(nb), items(b) + mid * esz, nb->n * esz);
+    memset(items(b) + mid * esz, 0, nb->n * esz);
+    b->n = mid;
+    *sep = key_at(nb, esz, 0);
+    put_item(k >= *sep ? nb : b, esz, item);
+    return 0;
+}
+
+/*
+Adds e to the tree of directory f
+Returns 0 on success else 1
+*/
+static int tree_insert(struct store_disk *d, struct store_file *f, const struct store_dirent *e) {
+    uint64_t block = d->sb.block;
+    char *buf = malloc((DIR_LEVELS + 2) * block);
+    if (!buf)
+        return 1;
+    struct store_dir_block *path[DIR_LEVELS];
+    uint64_t lblk[DIR_LEVELS];
+    for (int i = 0; i < DIR_LEVELS; i++)
+        path[i] = (struct store_dir_block *)(buf + i * block);
+    struct store_dir_block *nb = (struct store_dir_block *)(buf + DIR_LEVELS * block);
+    struct store_dir_block *nb2 = (struct store_dir_block *)(buf + (DIR_LEVELS + 1) * block);
+    uint64_t size = f->ino.size;
+    int ret = 1;
+
+    // an empty directory gets its root, a leaf
+    if (size == 0) {
+        if (reserve(d, f, 1) != 0)
+            goto out;
+        memset(path[0], 0, block);
+        if (write_blk(d, f, take_blk(d, f), path[0]) != 0)
+            goto out;
+    }
+    struct store_dir_block *root = path[0];
+    if (read_blk(d, f, 0, root) != 0)
+        goto out;
+    int h = root->level;
+    // a split at every level and two blocks for the root, taken before anything changes
+    if (h + 1 >= DIR_LEVELS || reserve(d, f, h + 2) != 0)
+        goto out;
+    // path[h - l] is the block at level l on the way down
+    lblk[0] = 0;
+    for (int l = h, i = 0; l > 0; l--, i++) {
+        struct store_dir_node *nodes = (struct store_dir_node *)items(path[i]);
+        uint32_t c = 0;
+        for (uint32_t j = 1; j < path[i]->n; j++)
+            if (nodes[j].hash <= e->hash)
+                c = j;
+        lblk[i + 1] = nodes[c].lblk;
+        if (read_blk(d, f, lblk[i + 1], path[i + 1]) != 0 || path[i + 1]->level != l - 1)
+            goto out;
+    }
+
+    // from the leaf up, each full block splits and hands its new sibling to the one above
+    const void *item = e;
+    size_t esz = sizeof(*e);
+    struct store_dir_node up;
+    for (int i = h; ; i--) {
+        struct store_dir_block *b = path[i];
+        uint32_t max = b->level ? node_max(d) : leaf_max(d);
+        if (b->n < max) {
+            put_item(b, esz, item);
+            ret = write_blk(d, f, lblk[i], b);
+            break;
+        }
+        uint64_t sep;
+        if (split(b, nb, block, esz, item, &sep) != 0) {
+            printf("Directory %s has too many names with one hash\n", f->ino.name);
+            goto out;
+        }
+        if (i == 0) {
+            // the root stays at block 0, both halves go down into new blocks
+            uint64_t left = take_blk(d, f), right = take_blk(d, f);
+            memcpy(nb2, b, block);
+            memset(b, 0, block);
+            b->level = nb2->level + 1;
+            b->n = 2;
+            struct store_dir_node *nodes = (struct store_dir_node *)items(b);
+            nodes[0] = (struct store_dir_node){ 0, left };
+            nodes[1] = (struct store_dir_node){ sep, right };
+            ret = write_blk(d, f, left, nb2) != 0 || write_blk(d, f, right, nb) != 0 ||
+                  write_blk(d, f, 0, b) != 0;
+            break;
+        }
+        uint64_t right = take_blk(d, f);
+        if (write_blk(d, f, right, nb) != 0 || write_blk(d, f, lblk[i], b) != 0)
+            goto out;
+        up = (struct store_dir_node){ sep, right };
+        item = &up;
+        // the parent takes it right after the child it came from, its hash puts it there
+        esz = sizeof(up);
+    }
+out:
+    // blocks taken stay taken even when the insert failed half way, a parent may point at them
+    if (f->ino.size != size && inode_write(d, &f->ino) != 0)
+        ret = 1;
+    free(buf);
+    return ret;
+}
+
+// Drops the entry for inode id with hash from the tree of f, returns 0 on success else 1
+static int tree_remove(struct store_disk *d, struct store_file *f, uint64_t hash, uint32_t id) {
+    if (f->ino.size == 0)
+        return 1;
+    struct store_dir_block *b = malloc(d->sb.block);
+    if (!b)
+        return 1;
+    uint64_t lblk = 0;
+    int ret = read_blk(d, f, 0, b);
+    while (ret == 0 && b->level > 0) {
+        struct store_dir_node *nodes = (struct store_dir_node *)items(b);
+        uint32_t c = 0;
+        for (uint32_t j = 1; j < b->n; j++)
+            if (nodes[j].hash <= hash)
+                c = j;
+        lblk = nodes[c].lblk;
+        ret = read_blk(d, f, lblk, b);
+    }
+    if (ret == 0) {
+        struct store_dirent *e = (struct store_dirent *)items(b);
+        uint32_t i = 0;
+        while (i < b->n && !(e[i].hash == hash && e[i].inode_id == id))
+            i++;
+        if (i == b->n) {
+            ret = 1;
+        } else {
+            memmove(&e[i], &e[i + 1], (b->n - i - 1) * sizeof(*e));
+            b->n--;
+            memset(&e[b->n], 0, sizeof(*e));
+            ret = write_blk(d, f, lblk, b);
+        }
+    }
+    free(b);
+    return ret;
+}
+
+// Adds the entry leaf -> id to directory f
+static int add_entry(struct store_disk *d, struct store_file *f, const char *leaf, uint32_t id, uint32_t flags) {
+    struct store_dirent e = { .hash = name_hash(leaf), .inode_id = id,
+                              .flags = flags & (FLAG_DIRECTORY | FLAG_HIDDEN) };
+    strncpy(e.name, leaf, INODE_NAME - 1);
+    return tree_insert(d, f, &e);
+}
+
+/*
+inode_alloc for a directory made while inode pending is taken but not written
+yet [a slot only counts as used once written], which would be handed out again
+*/
+static uint32_t alloc_past(struct store_disk *d, uint32_t pending) {
+    uint32_t id = inode_alloc(d);
+    if (id && id == pending) {
+        d->sb.ino_next = pending + 1;
+        id = inode_alloc(d);
+        // pending is free until its owner writes it, the next search starts there again
+        d->sb.ino_next = pending;
+    }
+    return id;
+}
+
+/*
+resolve for the directory at path, making it [and its parents] when it isn't
+there. pending is the inode the name being linked will have.
+Returns 0 on success else 1
+*/
+static int make(struct store_disk *d, const char *path, struct store_file **f, uint32_t pending) {
+    int found = resolve(d, path, f);
+    if (found == 0)
+        return 0;
+    if (found == 2)
+        printf("%s is a file, not a directory\n", path);
+    if (found != 1)
+        return 1;
+    char parent[INODE_NAME];
+    struct store_file *pf;
+    parent_of(path, parent);
+    if (make(d, parent, &pf, pending) != 0)
+        return 1;
+    struct store_inode ino = {0};
+    ino.inode_id = alloc_past(d, pending);
+    if (ino.inode_id == 0) {
+        printf("No free inodes left on disk\n");
+        return 1;
+    }
+    ino.flags = FLAG_DIRECTORY | (dir_hidden(path) ? FLAG_HIDDEN : 0);
+    ino.data_cksum = CK_NONE;
+    strcpy(ino.name, path);
+    if (index_insert(d, path, ino.inode_id) != 0 || inode_write(d, &ino) != 0 ||
+        add_entry(d, pf, leaf_of(path), ino.inode_id, ino.flags) != 0)
+        return 1;
+    // done with pf, the new directory may take its slot
+    return resolve(d, path, f) != 0;
+}
+
+// Makes the root directory of a freshly formatted disk, returns 0 on success else 1
+int dir_init(struct store_disk *d) {
+    struct store_file f = {0};
+    f.ino.inode_id = inode_alloc(d);
+    if (f.ino.inode_id == 0)
+        return 1;
+    f.ino.flags = FLAG_DIRECTORY;
+    f.ino.data_cksum = CK_NONE;
+    strcpy(f.ino.name, "/");
+    if (index_insert(d, "/", f.ino.inode_id) != 0 || inode_write(d, &f.ino) != 0)
+        return 1;
+    d->sb.root_dir = f.ino.inode_id;
+    return 0;
+}
+
+/*
+index_insert for a file's name, plus its entry in the directory it is in,
+made first when it isn't there. flags are the inode's, for the entry.
+Returns 0 on success else 1, nothing of the name is left behind on failure
+*/
+int dir_link(struct store_disk *d, const char *name, uint32_t id, uint32_t flags) {
+    if (!path_ok(name)) {
+        printf("%s is not a path [empty part, or a leading or trailing /]\n", name);
+        return 1;
+    }
+    char parent[INODE_NAME];
+    struct store_file *dir;
+    parent_of(name, parent);
+    if (make(d, parent, &dir, id) != 0)
+        return 1;
+    int ret = index_insert(d, name, id);
+    if (ret == 0 && add_entry(d, dir, leaf_of(name), id, flags) != 0) {
+        index_remove(d, name, id);
+        ret = 1;
+    }
+    return ret;
+}
+
+// index_remove plus the entry in the file's directory, returns 0 on success else 1
+int dir_unlink(struct store_disk *d, const char *name, uint32_t id) {
+    if (index_remove(d, name, id) != 0)
+        return 1;
+    if (!path_ok(name))
+        return 0;
+    char parent[INODE_NAME];
+    struct store_file *dir;
+    parent_of(name, parent);
+    if (resolve(d, parent, &dir) != 0 || tree_remove(d, dir, name_hash(leaf_of(name)), id) != 0)
+        printf("%s is missing from directory %s\n", name, parent);
+    return 0;
+}
+
+static int any_entry(const struct store_dirent *e, void *arg) {
+    (void)e;
+    (void)arg;
+    return ST_INVAL;
+}
+
+/*
+Removes the directory ino, which must be empty, its slot and blocks go like a
+file's. Returns ST_OK, ST_INVAL for the root or one with entries, else ST_ERR
+*/
+int dir_remove(struct store_disk *d, const struct store_inode *ino) {
+    if (ino->inode_id == d->sb.root_dir) {
+        printf("The root directory can't be deleted\n");
+        return ST_INVAL;
+    }
+    struct store_file f;
+    if (file_load(d, ino->inode_id, &f) != 0)
+        return ST_ERR;
+    int st = dir_list(d, &f, any_entry, NULL);
+    if (st == ST_INVAL)
+        printf("%s is not empty\n", ino->name);
+    // its cache slot would outlive it
+    dcache_drop(d);
+    if (st == ST_OK && (dir_unlink(d, ino->name, ino->inode_id) != 0 || inode_free(d, ino->inode_id) != 0))
+        st = ST_ERR;
+    if (st == ST_OK)
+        file_release(d, &f);
+    file_put(&f);
+    return st;
+}
+
+/*
+Loads the directory at path ["" or "/" for the root] into f
+Returns ST_OK, ST_NOENT, ST_INVAL when path is a file
+*/
+int dir_open(struct store_disk *d, const char *path, struct store_file *f) {
+    char p[INODE_NAME];
+    size_t n = strlen(path);
+    if (n >= INODE_NAME)
+        return ST_NOENT;
+    // "a/" is a
+    while (n > 1 && path[n - 1] == '/')
+        n--;
+    memcpy(p, path, n);
+    p[n] = '\0';
+    struct store_file *c;
+    int found = resolve(d, n ? p : "/", &c);
+    if (found == 0)
+        return file_load(d, c->ino.inode_id, f) == 0 ? ST_OK : ST_ERR;
+    return found == 1 ? ST_NOENT : found == 2 ? ST_INVAL : ST_ERR;
+}
+
+/*
+Calls fn for every entry of directory dir, in no particular order, stops early
+when fn returns nonzero and hands that back. Blocks are read DIR_BATCH at a
+time in disk order, the index blocks among them are skipped, so a listing reads
+the directory once whatever its depth.
+*/
+int dir_list(struct store_disk *d, const struct store_file *dir,
+             int (*fn)(const struct store_dirent *e, void *arg), void *arg) {
+    uint64_t block = d->sb.block, used = dir->ino.size / block;
+    char *buf = malloc(DIR_BATCH * block);
+    if (!buf)
+        return ST_ERR;
+    uint64_t t_start = now_ns(), bytes = 0;
+    int ret = ST_OK;
+    for (uint64_t lblk = 0; lblk < used && ret == ST_OK; ) {
+        uint64_t run;
+        uint64_t pblk = file_map(dir, lblk, &run);
+        if (run > used - lblk)
+            run = used - lblk;
+        if (run > DIR_BATCH)
+            run = DIR_BATCH;
+        if (!pblk || disk_read_meta(d, (off_t)pblk * block, buf, run * block) != 0) {
+            printf("Failed to read directory %s\n", dir->ino.name);
+            ret = ST_ERR;
+            break;
+        }
+        bytes += run * block;
+        for (uint64_t i = 0; i < run && ret == ST_OK; i++) {
+            struct store_dir_block *b = (struct store_dir_block *)(buf + i * block);
+            if (b->magic != DIR_MAGIC || b->cksum != dir_cksum(d, b) ||
+                b->n > (b->level ? node_max(d) : leaf_max(d))) {
+                printf("Directory %s has a bad block %" PRIu64 "\n", dir->ino.name, lblk + i);
+                ret = ST_ERR;
+                break;
+            }
+            const struct store_dirent *e = (const struct store_dirent *)items(b);
+            for (uint32_t j = 0; b->level == 0 && j < b->n && ret == ST_OK; j++)
+                ret = fn(&e[j], arg);
+        }
+        lblk += run;
+    }
+    free(buf);
+    stats_op(SO_LIST, now_ns() - t_start, bytes, 0);
+    return ret;
+}
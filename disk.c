@@ -0,0 +1,690 @@
+#include "store.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+
+/*
+Disk handle, inode and extent helpers shared by the commands
+All metadata goes through disk_write_meta so it has a single choke point.
+*/
+
+// monotonic clock in ns, used for timing commands
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+disk_open, probe only tries the writer lock once and leaves the message about
+another writer to the caller. A command that reads has the lock for a moment
+too [disk_hold], a writer waits up to LOCK_WAIT_MS for it.
+*/
+static int open_disk(struct store_disk *d, const char *path, int flags, bool probe) {
+    memset(d, 0, sizeof(*d));
+    d->fd = open(path, flags);
+    if (d->fd < 0) {
+        printf("Unable to open disk file -> %s\n", path);
+        return 1;
+    }
+    bool writer = (flags & O_ACCMODE) != O_RDONLY;
+    int locked = writer ? flock(d->fd, LOCK_EX | LOCK_NB) : 0;
+    for (int ms = 0; locked != 0 && !probe && ms < LOCK_WAIT_MS; ms++) {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+        locked = flock(d->fd, LOCK_EX | LOCK_NB);
+    }
+    if (locked != 0) {
+        if (!probe)
+            printf("Disk %s is in use by another writer\n", path);
+        close(d->fd);
+        return 3;
+    }
+    if (pread(d->fd, &d->sb, sizeof(d->sb), 0) != sizeof(d->sb)) {
+        printf("Failed to read sb of disk\n");
+        close(d->fd);
+        return 1;
+    }
+    if (d->sb.magic != STORE_MAGIC) {
+        printf("Invalid store magic (bad disk)\n");
+        close(d->fd);
+        return 2;
+    }
+    // not even the journal can be replayed on a layout this build doesn't know
+    if (d->sb.version != STORE_VERSION) {
+        printf("Disk %s has layout version %" PRIu16 ", this build reads version %d: reinit the disk "
+               "[store init] and write its files again\n", path, d->sb.version, STORE_VERSION);
+        close(d->fd);
+        return 2;
+    }
+    reader_attach(d, path, writer);
+    // writers finish whatever a crash left in the journal before touching anything,
+    // that may rewrite the superblock too
+    int ret = 0;
+    if (writer && (journal_recover(d) != 0 || pread(d->fd, &d->sb, sizeof(d->sb), 0) != sizeof(d->sb))) {
+        ret = 1;
+    } else if (d->sb.sb_cksum != sb_cksum(&d->sb)) {
+        printf("Superblock checksum mismatch (bad disk)\n");
+        ret = 2;
+    }
+    if (ret != 0) {
+        reader_detach(d);
+        journal_free_mem(d);
+        close(d->fd);
+    } else {
+        stats_opened();
+    }
+    return ret;
+}
+
+/*
+Opens the disk file and reads its superblock, returns 0 if it looks like a store disk.
+Writers hold an exclusive lock on the disk file until disk_close, a second one
+[or any writer while the daemon runs] gets 3 back instead of racing the first.
+Readers take no lock, they go alongside the writer through the readers table [readers.c].
+*/
+int disk_open(struct store_disk *d, const char *path, int flags) {
+    return open_disk(d, path, flags, false);
+}
+
+// Closes the disk, anything not committed is dropped
+void disk_close(struct store_disk *d) {
+    reader_detach(d);
+    cache_free(d);
+    dcache_drop(d);
+    free(d->imap.free);
+    free(d->imap.group_free);
+    memset(&d->imap, 0, sizeof(d->imap));
+    if (d->io) {
+        io_queue_free(d->io);
+        free(d->io);
+        d->io = NULL;
+    }
+    journal_free_mem(d);
+    alloc_free_mem(&d->alloc);
+    if (d->map)
+        munmap(d->map, d->sb.disk_size);
+    d->map = NULL;
+    if (d->fd >= 0)
+        close(d->fd);
+    d->fd = -1;
+}
+
+/*
+A run checks the disk [verify_disk] and then works on it, both on one handle:
+disk_hold opens it for writing, which validates the superblock and replays the
+journal, and disk_take hands that same handle to whoever opens the disk next
+instead of opening it again. While another writer has the disk the handle is
+only good for reading, the writer took care of the journal.
+Other disks get handles of their own.
+*/
+static struct store_disk held;
+static char held_path[PATH_MAX];     // "" when nothing is held
+static bool held_ro;                 // held without the writer lock
+
+// Opens path for disk_take to hand on, returns what disk_open does
+int disk_hold(const char *path) {
+    if (held_path[0] && strcmp(held_path, path) == 0)
+        return 0;
+    disk_release();
+    if (strlen(path) >= sizeof(held_path)) {
+        printf("Disk name %s is too long\n", path);
+        return 1;
+    }
+    int ret = open_disk(&held, path, O_RDWR, true);
+    held_ro = ret == 3;
+    if (held_ro)
+        ret = disk_open(&held, path, O_RDONLY);
+    if (ret == 0)
+        strcpy(held_path, path);
+    return ret;
+}
+
+// The held handle if it is path's, else NULL
+struct store_disk *disk_held(const char *path) {
+    return held_path[0] && strcmp(held_path, path) == 0 ? &held : NULL;
+}
+
+/*
+disk_open that takes over the held handle when it is path's. A reader gets it
+without the writer lock, so writers aren't kept out while it reads.
+A writer asking for a handle held read-only gets disk_open's answer.
+*/
+int disk_take(struct store_disk *d, const char *path, int flags) {
+    bool reader = (flags & O_ACCMODE) == O_RDONLY;
+    if (disk_held(path) && held_ro && !reader)
+        disk_release();
+    if (!disk_held(path))
+        return disk_open(d, path, flags);
+    *d = held;
+    held_path[0] = '\0';
+    if (reader && !held_ro)
+        flock(d->fd, LOCK_UN);
+    return 0;
+}
+
+// Closes the held handle, if there is one
+void disk_release() {
+    if (held_path[0])
+        disk_close(&held);
+    held_path[0] = '\0';
+}
+
+// I/O queue of this disk handle, opened on first use, NULL if neither backend works
+struct io_queue *disk_io(struct store_disk *d) {
+    if (d->io)
+        return d->io;
+    struct io_queue *q = malloc(sizeof(*q));
+    if (!q || io_queue_init(q, IO_DEPTH, IO_AUTO) != 0) {
+        free(q);
+        return NULL;
+    }
+    d->io = q;
+    return q;
+}
+
+/*
+Writes n buffers to the disk, all in flight at once through the I/O queue
+[plain pwrite one by one if there is none]. Only fills in fd and write.
+Returns 0 when every byte made it else 1
+*/
+int disk_write_batch(struct store_disk *d, struct io_req *reqs, unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+        reqs[i].fd = d->fd;
+        reqs[i].write = true;
+    }
+    struct io_queue *q = n > 1 ? disk_io(d) : NULL;
+    if (q)
+        return io_run(q, reqs, n);
+    for (unsigned i = 0; i < n; i++) {
+        if (pwrite(d->fd, reqs[i].buf, reqs[i].len, reqs[i].off) != (ssize_t)reqs[i].len) {
+            perror("write disk");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int disk_write_sb(struct store_disk *d) {
+    d->sb.sb_cksum = sb_cksum(&d->sb);
+    return disk_write_meta(d, 0, &d->sb, sizeof(d->sb));
+}
+
+// Forgets the inode map, the table is read again as allocations get to it
+static void imap_drop(struct store_disk *d) {
+    struct inode_map *m = &d->imap;
+    d->sb.ino_next = 0;
+    if (!m->group_free)
+        return;
+    memset(m->group_free, 0xff, m->groups * sizeof(*m->group_free));
+    m->loaded = m->n_free = 0;
+}
+
+/*
+Persists allocator and superblock state after a command changed them, together
+with every other metadata write since the last commit, as one journal txn.
+A txn that outgrew the journal is dropped whole, nothing of it is written
+*/
+int disk_commit(struct store_disk *d) {
+    uint64_t t_start = now_ns();
+    if (d->j.txn.over || (d->alloc.map && alloc_flush(d) != 0) || disk_write_sb(d) != 0) {
+        journal_abort(d);
+        alloc_settle(d, false);
+        imap_drop(d);
+        dcache_drop(d);
+        return 1;
+    }
+    uint32_t images = d->j.txn.n;
+    uint64_t ios = d->j.ios;
+    // blocks freed in this txn can only be handed out again once it is durable,
+    // and once readers that may still have the old inodes are done with them
+    alloc_retire(d);
+    int ret = journal_commit(d);
+    alloc_settle(d, ret == 0);
+    // slots the dropped txn took are free again, wherever they were, and directories it made are gone
+    if (ret != 0) {
+        imap_drop(d);
+        dcache_drop(d);
+    }
+    if (ret == 0) {
+        stats_add(SC_JOURNAL_BLOCKS, images);
+        stats_op(SO_COMMIT, now_ns() - t_start, (uint64_t)images * d->sb.block, d->j.ios - ios);
+    }
+    return ret;
+}
+
+static off_t inode_off(const struct store_disk *d, uint32_t id) {
+    return (off_t)d->sb.inode_start * d->sb.block + (off_t)(id - 1) * sizeof(struct store_inode);
+}
+
+// id is slot + 1
+int inode_read(struct store_disk *d, uint32_t id, struct store_inode *ino) {
+    if (id == 0 || id > d->sb.inode_count) {
+        printf("Inode %" PRIu32 " out of range\n", id);
+        return 1;
+    }
+    if (disk_read_meta(d, inode_off(d, id), ino, sizeof(*ino)) != 0) {
+        printf("Failed to read inode %" PRIu32 "\n", id);
+        return 1;
+    }
+    // free slots are still the zeroed table
+    if (ino->inode_id != 0 && ino->checksum != inode_cksum(d, ino)) {
+        printf("Inode %" PRIu32 " checksum mismatch\n", id);
+        return 1;
+    }
+    return 0;
+}
+
+// Notes slot id as free or used in the map, groups not read yet learn it when they are
+static void imap_set(struct store_disk *d, uint32_t id, bool free) {
+    struct inode_map *m = &d->imap;
+    uint64_t slot = id - 1, g = slot / INODE_GROUP;
+    if (!m->group_free || m->group_free[g] == INODE_UNLOADED)
+        return;
+    uint64_t bit = 1ull << (slot % 64);
+    if (!(m->free[slot / 64] & bit) == !free)
+        return;
+    m->free[slot / 64] ^= bit;
+    m->group_free[g] += free ? 1 : -1;
+    m->n_free += free ? 1 : -1;
+}
+
+// Every write of a slot stamps it with sb.gen, so a diff can tell it didn't change [see snap.c]
+static int stamp(struct store_disk *d, uint32_t id) {
+    off_t off = (off_t)d->sb.gen_start * d->sb.block + (off_t)(id - 1) * sizeof(uint64_t);
+    return disk_write_meta(d, off, &d->sb.gen, sizeof(d->sb.gen));
+}
+
+int inode_write(struct store_disk *d, const struct store_inode *ino) {
+    if (ino->inode_id == 0 || ino->inode_id > d->sb.inode_count) {
+        printf("Inode %" PRIu32 " out of range\n", ino->inode_id);
+        return 1;
+    }
+    struct store_inode tmp = *ino;
+    tmp.checksum = inode_cksum(d, &tmp);
+    imap_set(d, ino->inode_id, false);
+    return disk_write_meta(d, inode_off(d, ino->inode_id), &tmp, sizeof(tmp)) != 0 || stamp(d, ino->inode_id) != 0;
+}
+
+// Frees the slot of inode id, free slots are kept zeroed like the table at init
+int inode_free(struct store_disk *d, uint32_t id) {
+    if (id == 0 || id > d->sb.inode_count) {
+        printf("Inode %" PRIu32 " out of range\n", id);
+        return 1;
+    }
+    struct store_inode zero = {0};
+    if (id < d->sb.ino_next)
+        d->sb.ino_next = id;
+    imap_set(d, id, true);
+    return disk_write_meta(d, inode_off(d, id), &zero, sizeof(zero)) != 0 || stamp(d, id) != 0;
+}
+
+/*
+Generation of every inode slot, gens[id - 1].
+Returns NULL on failure, else an array the caller frees
+*/
+uint64_t *inode_gens(struct store_disk *d) {
+    uint64_t *gens = calloc(d->sb.inode_count ? d->sb.inode_count : 1, sizeof(*gens));
+    if (gens &&
+        disk_read_meta(d, (off_t)d->sb.gen_start * d->sb.block, gens, d->sb.inode_count * sizeof(*gens)) != 0) {
+        printf("Failed to read inode generations\n");
+        free(gens);
+        return NULL;
+    }
+    return gens;
+}
+
+// Reads group g of the inode table into the map, returns 0 on success else 1
+static int imap_load(struct store_disk *d, uint64_t g, struct store_inode *batch) {
+    struct inode_map *m = &d->imap;
+    uint64_t first = g * INODE_GROUP;
+    uint64_t n = d->sb.inode_count - first < INODE_GROUP ? d->sb.inode_count - first : INODE_GROUP;
+    if (disk_read_meta(d, inode_off(d, (uint32_t)first + 1), batch, n * sizeof(*batch)) != 0) {
+        printf("Failed to read inode table\n");
+        return 1;
+    }
+    uint32_t n_free = 0;
+    // groups are whole bitmap words, INODE_GROUP is a multiple of 64
+    memset(&m->free[first / 64], 0, (n + 63) / 64 * sizeof(uint64_t));
+    for (uint64_t i = 0; i < n; i++) {
+        if (batch[i].inode_id == 0) {
+            m->free[(first + i) / 64] |= 1ull << ((first + i) % 64);
+            n_free++;
+        }
+    }
+    m->group_free[g] = n_free;
+    m->loaded++;
+    m->n_free += n_free;
+    return 0;
+}
+
+/*
+Finds a free inode slot from sb.ino_next on [no slot below it is free, the hint
+goes to disk with every commit so a new run starts where the last one stopped],
+returns its id or 0 when the table is full. Groups of the table are read into the map the
+first time the search gets to them and full ones are skipped after that, so back
+to back creates cost a bit scan instead of a read of the table. The slot only
+counts as used once inode_write puts an inode in it.
+*/
+uint32_t inode_alloc(struct store_disk *d) {
+    struct inode_map *m = &d->imap;
+    if (!m->group_free) {
+        m->groups = (d->sb.inode_count + INODE_GROUP - 1) / INODE_GROUP;
+        m->free = calloc(m->groups * (INODE_GROUP / 64), sizeof(uint64_t));
+        m->group_free = malloc(m->groups * sizeof(*m->group_free));
+        if (!m->free || !m->group_free) {
+            printf("Unable to alloc mem for the inode map\n");
+            free(m->free);
+            free(m->group_free);
+            memset(m, 0, sizeof(*m));
+            return 0;
+        }
+        memset(m->group_free, 0xff, m->groups * sizeof(*m->group_free));
+    }
+    struct store_inode *batch = NULL;
+    uint64_t slot = d->sb.ino_next ? d->sb.ino_next - 1 : 0;
+    uint32_t found = 0;
+    for (uint64_t g = slot / INODE_GROUP; g < m->groups && !found; g++, slot = g * INODE_GROUP) {
+        if (m->group_free[g] == INODE_UNLOADED) {
+            if ((!batch && !(batch = malloc(INIT_BATCH))) || imap_load(d, g, batch) != 0)
+                break;
+        }
+        if (m->group_free[g] == 0)
+            continue;
+        uint64_t end = g * INODE_GROUP + INODE_GROUP;
+        for (uint64_t w = slot / 64; w < end / 64 && !found; w++) {
+            // bits below slot in its first word are known used
+            uint64_t bits = m->free[w] & (w == slot / 64 ? ~0ull << (slot % 64) : ~0ull);
+            if (bits)
+                found = (uint32_t)(w * 64 + (uint64_t)__builtin_ctzll(bits) + 1);
+        }
+    }
+    free(batch);
+    if (found)
+        d->sb.ino_next = found;
+    return found;
+}
+
+// disk blocks an extent takes, a compressed cluster only needs enough for csize bytes
+uint64_t ext_blocks(const struct store_disk *d, const struct store_extent *e) {
+    return e->csize ? (e->csize + d->sb.block - 1) / d->sb.block : e->count;
+}
+
+static uint32_t ext_per_block(const struct store_disk *d) {
+    return (d->sb.block - sizeof(struct store_ext_block)) / sizeof(struct store_extent);
+}
+
+static uint32_t ext_block_cksum(const struct store_disk *d, struct store_ext_block *eb) {
+    uint32_t saved = eb->cksum;
+    eb->cksum = 0;
+    uint32_t c = crc32c(0, eb, d->sb.block);
+    eb->cksum = saved;
+    return c;
+}
+
+static int ext_reserve(struct store_file *f, uint32_t n) {
+    if (n <= f->cap)
+        return 0;
+    uint32_t cap = f->cap ? f->cap : INODE_EXTENTS;
+    while (cap < n)
+        cap *= 2;
+    struct store_extent *e = realloc(f->ext, cap * sizeof(*e));
+    if (!e) {
+        printf("Unable to alloc mem for extents\n");
+        return 1;
+    }
+    f->ext = e;
+    f->cap = cap;
+    return 0;
+}
+
+// Loads inode id and walks its overflow chain so all extents are in f->ext
+int file_load(struct store_disk *d, uint32_t id, struct store_file *f) {
+    memset(f, 0, sizeof(*f));
+    if (inode_read(d, id, &f->ino) != 0)
+        return 1;
+    uint32_t n = f->ino.n_extents;
+    if (ext_reserve(f, n ? n : INODE_EXTENTS) != 0)
+        return 1;
+    uint32_t inl = n < INODE_EXTENTS ? n : INODE_EXTENTS;
+    memcpy(f->ext, f->ino.extents, inl * sizeof(struct store_extent));
+    f->n_ext = inl;
+
+    struct store_ext_block *eb = malloc(d->sb.block);
+    if (!eb) {
+        file_put(f);
+        return 1;
+    }
+    for (uint64_t blk = f->ino.ext_block; blk != 0 && f->n_ext < n; blk = eb->next) {
+        if (disk_read_meta(d, (off_t)blk * d->sb.block, eb, d->sb.block) != 0 ||
+            eb->cksum != ext_block_cksum(d, eb) || eb->n > ext_per_block(d) || f->n_ext + eb->n > n) {
+            printf("Corrupt extent block %" PRIu64 " for inode %" PRIu32 "\n", blk, id);
+            free(eb);
+            file_put(f);
+            return 1;
+        }
+        uint64_t *chain = realloc(f->chain, (f->n_chain + 1) * sizeof(*chain));
+        if (!chain) {
+            free(eb);
+            file_put(f);
+            return 1;
+        }
+        f->chain = chain;
+        f->chain[f->n_chain++] = blk;
+        memcpy(f->ext + f->n_ext, eb->extents, eb->n * sizeof(struct store_extent));
+        f->n_ext += eb->n;
+    }
+    free(eb);
+    if (f->n_ext != n) {
+        printf("Inode %" PRIu32 " lists %" PRIu32 " extents, found %" PRIu32 "\n", id, n, f->n_ext);
+        file_put(f);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Appends an extent for count file blocks at pblk, csize as in store_extent.
+A plain extent that starts right where the last plain one ends just extends it.
+Returns 0 on success else 1
+*/
+int file_add_extent(struct store_file *f, uint64_t pblk, uint64_t count, uint32_t csize) {
+    struct store_extent *last = f->n_ext ? &f->ext[f->n_ext - 1] : NULL;
+    if (!csize && last && !last->csize && last->pblk + last->count == pblk &&
+        (uint64_t)last->count + count <= UINT32_MAX) {
+        last->count += count;
+    } else {
+        if (ext_reserve(f, f->n_ext + 1) != 0)
+            return 1;
+        struct store_extent *e = &f->ext[f->n_ext++];
+        memset(e, 0, sizeof(*e));
+        e->lblk = f->ino.block_count;
+        e->pblk = pblk;
+        e->count = count;
+        e->csize = csize;
+    }
+    f->ino.block_count += count;
+    return 0;
+}
+
+/*
+Adds blocks to the end of the file, extending the last extent in place when the
+allocator can hand out the blocks right after it.
+Returns 0 once all blocks were added, 1 if the disk ran out [what was added stays]
+*/
+int file_grow(struct store_disk *d, struct store_file *f, uint64_t blocks) {
+    while (blocks > 0) {
+        struct store_extent *last = f->n_ext ? &f->ext[f->n_ext - 1] : NULL;
+        uint64_t goal = last ? last->pblk + ext_blocks(d, last) : 0;
+        uint64_t want = blocks < UINT32_MAX ? blocks : UINT32_MAX;
+        uint64_t pblk;
+        uint64_t got = alloc_extent(d, want, goal, &pblk);
+        if (got == 0) {
+            printf("Out of data blocks\n");
+            return 1;
+        }
+        if (file_add_extent(f, pblk, got, 0) != 0) {
+            alloc_release(d, pblk, got);
+            return 1;
+        }
+        blocks -= got;
+    }
+    return 0;
+}
+
+/*
+Adds up to blocks blocks to the end of the file, only where they continue its
+last extent, anywhere else they'd be no help to the appends they are kept for.
+Returns the blocks added
+*/
+uint64_t file_reserve(struct store_disk *d, struct store_file *f, uint64_t blocks) {
+    struct store_extent *last = f->n_ext ? &f->ext[f->n_ext - 1] : NULL;
+    if (!last || last->csize)
+        return 0;
+    uint64_t goal = last->pblk + last->count;
+    uint64_t got = alloc_at(d, goal, blocks < UINT32_MAX - last->count ? blocks : UINT32_MAX - last->count);
+    // continues the last extent, so there is nothing to allocate and no way to fail
+    if (got)
+        file_add_extent(f, goal, got, 0);
+    return got;
+}
+
+// Gives every data and overflow block [or pack slot] of the file back to the allocator, shared blocks lose an owner
+int file_release(struct store_disk *d, struct store_file *f) {
+    if (pack_free(d, &f->ino) != 0)
+        printf("Lost track of the pack slots of %s, they stay used\n", f->ino.name);
+    f->ino.flags &= ~(FLAG_INLINE | FLAG_PACKED);
+    for (uint32_t i = 0; i < f->n_ext; i++)
+        dedup_release(d, f->ext[i].pblk, ext_blocks(d, &f->ext[i]));
+    for (uint32_t i = 0; i < f->n_chain; i++)
+        alloc_release(d, f->chain[i], 1);
+    f->n_ext = 0;
+    f->n_chain = 0;
+    f->ino.block_count = 0;
+    f->ino.ext_block = 0;
+    return 0;
+}
+
+/*
+Keeps the first blocks blocks of the file and frees the rest
+A compressed cluster can't be cut, it is kept whole if blocks ends inside it
+*/
+int file_truncate(struct store_disk *d, struct store_file *f, uint64_t blocks) {
+    while (f->n_ext > 0 && f->ino.block_count > blocks) {
+        struct store_extent *e = &f->ext[f->n_ext - 1];
+        uint64_t drop = f->ino.block_count - blocks;
+        if (drop >= e->count) {
+            drop = e->count;
+            dedup_release(d, e->pblk, ext_blocks(d, e));
+            f->n_ext--;
+        } else if (e->csize) {
+            break;
+        } else {
+            e->count -= drop;
+            dedup_release(d, e->pblk + e->count, drop);
+        }
+        f->ino.block_count -= drop;
+    }
+    return 0;
+}
+
+/*
+Writes the inode back, spilling extents past INODE_EXTENTS into the overflow chain.
+The chain goes to fresh blocks every time and the old ones are freed with the
+txn, so a reader that loaded the old inode still walks an intact chain [readers.c].
+*/
+int file_store(struct store_disk *d, struct store_file *f) {
+    // inline and packed files have no extents, the union holds their data instead
+    if (f->ino.flags & (FLAG_INLINE | FLAG_PACKED))
+        return inode_write(d, &f->ino);
+    uint32_t per = ext_per_block(d);
+    uint32_t spill = f->n_ext > INODE_EXTENTS ? f->n_ext - INODE_EXTENTS : 0;
+    uint32_t need = (spill + per - 1) / per;
+
+    uint64_t goal = f->n_chain ? f->chain[0] : 0;
+    while (f->n_chain > 0)
+        alloc_release(d, f->chain[--f->n_chain], 1);
+    if (need > 0) {
+        uint64_t *chain = realloc(f->chain, need * sizeof(*chain));
+        if (!chain)
+            return 1;
+        f->chain = chain;
+        while (f->n_chain < need) {
+            if (f->n_chain)
+                goal = f->chain[f->n_chain - 1] + 1;
+            if (alloc_extent(d, 1, goal, &f->chain[f->n_chain]) != 1) {
+                printf("Out of blocks for extent list\n");
+                return 1;
+            }
+            f->n_chain++;
+        }
+    }
+
+    uint32_t inl = f->n_ext < INODE_EXTENTS ? f->n_ext : INODE_EXTENTS;
+    memset(f->ino.extents, 0, sizeof(f->ino.extents));
+    memcpy(f->ino.extents, f->ext, inl * sizeof(struct store_extent));
+    f->ino.n_extents = f->n_ext;
+    f->ino.ext_block = need ? f->chain[0] : 0;
+
+    if (need) {
+        struct store_ext_block *eb = calloc(1, d->sb.block);
+        if (!eb)
+            return 1;
+        for (uint32_t c = 0; c < need; c++) {
+            uint32_t first = INODE_EXTENTS + c * per;
+            eb->next = c + 1 < need ? f->chain[c + 1] : 0;
+            eb->n = f->n_ext - first < per ? f->n_ext - first : per;
+            memset(eb->extents, 0, per * sizeof(struct store_extent));
+            memcpy(eb->extents, f->ext + first, eb->n * sizeof(struct store_extent));
+            eb->cksum = ext_block_cksum(d, eb);
+            if (disk_write_meta(d, (off_t)f->chain[c] * d->sb.block, eb, d->sb.block) != 0) {
+                free(eb);
+                return 1;
+            }
+        }
+        free(eb);
+    }
+    return inode_write(d, &f->ino);
+}
+
+void file_put(struct store_file *f) {
+    free(f->ext);
+    free(f->chain);
+    free(f->data);
+    f->ext = NULL;
+    f->chain = NULL;
+    f->data = NULL;
+    f->n_ext = f->cap = f->n_chain = 0;
+}
+
+// Extent holding file block lblk, NULL if lblk is past the last extent
+const struct store_extent *file_extent(const struct store_file *f, uint64_t lblk) {
+    uint32_t lo = 0, hi = f->n_ext;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct store_extent *e = &f->ext[mid];
+        if (lblk < e->lblk)
+            hi = mid;
+        else if (lblk >= e->lblk + e->count)
+            lo = mid + 1;
+        else
+            return e;
+    }
+    return NULL;
+}
+
+/*
+Maps a file block to its disk block, *run gets how many blocks follow contiguously
+Returns 0 if lblk is past the last extent or inside a compressed cluster
+*/
+uint64_t file_map(const struct store_file *f, uint64_t lblk, uint64_t *run) {
+    const struct store_extent *e = file_extent(f, lblk);
+    if (!e || e->csize) {
+        if (run)
+            *run = 0;
+        return 0;
+    }
+    if (run)
+        *run = e->lblk + e->count - lblk;
+    return e->pblk + (lblk - e->lblk);
+}
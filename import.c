@@ -0,0 +1,570 @@
+#include "store.h"
+
+#include <dirent.h>
+
+/*
+Import
+Loads a directory tree, a tar file or a list of paths into the disk in one run,
+instead of one store write per file that opens and checks the disk and commits
+on its own. The caller's thread is the only writer, it runs op_write for every
+file back to back in the order they were found, so the allocator hands out
+blocks in one sweep across the free space and the inode, index and bitmap
+blocks of many files go out as the same txn images. It commits whole files
+once the journal is getting full [journal_full, a txn has to fit it], the caller commits
+the rest.
+A lister thread walks the input while IMPORT_READERS reader threads open and
+read the files it found into memory ahead of the writer, up to IMPORT_AHEAD
+bytes in flight. Files over IMPORT_BIG aren't read ahead, the writer copies
+them from the fd the reader opened [copy_file_range, see data.c]. A tar file
+only reads in order, so its lister reads the members itself and hands a big
+one to the writer straight from the tar fd, going on once it is written.
+Names are paths below the top of the tree [or as the list and the tar have
+them, without a leading / or ./], files whose name doesn't fit INODE_NAME,
+links and other non regular files are skipped.
+*/
+
+#define IMPORT_READERS 8
+#define IMPORT_AHEAD (64 << 20)    // bytes read but not yet written at most
+#define IMPORT_BIG (4 << 20)       // bigger files go from their fd, they count this much ahead
+#define TAR_BLOCK 512
+
+enum item_state {
+    IS_NEW,
+    IS_READY,                // buf or fd holds the bytes
+    IS_SKIP,                 // unreadable, nothing to write
+    IS_DONE,                 // written [or skipped] by the writer
+};
+
+struct item {
+    char name[INODE_NAME];
+    char *path;              // source for a list, NULL for tree and tar entries
+    char *buf;               // bytes read ahead, NULL for big files
+    int fd;                  // big file the writer copies from, else -1
+    uint64_t size;
+    uint64_t cost;           // its share of IMPORT_AHEAD
+    enum item_state state;
+};
+
+struct import {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct item *items;      // in the order they are written
+    size_t n;
+    size_t cap;
+    bool listed;             // the lister is through, n is final
+    bool list_failed;
+    bool stop;               // the writer gave up, everyone winds down
+    size_t claim;            // next item for a reader
+    size_t granted;          // items that took their share of IMPORT_AHEAD, in order
+    uint64_t ahead;          // bytes granted and not yet written
+    uint64_t skipped;
+    const char *from;
+    int top;                 // directory fd names are opened at, -1 for a list
+    int tar;                 // tar file, -1 when not one
+};
+
+// Adds an item at the end, returns its index or -1. Called with the lock held.
+static ssize_t add_item(struct import *im, const char *name, const char *path) {
+    if (im->n == im->cap) {
+        size_t cap = im->cap ? im->cap * 2 : 1024;
+        struct item *it = realloc(im->items, cap * sizeof(*it));
+        if (!it) {
+            printf("Unable to alloc mem for the import list\n");
+            return -1;
+        }
+        im->items = it;
+        im->cap = cap;
+    }
+    struct item *it = &im->items[im->n];
+    *it = (struct item){ .fd = -1, .state = IS_NEW };
+    strcpy(it->name, name);
+    if (path && !(it->path = strdup(path))) {
+        printf("Unable to alloc mem for the import list\n");
+        return -1;
+    }
+    pthread_cond_broadcast(&im->cond);
+    return im->n++;
+}
+
+// im->stop under the lock, for the listers' loops
+static bool stopped(struct import *im) {
+    pthread_mutex_lock(&im->lock);
+    bool stop = im->stop;
+    pthread_mutex_unlock(&im->lock);
+    return stop;
+}
+
+static void skip_name(struct import *im, const char *name) {
+    printf("Skipping %s, names are at most %d chars\n", name, INODE_NAME - 1);
+    pthread_mutex_lock(&im->lock);
+    im->skipped++;
+    pthread_mutex_unlock(&im->lock);
+}
+
+// Lists every regular file below rel [a path under im->top, "" for the top], returns 0 on success else 1
+static int walk(struct import *im, const char *rel) {
+    int fd = openat(im->top, rel[0] ? rel : ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        printf("Unable to read directory %s/%s\n", im->from, rel);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    int ret = 0;
+    struct dirent *de;
+    while (ret == 0 && !stopped(im) && (de = readdir(dir))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", de->d_name);
+        struct stat st;
+        // links aren't followed, a tree can't loop or reach outside itself
+        if (fstatat(im->top, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            // nothing below fits either
+            if (strlen(name) + 2 >= INODE_NAME)
+                skip_name(im, name);
+            else
+                walk(im, name);
+        } else if (S_ISREG(st.st_mode)) {
+            if (strlen(name) >= INODE_NAME) {
+                skip_name(im, name);
+                continue;
+            }
+            pthread_mutex_lock(&im->lock);
+            ret = add_item(im, name, NULL) < 0;
+            pthread_mutex_unlock(&im->lock);
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+// Drops any leading / and ./ so names in the disk are relative
+static const char *relative(const char *p) {
+    for (;;) {
+        if (p[0] == '/')
+            p++;
+        else if (p[0] == '.' && p[1] == '/')
+            p += 2;
+        else
+            return p;
+    }
+}
+
+// Lists the paths on stdin, one per line, returns 0 on success else 1
+static int read_list(struct import *im) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int ret = 0;
+    while (ret == 0 && !stopped(im) && (len = getline(&line, &cap, stdin)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        const char *name = relative(line);
+        if (name[0] == '\0')
+            continue;
+        if (strlen(name) >= INODE_NAME) {
+            skip_name(im, name);
+            continue;
+        }
+        pthread_mutex_lock(&im->lock);
+        ret = add_item(im, name, line) < 0;
+        pthread_mutex_unlock(&im->lock);
+    }
+    free(line);
+    return ret;
+}
+
+// read() until len bytes or EOF, returns what it got or -1
+static ssize_t read_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// Moves len bytes on in the tar, returns 0 on success else 1
+static int tar_skip(int fd, uint64_t len, bool seekable) {
+    if (seekable)
+        return lseek(fd, len, SEEK_CUR) < 0;
+    char buf[16 * TAR_BLOCK];
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (read_full(fd, buf, n) != (ssize_t)n)
+            return 1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Header number field, octal or GNU base-256 when the top bit of the first byte is set
+static uint64_t tar_num(const char *p, size_t len) {
+    uint64_t v = 0;
+    if ((unsigned char)p[0] & 0x80) {
+        v = (unsigned char)p[0] & 0x7f;
+        for (size_t i = 1; i < len; i++)
+            v = v << 8 | (unsigned char)p[i];
+        return v;
+    }
+    for (size_t i = 0; i < len && p[i]; i++)
+        if (p[i] >= '0' && p[i] <= '7')
+            v = v * 8 + (p[i] - '0');
+    return v;
+}
+
+// ustar header checksum, the sum of the bytes with the checksum field as spaces
+static bool tar_header_ok(const unsigned char *h) {
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    return sum == tar_num((const char *)h + 148, 8);
+}
+
+// path= out of a pax header block, into name [cap bytes]
+static void pax_path(const char *rec, uint64_t len, char *name, size_t cap) {
+    uint64_t at = 0;
+    while (at < len) {
+        char *end;
+        uint64_t n = strtoull(rec + at, &end, 10);
+        if (n == 0 || at + n > len || *end != ' ')
+            return;
+        const char *kv = end + 1;
+        size_t kv_len = rec + at + n - 1 - kv;      // without the '\n'
+        if (kv_len > 5 && strncmp(kv, "path=", 5) == 0) {
+            size_t m = kv_len - 5 < cap - 1 ? kv_len - 5 : cap - 1;
+            memcpy(name, kv + 5, m);
+            name[m] = '\0';
+        }
+        at += n;
+    }
+}
+
+/*
+Reads the tar in order, lists its regular files and reads the small ones into
+memory. Long names come from GNU 'L' entries and pax path records.
+Returns 0 on success else 1
+*/
+static int read_tar(struct import *im) {
+    struct stat st;
+    bool seekable = fstat(im->tar, &st) == 0 && S_ISREG(st.st_mode);
+    unsigned char h[TAR_BLOCK];
+    char long_name[PATH_MAX] = "";
+    for (;;) {
+        ssize_t got = read_full(im->tar, h, TAR_BLOCK);
+        // some writers leave out the zero blocks at the end
+        if (got == 0)
+            break;
+        if (got != TAR_BLOCK) {
+            printf("%s ends in the middle of a tar entry\n", im->from);
+            return 1;
+        }
+        bool zero = true;
+        for (int i = 0; i < TAR_BLOCK && zero; i++)
+            zero = h[i] == 0;
+        // the end is marked by zero blocks
+        if (zero)
+            break;
+        if (!tar_header_ok(h)) {
+            if (h[0] == 0x1f && h[1] == 0x8b)
+                printf("%s is compressed, pipe it through gzip -dc into store import /dev/stdin\n", im->from);
+            else
+                printf("%s is not a tar file\n", im->from);
+            return 1;
+        }
+        uint64_t size = tar_num((const char *)h + 124, 12);
+        uint64_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+        char type = h[156];
+
+        if (type == 'L' || type == 'x') {
+            // names the next entry
+            char *rec = malloc(size + 1);
+            if (!rec || read_full(im->tar, rec, size) != (ssize_t)size || tar_skip(im->tar, pad, seekable) != 0) {
+                printf("Unable to read tar entry in %s\n", im->from);
+                free(rec);
+                return 1;
+            }
+            rec[size] = '\0';
+            if (type == 'L')
+                snprintf(long_name, sizeof(long_name), "%s", rec);
+            else
+                pax_path(rec, size, long_name, sizeof(long_name));
+            free(rec);
+            continue;
+        }
+        char path[PATH_MAX];
+        if (long_name[0])
+            snprintf(path, sizeof(path), "%s", long_name);
+        else if (memcmp(h + 257, "ustar", 5) == 0 && h[345])
+            snprintf(path, sizeof(path), "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+        else
+            snprintf(path, sizeof(path), "%.100s", (const char *)h);
+        long_name[0] = '\0';
+        const char *name = relative(path);
+
+        // directories, links, devices and global pax headers have nothing to write
+        if ((type != '0' && type != '\0' && type != '7') || name[0] == '\0' || strlen(name) >= INODE_NAME) {
+            if ((type == '0' || type == '\0' || type == '7') && name[0])
+                skip_name(im, name);
+            if (tar_skip(im->tar, size + pad, seekable) != 0) {
+                printf("Unable to read tar entry in %s\n", im->from);
+                return 1;
+            }
+            continue;
+        }
+
+        bool big = size > IMPORT_BIG;
+        uint64_t cost = big ? IMPORT_BIG : size;
+        pthread_mutex_lock(&im->lock);
+        while (!im->stop && im->ahead > 0 && im->ahead + cost > IMPORT_AHEAD)
+            pthread_cond_wait(&im->cond, &im->lock);
+        ssize_t k = im->stop ? -1 : add_item(im, name, NULL);
+        if (k >= 0)
+            im->ahead += cost;
+        pthread_mutex_unlock(&im->lock);
+        if (k < 0)
+            return 1;
+
+        char *buf = NULL;
+        int ret = 0;
+        if (!big) {
+            buf = malloc(size ? size : 1);
+            ret = !buf || read_full(im->tar, buf, size) != (ssize_t)size;
+        }
+        pthread_mutex_lock(&im->lock);
+        struct item *it = &im->items[k];
+        it->buf = buf;
+        it->fd = big ? im->tar : -1;
+        it->size = size;
+        it->cost = cost;
+        it->state = ret ? IS_SKIP : IS_READY;
+        pthread_cond_broadcast(&im->cond);
+        // the writer reads a big one from the tar fd, it has to be through before we go on
+        while (big && !im->stop && im->items[k].state != IS_DONE)
+            pthread_cond_wait(&im->cond, &im->lock);
+        bool stop = im->stop;
+        pthread_mutex_unlock(&im->lock);
+        if (ret || stop) {
+            if (ret)
+                printf("Unable to read %s from %s\n", name, im->from);
+            return ret;
+        }
+        // a copy from a regular file leaves the position where it was, a splice from a pipe moves it
+        if ((big && seekable && lseek(im->tar, size, SEEK_CUR) < 0) || tar_skip(im->tar, pad, seekable) != 0) {
+            printf("Unable to read tar entry in %s\n", im->from);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *lister(void *arg) {
+    struct import *im = arg;
+    int ret;
+    if (im->tar >= 0)
+        ret = read_tar(im);
+    else if (im->top >= 0)
+        ret = walk(im, "");
+    else
+        ret = read_list(im);
+    pthread_mutex_lock(&im->lock);
+    im->listed = true;
+    im->list_failed = ret != 0;
+    pthread_cond_broadcast(&im->cond);
+    pthread_mutex_unlock(&im->lock);
+    return NULL;
+}
+
+// Opens and reads the listed files in order of the list, ahead of the writer
+static void *reader(void *arg) {
+    struct import *im = arg;
+    pthread_mutex_lock(&im->lock);
+    for (;;) {
+        while (!im->stop && im->claim >= im->n && !im->listed)
+            pthread_cond_wait(&im->cond, &im->lock);
+        if (im->stop || im->claim >= im->n)
+            break;
+        size_t k = im->claim++;
+        char name[INODE_NAME];
+        strcpy(name, im->items[k].name);
+        char *path = im->items[k].path;
+        pthread_mutex_unlock(&im->lock);
+
+        int fd = path ? open(path, O_RDONLY) : openat(im->top, name, O_RDONLY);
+        struct stat st;
+        bool ok = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        uint64_t size = ok ? (uint64_t)st.st_size : 0;
+        bool big = size > IMPORT_BIG;
+        uint64_t cost = big ? IMPORT_BIG : size;
+
+        // shares go out in list order, so whatever is ahead of k the writer can get through
+        pthread_mutex_lock(&im->lock);
+        while (!im->stop && (im->granted != k || (im->ahead > 0 && im->ahead + cost > IMPORT_AHEAD)))
+            pthread_cond_wait(&im->cond, &im->lock);
+        if (im->stop) {
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        im->granted++;
+        im->ahead += cost;
+        pthread_cond_broadcast(&im->cond);
+        pthread_mutex_unlock(&im->lock);
+
+        char *buf = NULL;
+        if (ok && !big) {
+            buf = malloc(size ? size : 1);
+            uint64_t done = 0;
+            ssize_t n = 1;
+            while (buf && done < size && (n = pread(fd, buf + done, size - done, done)) > 0)
+                done += n;
+            // a file that shrank since the stat goes in as it is now
+            ok = buf && n >= 0;
+            size = done;
+        }
+        if (!ok)
+            printf("Unable to read %s\n", path ? path : name);
+        if ((!ok || !big) && fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+
+        pthread_mutex_lock(&im->lock);
+        struct item *it = &im->items[k];
+        it->buf = buf;
+        it->fd = fd;
+        it->size = size;
+        it->cost = cost;
+        it->state = ok ? IS_READY : IS_SKIP;
+        pthread_cond_broadcast(&im->cond);
+    }
+    pthread_mutex_unlock(&im->lock);
+    return NULL;
+}
+
+/*
+Imports from [a directory, a tar file, or "-" for a list of paths on stdin]
+into the disk, replacing files of the same name. Stops at the first file that
+doesn't fit, files before it are in. is gets what went in.
+Returns an enum op_status, whatever the last commit didn't take is in the open txn
+*/
+int import_run(struct store_disk *d, const char *from, struct import_stats *is) {
+    uint64_t t_start = now_ns();
+    struct import im = { .from = from, .top = -1, .tar = -1 };
+    struct stat sst;
+    if (strcmp(from, "-") != 0) {
+        if (stat(from, &sst) != 0) {
+            printf("Unable to find %s\n", from);
+            return ST_NOENT;
+        }
+        int fd = open(from, S_ISDIR(sst.st_mode) ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+        if (fd < 0) {
+            printf("Unable to open %s\n", from);
+            return ST_ERR;
+        }
+        if (S_ISDIR(sst.st_mode))
+            im.top = fd;
+        else
+            im.tar = fd;
+    }
+    if ((!d->alloc.map && alloc_load(d) != 0)) {
+        close(im.top >= 0 ? im.top : im.tar);
+        return ST_ERR;
+    }
+    pthread_mutex_init(&im.lock, NULL);
+    pthread_cond_init(&im.cond, NULL);
+    pthread_t list_th, th[IMPORT_READERS];
+    int n_th = 0;
+    int st_ret = ST_OK;
+    bool listing = pthread_create(&list_th, NULL, lister, &im) == 0;
+    if (!listing) {
+        printf("Unable to start the import\n");
+        st_ret = ST_ERR;
+    }
+    // a tar is read by its lister
+    while (listing && im.tar < 0 && n_th < IMPORT_READERS && pthread_create(&th[n_th], NULL, reader, &im) == 0)
+        n_th++;
+    if (listing && im.tar < 0 && n_th == 0) {
+        printf("Unable to start the import readers\n");
+        st_ret = ST_ERR;
+    }
+
+    for (size_t i = 0; st_ret == ST_OK; i++) {
+        pthread_mutex_lock(&im.lock);
+        while (!(i < im.n && im.items[i].state != IS_NEW) && !(im.listed && i >= im.n))
+            pthread_cond_wait(&im.cond, &im.lock);
+        if (i >= im.n) {
+            pthread_mutex_unlock(&im.lock);
+            break;
+        }
+        struct item it = im.items[i];
+        pthread_mutex_unlock(&im.lock);
+
+        int st = ST_OK;
+        if (it.state == IS_READY) {
+            struct data_src src = { .kind = D_STR, .mem = it.buf, .size = it.size, .size_known = true };
+            if (!it.buf)
+                src = (struct data_src){ .kind = D_FIL, .fd = it.fd, .size = it.size, .size_known = true };
+            struct write_stats ws = {0};
+            st = op_write(d, it.name, &src, false, -1, -1, &ws);
+            if (st == ST_OK) {
+                is->files++;
+                is->bytes += it.size;
+            }
+        }
+        if (it.state != IS_READY)
+            is->skipped++;
+        // commits hold whole files, see snap.c settle
+        if (st == ST_OK && (journal_full(d) || d->alloc.pend_blocks >= d->alloc.n_free) &&
+            disk_commit(d) != 0)
+            st = ST_ERR;
+        if (st != ST_OK) {
+            printf("Unable to import %s\n", it.name);
+            st_ret = st;
+        }
+        free(it.buf);
+        if (it.fd >= 0 && it.fd != im.tar)
+            close(it.fd);
+        pthread_mutex_lock(&im.lock);
+        im.items[i].buf = NULL;
+        im.items[i].fd = -1;
+        im.items[i].state = IS_DONE;
+        im.ahead -= it.cost;
+        pthread_cond_broadcast(&im.cond);
+        pthread_mutex_unlock(&im.lock);
+    }
+
+    pthread_mutex_lock(&im.lock);
+    im.stop = true;
+    pthread_cond_broadcast(&im.cond);
+    pthread_mutex_unlock(&im.lock);
+    for (int i = 0; i < n_th; i++)
+        pthread_join(th[i], NULL);
+    if (listing)
+        pthread_join(list_th, NULL);
+    if (st_ret == ST_OK && im.list_failed)
+        st_ret = ST_ERR;
+    is->skipped += im.skipped;
+    for (size_t i = 0; i < im.n; i++) {
+        free(im.items[i].buf);
+        free(im.items[i].path);
+        if (im.items[i].fd >= 0 && im.items[i].fd != im.tar)
+            close(im.items[i].fd);
+    }
+    free(im.items);
+    close(im.top >= 0 ? im.top : im.tar);
+    pthread_mutex_destroy(&im.lock);
+    pthread_cond_destroy(&im.cond);
+    stats_op(SO_IMPORT, now_ns() - t_start, is->bytes, 0);
+    return st_ret;
+}
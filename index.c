@@ -0,0 +1,281 @@
+#include "store.h"
+
+/*
+Name index
+A persistent hash table from file name to inode_id in [sb.index_start..sb.index_end].
+Each block is a bucket of store_index_entry, a name hashes to one bucket and
+only probes the next bucket when its own is full. Snapshots [snap.c] are named
+in the same table, a file and a snapshot may share a name. The table is sized at init
+for twice the inode count, so a lookup is one bucket read plus one inode read
+no matter how many files the disk holds. A delete leaves a tombstone, which the
+next insert probing past it takes, and compact keeps them from filling buckets.
+*/
+
+#define PULL_BUCKETS 4      // buckets compact looks at past a full one
+
+// FNV-1a, 64 bit
+uint64_t name_hash(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t n_buckets(const struct store_disk *d) {
+    return (uint64_t)d->sb.index_end - d->sb.index_start + 1;
+}
+
+static uint32_t per_bucket(const struct store_disk *d) {
+    return d->sb.block / sizeof(struct store_index_entry);
+}
+
+static off_t bucket_off(const struct store_disk *d, uint64_t b) {
+    return (off_t)(d->sb.index_start + b) * d->sb.block;
+}
+
+static int read_bucket(struct store_disk *d, uint64_t b, struct store_index_entry *e) {
+    if (disk_read_meta(d, bucket_off(d, b), e, d->sb.block) != 0) {
+        printf("Failed to read index bucket %" PRIu64 "\n", b);
+        return 1;
+    }
+    return 0;
+}
+
+// slot within the index, bucket b entry i
+struct index_pos {
+    uint64_t b;
+    uint32_t i;
+    bool ok;
+};
+
+/*
+Walks the probe sequence for name, calling back on every live entry with a matching hash.
+Stops at the first never-used slot, *slot gets the first reusable slot seen on the way
+[without a visit that is where it stops, an insert takes the first tombstone it meets].
+Returns 0 when visit accepted an entry [its position in *hit], 1 if not found, -1 on err
+*/
+static int probe(struct store_disk *d, const char *name,
+                 int (*visit)(struct store_disk *, const struct store_index_entry *, void *), void *arg,
+                 struct index_pos *hit, struct index_pos *slot) {
+    uint64_t h = name_hash(name);
+    uint32_t h32 = (uint32_t)h;
+    uint64_t nb = n_buckets(d);
+    uint32_t per = per_bucket(d);
+
+    struct store_index_entry *e = malloc(d->sb.block);
+    if (!e)
+        return -1;
+    int ret = 1;
+    for (uint64_t n = 0; n < nb; n++) {
+        uint64_t b = ((h >> 32) + n) % nb;
+        if (read_bucket(d, b, e) != 0) {
+            ret = -1;
+            break;
+        }
+        bool ended = false;
+        for (uint32_t j = 0; j < per; j++) {
+            if (e[j].inode_id == 0 || e[j].inode_id == INDEX_TOMB) {
+                if (slot && !slot->ok)
+                    *slot = (struct index_pos){ b, j, true };
+                if (e[j].inode_id == 0 || !visit) {
+                    ended = true;
+                    break;
+                }
+                continue;
+            }
+            if (e[j].hash == h32 && visit && visit(d, &e[j], arg) == 0) {
+                if (hit)
+                    *hit = (struct index_pos){ b, j, true };
+                ret = 0;
+                ended = true;
+                break;
+            }
+        }
+        if (ended)
+            break;
+    }
+    free(e);
+    return ret;
+}
+
+struct match_arg {
+    const char *name;
+    uint32_t id;                 // 0 = any
+    struct store_inode *ino;
+    uint32_t snapshot;           // FLAG_SNAPSHOT to find a snapshot, 0 for a file
+};
+
+static int match_name(struct store_disk *d, const struct store_index_entry *e, void *arg) {
+    struct match_arg *m = arg;
+    if (m->id && e->inode_id != m->id)
+        return 1;
+    if (inode_read(d, e->inode_id, m->ino) != 0)
+        return 1;
+    if (!m->id && (m->ino->flags & FLAG_SNAPSHOT) != m->snapshot)
+        return 1;
+    return strncmp(m->ino->name, m->name, INODE_NAME) == 0 ? 0 : 1;
+}
+
+/*
+Finds the file named name and copies its inode into ino
+Returns 0 if found, 1 if not, -1 on errors
+*/
+int index_lookup(struct store_disk *d, const char *name, struct store_inode *ino) {
+    struct store_inode tmp;
+    struct match_arg m = { name, 0, ino ? ino : &tmp, 0 };
+    return probe(d, name, match_name, &m, NULL, NULL);
+}
+
+// index_lookup for the snapshot named name
+int index_lookup_snapshot(struct store_disk *d, const char *name, struct store_inode *ino) {
+    struct store_inode tmp;
+    struct match_arg m = { name, 0, ino ? ino : &tmp, FLAG_SNAPSHOT };
+    return probe(d, name, match_name, &m, NULL, NULL);
+}
+
+static int write_entry(struct store_disk *d, const struct index_pos *pos, const struct store_index_entry *e) {
+    off_t off = bucket_off(d, pos->b) + (off_t)pos->i * sizeof(*e);
+    return disk_write_meta(d, off, e, sizeof(*e));
+}
+
+// Adds name -> id, caller makes sure name isn't already indexed
+int index_insert(struct store_disk *d, const char *name, uint32_t id) {
+    struct index_pos slot = {0};
+    if (probe(d, name, NULL, NULL, NULL, &slot) < 0)
+        return 1;
+    if (!slot.ok) {
+        printf("Name index is full\n");
+        return 1;
+    }
+    struct store_index_entry ent = { (uint32_t)name_hash(name), id };
+    return write_entry(d, &slot, &ent);
+}
+
+static bool live(const struct store_index_entry *e) {
+    return e->inode_id != 0 && e->inode_id != INDEX_TOMB;
+}
+
+/*
+Moves the live entries of bucket e to its front, returns how many there are.
+*open is whether the bucket has a never-used slot [which ends probes], the
+slots after the live ones are never-used then and tombstones otherwise
+*/
+static uint32_t pack(struct store_index_entry *e, uint32_t per, bool *open) {
+    uint32_t k = 0, j = 0;
+    for (; j < per && e[j].inode_id != 0; j++)
+        if (live(&e[j]))
+            e[k++] = e[j];
+    *open = j < per;
+    for (uint32_t i = k; i < per; i++)
+        e[i] = (struct store_index_entry){ 0, *open ? 0 : INDEX_TOMB };
+    return k;
+}
+
+/*
+Writes bucket b [its entries in e] without letting tombstones pile up. In a
+bucket with a never-used slot every probe that gets there ends there, so its
+tombstones go back to never-used. A full one sends probes on to the next
+bucket, tombstones and all: once they are half of it the entries up to
+PULL_BUCKETS further on whose probe runs through b are moved back into it, and
+if that gets to a bucket where probes end with room left in b, b gets
+never-used slots and those probes stop at b. Returns 0 on success else 1
+*/
+static int compact(struct store_disk *d, uint64_t b, struct store_index_entry *e) {
+    uint32_t per = per_bucket(d);
+    uint64_t nb = n_buckets(d);
+    bool open, ended = false;
+    uint32_t k = pack(e, per, &open);
+    if (open || (per - k) * 2 < per)
+        return disk_write_meta(d, bucket_off(d, b), e, d->sb.block);
+
+    struct store_index_entry *c = malloc(d->sb.block);
+    struct store_inode ino;
+    int ret = !c;
+    for (uint64_t n = 1; !ret && !ended && k < per && n <= PULL_BUCKETS && n < nb; n++) {
+        uint64_t cb = (b + n) % nb;
+        bool moved = false;
+        ret = read_bucket(d, cb, c);
+        for (uint32_t j = 0; !ret && j < per && k < per; j++) {
+            if (c[j].inode_id == 0) {
+                ended = true;
+                break;
+            }
+            if (!live(&c[j]) || (ret = inode_read(d, c[j].inode_id, &ino)) != 0)
+                continue;
+            // the probe from its home bucket gets to b before cb
+            uint64_t home = (name_hash(ino.name) >> 32) % nb;
+            if ((b + nb - home) % nb < (cb + nb - home) % nb) {
+                e[k++] = c[j];
+                c[j] = (struct store_index_entry){ 0, INDEX_TOMB };
+                moved = true;
+            }
+        }
+        if (!ret && moved) {
+            pack(c, per, &open);
+            ret = disk_write_meta(d, bucket_off(d, cb), c, d->sb.block);
+        }
+        ended = ended || n == nb - 1;
+    }
+    free(c);
+    // every entry whose probe went past b is in it now
+    for (uint32_t j = k; ended && j < per; j++)
+        e[j].inode_id = 0;
+    return ret || disk_write_meta(d, bucket_off(d, b), e, d->sb.block);
+}
+
+// Drops name -> id, leaving a tombstone so later entries stay reachable [see compact]
+int index_remove(struct store_disk *d, const char *name, uint32_t id) {
+    struct store_inode tmp;
+    struct match_arg m = { name, id, &tmp, 0 };
+    struct index_pos hit;
+    int ret = probe(d, name, match_name, &m, &hit, NULL);
+    if (ret != 0) {
+        if (ret > 0)
+            printf("%s is not in the name index\n", name);
+        return 1;
+    }
+    struct store_index_entry *e = malloc(d->sb.block);
+    if (!e || read_bucket(d, hit.b, e) != 0) {
+        free(e);
+        return 1;
+    }
+    e[hit.i] = (struct store_index_entry){ 0, INDEX_TOMB };
+    ret = compact(d, hit.b, e);
+    free(e);
+    return ret;
+}
+
+// Renames a file, updating both its inode and the index
+int index_rename(struct store_disk *d, const char *from, const char *to) {
+    if (strlen(to) >= INODE_NAME) {
+        printf("Name %s is longer than %d chars\n", to, INODE_NAME - 1);
+        return 1;
+    }
+    struct store_inode ino;
+    int ret = index_lookup(d, to, NULL);
+    if (ret == 0) {
+        printf("%s already exists\n", to);
+        return 1;
+    } else if (ret < 0) {
+        return 1;
+    }
+    ret = index_lookup(d, from, &ino);
+    if (ret != 0) {
+        if (ret > 0)
+            printf("%s does not exist\n", from);
+        return 1;
+    }
+    // a directory's files are named by its path, they'd all have to move with it
+    if (ino.flags & FLAG_DIRECTORY) {
+        printf("%s is a directory, rename its files instead\n", from);
+        return 1;
+    }
+    ino.flags = (ino.flags & ~FLAG_HIDDEN) | (dir_hidden(to) ? FLAG_HIDDEN : 0);
+    if (dir_unlink(d, from, ino.inode_id) != 0 || dir_link(d, to, ino.inode_id, ino.flags) != 0)
+        return 1;
+    memset(ino.name, 0, sizeof(ino.name));
+    strcpy(ino.name, to);
+    return inode_write(d, &ino);
+}
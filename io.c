@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+I/O engine
+A queue takes pread/pwrite style requests, hands them to the kernel in batches
+and gives back completions in whatever order they finish, so many requests can
+be in flight on one fd. Queues aren't shared, every thread [one per core] that
+does I/O opens its own, which is what keeps submission lock free.
+Backends:
+  IO_URING    raw io_uring syscalls, one ring per queue, one io_uring_enter per batch
+  IO_THREADS  a few worker threads per queue doing blocking pread/pwrite, for
+              kernels or sandboxes without io_uring
+IO_AUTO takes io_uring when io_uring_setup works.
+Usage: io_push requests, io_submit the batch, io_reap completions [io_run does
+all three for a set of requests and finishes short transfers].
+*/
+
+static const char *backend_names[] = {
+    [IO_AUTO] = "auto",
+    [IO_URING] = "io_uring",
+    [IO_THREADS] = "threads",
+};
+
+const char *io_backend_name(enum io_backend b) {
+    return backend_names[b];
+}
+
+static int ring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_init(struct io_queue *q) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    q->ring_fd = ring_setup(q->depth, &p);
+    if (q->ring_fd < 0)
+        return 1;
+    q->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // newer kernels map both rings in one go
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        q->sq_sz = q->cq_sz = q->sq_sz > q->cq_sz ? q->sq_sz : q->cq_sz;
+    q->sq_ptr = mmap(NULL, q->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd,
+                     IORING_OFF_SQ_RING);
+    if (q->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        q->cq_ptr = q->sq_ptr;
+    } else {
+        q->cq_ptr = mmap(NULL, q->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd,
+                         IORING_OFF_CQ_RING);
+        if (q->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    q->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+    if (q->sqes == MAP_FAILED)
+        goto fail;
+    char *sq = q->sq_ptr, *cq = q->cq_ptr;
+    q->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    q->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    q->sq_array = (unsigned *)(sq + p.sq_off.array);
+    q->sq_entries = p.sq_entries;
+    q->cq_head = (unsigned *)(cq + p.cq_off.head);
+    q->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    q->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    q->tail = *q->sq_tail;
+    return 0;
+fail:
+    if (q->sqes && q->sqes != MAP_FAILED)
+        munmap(q->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+    if (q->cq_ptr && q->cq_ptr != MAP_FAILED && q->cq_ptr != q->sq_ptr)
+        munmap(q->cq_ptr, q->cq_sz);
+    if (q->sq_ptr && q->sq_ptr != MAP_FAILED)
+        munmap(q->sq_ptr, q->sq_sz);
+    close(q->ring_fd);
+    return 1;
+}
+
+static void *worker(void *arg) {
+    struct io_queue *q = arg;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->todo && !q->stop)
+            pthread_cond_wait(&q->work, &q->lock);
+        if (!q->todo)
+            break;
+        struct io_req *r = q->todo;
+        q->todo = r->next;
+        pthread_mutex_unlock(&q->lock);
+
+        ssize_t n = r->write ? pwrite(r->fd, r->buf, r->len, r->off) : pread(r->fd, r->buf, r->len, r->off);
+        r->res = n < 0 ? -errno : n;
+
+        pthread_mutex_lock(&q->lock);
+        r->next = q->done;
+        q->done = r;
+        pthread_cond_signal(&q->finished);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static int threads_init(struct io_queue *q) {
+    q->n_th = q->depth < IO_THREADS_MAX ? q->depth : IO_THREADS_MAX;
+    q->th = malloc(q->n_th * sizeof(*q->th));
+    if (!q->th)
+        return 1;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->finished, NULL);
+    for (unsigned i = 0; i < q->n_th; i++) {
+        if (pthread_create(&q->th[i], NULL, worker, q) != 0) {
+            q->n_th = i;
+            io_queue_free(q);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Opens a queue that keeps up to depth requests in flight.
+Returns 0 on success else 1, q->backend says what it ended up with
+*/
+int io_queue_init(struct io_queue *q, unsigned depth, enum io_backend backend) {
+    memset(q, 0, sizeof(*q));
+    q->depth = depth ? depth : 1;
+    q->ring_fd = -1;
+    if (backend != IO_THREADS && uring_init(q) == 0) {
+        q->backend = IO_URING;
+        return 0;
+    }
+    if (backend == IO_URING) {
+        printf("io_uring is not available\n");
+        return 1;
+    }
+    q->backend = IO_THREADS;
+    if (threads_init(q) != 0) {
+        printf("Unable to start I/O threads\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Waits for everything in flight, then tears the queue down
+void io_queue_free(struct io_queue *q) {
+    while (q->inflight && io_reap(q, true))
+        ;
+    if (q->backend == IO_URING) {
+        munmap(q->sqes, q->sq_entries * sizeof(struct io_uring_sqe));
+        if (q->cq_ptr != q->sq_ptr)
+            munmap(q->cq_ptr, q->cq_sz);
+        munmap(q->sq_ptr, q->sq_sz);
+        close(q->ring_fd);
+    } else if (q->th) {
+        pthread_mutex_lock(&q->lock);
+        q->stop = true;
+        pthread_cond_broadcast(&q->work);
+        pthread_mutex_unlock(&q->lock);
+        for (unsigned i = 0; i < q->n_th; i++)
+            pthread_join(q->th[i], NULL);
+        free(q->th);
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->work);
+        pthread_cond_destroy(&q->finished);
+    }
+    memset(q, 0, sizeof(*q));
+    q->ring_fd = -1;
+}
+
+/*
+Queues r, nothing reaches the kernel before io_submit.
+Returns 0 on success, 1 when depth requests are already queued or in flight
+*/
+int io_push(struct io_queue *q, struct io_req *r) {
+    if (q->queued + q->inflight >= q->depth)
+        return 1;
+    r->res = 0;
+    r->done = false;
+    if (q->backend == IO_URING) {
+        unsigned idx = q->tail & q->sq_mask;
+        struct io_uring_sqe *sqe = &q->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = r->fd;
+        sqe->addr = (uint64_t)(uintptr_t)r->buf;
+        sqe->len = r->len;
+        sqe->off = r->off;
+        sqe->user_data = (uint64_t)(uintptr_t)r;
+        q->sq_array[idx] = idx;
+        q->tail++;
+    } else {
+        r->next = NULL;
+        if (q->pend_tail)
+            q->pend_tail->next = r;
+        else
+            q->pend = r;
+        q->pend_tail = r;
+    }
+    q->queued++;
+    return 0;
+}
+
+// Hands every queued request over in one go, returns 0 on success else 1
+int io_submit(struct io_queue *q) {
+    if (q->queued == 0)
+        return 0;
+    q->submits++;
+    if (q->backend == IO_URING) {
+        __atomic_store_n(q->sq_tail, q->tail, __ATOMIC_RELEASE);
+        while (q->queued) {
+            int n = ring_enter(q->ring_fd, q->queued, 0, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                perror("io_uring_enter");
+                return 1;
+            }
+            q->queued -= n;
+            q->inflight += n;
+        }
+        return 0;
+    }
+    pthread_mutex_lock(&q->lock);
+    struct io_req **end = &q->todo;
+    while (*end)
+        end = &(*end)->next;
+    *end = q->pend;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    q->pend = q->pend_tail = NULL;
+    q->inflight += q->queued;
+    q->queued = 0;
+    return 0;
+}
+
+/*
+Takes one finished request off the queue, r->res holds bytes moved or -errno.
+Returns NULL when nothing is in flight, or nothing finished and wait is false
+*/
+struct io_req *io_reap(struct io_queue *q, bool wait) {
+    if (q->inflight == 0)
+        return NULL;
+    if (q->backend == IO_URING) {
+        for (;;) {
+            unsigned head = *q->cq_head;
+            if (head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &q->cqes[head & q->cq_mask];
+                struct io_req *r = (struct io_req *)(uintptr_t)cqe->user_data;
+                r->res = cqe->res;
+                r->done = true;
+                __atomic_store_n(q->cq_head, head + 1, __ATOMIC_RELEASE);
+                q->inflight--;
+                return r;
+            }
+            if (!wait)
+                return NULL;
+            if (ring_enter(q->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                perror("io_uring_enter");
+                return NULL;
+            }
+        }
+    }
+    pthread_mutex_lock(&q->lock);
+    while (!q->done && wait)
+        pthread_cond_wait(&q->finished, &q->lock);
+    struct io_req *r = q->done;
+    if (r) {
+        q->done = r->next;
+        q->inflight--;
+        r->done = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return r;
+}
+
+/*
+Runs n requests keeping the queue full, short transfers are resubmitted for the
+rest [r->buf, r->off and r->len move along]. Returns once all of them finished,
+0 if every one moved all its bytes else 1.
+Other requests already in flight on q may finish meanwhile, they are only
+marked done for whoever pushed them.
+*/
+int io_run(struct io_queue *q, struct io_req *reqs, unsigned n) {
+    unsigned next = 0, left = n;
+    int ret = 0;
+    while (left > 0) {
+        while (next < n && io_push(q, &reqs[next]) == 0)
+            next++;
+        if (io_submit(q) != 0) {
+            ret = 1;
+            // nothing new can go out, still wait for what's in flight
+            next = n;
+            left = q->inflight;
+            if (left == 0)
+                break;
+        }
+        struct io_req *r = io_reap(q, true);
+        if (!r) {
+            ret = 1;
+            break;
+        }
+        if (r < reqs || r >= reqs + n)
+            continue;
+        if (r->res > 0 && (size_t)r->res < r->len && ret == 0) {
+            r->buf = (char *)r->buf + r->res;
+            r->off += r->res;
+            r->len -= r->res;
+            if (io_push(q, r) == 0)
+                continue;
+        }
+        if (r->res < 0 || (size_t)r->res < r->len) {
+            if (ret == 0)
+                printf("I/O %s at %" PRIu64 " failed: %s\n", r->write ? "write" : "read", (uint64_t)r->off,
+                       r->res < 0 ? strerror((int)-r->res) : "short transfer");
+            ret = 1;
+        }
+        left--;
+    }
+    return ret;
+}
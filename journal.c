@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+/*
+Write-ahead journal
+Every metadata write [superblock, inodes, extent blocks, bitmap, name index]
+lands in an in-memory transaction of whole block images instead of going to
+its home location. Reads of metadata go through disk_read_meta so they see
+the transaction. disk_commit then:
+    1. appends the images to the journal area behind a header carrying the
+       target blocks and a checksum
+    2. fdatasync [the only sync, it also covers data blocks written in place]
+    3. checkpoints the images to their home blocks
+A commit can carry any number of operations as long as their images fit the
+journal, so batch paths pay one sync for many files [they commit once
+journal_full says so]. An image past that fails the write and marks the txn,
+disk_commit then drops it rather than make part of an op durable. After a
+crash, journal_recover replays every txn from the journal head whose checksum
+holds, so recovery reads at most the journal area.
+
+[ journal block 0 ]    journal super, where replay starts
+[ journal block 1.. ]  txn = header + images [+ header + images...], last header has last = 1
+*/
+
+#define JOURNAL_MAGIC 0x4A524E4C    // 'JRNL'
+
+struct journal_super {
+    uint32_t magic;
+    uint32_t head;           // block in the journal area where replay starts
+    uint64_t seq;            // seq of the txn at head
+    uint64_t ckpt_seq;       // txns below this were checkpointed ...
+    uint64_t boot;           // ... during this boot, so the page cache has them
+    uint32_t tail;           // where the txn ckpt_seq goes, 0 on disks from before it was kept
+    uint32_t reserved;
+};
+
+struct journal_header {
+    uint32_t magic;
+    uint16_t n;              // images after this header
+    uint16_t last;           // 1 on the final header of the txn
+    uint64_t seq;
+    uint64_t cksum;          // over seq, targets and images
+    uint64_t blocks[];       // home block of each image
+};
+
+// chains a checksum over buf, xxHash64 seeded with the previous value
+uint64_t cksum64(uint64_t h, const void *buf, size_t len) {
+    return xxh64(buf, len, h);
+}
+
+// identifies this boot, 0 if unknown [never trusted]
+static uint64_t boot_id() {
+    char id[64] = {0};
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!f)
+        return 0;
+    if (!fgets(id, sizeof(id), f))
+        id[0] = '\0';
+    fclose(f);
+    return id[0] ? name_hash(id) : 0;
+}
+
+static uint32_t per_header(const struct store_disk *d) {
+    return (d->sb.block - sizeof(struct journal_header)) / sizeof(uint64_t);
+}
+
+// blocks in the journal after the journal super
+static uint32_t area(const struct store_disk *d) {
+    return d->sb.journal_blocks - 1;
+}
+
+static off_t jblock_off(const struct store_disk *d, uint32_t jblk) {
+    return (off_t)(d->sb.journal_start + jblk) * d->sb.block;
+}
+
+// most images one txn can carry and still fit the journal, a last partial group counts too
+static uint32_t max_images(const struct store_disk *d) {
+    uint32_t p = per_header(d);
+    uint32_t full = area(d) / (p + 1), rest = area(d) % (p + 1);
+    return full * p + (rest ? rest - 1 : 0);
+}
+
+static uint64_t group_cksum(const struct journal_header *h, const char *img, uint32_t block) {
+    uint64_t c = cksum64(0xcbf29ce484222325ull, &h->seq, sizeof(h->seq));
+    c = cksum64(c, h->blocks, h->n * sizeof(uint64_t));
+    return cksum64(c, img, (size_t)h->n * block);
+}
+
+static int write_super(struct store_disk *d) {
+    struct journal_super js = { JOURNAL_MAGIC, d->j.head, d->j.head_seq, d->j.seq, d->j.boot, d->j.tail, 0 };
+    if (pwrite(d->fd, &js, sizeof(js), jblock_off(d, 0)) != sizeof(js)) {
+        perror("journal super write");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Looks for the txn at jblk with sequence seq, checks every group's checksum and
+when apply is set writes the images home.
+Returns blocks the txn spans, 0 if there is no valid txn there
+*/
+static uint32_t scan_txn(struct store_disk *d, uint32_t jblk, uint64_t seq, bool apply) {
+    uint32_t block = d->sb.block;
+    struct journal_header *h = malloc(block);
+    char *img = malloc((size_t)per_header(d) * block);
+    uint32_t pos = jblk;
+    bool valid = false;
+    if (!h || !img)
+        goto out;
+    for (;;) {
+        if (pos >= area(d) + 1 || pread(d->fd, h, block, jblock_off(d, pos)) != (ssize_t)block)
+            break;
+        if (h->magic != JOURNAL_MAGIC || h->seq != seq || h->n > per_header(d) || pos + 1 + h->n > area(d) + 1)
+            break;
+        size_t len = (size_t)h->n * block;
+        if (pread(d->fd, img, len, jblock_off(d, pos + 1)) != (ssize_t)len)
+            break;
+        if (group_cksum(h, img, block) != h->cksum)
+            break;
+        if (apply) {
+            for (uint32_t i = 0; i < h->n; i++) {
+                if (pwrite(d->fd, img + (size_t)i * block, block, (off_t)h->blocks[i] * block) != (ssize_t)block) {
+                    perror("journal replay");
+                    goto out;
+                }
+            }
+        }
+        pos += 1 + h->n;
+        if (h->last) {
+            valid = true;
+            break;
+        }
+    }
+out:
+    free(h);
+    free(img);
+    return valid ? pos - jblk : 0;
+}
+
+/*
+Called once a disk is open for writing. Replays committed txns that may not
+have reached their home blocks and positions the journal for new commits.
+Returns 0 on success else 1
+*/
+int journal_recover(struct store_disk *d) {
+    struct store_journal *j = &d->j;
+    j->boot = boot_id();
+    j->head = 1;
+    j->tail = 1;
+    j->seq = j->head_seq = 1;
+    if (d->sb.journal_blocks < 2)
+        return 0;
+
+    struct journal_super js;
+    if (pread(d->fd, &js, sizeof(js), jblock_off(d, 0)) != sizeof(js)) {
+        printf("Failed to read journal super\n");
+        return 1;
+    }
+    if (js.magic != JOURNAL_MAGIC) {
+        // fresh disk, the journal area is still the zeroed hole
+        return write_super(d);
+    }
+    j->head = js.head;
+    j->seq = j->head_seq = js.seq;
+
+    // find the end of the committed txns first, from where the last checkpoint of
+    // this boot got to when there is one, only what came after it needs a look
+    uint32_t pos = j->head;
+    uint64_t seq = j->seq;
+    if (js.boot != 0 && js.boot == j->boot && js.tail >= j->head && js.tail <= area(d) + 1 && js.ckpt_seq >= seq) {
+        pos = js.tail;
+        seq = js.ckpt_seq;
+    }
+    for (uint32_t n; (n = scan_txn(d, pos, seq, false)) > 0; pos += n)
+        seq++;
+
+    // everything was checkpointed in this boot, the page cache already has it
+    bool clean = js.boot != 0 && js.boot == j->boot && js.ckpt_seq == seq;
+    if (!clean && seq > j->seq) {
+        uint64_t t = now_ns();
+        pos = j->head;
+        reader_ckpt_begin(d, NULL, 0);
+        for (uint64_t s = j->seq; s < seq; s++)
+            pos += scan_txn(d, pos, s, true);
+        reader_ckpt_end(d);
+        if (fdatasync(d->fd) != 0) {
+            perror("journal replay sync");
+            return 1;
+        }
+        // stderr, `store read` owns stdout
+        fprintf(stderr, "Journal: replayed %" PRIu64 " txns [%" PRIu32 " blocks] in %.3f ms\n",
+               seq - j->seq, pos - j->head, (now_ns() - t) / 1e6);
+        // home blocks are durable now, start the journal over
+        j->head = 1;
+        j->head_seq = seq;
+        j->tail = 1;
+        j->seq = seq;
+        return write_super(d);
+    }
+    j->tail = pos;
+    j->seq = seq;
+    return 0;
+}
+
+static int txn_reserve(struct store_txn *t, uint32_t n, uint32_t block) {
+    if (n <= t->cap)
+        return 0;
+    uint32_t cap = t->cap ? t->cap * 2 : 16;
+    while (cap < n)
+        cap *= 2;
+    uint64_t *blk = realloc(t->blk, cap * sizeof(*blk));
+    if (!blk)
+        return 1;
+    t->blk = blk;
+    char *img = realloc(t->img, (size_t)cap * block);
+    if (!img)
+        return 1;
+    t->img = img;
+    t->cap = cap;
+    return 0;
+}
+
+static uint32_t slot_of(uint64_t blk, uint32_t n_slot) {
+    return (uint32_t)((blk * 0x9E3779B97F4A7C15ull) >> 32) & (n_slot - 1);
+}
+
+static int txn_rehash(struct store_txn *t, uint32_t n_slot) {
+    uint32_t *slot = calloc(n_slot, sizeof(*slot));
+    if (!slot)
+        return 1;
+    for (uint32_t i = 0; i < t->n; i++) {
+        uint32_t s = slot_of(t->blk[i], n_slot);
+        while (slot[s])
+            s = (s + 1) & (n_slot - 1);
+        slot[s] = i + 1;
+    }
+    free(t->slot);
+    t->slot = slot;
+    t->n_slot = n_slot;
+    return 0;
+}
+
+// image of blk in the open txn, NULL if the txn hasn't touched it
+static char *txn_find(struct store_disk *d, uint64_t blk) {
+    struct store_txn *t = &d->j.txn;
+    if (t->n == 0)
+        return NULL;
+    for (uint32_t s = slot_of(blk, t->n_slot); t->slot[s]; s = (s + 1) & (t->n_slot - 1)) {
+        if (t->blk[t->slot[s] - 1] == blk)
+            return t->img + (size_t)(t->slot[s] - 1) * d->sb.block;
+    }
+    return NULL;
+}
+
+// image of blk in the open txn, pulled in from disk on first touch
+static char *txn_get(struct store_disk *d, uint64_t blk) {
+    struct store_txn *t = &d->j.txn;
+    char *img = txn_find(d, blk);
+    if (img)
+        return img;
+    // committing here would make half an op durable with the bitmap and superblock behind it
+    if (t->n + 1 > max_images(d)) {
+        if (!t->over)
+            printf("Transaction is too large for the journal (%" PRIu32 " blocks), it is dropped\n", max_images(d));
+        t->over = true;
+        return NULL;
+    }
+    if (txn_reserve(t, t->n + 1, d->sb.block) != 0)
+        return NULL;
+    if ((t->n + 1) * 2 > t->n_slot && txn_rehash(t, t->n_slot ? t->n_slot * 2 : 64) != 0)
+        return NULL;
+    img = t->img + (size_t)t->n * d->sb.block;
+    if (d->cache ? cache_read(d, (off_t)blk * d->sb.block, img, d->sb.block) != 0
+                 : pread(d->fd, img, d->sb.block, (off_t)blk * d->sb.block) != (ssize_t)d->sb.block) {
+        printf("Failed to read metadata block %" PRIu64 "\n", blk);
+        return NULL;
+    }
+    t->blk[t->n] = blk;
+    uint32_t s = slot_of(blk, t->n_slot);
+    while (t->slot[s])
+        s = (s + 1) & (t->n_slot - 1);
+    t->slot[s] = ++t->n;
+    return img;
+}
+
+int disk_write_meta(struct store_disk *d, off_t off, const void *buf, size_t len) {
+    uint32_t block = d->sb.block;
+    const char *src = buf;
+    while (len > 0) {
+        uint64_t blk = off / block;
+        size_t in = off % block;
+        size_t n = block - in < len ? block - in : len;
+        char *img = txn_get(d, blk);
+        if (!img)
+            return 1;
+        memcpy(img + in, src, n);
+        off += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// pread that sees metadata written by the open txn, through the block cache when there is one
+int disk_read_meta(struct store_disk *d, off_t off, void *buf, size_t len) {
+    // a reader has no txn and checkpoints may be going on under it
+    if (d->rd.slot)
+        return reader_read(d, off, buf, len);
+    if (d->cache && len <= CACHE_BYPASS) {
+        if (cache_read(d, off, buf, len) != 0)
+            return 1;
+    } else if (pread(d->fd, buf, len, off) != (ssize_t)len) {
+        return 1;
+    }
+    if (d->j.txn.n == 0)
+        return 0;
+    uint32_t block = d->sb.block;
+    for (uint64_t blk = off / block; (off_t)(blk * block) < off + (off_t)len; blk++) {
+        const char *img = txn_find(d, blk);
+        if (!img)
+            continue;
+        off_t b_start = (off_t)(blk * block);
+        off_t from = b_start > off ? b_start : off;
+        off_t to = b_start + block < off + (off_t)len ? b_start + block : off + (off_t)len;
+        memcpy((char *)buf + (from - off), img + (from - b_start), to - from);
+    }
+    return 0;
+}
+
+static int cmp_target(const void *a, const void *b, void *arg) {
+    const uint64_t *blk = arg;
+    uint64_t x = blk[*(const uint32_t *)a], y = blk[*(const uint32_t *)b];
+    return x < y ? -1 : x > y;
+}
+
+/*
+Commits the open txn, see the top of this file.
+Returns 0 on success else 1 [the txn is dropped either way]
+*/
+int journal_commit(struct store_disk *d) {
+    struct store_journal *j = &d->j;
+    struct store_txn *t = &j->txn;
+    if (t->n == 0)
+        return 0;
+    uint32_t block = d->sb.block;
+    uint32_t per = per_header(d);
+    uint32_t groups = (t->n + per - 1) / per;
+    uint32_t need = groups + t->n;
+    int ret = 1;
+
+    // one header per group, every header and image run goes out in the same batch
+    char *hdrs = calloc(groups, block);
+    uint32_t *order = malloc(t->n * sizeof(*order));
+    struct io_req *reqs = calloc(t->n > 2 * groups ? t->n : 2 * groups, sizeof(*reqs));
+    if (!hdrs || !order || !reqs)
+        goto out;
+
+    if (j->tail + need > area(d) + 1) {
+        // wrap, everything before is checkpointed so make it durable and start over
+        if (fdatasync(d->fd) != 0) {
+            perror("journal sync");
+            goto out;
+        }
+        j->head = j->tail = 1;
+        j->head_seq = j->seq;
+        j->ios += 2;
+        if (write_super(d) != 0)
+            goto out;
+    }
+
+    uint32_t pos = j->tail;
+    for (uint32_t g = 0; g < groups; g++) {
+        uint32_t first = g * per;
+        struct journal_header *h = (struct journal_header *)(hdrs + (size_t)g * block);
+        h->magic = JOURNAL_MAGIC;
+        h->n = t->n - first < per ? t->n - first : per;
+        h->last = g + 1 == groups;
+        h->seq = j->seq;
+        memcpy(h->blocks, t->blk + first, h->n * sizeof(uint64_t));
+        char *img = t->img + (size_t)first * block;
+        h->cksum = group_cksum(h, img, block);
+        reqs[2 * g] = (struct io_req){ .buf = h, .len = block, .off = jblock_off(d, pos) };
+        reqs[2 * g + 1] = (struct io_req){ .buf = img, .len = (size_t)h->n * block, .off = jblock_off(d, pos + 1) };
+        pos += 1 + h->n;
+    }
+    j->ios += 2 * groups + 1;
+    if (disk_write_batch(d, reqs, 2 * groups) != 0) {
+        printf("Journal write failed\n");
+        goto out;
+    }
+    // one sync makes the txn and every data block written before it durable
+    if (fdatasync(d->fd) != 0) {
+        perror("journal sync");
+        goto out;
+    }
+    j->tail = pos;
+    j->seq++;
+    j->commits++;
+
+    // checkpoint in block order, all in flight at once, nothing waits on these until the next wrap
+    for (uint32_t i = 0; i < t->n; i++)
+        order[i] = i;
+    qsort_r(order, t->n, sizeof(*order), cmp_target, t->blk);
+    for (uint32_t i = 0; i < t->n; i++) {
+        uint32_t k = order[i];
+        reqs[i] = (struct io_req){ .buf = t->img + (size_t)k * block, .len = block, .off = (off_t)t->blk[k] * block };
+    }
+    j->ios += t->n + 1;
+    reader_ckpt_begin(d, t->blk, t->n);
+    int cp = disk_write_batch(d, reqs, t->n);
+    reader_ckpt_end(d);
+    // cached home copies follow the checkpoint, or go if it's unclear what landed
+    for (uint32_t i = 0; i < t->n; i++) {
+        if (cp == 0)
+            cache_update(d, t->blk[i], t->img + (size_t)i * block);
+        else
+            cache_drop(d, (off_t)t->blk[i] * block, block);
+    }
+    if (cp != 0) {
+        // committed anyway, recovery will finish the job
+        printf("Journal checkpoint failed\n");
+        goto out;
+    }
+    ret = write_super(d);
+out:
+    free(hdrs);
+    free(order);
+    free(reqs);
+    journal_abort(d);
+    return ret;
+}
+
+/*
+The open txn should be committed before another file goes in: once the commit
+adds the bitmap and the superblock, less than a quarter of the journal would
+be left [room for a file of ordinary size, a bigger one fails alone]
+*/
+bool journal_full(const struct store_disk *d) {
+    uint32_t max = max_images(d);
+    return d->j.txn.n + d->alloc.map_blocks + 1 + max / 4 >= max;
+}
+
+// Drops the open txn without writing anything
+void journal_abort(struct store_disk *d) {
+    struct store_txn *t = &d->j.txn;
+    t->n = 0;
+    t->over = false;
+    if (t->slot)
+        memset(t->slot, 0, t->n_slot * sizeof(*t->slot));
+}
+
+void journal_free_mem(struct store_disk *d) {
+    struct store_txn *t = &d->j.txn;
+    free(t->blk);
+    free(t->img);
+    free(t->slot);
+    memset(t, 0, sizeof(*t));
+}
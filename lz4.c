@@ -0,0 +1,194 @@
+#include "store.h"
+
+/*
+LZ4 block codec
+Own implementation of the LZ4 block format [no frame, no checksum], so output
+can be read by any LZ4 decoder and we don't need the library at build time.
+A block is a run of sequences:
+    token [literal len:4 | match len - 4:4], more literal len bytes, literals,
+    match offset [2 bytes LE], more match len bytes
+The last sequence is literals only, the last match starts at least LZ4_MFLIMIT
+bytes before the end and the last LZ4_LAST_LITERALS bytes are always literals.
+*/
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_MFLIMIT 12
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 12
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// bytes p and r have in common, a word at a time, stopping at limit
+static size_t match_len(const uint8_t *p, const uint8_t *r, const uint8_t *limit) {
+    const uint8_t *start = p;
+    while (p + 8 <= limit) {
+        uint64_t diff = read64(p) ^ read64(r);
+        if (diff)
+            return p - start + (__builtin_ctzll(diff) >> 3);
+        p += 8;
+        r += 8;
+    }
+    while (p < limit && *p == *r) {
+        p++;
+        r++;
+    }
+    return p - start;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// length past the 15 that fits in the token, 255 per byte
+static uint8_t *put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_seq(uint8_t *op, const uint8_t *lit, size_t n_lit, size_t off, size_t m_len) {
+    uint8_t *token = op++;
+    *token = (uint8_t)((n_lit < 15 ? n_lit : 15) << 4);
+    if (n_lit >= 15)
+        op = put_len(op, n_lit - 15);
+    memcpy(op, lit, n_lit);
+    op += n_lit;
+    if (off == 0)
+        return op;
+    *op++ = (uint8_t)off;
+    *op++ = (uint8_t)(off >> 8);
+    m_len -= LZ4_MIN_MATCH;
+    *token |= m_len < 15 ? m_len : 15;
+    if (m_len >= 15)
+        op = put_len(op, m_len - 15);
+    return op;
+}
+
+// worst case bytes put_seq needs
+static size_t seq_bound(size_t n_lit, size_t m_len) {
+    return 1 + n_lit / 255 + 1 + n_lit + 2 + m_len / 255 + 1;
+}
+
+/*
+Compresses n bytes [n < 4GB] of src into dst, greedy matching over a 4K entry hash table.
+Skips ahead faster the longer it goes without a match so random data costs little.
+Returns the compressed size, 0 if it doesn't fit in cap
+*/
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t cap) {
+    const uint8_t *in = src, *ip = in, *anchor = in, *end = in + n;
+    uint8_t *op = dst, *o_end = op + cap;
+    uint32_t table[1 << LZ4_HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    if (n > LZ4_MFLIMIT) {
+        const uint8_t *mf_limit = end - LZ4_MFLIMIT, *match_limit = end - LZ4_LAST_LITERALS;
+        uint32_t misses = 0;
+        while (ip < mf_limit) {
+            uint32_t v = read32(ip);
+            uint32_t h = hash4(v);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != v) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + LZ4_MIN_MATCH;
+            m += match_len(m, ref + LZ4_MIN_MATCH, match_limit);
+            size_t n_lit = ip - anchor, m_len = m - ip;
+            if ((size_t)(o_end - op) < seq_bound(n_lit, m_len))
+                return 0;
+            op = put_seq(op, anchor, n_lit, ip - ref, m_len);
+            ip = anchor = m;
+            // seed the table inside the match too, helps the next lookup
+            table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+        }
+    }
+    size_t n_lit = end - anchor;
+    if ((size_t)(o_end - op) < seq_bound(n_lit, 0))
+        return 0;
+    op = put_seq(op, anchor, n_lit, 0, 0);
+    return op - (uint8_t *)dst;
+}
+
+static bool get_len(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/*
+Decompresses n bytes of src into dst, never reading or writing out of bounds
+whatever src holds.
+Returns the decompressed size, -1 if src is corrupt or doesn't fit in cap
+*/
+ssize_t lz4_decompress(const void *src, size_t n, void *dst, size_t cap) {
+    const uint8_t *ip = src, *end = ip + n;
+    uint8_t *op = dst, *o_start = op, *o_end = op + cap;
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && !get_len(&ip, end, &n_lit))
+            return -1;
+        if (n_lit > (size_t)(end - ip) || n_lit > (size_t)(o_end - op))
+            return -1;
+        if (end - ip >= 16 && o_end - op >= 16) {
+            // short literals [the common case] as one fixed 16 byte copy
+            memcpy(op, ip, 16);
+            if (n_lit > 16)
+                memcpy(op + 16, ip + 16, n_lit - 16);
+        } else {
+            memcpy(op, ip, n_lit);
+        }
+        op += n_lit;
+        ip += n_lit;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t m_len = token & 15;
+        if (m_len == 15 && !get_len(&ip, end, &m_len))
+            return -1;
+        m_len += LZ4_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - o_start) || m_len > (size_t)(o_end - op))
+            return -1;
+        const uint8_t *m = op - off;
+        if (off >= 8 && (size_t)(o_end - op) >= m_len + 8) {
+            // 8 byte chunks, even when overlapping each chunk reads bytes already
+            // written, the last one may spill past the match into space we own
+            for (size_t i = 0; i < m_len; i += 8)
+                memcpy(op + i, m + i, 8);
+        } else if (off >= m_len) {
+            memcpy(op, m, m_len);
+        } else {
+            for (size_t i = 0; i < m_len; i++)
+                op[i] = m[i];
+        }
+        op += m_len;
+    }
+    return op - o_start;
+}
@@ -0,0 +1,248 @@
+#include "store.h"
+
+/*
+File level operations on an open disk, shared by the commands and the daemon.
+None of them commit, the caller decides when the open txn goes to disk, so the
+daemon can put many of them in one commit.
+They return an enum op_status, ST_OK is 0.
+*/
+
+static const char *status_names[] = {
+    [ST_OK] = "ok",
+    [ST_ERR] = "failed",
+    [ST_NOENT] = "no such file",
+    [ST_INVAL] = "invalid request",
+    [ST_NOSPC] = "not enough space",
+};
+
+const char *op_status_name(int st) {
+    if (st < 0 || st >= (int)(sizeof(status_names) / sizeof(status_names[0])))
+        return "unknown status";
+    return status_names[st];
+}
+
+/*
+Writes src into the file called name. A plain write replaces the contents [new
+data goes to fresh blocks, the old blocks are freed once the inode points at the
+new ones], append adds to the end of an existing file. Small files are inlined
+or packed the same way, old slots are freed once the inode is stored.
+compression is an enum store_compression for this file, -1 keeps the file's
+own setting [or the disk's for new files], appends always keep the file's.
+key works the same way for encryption, 0 stores the file in the clear and 1-255
+encrypts it with that key [see crypt.c], which has to be loaded.
+On failure every block the write took is handed back and nothing it touched is
+left in the open txn that could point at them, other work in the txn stays.
+*/
+int op_write(struct store_disk *d, const char *name, struct data_src *src, bool append, int compression,
+             int key, struct write_stats *ws) {
+    if (strlen(name) >= INODE_NAME) {
+        printf("Name %s is longer than %d chars\n", name, INODE_NAME - 1);
+        return ST_INVAL;
+    }
+    if (key > 255) {
+        printf("Key ids go from 1 to 255\n");
+        return ST_INVAL;
+    }
+    if ((!d->alloc.map && alloc_load(d) != 0) || data_src_open(src) != 0)
+        return ST_ERR;
+    uint64_t t_start = now_ns(), bytes = ws->bytes, syscalls = ws->syscalls;
+
+    struct store_file f = {0}, old = {0};
+    struct store_inode ino;
+    int found = index_lookup(d, name, &ino);
+    if (found < 0)
+        return ST_ERR;
+    if (found > 0 && append) {
+        printf("%s does not exist\n", name);
+        return ST_NOENT;
+    }
+    if (found == 0 && (ino.flags & FLAG_DIRECTORY)) {
+        printf("%s is a directory\n", name);
+        return ST_INVAL;
+    }
+    if (found == 0 && file_load(d, ino.inode_id, append ? &f : &old) != 0)
+        return ST_ERR;
+    if (append) {
+        compression = -1;
+        key = -1;
+    } else if (found == 0) {
+        f.ino = old.ino;
+        f.ino.size = 0;
+        f.ino.block_count = 0;
+        f.ino.ext_block = 0;
+        f.ino.n_extents = 0;
+        f.ino.prealloc = 0;
+        f.ino.flags &= ~(FLAG_INLINE | FLAG_PACKED);
+        memset(f.ino.extents, 0, sizeof(f.ino.extents));
+        // rewritten data goes to fresh blocks, they follow the disk's checksum setting
+        f.ino.data_cksum = d->sb.csum_blocks ? d->sb.checksum : CK_NONE;
+    } else {
+        f.ino.inode_id = inode_alloc(d);
+        if (f.ino.inode_id == 0) {
+            printf("No free inodes left on disk\n");
+            return ST_NOSPC;
+        }
+        // inode inherits flags and compression from sb
+        f.ino.flags = d->sb.flags & ~FLAG_DIRECTORY;
+        if (dir_hidden(name))
+            f.ino.flags |= FLAG_HIDDEN;
+        f.ino.compression = d->sb.compression;
+        f.ino.data_cksum = d->sb.csum_blocks ? d->sb.checksum : CK_NONE;
+        f.ino.key = f.ino.flags & FLAG_ENCRYPTED ? d->sb.key : 0;
+        strcpy(f.ino.name, name);
+    }
+    if (compression >= 0) {
+        f.ino.compression = compression;
+        if (compression != COMP_NONE)
+            f.ino.flags |= FLAG_COMPRESSION;
+        else
+            f.ino.flags &= ~FLAG_COMPRESSION;
+    }
+    if (key >= 0) {
+        f.ino.key = key;
+        if (key)
+            f.ino.flags |= FLAG_ENCRYPTED;
+        else
+            f.ino.flags &= ~FLAG_ENCRYPTED;
+    }
+    bool missing;
+    crypt_file_key(&f.ino, &missing);
+    // encrypted blocks are only ever written with a MAC, see crypt.c
+    if ((f.ino.flags & FLAG_ENCRYPTED) && !d->sb.csum_blocks && !missing) {
+        printf("%s can't be encrypted, the disk has no checksum table to keep MACs in [-ck off]\n", name);
+        missing = true;
+    }
+    if (missing) {
+        file_put(&f);
+        file_put(&old);
+        return ST_INVAL;
+    }
+    // compressed or deduplicated data may still fit, the rest can be checked up front
+    uint64_t block = d->sb.block;
+    uint64_t pos = append ? f.ino.size : 0;
+    if (src->size_known && f.ino.compression == COMP_NONE && !d->sb.dedup_blocks &&
+        (pos + src->size + block - 1) / block > f.ino.block_count + d->alloc.n_free) {
+        printf("Data to be written is more than the space available\n");
+        file_put(&f);
+        file_put(&old);
+        return ST_NOSPC;
+    }
+
+    // data_write moves a packed file to new slots or to blocks, the old slots go once it's stored
+    struct store_inode was = f.ino;
+    uint64_t pack_blk = d->sb.pack_blk;
+    alloc_mark(d);
+    int ret = data_write(d, &f, pos, src, ws);
+    // the name goes in before the inode, so a failed insert leaves no live inode behind
+    bool inserted = false;
+    if (ret == 0 && found != 0) {
+        ret = dir_link(d, name, f.ino.inode_id, f.ino.flags);
+        inserted = ret == 0;
+    }
+    if (ret == 0)
+        ret = file_store(d, &f);
+    bool new_slots = (f.ino.flags & FLAG_PACKED) && !((was.flags & FLAG_PACKED) &&
+                     was.pack.pblk == f.ino.pack.pblk && was.pack.slot == f.ino.pack.slot);
+    if (ret == 0) {
+        alloc_keep(d);
+        file_release(d, &old);
+        if (append && (was.flags & FLAG_PACKED) && pack_free(d, &was) != 0)
+            printf("Lost track of the old pack slots of %s, they stay used\n", name);
+    } else {
+        if (inserted)
+            dir_unlink(d, name, f.ino.inode_id);
+        if (new_slots)
+            pack_free(d, &f.ino);
+        // a pack block the write started is handed back by the undo
+        d->sb.pack_blk = pack_blk;
+        if (alloc_undo(d) != 0)
+            printf("Lost track of blocks taken by the failed write, they stay used\n");
+    }
+    file_put(&f);
+    file_put(&old);
+    stats_op(append ? SO_APPEND : SO_WRITE, now_ns() - t_start, ws->bytes - bytes, ws->syscalls - syscalls);
+    return ret ? ST_ERR : ST_OK;
+}
+
+// Loads the file called name into f, f needs file_put after ST_OK. Directories aren't files [ST_INVAL]
+int op_open(struct store_disk *d, const char *name, struct store_file *f) {
+    struct store_inode ino;
+    int found = index_lookup(d, name, &ino);
+    if (found < 0)
+        return ST_ERR;
+    if (found > 0)
+        return ST_NOENT;
+    if (ino.flags & FLAG_DIRECTORY) {
+        printf("%s is a directory\n", name);
+        return ST_INVAL;
+    }
+    return file_load(d, ino.inode_id, f) == 0 ? ST_OK : ST_ERR;
+}
+
+/*
+Removes the file called name. Its blocks are freed [shared ones lose an owner]
+and its inode slot is free once the txn commits. An empty directory goes the
+same way [dir_remove], one with entries is ST_INVAL.
+*/
+int op_delete(struct store_disk *d, const char *name) {
+    if (!d->alloc.map && alloc_load(d) != 0)
+        return ST_ERR;
+    uint64_t t_start = now_ns();
+    struct store_inode ino;
+    int found = index_lookup(d, name, &ino);
+    if (found != 0)
+        return found < 0 ? ST_ERR : ST_NOENT;
+    if (ino.flags & FLAG_DIRECTORY)
+        return dir_remove(d, &ino);
+    struct store_file f;
+    if (file_load(d, ino.inode_id, &f) != 0)
+        return ST_ERR;
+    // the name and the slot go first, blocks are only let go once nothing points at them
+    int ret = dir_unlink(d, name, f.ino.inode_id) != 0 || inode_free(d, f.ino.inode_id) != 0;
+    if (ret == 0)
+        file_release(d, &f);
+    file_put(&f);
+    stats_op(SO_DELETE, now_ns() - t_start, 0, 0);
+    return ret ? ST_ERR : ST_OK;
+}
+
+// Walks the inode table for op_list and op_list_snapshots, flags picks which inodes fn gets
+static int scan(struct store_disk *d, uint32_t flags, int (*fn)(const struct store_inode *ino, void *arg),
+                void *arg) {
+    uint32_t per_read = INIT_BATCH / sizeof(struct store_inode);
+    struct store_inode *batch = malloc(INIT_BATCH);
+    if (!batch)
+        return ST_ERR;
+    int ret = ST_OK;
+    uint64_t t_start = now_ns(), bytes = 0;
+    off_t table = (off_t)d->sb.inode_start * d->sb.block;
+    for (uint64_t first = 1; first <= d->sb.inode_count && ret == ST_OK; first += per_read) {
+        uint64_t n = d->sb.inode_count - first + 1 < per_read ? d->sb.inode_count - first + 1 : per_read;
+        if (disk_read_meta(d, table + (off_t)(first - 1) * sizeof(*batch), batch, n * sizeof(*batch)) != 0) {
+            printf("Failed to read inode table\n");
+            ret = ST_ERR;
+            break;
+        }
+        bytes += n * sizeof(*batch);
+        for (uint64_t i = 0; i < n && ret == ST_OK; i++)
+            if (batch[i].inode_id != 0 && (batch[i].flags & (FLAG_SNAPSHOT | FLAG_DIRECTORY)) == flags)
+                ret = fn(&batch[i], arg);
+    }
+    free(batch);
+    stats_op(SO_LIST, now_ns() - t_start, bytes, 0);
+    return ret;
+}
+
+/*
+Calls fn for every file on the disk in inode table order, stops early when fn
+returns nonzero and hands that back. Snapshots aren't files, see op_list_snapshots,
+and neither are directories [dir_list].
+*/
+int op_list(struct store_disk *d, int (*fn)(const struct store_inode *ino, void *arg), void *arg) {
+    return scan(d, 0, fn, arg);
+}
+
+// op_list for the snapshots on the disk, fn gets each snapshot's own inode
+int op_list_snapshots(struct store_disk *d, int (*fn)(const struct store_inode *ino, void *arg), void *arg) {
+    return scan(d, FLAG_SNAPSHOT, fn, arg);
+}
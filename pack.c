@@ -0,0 +1,191 @@
+#include "store.h"
+
+/*
+Small files
+Files of at most INODE_INLINE bytes live in the inode itself, in the space the
+extent list would take. Anything else up to sb.pack_max bytes is packed into
+PACK_SLOT sized slots of a shared data block, a pack block:
+  slot 0..      header [struct store_pack_block], slot bitmap
+  next slots    file data, every file takes a run of whole slots
+New files go to the pack block in sb.pack_blk, when it has no run long enough a
+fresh one takes its place. Pack blocks go through the journal like metadata, so
+a file's data, its slots and its inode are always committed together and a
+block other files still live in is never half written. A pack block is freed
+once its last file is gone.
+*/
+
+static uint32_t pack_slots(uint32_t block) {
+    return block / PACK_SLOT;
+}
+
+// slots the header and its bitmap take
+static uint32_t hdr_slots(uint32_t block) {
+    size_t hdr = sizeof(struct store_pack_block) + (pack_slots(block) + 63) / 64 * sizeof(uint64_t);
+    return (hdr + PACK_SLOT - 1) / PACK_SLOT;
+}
+
+// Largest file a pack block of this block size holds, what init puts in sb.pack_max
+uint32_t pack_capacity(uint32_t block) {
+    return (pack_slots(block) - hdr_slots(block)) * PACK_SLOT;
+}
+
+static uint32_t pack_cksum(const struct store_disk *d, struct store_pack_block *pb) {
+    uint32_t saved = pb->cksum;
+    pb->cksum = 0;
+    uint32_t c = crc32c(0, pb, d->sb.block);
+    pb->cksum = saved;
+    return c;
+}
+
+static int pack_load(struct store_disk *d, uint64_t pblk, struct store_pack_block *pb) {
+    if (disk_read_meta(d, (off_t)pblk * d->sb.block, pb, d->sb.block) != 0 || pb->magic != PACK_MAGIC ||
+        pb->cksum != pack_cksum(d, pb)) {
+        printf("Corrupt pack block %" PRIu64 "\n", pblk);
+        return 1;
+    }
+    return 0;
+}
+
+static int pack_put(struct store_disk *d, uint64_t pblk, struct store_pack_block *pb) {
+    pb->cksum = pack_cksum(d, pb);
+    return disk_write_meta(d, (off_t)pblk * d->sb.block, pb, d->sb.block);
+}
+
+static bool slot_used(const struct store_pack_block *pb, uint32_t s) {
+    return pb->map[s / 64] >> (s % 64) & 1;
+}
+
+static void slots_set(struct store_pack_block *pb, uint32_t s, uint32_t n, bool used) {
+    for (uint32_t i = s; i < s + n; i++) {
+        if (used)
+            pb->map[i / 64] |= 1ull << (i % 64);
+        else
+            pb->map[i / 64] &= ~(1ull << (i % 64));
+    }
+}
+
+// First run of n free slots, 0 if there is none [slot 0 is always the header's]
+static uint32_t find_run(const struct store_pack_block *pb, uint32_t slots, uint32_t n) {
+    uint32_t run = 0;
+    for (uint32_t s = 0; s < slots; s++) {
+        run = slot_used(pb, s) ? 0 : run + 1;
+        if (run == n)
+            return s + 1 - n;
+    }
+    return 0;
+}
+
+static void pack_init(struct store_disk *d, struct store_pack_block *pb) {
+    memset(pb, 0, d->sb.block);
+    pb->magic = PACK_MAGIC;
+    slots_set(pb, 0, hdr_slots(d->sb.block), true);
+}
+
+/*
+Stores len bytes [<= sb.pack_max] of data as ino's contents, inline or in a
+pack block, and sets ino's flags and size to match. Whatever ino held before is
+left alone, the caller frees old slots once the new inode is in place.
+Returns 0 on success else 1
+*/
+int pack_store(struct store_disk *d, struct store_inode *ino, const char *data, uint64_t len) {
+    ino->flags &= ~(FLAG_INLINE | FLAG_PACKED);
+    ino->size = len;
+    ino->block_count = 0;
+    ino->ext_block = 0;
+    ino->n_extents = 0;
+    memset(ino->inline_data, 0, sizeof(ino->inline_data));
+    if (len <= INODE_INLINE) {
+        memcpy(ino->inline_data, data, len);
+        ino->flags |= FLAG_INLINE;
+        return 0;
+    }
+    if (len > d->sb.pack_max) {
+        printf("%" PRIu64 " bytes don't fit in a pack block\n", len);
+        return 1;
+    }
+    uint32_t slots = pack_slots(d->sb.block);
+    uint32_t need = (len + PACK_SLOT - 1) / PACK_SLOT;
+    struct store_pack_block *pb = malloc(d->sb.block);
+    if (!pb)
+        return 1;
+    uint64_t pblk = d->sb.pack_blk;
+    uint32_t slot = 0;
+    if (pblk && pack_load(d, pblk, pb) == 0)
+        slot = find_run(pb, slots, need);
+    if (slot == 0) {
+        // the old block stays where its files are, new ones go to a fresh block next to it
+        if (alloc_extent(d, 1, pblk ? pblk + 1 : 0, &pblk) != 1) {
+            printf("Out of data blocks\n");
+            free(pb);
+            return 1;
+        }
+        pack_init(d, pb);
+        slot = hdr_slots(d->sb.block);
+        d->sb.pack_blk = pblk;
+    }
+    slots_set(pb, slot, need, true);
+    pb->used += need;
+    char *p = (char *)pb + (size_t)slot * PACK_SLOT;
+    memcpy(p, data, len);
+    memset(p + len, 0, (size_t)need * PACK_SLOT - len);
+    int ret = pack_put(d, pblk, pb);
+    free(pb);
+    if (ret == 0) {
+        ino->pack.pblk = pblk;
+        ino->pack.slot = slot;
+        ino->pack.n_slots = need;
+        ino->flags |= FLAG_PACKED;
+    }
+    return ret;
+}
+
+/*
+Gives ino's slots back. An emptied pack block goes back to the allocator, one
+with more room than the current pack block takes its place.
+Returns 0 on success else 1
+*/
+int pack_free(struct store_disk *d, const struct store_inode *ino) {
+    if (!(ino->flags & FLAG_PACKED))
+        return 0;
+    uint64_t pblk = ino->pack.pblk;
+    struct store_pack_block *pb = malloc(d->sb.block), *cur = NULL;
+    if (!pb || pack_load(d, pblk, pb) != 0) {
+        free(pb);
+        return 1;
+    }
+    slots_set(pb, ino->pack.slot, ino->pack.n_slots, false);
+    pb->used -= pb->used < ino->pack.n_slots ? pb->used : ino->pack.n_slots;
+    int ret = 0;
+    if (pblk == d->sb.pack_blk) {
+        ret = pack_put(d, pblk, pb);
+    } else if (pb->used == 0) {
+        alloc_release(d, pblk, 1);
+    } else if ((ret = pack_put(d, pblk, pb)) == 0) {
+        cur = d->sb.pack_blk ? malloc(d->sb.block) : NULL;
+        if (!d->sb.pack_blk || (cur && (pack_load(d, d->sb.pack_blk, cur) != 0 || cur->used > pb->used)))
+            d->sb.pack_blk = pblk;
+    }
+    free(cur);
+    free(pb);
+    return ret;
+}
+
+/*
+Points at ino's bytes, inside ino for inline files, else read into blk [one
+block] and checked against the pack block's checksum.
+Returns NULL if the pack block is corrupt or the inode points outside it
+*/
+const char *pack_data(struct store_disk *d, const struct store_inode *ino, char *blk) {
+    if (ino->flags & FLAG_INLINE)
+        return ino->size <= INODE_INLINE ? ino->inline_data : NULL;
+    struct store_pack_block *pb = (struct store_pack_block *)blk;
+    uint32_t slots = pack_slots(d->sb.block);
+    if (pack_load(d, ino->pack.pblk, pb) != 0)
+        return NULL;
+    if (ino->pack.slot < hdr_slots(d->sb.block) || ino->pack.slot + ino->pack.n_slots > slots ||
+        ino->size > (uint64_t)ino->pack.n_slots * PACK_SLOT) {
+        printf("Inode %" PRIu32 " points outside its pack block\n", ino->inode_id);
+        return NULL;
+    }
+    return blk + (size_t)ino->pack.slot * PACK_SLOT;
+}
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+/*
+Readers alongside the writer
+One writer [the daemon or a command holding the disk lock] changes the disk
+while any number of threads and processes read it, none of them take a lock.
+They meet in the disk name + ".readers" file, mapped by every handle:
+
+    ver[]     version counter per metadata block [striped, block % READER_STRIPES].
+              A checkpoint makes the counters of the blocks it writes home odd,
+              writes them, and makes them even again. A reader notes the
+              counters of what it reads, waits out odd ones and reads again
+              when they moved, so every metadata read sees a block whole,
+              from before or after a checkpoint [reader_read].
+    epoch     bumped after every checkpoint.
+    slot[]    epoch each reader came in at [reader_enter], 0 when free.
+    retired[] runs of blocks a commit freed, with the epoch after it. A reader
+              that came in before that epoch may have the old inode and read
+              them, so they are only handed out again once every slot is past
+              it [alloc_retire, alloc_reclaim].
+
+Data blocks never change under a reader: a plain write goes to fresh blocks,
+extent chains are written to fresh blocks too [file_store], and what the old
+version pointed at is retired. The one thing written in place is the partial
+last block of an append, past the old EOF, so reader_open keeps the checksum
+that block had with the inode it loaded.
+A file is loaded as of one version: the counter of its inode's block is noted
+before the inode is read and checked once the extents [and the bytes of a
+packed file] are in, any checkpoint that touched the inode in between makes
+the reader load it again [reader_open].
+*/
+
+static void table_path(const char *disk_path, char *out, size_t cap) {
+    snprintf(out, cap, "%s.readers", disk_path);
+}
+
+/*
+Maps the readers table of the disk at path, making it when there is none.
+A disk that can't have one [read-only directory, a table from another build]
+is read without it, as before there was one.
+Returns 0, the table is optional
+*/
+int reader_attach(struct store_disk *d, const char *path, bool writer) {
+    char tp[PATH_MAX + 16];
+    table_path(path, tp, sizeof(tp));
+    d->rd = (struct reader_state){0};
+    int fd = open(tp, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    struct reader_table *t = MAP_FAILED;
+    if ((st.st_size == 0 && ftruncate(fd, sizeof(*t)) == 0) || st.st_size == (off_t)sizeof(*t))
+        t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED)
+        return 0;
+    // a new table is all zeroes, whoever gets there first starts the epochs
+    uint64_t zero = 0;
+    __atomic_compare_exchange_n(&t->epoch, &zero, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    uint32_t none = 0;
+    __atomic_compare_exchange_n(&t->magic, &none, READERS_MAGIC, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (t->magic != READERS_MAGIC || (t->size && t->size != sizeof(*t))) {
+        munmap(t, sizeof(*t));
+        return 0;
+    }
+    if (writer) {
+        t->size = sizeof(*t);
+        // holding the writer lock, an odd counter is a checkpoint that never finished
+        for (uint32_t i = 0; i < READER_STRIPES; i++)
+            if (__atomic_load_n(&t->ver[i], __ATOMIC_RELAXED) & 1)
+                __atomic_add_fetch(&t->ver[i], 1, __ATOMIC_SEQ_CST);
+    }
+    d->rd.t = t;
+    return 0;
+}
+
+void reader_detach(struct store_disk *d) {
+    if (!d->rd.t)
+        return;
+    reader_exit(d);
+    munmap(d->rd.t, sizeof(*d->rd.t));
+    d->rd.t = NULL;
+}
+
+/*
+Starts a read on the handle, everything read until reader_exit is as of one
+version per file and no block it points at is handed out again meanwhile.
+A handle that is behind a checkpoint gets the superblock again and forgets
+what its cache holds first.
+*/
+void reader_enter(struct store_disk *d) {
+    struct reader_table *t = d->rd.t;
+    if (!t || d->rd.slot)
+        return;
+    uint32_t pid = (uint32_t)getpid();
+    uint64_t e = 0;
+    // threads of a process start at different slots so they don't all fight over the first one
+    uint32_t i = (uint32_t)((uintptr_t)d >> 6) % READER_SLOTS;
+    for (uint32_t n = 0; ; n++, i = (i + 1) % READER_SLOTS) {
+        if (n && n % READER_SLOTS == 0) {
+            reader_oldest(d);
+            sched_yield();
+        }
+        e = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+        uint64_t zero = 0;
+        if (__atomic_load_n(&t->slot[i].epoch, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&t->slot[i].epoch, &zero, e, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            break;
+    }
+    __atomic_store_n(&t->slot[i].pid, pid, __ATOMIC_RELAXED);
+    d->rd.slot = i + 1;
+    if (e == d->rd.seen)
+        return;
+    struct store_super_block sb;
+    if (reader_read(d, 0, &sb, sizeof(sb)) == 0 && sb.magic == STORE_MAGIC && sb.sb_cksum == sb_cksum(&sb) &&
+        sb.disk_size == d->sb.disk_size)
+        d->sb = sb;
+    cache_drop(d, 0, d->sb.disk_size);
+    dcache_drop(d);
+    d->rd.seen = e;
+}
+
+void reader_exit(struct store_disk *d) {
+    if (!d->rd.slot)
+        return;
+    struct reader_slot *s = &d->rd.t->slot[d->rd.slot - 1];
+    __atomic_store_n(&s->pid, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->epoch, 0, __ATOMIC_RELEASE);
+    d->rd.slot = 0;
+}
+
+// sum of the counters over blocks [first, last], UINT64_MAX while any is odd unless odd is fine
+static uint64_t versions(const struct reader_table *t, uint64_t first, uint64_t last, bool odd) {
+    if (last - first >= READER_STRIPES) {
+        first = 0;
+        last = READER_STRIPES - 1;
+    }
+    uint64_t sum = 0;
+    for (uint64_t b = first; b <= last; b++) {
+        uint32_t v = __atomic_load_n(&t->ver[b % READER_STRIPES], __ATOMIC_ACQUIRE);
+        if ((v & 1) && !odd)
+            return UINT64_MAX;
+        sum += v;
+    }
+    return sum;
+}
+
+/*
+A counter that stays odd may be left by a writer that died in a checkpoint,
+once nobody holds the writer lock it means nothing [the next writer evens it]
+*/
+static bool writer_gone(struct store_disk *d, uint32_t *waits) {
+    if (++*waits % 1024)
+        return false;
+    if (flock(d->fd, LOCK_SH | LOCK_NB) != 0)
+        return false;
+    flock(d->fd, LOCK_UN);
+    return true;
+}
+
+/*
+pread of metadata for a handle between reader_enter and reader_exit [see
+disk_read_meta], read again until no checkpoint wrote any of the blocks
+meanwhile. Skips the block cache, a copy cached before a checkpoint would
+pass the check. Returns 0 on success else 1
+*/
+int reader_read(struct store_disk *d, off_t off, void *buf, size_t len) {
+    const struct reader_table *t = d->rd.t;
+    if (len == 0)
+        return 0;
+    uint64_t first = off / d->sb.block, last = (off + len - 1) / d->sb.block;
+    uint32_t waits = 0;
+    bool odd = false;
+    for (;;) {
+        uint64_t v = versions(t, first, last, odd);
+        if (v == UINT64_MAX) {
+            odd = writer_gone(d, &waits);
+            sched_yield();
+            continue;
+        }
+        if (pread(d->fd, buf, len, off) != (ssize_t)len)
+            return 1;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (versions(t, first, last, odd) == v)
+            return 0;
+    }
+}
+
+// counter of the block inode id sits in, once it is even
+static uint32_t inode_version(struct store_disk *d, uint32_t id) {
+    uint64_t blk = d->sb.inode_start + (uint64_t)(id - 1) * sizeof(struct store_inode) / d->sb.block;
+    const uint32_t *v = &d->rd.t->ver[blk % READER_STRIPES];
+    uint32_t n, waits = 0;
+    while (((n = __atomic_load_n(v, __ATOMIC_ACQUIRE)) & 1) && !writer_gone(d, &waits))
+        sched_yield();
+    return n;
+}
+
+// Reads what of f may change in place once the inode does, returns 0 on success else 1
+static int pin(struct store_disk *d, struct store_file *f) {
+    uint64_t block = d->sb.block;
+    if (f->ino.flags & FLAG_PACKED) {
+        char *blk = malloc(block);
+        f->data = blk ? malloc(f->ino.size ? f->ino.size : 1) : NULL;
+        const char *p = f->data ? pack_data(d, &f->ino, blk) : NULL;
+        if (p)
+            memcpy(f->data, p, f->ino.size);
+        free(blk);
+        return !p;
+    }
+    // encrypted and compressed tails go to new blocks, they have nothing to pin
+    const struct store_extent *e = f->ino.size % block ? file_extent(f, f->ino.size / block) : NULL;
+    if (!e || e->csize || (f->ino.flags & FLAG_ENCRYPTED) || f->ino.data_cksum == CK_NONE || !d->sb.csum_blocks)
+        return 0;
+    struct cksum_cursor c = {0};
+    uint64_t pblk = e->pblk + (f->ino.size / block - e->lblk);
+    int ret = cksum_get(d, &c, pblk, &f->tail_sum);
+    cksum_cursor_free(&c);
+    if (ret == 0)
+        f->tail_blk = pblk;
+    return ret;
+}
+
+/*
+op_open for readers: loads the file called name as of one version, with the
+bytes of a packed file and the checksum of a partial last block [see pin].
+Outside reader_enter/reader_exit the version isn't checked.
+*/
+int reader_open(struct store_disk *d, const char *name, struct store_file *f) {
+    for (;;) {
+        struct store_inode ino;
+        int found = index_lookup(d, name, &ino);
+        if (found != 0)
+            return found < 0 ? ST_ERR : ST_NOENT;
+        if (ino.flags & FLAG_DIRECTORY) {
+            printf("%s is a directory\n", name);
+            return ST_INVAL;
+        }
+        bool check = d->rd.slot != 0;
+        uint32_t v = check ? inode_version(d, ino.inode_id) : 0;
+        if (file_load(d, ino.inode_id, f) != 0)
+            return ST_ERR;
+        int ret = pin(d, f);
+        if (!check || (inode_version(d, ino.inode_id) == v && f->ino.inode_id == ino.inode_id &&
+                       strncmp(f->ino.name, name, INODE_NAME) == 0)) {
+            if (ret != 0)
+                file_put(f);
+            return ret ? ST_ERR : ST_OK;
+        }
+        // changed while it was loading, or not this file any more
+        file_put(f);
+    }
+}
+
+/*
+Epoch the oldest reader came in at, UINT64_MAX when none is reading.
+Slots of processes that are gone are freed on the way.
+*/
+uint64_t reader_oldest(struct store_disk *d) {
+    struct reader_table *t = d->rd.t;
+    uint64_t oldest = UINT64_MAX;
+    if (!t)
+        return oldest;
+    for (uint32_t i = 0; i < READER_SLOTS; i++) {
+        uint64_t e = __atomic_load_n(&t->slot[i].epoch, __ATOMIC_SEQ_CST);
+        if (e == 0)
+            continue;
+        uint32_t pid = __atomic_load_n(&t->slot[i].pid, __ATOMIC_RELAXED);
+        if (pid && kill((pid_t)pid, 0) != 0 && errno == ESRCH) {
+            __atomic_compare_exchange_n(&t->slot[i].epoch, &e, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (e < oldest)
+            oldest = e;
+    }
+    return oldest;
+}
+
+/*
+The writer is about to write blks home [NULL = any block, a journal replay],
+their counters go odd until reader_ckpt_end
+*/
+void reader_ckpt_begin(struct store_disk *d, const uint64_t *blks, uint32_t n) {
+    struct reader_table *t = d->rd.t;
+    if (!t)
+        return;
+    uint64_t *held = d->rd.held;
+    for (uint32_t i = 0; i < (blks ? n : READER_STRIPES); i++) {
+        uint64_t s = blks ? blks[i] % READER_STRIPES : i;
+        if (held[s / 64] & (1ull << (s % 64)))
+            continue;
+        held[s / 64] |= 1ull << (s % 64);
+        __atomic_add_fetch(&t->ver[s], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// The blocks are home, counters go even and the epoch moves on
+void reader_ckpt_end(struct store_disk *d) {
+    struct reader_table *t = d->rd.t;
+    if (!t)
+        return;
+    for (uint32_t w = 0; w < READER_STRIPES / 64; w++) {
+        for (uint64_t m = d->rd.held[w]; m; m &= m - 1)
+            __atomic_add_fetch(&t->ver[w * 64 + __builtin_ctzll(m)], 1, __ATOMIC_SEQ_CST);
+        d->rd.held[w] = 0;
+    }
+    __atomic_add_fetch(&t->epoch, 1, __ATOMIC_SEQ_CST);
+}
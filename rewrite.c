@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <sys/mman.h>
+
+/*
+Online rewrite
+Reshapes a disk [size, inode/data split, block size, checksum, compression,
+packing] by copying every file into a new disk file formatted with the new
+layout, then renaming it over the old one. The old disk stays in use the
+whole time, the copy goes a step at a time:
+  a step walks old inode slots from the cursor and copies up to REWRITE_BATCH
+  bytes, a big file goes across in REWRITE_BATCH pieces [read from the old
+  disk with its checksums checked, appended to the new one, which keeps it
+  in one extent], then the new disk is committed
+  steps are spaced so the copy stays under rate bytes/s
+  a write to a slot behind the cursor marks it [rewrite_touch], marked slots
+  are copied again once the cursor is through the table, the one being
+  copied starts over
+  a delete of a slot the copy has been through deletes the name on the new
+  disk too [rewrite_forget]
+The daemon interleaves steps with requests and switches to the new disk once
+nothing is left to copy. A crash anywhere before the rename leaves the old
+disk as it was, the half written new one is thrown away by the next rewrite.
+*/
+
+// Sets rw up to copy from into the disk already formatted at path, returns 0 on success else 1
+int rewrite_start(struct store_rewrite *rw, const struct store_disk *from, const char *path, uint64_t rate) {
+    memset(rw, 0, sizeof(*rw));
+    rw->buf = -1;
+    rw->path = strdup(path);
+    if (!rw->path || disk_open(&rw->to, path, O_RDWR) != 0) {
+        free(rw->path);
+        rw->path = NULL;
+        return 1;
+    }
+    rw->redo = calloc((from->sb.inode_count + 63) / 64, sizeof(uint64_t));
+    rw->buf = memfd_create("store-rewrite", MFD_CLOEXEC);
+    if (!rw->redo || rw->buf < 0 || alloc_load(&rw->to) != 0) {
+        printf("Unable to set up the rewrite into %s\n", path);
+        rewrite_abort(rw);
+        return 1;
+    }
+    rw->rate = rate;
+    rw->next = 1;
+    rw->t_start = now_ns();
+    rw->active = true;
+    return 0;
+}
+
+// Old slot id changed, copies it again unless the cursor hasn't got to it yet
+void rewrite_touch(struct store_rewrite *rw, uint32_t id) {
+    if (!rw->active)
+        return;
+    if (id == rw->cur) {
+        rw->off = 0;
+    } else if (id < rw->next && !(rw->redo[(id - 1) / 64] & (1ull << ((id - 1) % 64)))) {
+        rw->redo[(id - 1) / 64] |= 1ull << ((id - 1) % 64);
+        rw->n_redo++;
+    }
+}
+
+// Old slot id was deleted as name, whatever of it is on the new disk goes too
+void rewrite_forget(struct store_rewrite *rw, uint32_t id, const char *name) {
+    if (!rw->active)
+        return;
+    if (id == rw->cur) {
+        rw->cur = 0;
+    } else if (id < rw->next && (rw->redo[(id - 1) / 64] & (1ull << ((id - 1) % 64)))) {
+        rw->redo[(id - 1) / 64] &= ~(1ull << ((id - 1) % 64));
+        rw->n_redo--;
+    }
+    int st = op_delete(&rw->to, name);
+    if (st != ST_OK && st != ST_NOENT)
+        printf("%s is left on %s: %s\n", name, rw->path, op_status_name(st));
+}
+
+// Next old slot to look at, 0 when the table and every marked slot are done
+static uint32_t pick(struct store_rewrite *rw, const struct store_disk *from) {
+    if (rw->next <= from->sb.inode_count)
+        return rw->next++;
+    for (uint64_t w = 0; rw->n_redo && w < (from->sb.inode_count + 63) / 64; w++) {
+        if (!rw->redo[w])
+            continue;
+        int bit = __builtin_ctzll(rw->redo[w]);
+        rw->redo[w] &= rw->redo[w] - 1;
+        rw->n_redo--;
+        return (uint32_t)(w * 64 + bit + 1);
+    }
+    return 0;
+}
+
+/*
+Copies up to max bytes of rw->cur from where it left off, through the memfd.
+The first piece replaces whatever the new disk has under that name, the rest
+are appended. Clears rw->cur once the file is across.
+Returns 0 on success else 1
+*/
+static int copy_piece(struct store_rewrite *rw, struct store_disk *from, uint64_t max, uint64_t *moved) {
+    struct store_file f;
+    if (file_load(from, rw->cur, &f) != 0)
+        return 1;
+    uint64_t n = f.ino.size - rw->off < max ? f.ino.size - rw->off : max;
+    // pieces end on a block so the next one is appended without a partial block [and deduplicated]
+    uint64_t block = rw->to.sb.block;
+    if (rw->off + n < f.ino.size)
+        n = n >= block ? n - n % block : (f.ino.size - rw->off < block ? f.ino.size - rw->off : block);
+    struct read_stats rs = {0};
+    int ret = ftruncate(rw->buf, 0) != 0 || lseek(rw->buf, 0, SEEK_SET) != 0;
+    if (ret == 0 && n)
+        ret = data_read(from, &f, rw->off, n, rw->buf, READ_AUTO, &rs) != 0 || rs.bytes != n;
+    if (ret == 0 && lseek(rw->buf, 0, SEEK_SET) != 0)
+        ret = 1;
+    if (ret == 0) {
+        struct data_src src = { .kind = D_FIL, .fd = rw->buf, .size = n, .size_known = true };
+        struct write_stats ws = {0};
+        int st = op_write(&rw->to, f.ino.name, &src, rw->off > 0, f.ino.compression,
+                          f.ino.flags & FLAG_ENCRYPTED ? f.ino.key : 0, &ws);
+        if (st != ST_OK) {
+            printf("Unable to copy %s into %s: %s\n", f.ino.name, rw->path, op_status_name(st));
+            ret = 1;
+        }
+    }
+    if (ret == 0) {
+        rw->off += n;
+        *moved += n;
+        if (rw->off == f.ino.size) {
+            rw->cur = 0;
+            rw->files++;
+        }
+    }
+    file_put(&f);
+    return ret;
+}
+
+/*
+Copies the next batch of files and commits them on the new disk, does nothing
+until rw->next_at when throttled.
+Returns 1 while there is more to copy, 0 once everything is across, -1 on errors
+[rewrite_abort throws the new disk away]
+*/
+int rewrite_step(struct store_rewrite *rw, struct store_disk *from) {
+    uint64_t t_start = now_ns();
+    if (t_start < rw->next_at)
+        return 1;
+    uint64_t moved = 0;
+    bool more = true;
+    for (uint32_t looked = 0; moved < REWRITE_BATCH && looked < REWRITE_SCAN && !journal_full(&rw->to); ) {
+        if (!rw->cur) {
+            uint32_t id = pick(rw, from);
+            if (id == 0) {
+                more = false;
+                break;
+            }
+            looked++;
+            struct store_inode ino;
+            if (inode_read(from, id, &ino) != 0)
+                return -1;
+            if (ino.inode_id == 0)
+                continue;
+            // its manifest points at blocks of this disk, there is nothing to copy it as
+            if (ino.flags & FLAG_SNAPSHOT) {
+                printf("Snapshot %s can't be rewritten, delete snapshots first\n", ino.name);
+                return -1;
+            }
+            // the new disk makes directories as the files in them come
+            if (ino.flags & FLAG_DIRECTORY)
+                continue;
+            rw->cur = id;
+            rw->off = 0;
+        }
+        if (copy_piece(rw, from, REWRITE_BATCH - moved, &moved) != 0)
+            return -1;
+    }
+    if (rw->to.j.txn.n && disk_commit(&rw->to) != 0)
+        return -1;
+    rw->bytes += moved;
+    if (rw->rate)
+        rw->next_at = t_start + moved * 1000000000ull / rw->rate;
+    stats_op(SO_REWRITE, now_ns() - t_start, moved, 0);
+    return more || rw->cur;
+}
+
+// The new disk's readers table [readers.c], nobody reads it under that name
+static void drop_readers(const char *path) {
+    char tp[PATH_MAX + 16];
+    snprintf(tp, sizeof(tp), "%s.readers", path);
+    unlink(tp);
+}
+
+/*
+Puts the new disk in place of the one at over, everything must be across
+[rewrite_step returned 0]. Returns 0 on success else 1, the old disk is left as
+it was on failure
+*/
+int rewrite_finish(struct store_rewrite *rw, const char *over) {
+    double secs = (now_ns() - rw->t_start) / 1e9;
+    int ret = disk_commit(&rw->to);
+    if (ret == 0 && rename(rw->path, over) != 0) {
+        perror("rename rewritten disk");
+        ret = 1;
+    }
+    if (ret == 0)
+        printf("Rewrote %" PRIu64 " files, %" PRIu64 " bytes in %.2f s (%.1f MB/s) into %" PRIu64
+               " bytes with %" PRIu32 " byte blocks\n", rw->files, rw->bytes, secs,
+               secs > 0 ? rw->bytes / secs / (1 << 20) : 0.0, rw->to.sb.disk_size, rw->to.sb.block);
+    if (ret != 0) {
+        rewrite_abort(rw);
+        return 1;
+    }
+    disk_close(&rw->to);
+    drop_readers(rw->path);
+    close(rw->buf);
+    free(rw->path);
+    free(rw->redo);
+    memset(rw, 0, sizeof(*rw));
+    return 0;
+}
+
+// Stops a rewrite and removes the new disk file
+void rewrite_abort(struct store_rewrite *rw) {
+    if (!rw->path)
+        return;
+    disk_close(&rw->to);
+    unlink(rw->path);
+    drop_readers(rw->path);
+    if (rw->buf >= 0)
+        close(rw->buf);
+    free(rw->path);
+    free(rw->redo);
+    memset(rw, 0, sizeof(*rw));
+}
@@ -0,0 +1,1020 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <sys/mman.h>
+
+/*
+Snapshots, clones and diffs
+A snapshot is an inode of its own [FLAG_SNAPSHOT, in the name index next to the
+files] whose data is a manifest: a copy of every file's inode and extents as
+they were when it was taken [layout in store.h]. No file data is copied, every
+block the manifest points at gets one more owner in the reference counts
+[dedup.c] instead, so taking one costs time in proportion to the inodes and
+extents on the disk, not to the bytes in the files. A block with other owners
+is never written in place, later writes go copy on write into fresh blocks:
+  a rewrite gets fresh blocks anyway and the old ones only lose an owner
+  an append into a shared partial last block copies it first [write_blocks]
+  a compressed file's partial last cluster is rewritten into fresh blocks anyway
+Manifests stop at EOF, blocks reserved past it for appends stay the file's.
+Pack blocks [pack.c] are written in place as files come and go, so a packed
+file's bytes go into the manifest, an inline one's are in the inode copy.
+A clone is the same for one file, a new inode listing the same extents.
+A diff streams what changed from one snapshot to another: a block both point at
+holds the same bytes in both, nobody writes it in place, so only blocks that
+map differently are read and sent. Every inode write stamps the slot with
+sb.gen [disk.c] and every snapshot moves sb.gen on, so a file whose slot has
+the same generation in both snapshots wasn't touched in between and is skipped
+without looking at its extents. Apply builds every changed file on the
+target from the version it has, sharing what didn't change, then takes the
+same snapshot there, so the next diff goes on top of it.
+*/
+
+static uint64_t eof_blocks(const struct store_disk *d, const struct store_inode *ino) {
+    return (ino->size + d->sb.block - 1) / d->sb.block;
+}
+
+// Cuts f's extents at EOF [blocks reserved past it stay behind], f isn't stored afterwards
+static void trim(const struct store_disk *d, struct store_file *f) {
+    uint64_t eof = eof_blocks(d, &f->ino);
+    uint32_t n = 0;
+    f->ino.block_count = 0;
+    while (n < f->n_ext && f->ext[n].lblk < eof) {
+        struct store_extent *e = &f->ext[n++];
+        // a compressed cluster only comes whole
+        if (!e->csize && e->lblk + e->count > eof)
+            e->count = eof - e->lblk;
+        f->ino.block_count = e->lblk + e->count;
+    }
+    f->n_ext = n;
+}
+
+// Gives every block of f's extents one more owner, returns 0 on success else 1
+static int share_extents(struct store_disk *d, const struct store_file *f) {
+    for (uint32_t i = 0; i < f->n_ext; i++)
+        if (dedup_share(d, f->ext[i].pblk, ext_blocks(d, &f->ext[i])) != 0)
+            return 1;
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    for (const char *p = buf; len > 0; ) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    for (char *p = buf; len > 0; ) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+struct manifest {
+    struct store_disk *d;
+    struct snap_header h;
+    uint64_t *gens;          // inode_gens
+    char *p;
+    size_t len;
+    size_t cap;
+};
+
+// Adds len bytes to the manifest, padded to 8 so every inode copy stays aligned
+static int put(struct manifest *m, const void *p, size_t len) {
+    size_t padded = (len + 7) & ~(size_t)7;
+    if (m->len + padded > m->cap) {
+        size_t cap = m->cap ? m->cap : 4096;
+        while (cap < m->len + padded)
+            cap *= 2;
+        char *np = realloc(m->p, cap);
+        if (!np)
+            return 1;
+        m->p = np;
+        m->cap = cap;
+    }
+    memcpy(m->p + m->len, p, len);
+    memset(m->p + m->len + len, 0, padded - len);
+    m->len += padded;
+    return 0;
+}
+
+// op_list callback, adds a file to the manifest and gives its blocks another owner
+static int add_file(const struct store_inode *ino, void *arg) {
+    struct manifest *m = arg;
+    struct store_disk *d = m->d;
+    struct store_inode copy = *ino;
+    copy.checksum = 0;
+    copy.prealloc = 0;
+    if (put(m, &m->gens[ino->inode_id - 1], sizeof(uint64_t)) != 0)
+        return ST_ERR;
+    int ret;
+    if (ino->flags & FLAG_INLINE) {
+        ret = put(m, &copy, sizeof(copy));
+    } else if (ino->flags & FLAG_PACKED) {
+        char *blk = malloc(d->sb.block);
+        const char *p = blk ? pack_data(d, ino, blk) : NULL;
+        ret = !p || put(m, &copy, sizeof(copy)) != 0 || put(m, p, ino->size) != 0;
+        free(blk);
+    } else {
+        struct store_file f;
+        if (file_load(d, ino->inode_id, &f) != 0)
+            return ST_ERR;
+        trim(d, &f);
+        copy.block_count = f.ino.block_count;
+        copy.n_extents = f.n_ext;
+        copy.ext_block = 0;
+        memset(copy.extents, 0, sizeof(copy.extents));
+        ret = share_extents(d, &f) != 0 || put(m, &copy, sizeof(copy)) != 0 ||
+              put(m, f.ext, f.n_ext * sizeof(*f.ext)) != 0;
+        file_put(&f);
+    }
+    if (ret == 0) {
+        m->h.n_files++;
+        m->h.bytes += ino->size;
+    }
+    return ret ? ST_ERR : ST_OK;
+}
+
+/*
+Freezes every file on the disk as snapshot name. Only inodes and extents are
+copied, into the snapshot's manifest.
+Returns an enum op_status, nothing is left behind on failure
+*/
+int snap_create(struct store_disk *d, const char *name) {
+    if (strlen(name) >= INODE_NAME) {
+        printf("Name %s is longer than %d chars\n", name, INODE_NAME - 1);
+        return ST_INVAL;
+    }
+    if (!d->alloc.map && alloc_load(d) != 0)
+        return ST_ERR;
+    int found = index_lookup_snapshot(d, name, NULL);
+    if (found <= 0) {
+        if (found == 0)
+            printf("Snapshot %s already exists\n", name);
+        return found == 0 ? ST_INVAL : ST_ERR;
+    }
+    uint64_t t_start = now_ns();
+    struct manifest m = { .d = d, .h = { .magic = SNAP_MAGIC, .created = (uint64_t)time(NULL), .gen = d->sb.gen },
+                          .gens = inode_gens(d) };
+    struct store_file f = {0};
+    uint64_t pack_blk = d->sb.pack_blk;
+    int st = ST_OK;
+    alloc_mark(d);
+    if (!m.gens || put(&m, &m.h, sizeof(m.h)) != 0 || op_list(d, add_file, &m) != ST_OK)
+        st = ST_ERR;
+    if (st == ST_OK) {
+        memcpy(m.p, &m.h, sizeof(m.h));
+        f.ino.inode_id = inode_alloc(d);
+        if (f.ino.inode_id == 0) {
+            printf("No free inodes left on disk\n");
+            st = ST_NOSPC;
+        }
+    }
+    bool inserted = false;
+    if (st == ST_OK) {
+        f.ino.flags = FLAG_SNAPSHOT;
+        strcpy(f.ino.name, name);
+        f.ino.compression = COMP_NONE;
+        f.ino.data_cksum = d->sb.csum_blocks ? d->sb.checksum : CK_NONE;
+        struct data_src src = { .kind = D_STR, .mem = m.p, .size = m.len, .size_known = true };
+        struct write_stats ws = {0};
+        int ret = data_src_open(&src) != 0 || data_write(d, &f, 0, &src, &ws) != 0;
+        if (ret == 0) {
+            ret = index_insert(d, name, f.ino.inode_id);
+            inserted = ret == 0;
+        }
+        if (ret == 0)
+            ret = file_store(d, &f);
+        st = ret ? ST_ERR : ST_OK;
+    }
+    if (st == ST_OK) {
+        alloc_keep(d);
+        // whatever is written from here on is newer than the snapshot
+        d->sb.gen++;
+    } else {
+        if (inserted)
+            index_remove(d, name, f.ino.inode_id);
+        if (f.ino.flags & FLAG_PACKED)
+            pack_free(d, &f.ino);
+        d->sb.pack_blk = pack_blk;
+        if (alloc_undo(d) != 0)
+            printf("Lost track of blocks taken by the failed snapshot, they stay used\n");
+    }
+    file_put(&f);
+    free(m.gens);
+    free(m.p);
+    stats_op(SO_SNAPSHOT, now_ns() - t_start, m.len, 0);
+    return st;
+}
+
+/*
+Reads len bytes from off of the manifest of snapshot inode id into buf, through
+a memfd the way rewrite.c reads files. Returns 0 on success else 1
+*/
+static int read_manifest(struct store_disk *d, uint32_t id, uint64_t off, uint64_t len, char *buf) {
+    struct store_file f;
+    if (file_load(d, id, &f) != 0)
+        return 1;
+    int fd = memfd_create("store-snap", MFD_CLOEXEC);
+    struct read_stats rs = {0};
+    int ret = fd < 0 || off + len > f.ino.size || data_read(d, &f, off, len, fd, READ_PREAD, &rs) != 0 ||
+              rs.bytes != len || pread(fd, buf, len, 0) != (ssize_t)len;
+    if (fd >= 0)
+        close(fd);
+    file_put(&f);
+    return ret;
+}
+
+// Header of the snapshot whose inode is ino, without loading the rest
+int snap_info(struct store_disk *d, const struct store_inode *ino, struct snap_header *h) {
+    if (ino->size < sizeof(*h) || read_manifest(d, ino->inode_id, 0, sizeof(*h), (char *)h) != 0 ||
+        h->magic != SNAP_MAGIC) {
+        printf("Unable to read snapshot %s\n", ino->name);
+        return 1;
+    }
+    return 0;
+}
+
+static int by_name(const void *a, const void *b) {
+    return strncmp(((const struct snap_entry *)a)->ino->name, ((const struct snap_entry *)b)->ino->name,
+                   INODE_NAME);
+}
+
+// Points s->ent at the files in the manifest, checking it stays inside len bytes
+static int parse(struct store_snap *s, uint64_t len) {
+    if (len < sizeof(s->h))
+        return 1;
+    memcpy(&s->h, s->buf, sizeof(s->h));
+    if (s->h.magic != SNAP_MAGIC || s->h.n_files > len / sizeof(struct store_inode))
+        return 1;
+    s->ent = calloc(s->h.n_files ? s->h.n_files : 1, sizeof(*s->ent));
+    if (!s->ent)
+        return 1;
+    uint64_t at = sizeof(s->h);
+    for (uint32_t i = 0; i < s->h.n_files; i++) {
+        struct snap_entry *e = &s->ent[i];
+        if (len - at < sizeof(e->gen) + sizeof(struct store_inode))
+            return 1;
+        memcpy(&e->gen, s->buf + at, sizeof(e->gen));
+        at += sizeof(e->gen);
+        e->ino = (const struct store_inode *)(s->buf + at);
+        at += sizeof(struct store_inode);
+        uint64_t n = 0;
+        if (e->ino->flags & FLAG_PACKED)
+            n = (e->ino->size + 7) & ~7ull;
+        else if (!(e->ino->flags & FLAG_INLINE))
+            n = (uint64_t)e->ino->n_extents * sizeof(struct store_extent);
+        if (n > len - at || (e->ino->flags & FLAG_INLINE && e->ino->size > INODE_INLINE))
+            return 1;
+        if (e->ino->flags & FLAG_PACKED)
+            e->data = s->buf + at;
+        else if (!(e->ino->flags & FLAG_INLINE))
+            e->ext = (const struct store_extent *)(s->buf + at);
+        at += n;
+    }
+    qsort(s->ent, s->h.n_files, sizeof(*s->ent), by_name);
+    return 0;
+}
+
+// Loads snapshot name into s, s needs snap_close after ST_OK
+int snap_open(struct store_disk *d, const char *name, struct store_snap *s) {
+    memset(s, 0, sizeof(*s));
+    int found = index_lookup_snapshot(d, name, &s->ino);
+    if (found != 0)
+        return found < 0 ? ST_ERR : ST_NOENT;
+    s->buf = malloc(s->ino.size ? s->ino.size : 1);
+    if (!s->buf || read_manifest(d, s->ino.inode_id, 0, s->ino.size, s->buf) != 0 || parse(s, s->ino.size) != 0) {
+        printf("Unable to read snapshot %s\n", name);
+        snap_close(s);
+        return ST_ERR;
+    }
+    return ST_OK;
+}
+
+void snap_close(struct store_snap *s) {
+    free(s->buf);
+    free(s->ent);
+    s->buf = NULL;
+    s->ent = NULL;
+}
+
+// The file called name in s, NULL if it has none
+const struct snap_entry *snap_find(const struct store_snap *s, const char *name) {
+    struct store_inode ino;
+    strncpy(ino.name, name, INODE_NAME - 1);
+    ino.name[INODE_NAME - 1] = '\0';
+    struct snap_entry key = { .ino = &ino };
+    return bsearch(&key, s->ent, s->h.n_files, sizeof(*s->ent), by_name);
+}
+
+// A store_file for e that data_read takes [not for packed files], f needs file_put
+static int snap_file(const struct snap_entry *e, struct store_file *f) {
+    memset(f, 0, sizeof(*f));
+    f->ino = *e->ino;
+    if (!e->ext)
+        return 0;
+    f->ext = malloc((e->ino->n_extents ? e->ino->n_extents : 1) * sizeof(*f->ext));
+    if (!f->ext)
+        return 1;
+    memcpy(f->ext, e->ext, e->ino->n_extents * sizeof(*f->ext));
+    f->n_ext = f->cap = e->ino->n_extents;
+    return 0;
+}
+
+// data_read for a file of a snapshot
+int snap_read(struct store_disk *d, const struct snap_entry *e, uint64_t off, uint64_t len, int out_fd,
+              struct read_stats *rs) {
+    if (e->data) {
+        // the bytes are in the manifest
+        uint64_t n = off >= e->ino->size ? 0 : e->ino->size - off;
+        if (n > len)
+            n = len;
+        if (n && write_full(out_fd, e->data + off, n) != 0) {
+            perror("write snapshot data");
+            return 1;
+        }
+        rs->bytes += n;
+        return 0;
+    }
+    struct store_file f;
+    if (snap_file(e, &f) != 0)
+        return 1;
+    int ret = data_read(d, &f, off, len, out_fd, READ_AUTO, rs);
+    file_put(&f);
+    return ret;
+}
+
+static int count_one(const struct store_inode *ino, void *arg) {
+    (void)ino;
+    (*(int *)arg)++;
+    return ST_OK;
+}
+
+// Snapshots on the disk, -1 on errors
+int snap_count(struct store_disk *d) {
+    int n = 0;
+    return op_list_snapshots(d, count_one, &n) == ST_OK ? n : -1;
+}
+
+/*
+Deletes snapshot name, blocks nothing else points at are freed once the txn
+commits. Returns an enum op_status
+*/
+int snap_delete(struct store_disk *d, const char *name) {
+    if (!d->alloc.map && alloc_load(d) != 0)
+        return ST_ERR;
+    struct store_snap s;
+    int st = snap_open(d, name, &s);
+    if (st != ST_OK)
+        return st;
+    struct store_file f;
+    if (file_load(d, s.ino.inode_id, &f) != 0) {
+        snap_close(&s);
+        return ST_ERR;
+    }
+    // the name and the slot go first, blocks are only let go once nothing points at them
+    int ret = index_remove(d, name, s.ino.inode_id) != 0 || inode_free(d, s.ino.inode_id) != 0;
+    if (ret == 0) {
+        file_release(d, &f);
+        for (uint32_t i = 0; i < s.h.n_files; i++)
+            for (uint32_t j = 0; s.ent[i].ext && j < s.ent[i].ino->n_extents; j++)
+                dedup_release(d, s.ent[i].ext[j].pblk, ext_blocks(d, &s.ent[i].ext[j]));
+    }
+    file_put(&f);
+    snap_close(&s);
+    return ret ? ST_ERR : ST_OK;
+}
+
+/*
+Makes dst a copy of src [of the file src in snapshot snap when snap isn't NULL]
+without copying its data: dst lists the same extents and every block gets one
+more owner, only a packed file's few bytes are copied. An existing dst is
+replaced the way a write replaces it.
+Returns an enum op_status, nothing is left behind on failure
+*/
+int snap_clone(struct store_disk *d, const char *src, const char *dst, const char *snap) {
+    if (strlen(dst) >= INODE_NAME) {
+        printf("Name %s is longer than %d chars\n", dst, INODE_NAME - 1);
+        return ST_INVAL;
+    }
+    if (!snap && strcmp(src, dst) == 0) {
+        printf("Can't clone %s onto itself\n", src);
+        return ST_INVAL;
+    }
+    if (!d->alloc.map && alloc_load(d) != 0)
+        return ST_ERR;
+    uint64_t t_start = now_ns();
+    struct store_snap s = {0};
+    struct store_file from = {0}, nf = {0}, old = {0};
+    const char *packed = NULL;
+    char *blk = NULL;
+    int st;
+    if (snap) {
+        const struct snap_entry *e = NULL;
+        st = snap_open(d, snap, &s);
+        if (st == ST_OK && !(e = snap_find(&s, src)))
+            st = ST_NOENT;
+        if (e) {
+            st = snap_file(e, &from) == 0 ? ST_OK : ST_ERR;
+            packed = e->data;
+        }
+    } else {
+        st = op_open(d, src, &from);
+        if (st == ST_OK && (from.ino.flags & FLAG_PACKED)) {
+            blk = malloc(d->sb.block);
+            if (!blk || !(packed = pack_data(d, &from.ino, blk)))
+                st = ST_ERR;
+        }
+    }
+    struct store_inode ino;
+    int found = st == ST_OK ? index_lookup(d, dst, &ino) : 1;
+    if (found == 0 && (ino.flags & FLAG_DIRECTORY)) {
+        printf("%s is a directory\n", dst);
+        st = ST_INVAL;
+    } else if (found < 0 || (found == 0 && file_load(d, ino.inode_id, &old) != 0)) {
+        st = ST_ERR;
+    }
+    if (st == ST_OK) {
+        nf.ino = from.ino;
+        nf.ino.flags = (nf.ino.flags & ~FLAG_HIDDEN) | (dir_hidden(dst) ? FLAG_HIDDEN : 0);
+        nf.ino.inode_id = found == 0 ? old.ino.inode_id : inode_alloc(d);
+        if (nf.ino.inode_id == 0) {
+            printf("No free inodes left on disk\n");
+            st = ST_NOSPC;
+        }
+    }
+    if (st == ST_OK) {
+        uint64_t pack_blk = d->sb.pack_blk;
+        bool inserted = false;
+        memset(nf.ino.name, 0, sizeof(nf.ino.name));
+        strcpy(nf.ino.name, dst);
+        nf.ino.prealloc = 0;
+        alloc_mark(d);
+        int ret = 0;
+        if (packed) {
+            ret = pack_store(d, &nf.ino, packed, from.ino.size);
+        } else if (!(from.ino.flags & FLAG_INLINE)) {
+            trim(d, &from);
+            nf.ino.block_count = 0;
+            nf.ino.ext_block = 0;
+            nf.ino.n_extents = 0;
+            ret = share_extents(d, &from);
+            for (uint32_t i = 0; i < from.n_ext && ret == 0; i++)
+                ret = file_add_extent(&nf, from.ext[i].pblk, from.ext[i].count, from.ext[i].csize);
+        }
+        if (ret == 0 && found != 0) {
+            ret = dir_link(d, dst, nf.ino.inode_id, nf.ino.flags);
+            inserted = ret == 0;
+        }
+        if (ret == 0)
+            ret = file_store(d, &nf);
+        if (ret == 0) {
+            alloc_keep(d);
+            file_release(d, &old);
+        } else {
+            if (inserted)
+                dir_unlink(d, dst, nf.ino.inode_id);
+            if (packed && (nf.ino.flags & FLAG_PACKED))
+                pack_free(d, &nf.ino);
+            d->sb.pack_blk = pack_blk;
+            if (alloc_undo(d) != 0)
+                printf("Lost track of blocks taken by the failed clone, they stay used\n");
+            st = ST_ERR;
+        }
+    }
+    free(blk);
+    file_put(&from);
+    file_put(&nf);
+    file_put(&old);
+    snap_close(&s);
+    stats_op(SO_CLONE, now_ns() - t_start, st == ST_OK ? nf.ino.size : 0, 0);
+    return st;
+}
+
+static int put_rec(int fd, uint8_t type, const char *name, uint64_t off, uint64_t len, uint8_t compression,
+                   uint8_t key) {
+    struct diff_rec r = { .type = type, .compression = compression, .key = key,
+                          .name_len = name ? strlen(name) : 0, .off = off, .len = len };
+    return write_full(fd, &r, sizeof(r)) != 0 || (r.name_len && write_full(fd, name, r.name_len) != 0);
+}
+
+// Same contents in both snapshots, nothing of it has to be sent
+static bool same_file(const struct snap_entry *a, const struct snap_entry *b) {
+    if (a->ino->size != b->ino->size || a->ino->flags != b->ino->flags)
+        return false;
+    if (a->data)
+        return memcmp(a->data, b->data, a->ino->size) == 0;
+    if (a->ino->flags & FLAG_INLINE)
+        return memcmp(a->ino->inline_data, b->ino->inline_data, a->ino->size) == 0;
+    return a->ino->n_extents == b->ino->n_extents &&
+           memcmp(a->ext, b->ext, a->ino->n_extents * sizeof(*a->ext)) == 0;
+}
+
+/*
+Blocks from lblk on that are either all the same in of and nf or all changed,
+*same tells which. A block is the same when both map it to the same disk block
+and of holds all the bytes nf has in it, lim is the first block that can't be.
+Returns 0 if nf doesn't map lblk
+*/
+static uint64_t compare(const struct store_file *of, const struct store_file *nf, uint64_t lblk, uint64_t lim,
+                        bool *same) {
+    const struct store_extent *ne = file_extent(nf, lblk), *oe = of ? file_extent(of, lblk) : NULL;
+    *same = false;
+    if (!ne)
+        return 0;
+    uint64_t end = ne->lblk + ne->count;
+    if (!oe)
+        return end - lblk;
+    if (oe->lblk + oe->count < end)
+        end = oe->lblk + oe->count;
+    if (ne->csize || oe->csize) {
+        // clusters only compare whole
+        *same = ne->csize == oe->csize && ne->pblk == oe->pblk && ne->lblk == oe->lblk &&
+                ne->count == oe->count && end <= lim;
+        return end - lblk;
+    }
+    *same = ne->pblk - ne->lblk == oe->pblk - oe->lblk && lblk < lim;
+    if (*same && end > lim)
+        end = lim;
+    return end - lblk;
+}
+
+// Sends nf's blocks [start, end) as DIFF_DATA records
+static int send_range(struct store_disk *d, struct store_file *nf, uint64_t start, uint64_t end, int out_fd,
+                      struct diff_stats *ds) {
+    uint64_t off = start * d->sb.block, stop = end * d->sb.block;
+    if (stop > nf->ino.size)
+        stop = nf->ino.size;
+    while (off < stop) {
+        uint64_t len = stop - off < DIFF_CHUNK ? stop - off : DIFF_CHUNK;
+        struct read_stats rs = {0};
+        if (put_rec(out_fd, DIFF_DATA, NULL, off, len, 0, 0) != 0 ||
+            data_read(d, nf, off, len, out_fd, READ_AUTO, &rs) != 0 || rs.bytes != len)
+            return 1;
+        ds->bytes += len;
+        off += len;
+    }
+    return 0;
+}
+
+// Sends ne [the file as it is in the to snapshot], only what changed since oe when there is one
+static int send_file(struct store_disk *d, const struct snap_entry *oe, const struct snap_entry *ne, int out_fd,
+                     struct diff_stats *ds) {
+    uint64_t size = ne->ino->size;
+    ds->files++;
+    if (put_rec(out_fd, DIFF_FILE, ne->ino->name, size, 0, ne->ino->compression,
+                ne->ino->flags & FLAG_ENCRYPTED ? ne->ino->key : 0) != 0)
+        return 1;
+    if (!ne->ext) {
+        struct read_stats rs = {0};
+        ds->bytes += size;
+        return size && (put_rec(out_fd, DIFF_DATA, NULL, 0, size, 0, 0) != 0 ||
+                        snap_read(d, ne, 0, size, out_fd, &rs) != 0 || rs.bytes != size);
+    }
+    struct store_file nf, of;
+    bool old = oe && oe->ext;
+    if (snap_file(ne, &nf) != 0)
+        return 1;
+    if (old && snap_file(oe, &of) != 0) {
+        file_put(&nf);
+        return 1;
+    }
+    uint64_t blocks = eof_blocks(d, ne->ino);
+    uint64_t lim = !old ? 0 : size <= oe->ino->size ? blocks : oe->ino->size / d->sb.block;
+    uint64_t changed = UINT64_MAX;   // first block of the changed run, if one is open
+    int ret = 0;
+    for (uint64_t b = 0; b < blocks && ret == 0; ) {
+        bool same;
+        uint64_t n = compare(old ? &of : NULL, &nf, b, lim, &same);
+        if (n == 0) {
+            printf("%s in snapshot has no block %" PRIu64 "\n", ne->ino->name, b);
+            ret = 1;
+        } else if (!same && changed == UINT64_MAX) {
+            changed = b;
+        } else if (same && changed != UINT64_MAX) {
+            ret = send_range(d, &nf, changed, b, out_fd, ds);
+            changed = UINT64_MAX;
+        }
+        b += n;
+    }
+    if (ret == 0 && changed != UINT64_MAX)
+        ret = send_range(d, &nf, changed, blocks, out_fd, ds);
+    file_put(&nf);
+    if (old)
+        file_put(&of);
+    return ret;
+}
+
+/*
+Writes the diff stream from snapshot from to snapshot to into out_fd [a full
+stream of to when from is NULL], see store.h for the format. flags go in the
+header, DIFF_MIRROR only makes sense on a full stream, DIFF_REPLACE on an
+incremental one.
+Returns an enum op_status
+*/
+int snap_diff(struct store_disk *d, const char *from, const char *to, uint16_t flags, int out_fd,
+              struct diff_stats *ds) {
+    uint64_t t_start = now_ns();
+    struct store_snap fs = {0}, ts;
+    const char *missing = to;
+    int st = snap_open(d, to, &ts);
+    if (st == ST_OK && from && (st = snap_open(d, missing = from, &fs)) != ST_OK)
+        snap_close(&ts);
+    if (st != ST_OK) {
+        if (st == ST_NOENT)
+            fprintf(stderr, "No snapshot %s\n", missing);
+        return st;
+    }
+    struct diff_header h = { .magic = DIFF_MAGIC, .version = DIFF_VERSION, .flags = flags,
+                             .created = ts.h.created };
+    if (from)
+        strcpy(h.from, from);
+    strcpy(h.to, to);
+    int ret = write_full(out_fd, &h, sizeof(h));
+    for (uint32_t i = 0; i < ts.h.n_files && ret == 0; i++) {
+        const struct snap_entry *oe = from ? snap_find(&fs, ts.ent[i].ino->name) : NULL;
+        // same slot written last in the same generation, nothing to compare
+        if (oe && oe->gen && oe->gen == ts.ent[i].gen && oe->ino->inode_id == ts.ent[i].ino->inode_id)
+            continue;
+        if (!oe || !same_file(oe, &ts.ent[i]))
+            ret = send_file(d, oe, &ts.ent[i], out_fd, ds);
+    }
+    for (uint32_t i = 0; i < fs.h.n_files && ret == 0; i++) {
+        if (snap_find(&ts, fs.ent[i].ino->name))
+            continue;
+        ret = put_rec(out_fd, DIFF_DELETE, fs.ent[i].ino->name, 0, 0, 0, 0);
+        ds->deleted++;
+    }
+    if (ret == 0)
+        ret = put_rec(out_fd, DIFF_END, NULL, 0, 0, 0, 0);
+    snap_close(&ts);
+    snap_close(&fs);
+    stats_op(SO_DIFF, now_ns() - t_start, ds->bytes, 0);
+    return ret ? ST_ERR : ST_OK;
+}
+
+// A file snap_apply is putting together
+struct apply {
+    struct store_disk *d;
+    struct diff_stats *ds;
+    int buf;                     // memfd bytes copied from base go through
+    bool open;                   // nf is being built, under alloc_mark
+    bool found;                  // base is the file's current version
+    struct store_file base;
+    struct store_file nf;
+    uint64_t size;               // nf's size once done
+    uint64_t pack_blk;           // sb.pack_blk at the start
+};
+
+static int apply_start(struct apply *a, const char *name, uint64_t size, uint8_t compression, uint8_t key) {
+    struct store_disk *d = a->d;
+    memset(&a->nf, 0, sizeof(a->nf));
+    int st = op_open(d, name, &a->base);
+    if (st != ST_OK && st != ST_NOENT)
+        return 1;
+    a->found = st == ST_OK;
+    if (!a->found)
+        memset(&a->base, 0, sizeof(a->base));
+    struct store_inode *ino = &a->nf.ino;
+    if (a->found) {
+        *ino = a->base.ino;
+        ino->size = 0;
+        ino->block_count = 0;
+        ino->ext_block = 0;
+        ino->n_extents = 0;
+        ino->prealloc = 0;
+        ino->flags &= ~(FLAG_INLINE | FLAG_PACKED);
+        memset(ino->extents, 0, sizeof(ino->extents));
+    } else {
+        ino->flags = (d->sb.flags & ~FLAG_DIRECTORY) | (dir_hidden(name) ? FLAG_HIDDEN : 0);
+        strcpy(ino->name, name);
+    }
+    // blocks kept from base come with its checksums
+    if (!a->found || (a->base.ino.flags & (FLAG_INLINE | FLAG_PACKED)))
+        ino->data_cksum = d->sb.csum_blocks ? d->sb.checksum : CK_NONE;
+    ino->compression = compression;
+    if (compression != COMP_NONE)
+        ino->flags |= FLAG_COMPRESSION;
+    else
+        ino->flags &= ~FLAG_COMPRESSION;
+    // the stream carries plaintext, the file is encrypted again here with the key it had there
+    ino->key = key;
+    if (key)
+        ino->flags |= FLAG_ENCRYPTED;
+    else
+        ino->flags &= ~FLAG_ENCRYPTED;
+    a->size = size;
+    a->pack_blk = d->sb.pack_blk;
+    a->open = true;
+    alloc_mark(d);
+    return 0;
+}
+
+// Appends len bytes of fd to nf, returns 0 on success else 1
+static int put_bytes(struct apply *a, int fd, uint64_t len) {
+    struct data_src src = { .kind = D_FIL, .fd = fd, .size = len, .size_known = true };
+    struct write_stats ws = {0};
+    struct store_inode was = a->nf.ino;
+    int ret = data_src_open(&src) != 0 || data_write(a->d, &a->nf, a->nf.ino.size, &src, &ws) != 0;
+    // slots it moved the file out of, see op_write
+    if (ret == 0 && (was.flags & FLAG_PACKED) && !((a->nf.ino.flags & FLAG_PACKED) &&
+        was.pack.pblk == a->nf.ino.pack.pblk && was.pack.slot == a->nf.ino.pack.slot))
+        pack_free(a->d, &was);
+    // a regular file is read with pread, the next record is past what it took
+    if (ret == 0 && src.seekable && lseek(fd, src.off, SEEK_SET) < 0)
+        ret = 1;
+    return ret;
+}
+
+/*
+Gives nf whole blocks [or a cluster] of base from nf's end on, as far as they
+hold the same bytes for nf as they do for base, *n gets how many bytes. A
+partial last block is only shared when it ends at the same byte in both, its
+checksum covers the bytes up to EOF. Encrypted blocks only when both files have
+the same key. Returns 0 on success else 1
+*/
+static int share_base(struct apply *a, uint64_t end, uint64_t *n) {
+    struct store_disk *d = a->d;
+    struct store_file *nf = &a->nf, *base = &a->base;
+    uint64_t block = d->sb.block, pos = nf->ino.size, size = base->ino.size;
+    *n = 0;
+    if (!a->found || ((base->ino.flags | nf->ino.flags) & (FLAG_INLINE | FLAG_PACKED)) || pos % block ||
+        ((base->ino.flags ^ nf->ino.flags) & FLAG_ENCRYPTED) ||
+        ((nf->ino.flags & FLAG_ENCRYPTED) && base->ino.key != nf->ino.key))
+        return 0;
+    // the window an append reserved past EOF goes, shared blocks have to follow on
+    file_truncate(d, nf, pos / block);
+    const struct store_extent *e = file_extent(base, pos / block);
+    if (nf->ino.block_count != pos / block || !e)
+        return 0;
+    bool same_tail = end == a->size && a->size == size;
+    if (e->csize) {
+        uint64_t stop = (e->lblk + e->count) * block;
+        if (e->lblk * block != pos || (stop > size && !same_tail) || (stop < size ? stop : size) > end)
+            return 0;
+        if (dedup_share(d, e->pblk, ext_blocks(d, e)) != 0 || file_add_extent(nf, e->pblk, e->count, e->csize) != 0)
+            return 1;
+        a->ds->shared += ext_blocks(d, e);
+        nf->ino.size = stop < size ? stop : size;
+    } else {
+        uint64_t lim = same_tail ? (end + block - 1) / block : (end < size ? end : size) / block;
+        uint64_t stop = e->lblk + e->count < lim ? e->lblk + e->count : lim;
+        if (stop <= pos / block)
+            return 0;
+        uint64_t pblk = e->pblk + (pos / block - e->lblk), count = stop - pos / block;
+        if (dedup_share(d, pblk, count) != 0 || file_add_extent(nf, pblk, count, 0) != 0)
+            return 1;
+        a->ds->shared += count;
+        nf->ino.size = stop * block < end ? stop * block : end;
+    }
+    *n = nf->ino.size - pos;
+    return 0;
+}
+
+// Copies len bytes of base from nf's end on into nf
+static int copy_base(struct apply *a, uint64_t len) {
+    struct read_stats rs = {0};
+    if (ftruncate(a->buf, 0) != 0 || lseek(a->buf, 0, SEEK_SET) != 0 ||
+        data_read(a->d, &a->base, a->nf.ino.size, len, a->buf, READ_AUTO, &rs) != 0 || rs.bytes != len ||
+        lseek(a->buf, 0, SEEK_SET) != 0)
+        return 1;
+    return put_bytes(a, a->buf, len);
+}
+
+// Fills nf up to byte end with what base has there, shared where it can be
+static int carry(struct apply *a, uint64_t end) {
+    uint64_t block = a->d->sb.block;
+    while (a->nf.ino.size < end) {
+        uint64_t pos = a->nf.ino.size, n;
+        if (share_base(a, end, &n) != 0)
+            return 1;
+        if (n)
+            continue;
+        if (!a->found || pos >= a->base.ino.size) {
+            printf("%s here isn't what the stream was made against\n", a->nf.ino.name);
+            return 1;
+        }
+        uint64_t upto = end < a->base.ino.size ? end : a->base.ino.size;
+        const struct store_extent *e = file_extent(&a->base, pos / block);
+        if (e && (e->lblk + e->count) * block < upto)
+            upto = (e->lblk + e->count) * block;
+        if (upto - pos > DIFF_CHUNK)
+            upto = pos + DIFF_CHUNK;
+        if (copy_base(a, upto - pos) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Puts nf in place of base when ok [and it could be finished], else throws it away
+static int apply_end(struct apply *a, bool ok) {
+    struct store_disk *d = a->d;
+    struct store_file *nf = &a->nf;
+    int ret = !ok || carry(a, a->size) != 0;
+    // nothing more gets appended, a window reserved past EOF goes back
+    if (ret == 0 && !(nf->ino.flags & (FLAG_INLINE | FLAG_PACKED)))
+        file_truncate(d, nf, eof_blocks(d, &nf->ino));
+    bool inserted = false;
+    if (ret == 0 && !a->found) {
+        nf->ino.inode_id = inode_alloc(d);
+        if (nf->ino.inode_id == 0) {
+            printf("No free inodes left on disk\n");
+            ret = 1;
+        } else {
+            ret = dir_link(d, nf->ino.name, nf->ino.inode_id, nf->ino.flags);
+            inserted = ret == 0;
+        }
+    }
+    if (ret == 0)
+        ret = file_store(d, nf);
+    if (ret == 0) {
+        alloc_keep(d);
+        file_release(d, &a->base);
+    } else {
+        if (inserted)
+            dir_unlink(d, nf->ino.name, nf->ino.inode_id);
+        if (nf->ino.flags & FLAG_PACKED)
+            pack_free(d, &nf->ino);
+        d->sb.pack_blk = a->pack_blk;
+        if (alloc_undo(d) != 0)
+            printf("Lost track of blocks taken by the failed apply, they stay used\n");
+    }
+    file_put(&a->base);
+    file_put(nf);
+    a->open = false;
+    return ret;
+}
+
+/*
+Commits between files, so commits hold whole files, once the journal is getting full or
+the blocks of replaced files [only free after a commit] are as many as the
+free ones. Returns 0 on success else 1
+*/
+static int settle(struct store_disk *d) {
+    if (!journal_full(d) && d->alloc.pend_blocks < d->alloc.n_free)
+        return 0;
+    return disk_commit(d);
+}
+
+// File names a DIFF_MIRROR stream brought
+struct names {
+    char (*name)[INODE_NAME];
+    size_t n;
+    size_t cap;
+};
+
+static int add_name(struct names *nm, const char *name) {
+    if (nm->n == nm->cap) {
+        size_t cap = nm->cap ? nm->cap * 2 : 256;
+        char (*np)[INODE_NAME] = realloc(nm->name, cap * INODE_NAME);
+        if (!np)
+            return 1;
+        nm->name = np;
+        nm->cap = cap;
+    }
+    strncpy(nm->name[nm->n], name, INODE_NAME - 1);
+    nm->name[nm->n++][INODE_NAME - 1] = '\0';
+    return 0;
+}
+
+static int by_str(const void *a, const void *b) {
+    return strncmp(a, b, INODE_NAME);
+}
+
+struct prune {
+    const struct names *keep;    // sorted
+    struct names gone;
+};
+
+// op_list callback, notes the files the stream didn't name
+static int not_kept(const struct store_inode *ino, void *arg) {
+    struct prune *p = arg;
+    if (bsearch(ino->name, p->keep->name, p->keep->n, INODE_NAME, by_str))
+        return ST_OK;
+    return add_name(&p->gone, ino->name) == 0 ? ST_OK : ST_ERR;
+}
+
+// Deletes every file here that isn't in keep, the end of a DIFF_MIRROR stream
+static int prune(struct store_disk *d, struct names *keep, struct diff_stats *ds) {
+    qsort(keep->name, keep->n, INODE_NAME, by_str);
+    struct prune p = { .keep = keep };
+    int ret = op_list(d, not_kept, &p) != ST_OK;
+    for (size_t i = 0; i < p.gone.n && ret == 0; i++) {
+        ret = op_delete(d, p.gone.name[i]) != ST_OK;
+        ds->deleted++;
+    }
+    free(p.gone.name);
+    return ret;
+}
+
+/*
+Applies the diff stream read from in_fd: every file it names is rebuilt from
+the one here plus the data sent, then the to snapshot is taken here too. An
+incremental stream needs its from snapshot here [DIFF_REPLACE deletes it
+afterwards], after a DIFF_MIRROR one the disk holds just the files of to. Files are committed whole as the txn grows, a
+stream cut short can be applied again from the start, and one whose to
+snapshot is already here is skipped.
+Returns an enum op_status, the caller commits
+*/
+int snap_apply(struct store_disk *d, int in_fd, struct diff_stats *ds) {
+    struct diff_header h;
+    if (read_full(in_fd, &h, sizeof(h)) != 0 || h.magic != DIFF_MAGIC || h.version != DIFF_VERSION ||
+        !memchr(h.from, '\0', INODE_NAME) || !memchr(h.to, '\0', INODE_NAME)) {
+        printf("Not a diff stream\n");
+        return ST_INVAL;
+    }
+    bool mirror = h.flags & DIFF_MIRROR;
+    if ((h.flags & ~(DIFF_MIRROR | DIFF_REPLACE)) || (mirror && h.from[0])) {
+        printf("Diff stream has flags 0x%x this version doesn't know\n", h.flags);
+        return ST_INVAL;
+    }
+    if (!d->alloc.map && alloc_load(d) != 0)
+        return ST_ERR;
+    int found = index_lookup_snapshot(d, h.to, NULL);
+    if (found == 0)
+        printf("Snapshot %s is already here, nothing to apply\n", h.to);
+    if (found <= 0)
+        return found == 0 ? ST_OK : ST_ERR;
+    if (h.from[0] && (found = index_lookup_snapshot(d, h.from, NULL)) != 0) {
+        if (found > 0)
+            printf("Stream goes from snapshot %s to %s, this disk has no %s\n", h.from, h.to, h.from);
+        return found > 0 ? ST_INVAL : ST_ERR;
+    }
+    uint64_t t_start = now_ns();
+    struct apply a = { .d = d, .ds = ds, .buf = memfd_create("store-apply", MFD_CLOEXEC) };
+    if (a.buf < 0) {
+        perror("memfd_create");
+        return ST_ERR;
+    }
+    struct names seen = {0};
+    int ret = 0;
+    for (bool end = false; ret == 0 && !end; ) {
+        struct diff_rec r;
+        char name[INODE_NAME];
+        if (read_full(in_fd, &r, sizeof(r)) != 0 || r.name_len >= INODE_NAME ||
+            read_full(in_fd, name, r.name_len) != 0) {
+            printf("Diff stream ended early\n");
+            ret = 1;
+            break;
+        }
+        name[r.name_len] = '\0';
+        switch (r.type) {
+        case DIFF_FILE: {
+            ret = a.open && apply_end(&a, true) != 0;
+            // a mirror sends every byte, the file here would only hold blocks the new one needs
+            int st = ret == 0 && mirror ? op_delete(d, name) : ST_OK;
+            ret = ret || (st != ST_OK && st != ST_NOENT) || settle(d) != 0 ||
+                  apply_start(&a, name, r.off, r.compression, r.key) != 0 || (mirror && add_name(&seen, name) != 0);
+            ds->files++;
+            break;
+        }
+        case DIFF_DATA:
+            if (!a.open || r.off < a.nf.ino.size || r.len > a.size - r.off || r.off > a.size) {
+                printf("Diff stream has data out of place\n");
+                ret = 1;
+                break;
+            }
+            ret = carry(&a, r.off) != 0 || put_bytes(&a, in_fd, r.len) != 0;
+            ds->bytes += r.len;
+            break;
+        case DIFF_DELETE:
+            ret = (a.open && apply_end(&a, true) != 0) || settle(d) != 0;
+            if (ret == 0) {
+                int st = op_delete(d, name);
+                ret = st != ST_OK && st != ST_NOENT;
+                ds->deleted++;
+            }
+            break;
+        case DIFF_END:
+            ret = (a.open && apply_end(&a, true) != 0) || (mirror && prune(d, &seen, ds) != 0);
+            end = true;
+            break;
+        default:
+            printf("Unknown diff record %u\n", r.type);
+            ret = 1;
+            break;
+        }
+    }
+    if (a.open)
+        apply_end(&a, false);
+    close(a.buf);
+    free(seen.name);
+    if (ret == 0)
+        ret = snap_create(d, h.to) != ST_OK;
+    if (ret == 0 && h.from[0] && (h.flags & DIFF_REPLACE))
+        ret = snap_delete(d, h.from) != ST_OK;
+    stats_op(SO_APPLY, now_ns() - t_start, ds->bytes, 0);
+    return ret ? ST_ERR : ST_OK;
+}
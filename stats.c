@@ -0,0 +1,331 @@
+#include "store.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+
+/*
+Operation stats
+Every thread that records anything gets its own struct store_stats on first use
+and only ever writes to that one, so recording is a few adds with no locks and
+no shared cache lines. Nothing is summed until someone asks [stats_snapshot],
+which walks the live blocks plus whatever exited threads left behind.
+A command adds what it recorded to the disk name + ".stats" file when it ends
+[stats_save], `store stats` prints that file, plus the numbers of a running
+daemon that hasn't saved yet.
+*/
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_block {
+    struct store_stats s;
+    struct stats_block *next;
+} *live;
+static struct store_stats retired;      // threads that are gone
+static bool opened;                     // a disk was opened, there is a stats file to add to
+static _Thread_local struct stats_block *mine;
+
+static const char *op_names[SO_COUNT] = {
+    [SO_INIT] = "init", [SO_VERIFY] = "verify", [SO_SPACE] = "space_check", [SO_WRITE] = "write",
+    [SO_APPEND] = "append", [SO_READ] = "read", [SO_LIST] = "list", [SO_RENAME] = "rename",
+    [SO_COMMIT] = "commit", [SO_REWRITE] = "rewrite", [SO_SNAPSHOT] = "snapshot", [SO_CLONE] = "clone",
+    [SO_DIFF] = "diff", [SO_APPLY] = "apply", [SO_SYNC] = "sync", [SO_IMPORT] = "import",
+    [SO_DELETE] = "delete", [SO_DEFRAG] = "defrag",
+};
+
+static const char *ctr_names[SC_COUNT] = {
+    [SC_CACHE_HITS] = "cache_hits", [SC_CACHE_MISSES] = "cache_misses", [SC_CACHE_EVICTIONS] = "cache_evictions",
+    [SC_ALLOC_CALLS] = "alloc_calls", [SC_ALLOC_BLOCKS] = "alloc_blocks", [SC_FREED_BLOCKS] = "freed_blocks",
+    [SC_JOURNAL_BLOCKS] = "journal_blocks", [SC_DEDUP_BLOCKS] = "dedup_blocks",
+    [SC_PUNCHED_BLOCKS] = "punched_blocks",
+};
+
+const char *stats_op_name(enum stat_op op) {
+    return op < SO_COUNT ? op_names[op] : "unknown";
+}
+
+// only the owning thread writes, readers may run alongside so both sides go through relaxed atomics
+static void bump(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t peek(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void hist_merge(struct stats_hist *into, const struct stats_hist *h) {
+    if (!peek(&h->count))
+        return;
+    into->count += peek(&h->count);
+    into->ns += peek(&h->ns);
+    into->bytes += peek(&h->bytes);
+    into->syscalls += peek(&h->syscalls);
+    if (peek(&h->max) > into->max)
+        into->max = peek(&h->max);
+    for (int i = 0; i < STATS_BUCKETS; i++)
+        into->b[i] += peek(&h->b[i]);
+}
+
+void stats_merge(struct store_stats *into, const struct store_stats *s) {
+    for (int i = 0; i < SO_COUNT; i++)
+        hist_merge(&into->op[i], &s->op[i]);
+    for (int i = 0; i < SC_COUNT; i++)
+        into->ctr[i] += peek(&s->ctr[i]);
+}
+
+// a thread is going away, its numbers move to retired
+static void retire(void *arg) {
+    struct stats_block *b = arg;
+    pthread_mutex_lock(&lock);
+    for (struct stats_block **p = &live; *p; p = &(*p)->next) {
+        if (*p == b) {
+            *p = b->next;
+            break;
+        }
+    }
+    stats_merge(&retired, &b->s);
+    pthread_mutex_unlock(&lock);
+    free(b);
+}
+
+static void make_key(void) {
+    pthread_key_create(&key, retire);
+}
+
+static struct store_stats *local(void) {
+    if (mine)
+        return &mine->s;
+    pthread_once(&once, make_key);
+    struct stats_block *b = calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    b->next = live;
+    live = b;
+    pthread_mutex_unlock(&lock);
+    pthread_setspecific(key, b);
+    mine = b;
+    return &b->s;
+}
+
+static int bucket(uint64_t v) {
+    if (v < (1u << STATS_SUB_BITS))
+        return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return ((e - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + (int)((v >> (e - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1));
+}
+
+// middle of the values bucket i holds
+static uint64_t bucket_value(int i) {
+    if (i < (1 << STATS_SUB_BITS))
+        return i;
+    int g = i >> STATS_SUB_BITS, sub = i & ((1 << STATS_SUB_BITS) - 1);
+    uint64_t lo = (uint64_t)((1 << STATS_SUB_BITS) + sub) << (g - 1);
+    return lo + ((1ull << (g - 1)) >> 1);
+}
+
+// One op of kind op took ns, moving bytes with syscalls syscalls
+void stats_op(enum stat_op op, uint64_t ns, uint64_t bytes, uint64_t syscalls) {
+    struct store_stats *s = local();
+    if (!s)
+        return;
+    struct stats_hist *h = &s->op[op];
+    bump(&h->count, 1);
+    bump(&h->ns, ns);
+    bump(&h->bytes, bytes);
+    bump(&h->syscalls, syscalls);
+    if (ns > h->max)
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    bump(&h->b[bucket(ns)], 1);
+}
+
+void stats_add(enum stat_ctr c, uint64_t n) {
+    struct store_stats *s = local();
+    if (s && n)
+        bump(&s->ctr[c], n);
+}
+
+// Sums every thread's numbers into out
+void stats_snapshot(struct store_stats *out) {
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&lock);
+    stats_merge(out, &retired);
+    for (struct stats_block *b = live; b; b = b->next)
+        stats_merge(out, &b->s);
+    pthread_mutex_unlock(&lock);
+}
+
+static void stats_path(const char *disk_path, char *out, size_t cap) {
+    snprintf(out, cap, "%s.stats", disk_path);
+}
+
+// Notes that this process got a disk open [disk_open], before that there is nothing to save
+void stats_opened() {
+    __atomic_store_n(&opened, true, __ATOMIC_RELAXED);
+}
+
+/*
+Adds this process's numbers to the stats file of disk_path. The file is mapped
+and locked, only the pages holding something to add get touched. A run that
+never opened a disk [a name that isn't one, a daemon doing the work] leaves
+the file alone, so a failed command doesn't leave a stray one behind.
+Returns 0 on success else 1
+*/
+int stats_save(const char *disk_path) {
+    if (!__atomic_load_n(&opened, __ATOMIC_RELAXED))
+        return 0;
+    struct store_stats *s = malloc(sizeof(*s));
+    if (!s)
+        return 1;
+    stats_snapshot(s);
+    bool any = false;
+    for (int i = 0; i < SO_COUNT; i++)
+        any |= s->op[i].count != 0;
+    if (!any) {
+        free(s);
+        return 0;
+    }
+    char path[PATH_MAX + 8];
+    stats_path(disk_path, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        free(s);
+        return 1;
+    }
+    // anything not laid out like this build's stats starts over
+    bool fresh = st.st_size != sizeof(struct stats_file);
+    struct stats_file *f = MAP_FAILED;
+    if ((!fresh || ftruncate(fd, 0) == 0) && ftruncate(fd, sizeof(*f)) == 0)
+        f = mmap(NULL, sizeof(*f), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (f == MAP_FAILED) {
+        close(fd);
+        free(s);
+        return 1;
+    }
+    if (fresh || f->magic != STATS_MAGIC || f->size != sizeof(*f)) {
+        memset(f, 0, sizeof(*f));
+        f->magic = STATS_MAGIC;
+        f->size = sizeof(*f);
+        f->since = time(NULL);
+    }
+    for (int i = 0; i < SO_COUNT; i++) {
+        const struct stats_hist *h = &s->op[i];
+        struct stats_hist *t = &f->s.op[i];
+        if (!h->count)
+            continue;
+        t->count += h->count;
+        t->ns += h->ns;
+        t->bytes += h->bytes;
+        t->syscalls += h->syscalls;
+        if (h->max > t->max)
+            t->max = h->max;
+        for (int j = 0; j < STATS_BUCKETS; j++)
+            if (h->b[j])
+                t->b[j] += h->b[j];
+    }
+    for (int i = 0; i < SC_COUNT; i++)
+        f->s.ctr[i] += s->ctr[i];
+    munmap(f, sizeof(*f));
+    close(fd);
+    free(s);
+    return 0;
+}
+
+/*
+Reads the stats file of disk_path into out, a missing file reads as all zeroes.
+Returns 0 on success else 1
+*/
+int stats_load(const char *disk_path, struct stats_file *out) {
+    char path[PATH_MAX + 8];
+    stats_path(disk_path, path, sizeof(path));
+    memset(out, 0, sizeof(*out));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : 1;
+    int ret = 0;
+    if (flock(fd, LOCK_SH) != 0 || pread(fd, out, sizeof(*out), 0) != sizeof(*out) ||
+        out->magic != STATS_MAGIC || out->size != sizeof(*out)) {
+        printf("Stats file %s is from another build or damaged, store stats --reset starts it over\n", path);
+        memset(out, 0, sizeof(*out));
+        ret = 1;
+    }
+    close(fd);
+    return ret;
+}
+
+int stats_reset(const char *disk_path) {
+    char path[PATH_MAX + 8];
+    stats_path(disk_path, path, sizeof(path));
+    return unlink(path) != 0 && errno != ENOENT;
+}
+
+// Value at quantile q [0..1] of h, 0 if h is empty
+static uint64_t quantile(const struct stats_hist *h, double q) {
+    uint64_t want = (uint64_t)(q * h->count + 0.5), seen = 0;
+    if (want == 0)
+        want = 1;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += h->b[i];
+        if (seen >= want)
+            return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/*
+Prints s as a table or as JSON, latencies in microseconds.
+since is when the numbers start, 0 if unknown
+*/
+void stats_print(const struct store_stats *s, uint64_t since, bool json) {
+    if (json) {
+        printf("{\n  \"since\": %" PRIu64 ",\n  \"ops\": {", since);
+        bool first = true;
+        for (int i = 0; i < SO_COUNT; i++) {
+            const struct stats_hist *h = &s->op[i];
+            if (!h->count)
+                continue;
+            printf("%s\n    \"%s\": {\"count\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"syscalls\": %" PRIu64
+                   ", \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f"
+                   ", \"max_us\": %.3f}", first ? "" : ",", op_names[i], h->count, h->bytes, h->syscalls,
+                   h->ns / 1e3 / h->count, quantile(h, qs[0]) / 1e3, quantile(h, qs[1]) / 1e3,
+                   quantile(h, qs[2]) / 1e3, quantile(h, qs[3]) / 1e3, h->max / 1e3);
+            first = false;
+        }
+        printf("\n  },\n  \"counters\": {");
+        for (int i = 0; i < SC_COUNT; i++)
+            printf("%s\n    \"%s\": %" PRIu64, i ? "," : "", ctr_names[i], s->ctr[i]);
+        printf("\n  }\n}\n");
+        return;
+    }
+    if (since) {
+        time_t t = (time_t)since;
+        char when[64];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("Since %s\n", when);
+    }
+    printf("%-12s %10s %14s %10s %10s %10s %10s %10s %10s %10s\n", "op", "count", "bytes", "syscalls", "mean us",
+           "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (int i = 0; i < SO_COUNT; i++) {
+        const struct stats_hist *h = &s->op[i];
+        if (!h->count)
+            continue;
+        printf("%-12s %10" PRIu64 " %14" PRIu64 " %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               op_names[i], h->count, h->bytes, h->syscalls, h->ns / 1e3 / h->count, quantile(h, qs[0]) / 1e3,
+               quantile(h, qs[1]) / 1e3, quantile(h, qs[2]) / 1e3, quantile(h, qs[3]) / 1e3, h->max / 1e3);
+    }
+    uint64_t looks = s->ctr[SC_CACHE_HITS] + s->ctr[SC_CACHE_MISSES];
+    printf("Cache: %" PRIu64 " hits %" PRIu64 " misses (%.1f%% hit) %" PRIu64 " evictions\n", s->ctr[SC_CACHE_HITS],
+           s->ctr[SC_CACHE_MISSES], looks ? 100.0 * s->ctr[SC_CACHE_HITS] / looks : 0.0,
+           s->ctr[SC_CACHE_EVICTIONS]);
+    printf("Allocator: %" PRIu64 " allocations for %" PRIu64 " blocks, %" PRIu64 " blocks freed, %" PRIu64
+           " given back to the host\n", s->ctr[SC_ALLOC_CALLS], s->ctr[SC_ALLOC_BLOCKS], s->ctr[SC_FREED_BLOCKS],
+           s->ctr[SC_PUNCHED_BLOCKS]);
+    printf("Journal: %" PRIu64 " blocks committed\n", s->ctr[SC_JOURNAL_BLOCKS]);
+    if (s->ctr[SC_DEDUP_BLOCKS])
+        printf("Dedup: %" PRIu64 " blocks found on disk instead of written\n", s->ctr[SC_DEDUP_BLOCKS]);
+}
@@ -14,12 +14,32 @@ void print_super_block(const struct store_super_block *sb) {
     printf("Block size:      %" PRIu32 " bytes\n", sb->block);
     printf("Inode start:     %" PRIu32 "\n", sb->inode_start);
     printf("Inode end:       %" PRIu32 "\n", sb->inode_end);
+    printf("Inode count:     %" PRIu64 "\n", sb->inode_count);
+    printf("Gen start:       %" PRIu32 "\n", sb->gen_start);
+    printf("Gen blocks:      %" PRIu32 "\n", sb->gen_blocks);
+    printf("Generation:      %" PRIu64 "\n", sb->gen);
+    printf("Bitmap start:    %" PRIu32 "\n", sb->bitmap_start);
+    printf("Bitmap end:      %" PRIu32 "\n", sb->bitmap_end);
+    printf("Checksum start:  %" PRIu32 "\n", sb->csum_start);
+    printf("Checksum blocks: %" PRIu32 "\n", sb->csum_blocks);
+    printf("Refs start:      %" PRIu32 "\n", sb->refs_start);
+    printf("Refs blocks:     %" PRIu32 "\n", sb->refs_blocks);
+    printf("Dedup start:     %" PRIu32 "\n", sb->dedup_start);
+    printf("Dedup blocks:    %" PRIu32 "\n", sb->dedup_blocks);
+    printf("Index start:     %" PRIu32 "\n", sb->index_start);
+    printf("Index end:       %" PRIu32 "\n", sb->index_end);
+    printf("Journal start:   %" PRIu32 "\n", sb->journal_start);
+    printf("Journal blocks:  %" PRIu32 "\n", sb->journal_blocks);
     printf("Data start:      %" PRIu32 "\n", sb->data_start);
+    printf("Data blocks:     %" PRIu64 "\n", sb->data_blocks);
     printf("Data space left: %" PRIu64 " bytes\n", sb->data_space_left);
     printf("Compression:     %u\n", sb->compression);
     printf("Checksum:        %u\n", sb->checksum);
-    printf("SB Checksum:     %zu\n", sb->sb_cksum);
-    printf("Reserved:        %" PRIi32 "\n", sb->reserved);
+    printf("Pack max:        %" PRIu32 " bytes\n", sb->pack_max);
+    printf("Pack block:      %" PRIu64 "\n", sb->pack_blk);
+    printf("SB Checksum:     0x%016" PRIx64 "\n", sb->sb_cksum);
+    printf("Root directory:  %" PRIu32 "\n", sb->root_dir);
+    printf("Key:             %" PRIu16 "%s\n", sb->key, sb->flags & FLAG_ENCRYPTED ? "" : " [off]");
     printf("=======================\n");
 }
 
@@ -27,9 +47,20 @@ void usage(char *val) {
     printf("Usage: %s\n", val);
     printf("Flags: \n");
     printf("\t -co|--config config_file [Fetches from cur file or goes default mode]\n");
-    printf("\t -cm|--compression on|off [Default is off] \n");
+    printf("\t -cm|--compression on|off|lz4 [Default is off, on init sets it for the disk, on write for that file] \n");
     printf("\t -ds|--disk [Default -> store.disk\n");
     printf("\t -dz|--disk_size bytes|VALUE[KB|MB|GB] [ERR if neither in config, nor passed during init] \n");
+    printf("\t -ck|--checksum crc32c|xxhash64|off [Default is crc32c, data blocks are verified on every read]\n");
+    printf("\t -im|--init_mode sparse|full [Default is sparse, full writes every inode block at init]\n");
+    printf("\t -pk|--packing on|off [Default is on, small files go in the inode or share blocks, set on init]\n");
+    printf("\t -dd|--dedup on|off [Default is off, files share blocks with identical contents, set on init]\n");
+    printf("\t -en|--encrypt id|off [Default is off, on init new files get key id, on write that file does]\n");
+    printf("\t -kf|--key_file path [Keys for encrypted files, default [crypto] key_file or disk name + .keys]\n");
+    printf("\t --snapshot name [read, list and clone take the file as it is in that snapshot]\n");
+    printf("\t -a|--all [ls lists hidden entries too, names starting with .]\n");
+    printf("\t --to disk|dir|pipe|- [Where sync sends the disk, default [sync] to in the config]\n");
+    printf("\t --rate bytes/s [Caps rewrite and defrag copies, defrag defaults to 64MB, 0 for no cap]\n");
+    printf("\t --socket path [Daemon socket, default disk name + .sock, commands use the daemon when it runs]\n");
 }
 
 int read_config(char *file) {
@@ -58,6 +89,38 @@ uint64_t parse_size(const char *s) {
 }
 
 
+// "off"|"none" -> COMP_NONE, "lz4"|"on" -> COMP_LZ4, -1 for anything else
+int parse_compression(const char *s) {
+    if (strcasecmp(s, "off") == 0 || strcasecmp(s, "none") == 0)
+        return COMP_NONE;
+    if (strcasecmp(s, "lz4") == 0 || strcasecmp(s, "on") == 0)
+        return COMP_LZ4;
+    return -1;
+}
+
+
+// "off"|"none" -> 0, a key id 1-255 -> that id, -1 for anything else
+int parse_key(const char *s) {
+    if (strcasecmp(s, "off") == 0 || strcasecmp(s, "none") == 0)
+        return 0;
+    char *end;
+    long id = strtol(s, &end, 10);
+    return *s && *end == '\0' && id >= 1 && id <= 255 ? (int)id : -1;
+}
+
+
+// "off"|"none" -> CK_NONE, "crc32c" -> CK_CRC32C, "xxhash64"|"xxh64" -> CK_XXH64, -1 for anything else
+int parse_checksum(const char *s) {
+    if (strcasecmp(s, "off") == 0 || strcasecmp(s, "none") == 0)
+        return CK_NONE;
+    if (strcasecmp(s, "crc32c") == 0)
+        return CK_CRC32C;
+    if (strcasecmp(s, "xxhash64") == 0 || strcasecmp(s, "xxh64") == 0)
+        return CK_XXH64;
+    return -1;
+}
+
+
 int fill_config(char *file) {
     FILE *f = fopen(file, "r");
     if (f== NULL) {
@@ -99,6 +162,66 @@ int fill_config(char *file) {
             strcpy(config.usage, profile.u.s);
         }
     }
+    toml_table_t *policy = toml_table_in(conf, "policy");
+    if (policy) {
+        toml_datum_t comp = toml_string_in(policy, "compression");
+        if (comp.ok) {
+            config.compression = parse_compression(comp.u.s);
+            if (config.compression < 0) {
+                printf("Unknown compression %s in config, using off\n", comp.u.s);
+                config.compression = COMP_NONE;
+            }
+        }
+    }
+    if (policy) {
+        toml_datum_t ck = toml_string_in(policy, "checksum");
+        if (ck.ok) {
+            config.checksum = parse_checksum(ck.u.s);
+            if (config.checksum < 0) {
+                printf("Unknown checksum %s in config, using crc32c\n", ck.u.s);
+                config.checksum = CK_CRC32C;
+            }
+        }
+        toml_datum_t pk = toml_string_in(policy, "packing");
+        if (pk.ok)
+            config.no_packing = strcasecmp(pk.u.s, "off") == 0;
+        toml_datum_t dd = toml_string_in(policy, "dedup");
+        if (dd.ok)
+            config.dedup = strcasecmp(dd.u.s, "on") == 0;
+    }
+    // block cache of the process that opens the disk, not stored on it
+    toml_table_t *cache = toml_table_in(conf, "cache");
+    if (cache) {
+        toml_datum_t size = toml_string_in(cache, "size");
+        if (size.ok)
+            config.cache_size = parse_size(size.u.s);
+        toml_datum_t ra = toml_string_in(cache, "readahead");
+        if (ra.ok)
+            config.no_readahead = strcasecmp(ra.u.s, "off") == 0;
+    }
+    // where store sync goes without --to
+    toml_table_t *sync = toml_table_in(conf, "sync");
+    if (sync) {
+        toml_datum_t to = toml_string_in(sync, "to");
+        if (to.ok && strlen(to.u.s) < sizeof(config.sync_to))
+            strcpy(config.sync_to, to.u.s);
+        else if (to.ok)
+            printf("Sync target %s in config is too long\n", to.u.s);
+    }
+    // keys for encrypted files, encrypt is the disk-wide key on init
+    toml_table_t *crypto = toml_table_in(conf, "crypto");
+    if (crypto) {
+        toml_datum_t kf = toml_string_in(crypto, "key_file");
+        if (kf.ok && strlen(kf.u.s) < sizeof(config.key_file))
+            strcpy(config.key_file, kf.u.s);
+        else if (kf.ok)
+            printf("Key file %s in config is too long\n", kf.u.s);
+        toml_datum_t en = toml_string_in(crypto, "encrypt");
+        if (en.ok && (config.encrypt = parse_key(en.u.s)) < 0) {
+            printf("Unknown encrypt %s in config, using off\n", en.u.s);
+            config.encrypt = 0;
+        }
+    }
     toml_table_t *layout = toml_table_in(conf, "layout");
     if (layout) {
         toml_datum_t bs = toml_string_in(layout, "block_size");
@@ -115,8 +238,11 @@ void print_config() {
     printf("\t%-20s - %-10ld\n", "config.disk_size", config.disk_size);
     printf("\t%-20s - %-10s\n", "config.disk_name", config.disk_name);
     printf("\t%-20s - %-10s\n", "config.usage", config.usage);
+    printf("\t%-20s - %-10d\n", "config.checksum", config.checksum);
     printf("\t%-20s - %-10d\n", "config.block_size", config.block_size);
     printf("\t%-20s - %-10d\n", "config.ratio", config.ratio);
+    printf("\t%-20s - %-10" PRIu64 "\n", "config.cache_size", config.cache_size);
+    printf("\t%-20s - %-10d\n", "config.encrypt", config.encrypt);
 }
 
 int init_config(int argc, char **argv) {
@@ -139,12 +265,46 @@ int init_config(int argc, char **argv) {
             config.disk_size = parse_size(argv[i+1]);
         } else if ((strcmp(argv[i], "-dn")==0 || strcmp(argv[i], "--disk_name")==0) && i+1 < argc) {
                 strcpy(config.disk_name, argv[i+1]);
+        } else if ((strcmp(argv[i], "-im")==0 || strcmp(argv[i], "--init_mode")==0) && i+1 < argc) {
+            // sparse [default] leaves a zeroed inode table as a hole, full writes it out
+            config.init_full = strcasecmp(argv[i+1], "full") == 0;
+        } else if ((strcmp(argv[i], "-cm")==0 || strcmp(argv[i], "--compression")==0) && i+1 < argc) {
+            // flag wins over [policy] in the config
+            config.compression = parse_compression(argv[i+1]);
+            if (config.compression < 0) {
+                printf("Compression must be on|off|lz4\n");
+                return -1;
+            }
+        } else if ((strcmp(argv[i], "-pk")==0 || strcmp(argv[i], "--packing")==0) && i+1 < argc) {
+            if (strcasecmp(argv[i+1], "on") != 0 && strcasecmp(argv[i+1], "off") != 0) {
+                printf("Packing must be on|off\n");
+                return -1;
+            }
+            config.no_packing = strcasecmp(argv[i+1], "off") == 0;
+        } else if ((strcmp(argv[i], "-dd")==0 || strcmp(argv[i], "--dedup")==0) && i+1 < argc) {
+            if (strcasecmp(argv[i+1], "on") != 0 && strcasecmp(argv[i+1], "off") != 0) {
+                printf("Dedup must be on|off\n");
+                return -1;
+            }
+            config.dedup = strcasecmp(argv[i+1], "on") == 0;
+        } else if ((strcmp(argv[i], "-ck")==0 || strcmp(argv[i], "--checksum")==0) && i+1 < argc) {
+            config.checksum = parse_checksum(argv[i+1]);
+            if (config.checksum < 0) {
+                printf("Checksum must be crc32c|xxhash64|off\n");
+                return -1;
+            }
+        } else if ((strcmp(argv[i], "-en")==0 || strcmp(argv[i], "--encrypt")==0) && i+1 < argc) {
+            config.encrypt = parse_key(argv[i+1]);
+            if (config.encrypt < 0) {
+                printf("Encrypt must be a key id [1-255] or off\n");
+                return -1;
+            }
         }
     }
     // to be used for No. of inodes calculation
-    if (strcasecmp(config.usage, "largefile")) {
+    if (strcasecmp(config.usage, "largefile") == 0 || strcasecmp(config.usage, "largefiles") == 0) {
         config.ratio = LARGE;
-    } else if (strcasecmp(config.usage, "smallfiles")) {
+    } else if (strcasecmp(config.usage, "smallfiles") == 0) {
         config.ratio = SMALL;
     } else {
         config.ratio = BALANCED;
@@ -156,20 +316,94 @@ int init_config(int argc, char **argv) {
     return 0;
 }
 
+/*
+Writes n_inodes copies of tmpl starting at inode_off, INIT_BATCH bytes per pwrite
+instead of one pwrite per inode. *n_sys is bumped for every syscall issued.
+Returns 0 on success else 1
+*/
+int format_inode_table(int fd, off_t inode_off, uint64_t n_inodes,
+                       const struct store_inode *tmpl, uint32_t block, uint64_t *n_sys) {
+    uint64_t per_batch = INIT_BATCH / sizeof(*tmpl);
+    size_t buf_sz = per_batch * sizeof(*tmpl);
+    void *buf = NULL;
+    if (posix_memalign(&buf, block, buf_sz) != 0) {
+        printf("Unable to alloc mem for inode batch\n");
+        return 1;
+    }
+    struct store_inode *slots = buf;
+    for (uint64_t i = 0; i < per_batch; i++)
+        slots[i] = *tmpl;
+
+    for (uint64_t done = 0; done < n_inodes; ) {
+        uint64_t n = n_inodes - done < per_batch ? n_inodes - done : per_batch;
+        size_t len = n * sizeof(*tmpl);
+        (*n_sys)++;
+        if (pwrite(fd, buf, len, inode_off + done * sizeof(*tmpl)) != (ssize_t)len) {
+            perror("write inode batch");
+            free(buf);
+            return 1;
+        }
+        done += n;
+    }
+    free(buf);
+    return 0;
+}
+
 // Assumes that config is there [init_config], populates SUPERBLOCK & INODES for use
+/*
+Loads the keys for encrypted files once: --key_file, else [crypto] key_file in
+the config, else <disk>.keys when there is one. No key file is fine as long as
+nothing encrypted is touched. Returns 0 on success else 1
+*/
+int load_keys() {
+    static bool loaded;
+    if (loaded)
+        return 0;
+    char path[sizeof(config.disk_name) + 8];
+    if (config.key_file[0])
+        strcpy(path, config.key_file);
+    else if (snprintf(path, sizeof(path), "%s.keys", config.disk_name) < 0 || access(path, R_OK) != 0)
+        return 0;
+    if (crypt_load(path) != 0)
+        return 1;
+    loaded = true;
+    return 0;
+}
+
 int command_init() {
     // only runs when user does `store init ...`
     // based on the conf creates disk file in exec-dir and inits it
+    uint64_t t_start = now_ns();
+    uint64_t n_sys = 0;         // syscalls issued against the disk file
+
+    uint32_t block = config.block_size ? config.block_size:4096;
+    if ((block & (block - 1)) != 0 || block < 512) {
+        printf("Block size %" PRIu32 " must be a power of two >= 512\n", block);
+        return 1;
+    }
+    // nothing could be written to a disk whose key we don't have
+    if (config.encrypt > 0 && (load_keys() != 0 || !crypt_key(config.encrypt))) {
+        printf("Key %d isn't in the key file, unable to encrypt the disk with it\n", config.encrypt);
+        return 1;
+    }
+    // MACs live in the checksum table, encryption without them isn't authenticated
+    if (config.encrypt > 0 && config.checksum == CK_NONE) {
+        printf("Encryption needs checksums on, every encrypted block's MAC goes in the checksum table\n");
+        return 1;
+    }
+
     // creating the file
+    n_sys++;
     int fd = open(config.disk_name, O_RDWR | O_CREAT | O_EXCL, 0644);
     if (fd < 0) {
         perror("Unable to create disk file\n");
         return 1;
     }
-    // allocating size to disk file
-
+    // allocating size to disk file, everything not written below stays a zeroed hole
+    n_sys++;
     if (ftruncate(fd, config.disk_size)!=0){
         perror("ftruncate err\n");
+        close(fd);
         return 1;
     }
 
@@ -181,44 +415,107 @@ int command_init() {
         multiplier  [ratio / 1000]  -> 0.04
         disk_size   [4096MB]        -> 4294967296   [4096 * 1024 * 1024]
         ----------------------------------------------------------------
-        To calculate available space for inodes, we subtract the size of the superblock:
-        Available Space = disk_size - sizeof(struct store_super_block)
-        Let's assume sizeof(store_super_block) = 4KB -> 4096 bytes
+        To calculate available space for inodes, we subtract the superblock [block 0]:
+        Available Space = disk_size - block
+        Let's assume block = 4KB -> 4096 bytes
             Available Space = 4294967296 - 4096 -> 4294963200 bytes
         Space allocated for inodes = Available Space * multiplier
             Space for inodes = 4294963200 * 0.04 -> 171798528 bytes (~163 MB)
         We round down this number to the nearest multiple of sizeof(store_inode) to get
-        the final amount of space allocated for inodes.
+        the final amount of space allocated for inodes, then round that up to whole
+        blocks so that data always starts on a block boundary.
 
     Note:
         - The size of `store_super_block` and `store_inode` are system-dependent
           (typically defined as structures in the file system).
     */
 
-    uint64_t disk_avail = config.disk_size - sizeof(struct store_super_block);
+    uint64_t disk_avail = config.disk_size - block;
     uint64_t inode_space = (disk_avail * config.ratio)/1000;
     uint64_t n_inodes = (inode_space/sizeof(struct store_inode));
     uint64_t inode_space_used = n_inodes * sizeof(struct store_inode);
+    uint64_t inode_blocks = (inode_space_used + block - 1) / block;
+    // a partially used last block still gets its slots
+    n_inodes = inode_blocks * (block / sizeof(struct store_inode));
+
+    // a generation per inode slot, see snap.c
+    uint64_t gen_blocks = (n_inodes * sizeof(uint64_t) + block - 1) / block;
+    // name index keeps the load factor under 1/2
+    uint64_t index_blocks = (2 * n_inodes * sizeof(struct store_index_entry) + block - 1) / block;
+    // journal gets 1/64 of the disk, at least 64 and at most JOURNAL_MAX blocks
+    uint64_t journal_blocks = config.disk_size / block / 64;
+    if (journal_blocks < 64)
+        journal_blocks = 64;
+    if (journal_blocks > JOURNAL_MAX)
+        journal_blocks = JOURNAL_MAX;
+
+    // whatever is left is data plus one bitmap bit per data block
+    uint64_t total_blocks = config.disk_size / block;
+    uint64_t meta_blocks = 1 + inode_blocks + gen_blocks + index_blocks + journal_blocks;
+    if (n_inodes == 0 || total_blocks < 2 + meta_blocks) {
+        printf("Disk size too small for the chosen profile\n");
+        close(fd);
+        return 1;
+    }
+    // with checksums on every data block also costs 32 bits in the checksum table,
+    // 16 bits of reference count [clones, snapshots, dedup], with dedup its share of the fingerprint index
+    uint64_t rest = total_blocks - meta_blocks;
+    uint64_t per_bits = 1 + 16 + (config.checksum != CK_NONE ? 32 : 0) +
+                        (config.dedup ? 8 * sizeof(struct dedup_entry) / DEDUP_RATIO : 0);
+    uint64_t data_blocks = rest * 8 * block / (8ull * block + per_bits);
+    uint64_t bitmap_blocks, csum_blocks, refs_blocks, dedup_blocks;
+    for (;; data_blocks--) {
+        bitmap_blocks = (data_blocks + 8ull * block - 1) / (8ull * block);
+        csum_blocks = config.checksum != CK_NONE ? (data_blocks * 4 + block - 1) / block : 0;
+        refs_blocks = (data_blocks * 2 + block - 1) / block;
+        dedup_blocks = config.dedup ? (data_blocks / DEDUP_RATIO * sizeof(struct dedup_entry) + block - 1) / block : 0;
+        if (config.dedup && dedup_blocks == 0)
+            dedup_blocks = 1;
+        if (data_blocks + bitmap_blocks + csum_blocks + refs_blocks + dedup_blocks <= rest)
+            break;
+    }
 
     // super_block
     struct store_super_block sb = {0};
     sb.magic = STORE_MAGIC;
-    sb.version = 0;                     // first config
+    sb.version = STORE_VERSION;
     sb.flags = 0;                       // no features enabled
     sb.disk_size = config.disk_size;
-    sb.block = config.block_size ? config.block_size:4096;
+    sb.block = block;
     sb.inode_start = 1;                 // 0 reserver for SB
-    sb.inode_end = sb.inode_start + n_inodes - 1;
-    sb.data_start = sb.inode_end + 1;
-    sb.data_space_left = disk_avail - inode_space_used;
+    sb.inode_end = sb.inode_start + inode_blocks - 1;
+    sb.inode_count = n_inodes;
+    sb.gen_start = sb.inode_end + 1;
+    sb.gen_blocks = gen_blocks;
+    sb.gen = 1;                         // 0 is for slots of unknown age
+    sb.bitmap_start = sb.gen_start + gen_blocks;
+    sb.bitmap_end = sb.bitmap_start + bitmap_blocks - 1;
+    sb.csum_start = sb.bitmap_end + 1;
+    sb.csum_blocks = csum_blocks;
+    sb.refs_start = sb.csum_start + csum_blocks;
+    sb.refs_blocks = refs_blocks;
+    sb.dedup_start = sb.refs_start + refs_blocks;
+    sb.dedup_blocks = dedup_blocks;
+    sb.index_start = sb.dedup_start + dedup_blocks;
+    sb.index_end = sb.index_start + index_blocks - 1;
+    sb.journal_start = sb.index_end + 1;
+    sb.journal_blocks = journal_blocks;
+    sb.data_start = sb.journal_start + journal_blocks;
+    sb.data_blocks = data_blocks;
+    sb.data_space_left = data_blocks * block;
     sb.compression = config.compression;
-    sb.checksum = 0;                    // unused for now
-    sb.sb_cksum = 0;                    // unused for now
-    sb.reserved = 0;                    // unused for now
+    sb.checksum = config.checksum;
+    sb.pack_max = config.no_packing ? 0 : pack_capacity(block);
+    sb.pack_blk = 0;                    // first small file starts one
+    sb.key = config.encrypt > 0 ? config.encrypt : 0;
 
     // Set compression bit in flag if enabled disk-wide
     if (sb.compression != 0)
         sb.flags = sb.flags | FLAG_COMPRESSION;
+    // new files get encrypted with sb.key, see op_write
+    if (sb.key)
+        sb.flags = sb.flags | FLAG_ENCRYPTED;
+    sb.sb_cksum = sb_cksum(&sb);
 
     // padded superblock
     char *sb_block = malloc(sb.block);
@@ -230,8 +527,10 @@ int command_init() {
     memset(sb_block, 0, sb.block);
     memcpy(sb_block, &sb, sizeof(sb));
     // writing superblock
-    if (pwrite(fd, sb_block, 4096, 0) != 4096) {
+    n_sys++;
+    if (pwrite(fd, sb_block, sb.block, 0) != (ssize_t)sb.block) {
         printf("Error writing super-block to disk");
+        free(sb_block);
         close(fd);
         return 1;
     }
@@ -243,18 +542,40 @@ int command_init() {
     inode.flags = sb.flags;
     inode.compression = sb.compression;
 
-    off_t inode_off = (off_t)sb.inode_start * config.block_size;
+    off_t inode_off = (off_t)sb.inode_start * sb.block;
 
-    for (uint32_t i = 0; i < n_inodes; i++) {
-        if (pwrite(fd, &inode, sizeof(inode),
-                inode_off + i * sizeof(inode)) != sizeof(inode)) {
-            perror("write inode");
+    // an all-zero template is exactly what ftruncate already gave us, only write when
+    // the inodes carry inherited bits or the user asked for a fully written table
+    static const struct store_inode zero_inode;
+    uint64_t written = sb.block;
+    if (config.init_full || memcmp(&inode, &zero_inode, sizeof(inode)) != 0) {
+        if (format_inode_table(fd, inode_off, n_inodes, &inode, sb.block, &n_sys) != 0) {
             close(fd);
             return 1;
         }
+        written += n_inodes * sizeof(inode);
     }
 
+    // the free-space bitmap starts out all free, the generations, checksum table, reference
+    // counts, fingerprint and name index and journal empty, all of them are just the zeroed hole
+
+    n_sys++;
+    close(fd);
 
+    // the root directory, every path name hangs off it [dir.c]
+    struct store_disk d;
+    if (disk_open(&d, config.disk_name, O_RDWR) != 0)
+        return 1;
+    int ret = dir_init(&d) != 0 || disk_commit(&d) != 0;
+    disk_close(&d);
+    if (ret != 0) {
+        printf("Unable to make the root directory\n");
+        return 1;
+    }
+    uint64_t t_ns = now_ns() - t_start;
+    stats_op(SO_INIT, t_ns, written, n_sys);
+    printf("Init: %" PRIu64 " inodes in %" PRIu64 " blocks, %.3f ms, %" PRIu64 " syscalls\n",
+           n_inodes, inode_blocks, t_ns / 1e6, n_sys);
     return 0;
 }
 
@@ -320,6 +641,8 @@ int look_for_disk(int argc, char **argv) {
             snprintf(fname, PATH_MAX*2, "%s/%s", cwd, argv[idx+1]);
             strcpy(config.disk_name, fname);
         }
+    } else if (config.disk_name[0] == '\0') {
+        strcpy(config.disk_name, "store.disk");
     }
     return 0;
 }
@@ -328,21 +651,24 @@ int look_for_disk(int argc, char **argv) {
 /*
 Called from "write"|"append" after fetching disk name
 Checks if disk has been "init" as a failsafe to not write somewhere else
-Checks file access, file mode, sb.magic,sb.disk_size
+Checks file access, file mode, sb.magic,sb.disk_size and sb_cksum
+The disk stays open for the command that follows [disk_hold, open_disk takes it]
 Returns 0 if disk verified else ERR_VAL
 */
-int verify_disk() {
-    int fd = open(config.disk_name, O_RDONLY);      // DO NOT create if not exists
-    if (fd < 0) {
-        printf("Unable to open disk file -> %s\n", config.disk_name);
-        return 1;
-    }
+static int verify_disk_once(uint64_t *n_sys) {
+    // opening for write replays whatever a crash left in the journal, a superblock
+    // torn by that crash is whole again afterwards so sb_cksum is checked after it
+    int ret = disk_hold(config.disk_name);
+    if (ret != 0)
+        return ret == 2 ? 5 : 4;
+    struct store_disk *d = disk_held(config.disk_name);
 
     // stat disk info
     struct stat st;
-    if (fstat(fd, &st) < 0) {
+    (*n_sys)++;
+    if (fstat(d->fd, &st) < 0) {
         printf("Unable to get disk info\n");
-        close(fd);
+        disk_release();
         return -1;
     }
 
@@ -356,37 +682,29 @@ int verify_disk() {
     mode_t mode = st.st_mode & 0777;
     if (mode != 0644) {
         printf("Mode of disk file is different from the one at init\n");
-        close(fd);
+        disk_release();
         return 1;
         // TODO: will add different file modes later
     }
 
-    struct store_super_block sb;
-    ssize_t n = pread(fd, &sb, sizeof(sb), 0);
-
-    if (n != sizeof(sb)) {
-        printf("Failed to read sb of disk\n");
-        close(fd);
-        return 1;
-    }
-
-    if (sb.magic !=STORE_MAGIC) {
-        printf("Invalid store magic (bad disk)\n");
-        close(fd);
-        return 2;
-    }
-
-    if (sb.disk_size != (uint64_t) st.st_size) {
+    if (d->sb.disk_size != (uint64_t) st.st_size) {
         printf("Disk size mismatch\n");
-        close(fd);
+        disk_release();
         return 3;
     }
-    config.disk_size = sb.disk_size;
-    close(fd);
+    config.disk_size = d->sb.disk_size;
     return 0;
 
 }
 
+int verify_disk() {
+    uint64_t t_start = now_ns(), n_sys = 0;
+    int ret = verify_disk_once(&n_sys);
+    // disk_hold's own syscalls aren't in n_sys
+    stats_op(SO_VERIFY, now_ns() - t_start, sizeof(struct store_super_block), n_sys);
+    return ret;
+}
+
 
 uint64_t verify_data(int argc, char **argv, enum data_in *write_source) {
     // 3 ways to send data for "write"/"append"
@@ -407,7 +725,13 @@ uint64_t verify_data(int argc, char **argv, enum data_in *write_source) {
         data = strlen(argv[i+1]);
         return data;
     }
-    // default is stdin but will do it later
+    // default is stdin, size is only known up front when it is redirected from a file
+    if (!isatty(STDIN_FILENO)) {
+        struct stat st;
+        *write_source = D_STD;
+        if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+            data = st.st_size;
+    }
     return data;
 }
 
@@ -417,40 +741,892 @@ Called after verify_data to check available space
 -1 is not enough space else 0
 */
 int check_available_space(uint64_t write_sz_b) {
-    int fd = open(config.disk_name, O_RDONLY);      // DO NOT create if not exists
-    if (fd < 0) {
-        printf("Unable to open disk file -> %s\n", config.disk_name);
-        return -1;
-    }
+    uint64_t t_start = now_ns(), n_sys = 0;
     struct store_super_block sb;
-    ssize_t n = pread(fd, &sb, sizeof(sb), 0);
-    // print_super_block(&sb);
-
-    if (n != sizeof(sb)) {
-        printf("Failed to read sb of disk\n");
+    // verify_disk already has the superblock
+    struct store_disk *d = disk_held(config.disk_name);
+    if (d) {
+        sb = d->sb;
+    } else {
+        n_sys = 3;
+        int fd = open(config.disk_name, O_RDONLY);      // DO NOT create if not exists
+        if (fd < 0) {
+            printf("Unable to open disk file -> %s\n", config.disk_name);
+            return -1;
+        }
+        ssize_t n = pread(fd, &sb, sizeof(sb), 0);
         close(fd);
-        return -1;
+        if (n != sizeof(sb)) {
+            printf("Failed to read sb of disk\n");
+            return -1;
+        }
     }
+    stats_op(SO_SPACE, now_ns() - t_start, sizeof(sb), n_sys);
 
-    if (write_sz_b > sb.data_space_left) {
+    // with dedup on only the write can tell how much of it is already there
+    if (!sb.dedup_blocks && write_sz_b > sb.data_space_left) {
         return -1;
     } return 0;
 }
 
 
+// disk_take plus the block cache the config asks for
+static int open_disk(struct store_disk *d, int flags) {
+    if (load_keys() != 0)
+        return 1;
+    int ret = disk_take(d, config.disk_name, flags);
+    if (ret == 0 && cache_init(d, config.cache_size, !config.no_readahead) != 0) {
+        disk_close(d);
+        return 1;
+    }
+    return ret;
+}
+
+/*
+Writes src into the file called name, replacing its contents if it exists
+[append adds to the end of an existing file instead], see op_write.
+compression is an enum store_compression for this file, -1 keeps the file's
+own setting [or the disk's for new files], key the same for its key id.
+*/
+int command_write(const char *name, struct data_src *src, int compression, int key, bool append) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDWR) != 0)
+        return 1;
+    struct write_stats ws = {0};
+    int ret = op_write(&d, name, src, append, compression, key, &ws);
+    if (ret == ST_OK)
+        ret = disk_commit(&d);
+    // on failure nothing was committed, the blocks we took are still free on disk
+    bool lz4 = false;
+    struct store_file f;
+    if (ret == 0 && op_open(&d, name, &f) == ST_OK) {
+        lz4 = f.ino.compression == COMP_LZ4;
+        file_put(&f);
+    }
+    disk_close(&d);
+    if (ret == 0) {
+        double secs = ws.ns / 1e9;
+        printf("%s %" PRIu64 " bytes to %s in %.3f ms (%.1f MB/s) via %s, %" PRIu64 " syscalls\n",
+               append ? "Appended" : "Wrote", ws.bytes, name, ws.ns / 1e6,
+               secs > 0 ? ws.bytes / secs / (1 << 20) : 0.0, xfer_name(ws.method), ws.syscalls);
+        if (ws.shared)
+            printf("Dedup: %" PRIu64 " blocks were already on disk, %" PRIu64 " bytes written\n",
+                   ws.shared, ws.stored);
+        if (lz4)
+            printf("Compressed with lz4: %" PRIu64 " bytes on disk (%.1f%%), %" PRIu64 " clusters stored raw\n",
+                   ws.stored, ws.bytes ? 100.0 * ws.stored / ws.bytes : 0.0, ws.raw_clusters);
+    }
+    return ret;
+}
+
+// Streams the file called name [as it is in snapshot snap, unless NULL] to stdout
+int command_read(const char *name, uint64_t off, uint64_t len, enum read_mode mode, const char *snap) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDONLY) != 0)
+        return 1;
+    // a writer may be at it meanwhile, see readers.c [disk_close ends the read]
+    reader_enter(&d);
+    if (snap) {
+        struct store_snap sn;
+        int st = snap_open(&d, snap, &sn);
+        const struct snap_entry *e = st == ST_OK ? snap_find(&sn, name) : NULL;
+        struct read_stats rs = {0};
+        if (st == ST_NOENT)
+            fprintf(stderr, "No snapshot %s\n", snap);
+        else if (st == ST_OK && !e)
+            fprintf(stderr, "%s is not in snapshot %s\n", name, snap);
+        int ret = !e || snap_read(&d, e, off, len, STDOUT_FILENO, &rs) != 0;
+        if (st == ST_OK)
+            snap_close(&sn);
+        disk_close(&d);
+        return ret;
+    }
+    struct store_file f;
+    int st = reader_open(&d, name, &f);
+    if (st != ST_OK) {
+        if (st == ST_NOENT)
+            fprintf(stderr, "%s does not exist\n", name);
+        disk_close(&d);
+        return 1;
+    }
+    struct read_stats rs = {0};
+    int ret = data_read(&d, &f, off, len, STDOUT_FILENO, mode, &rs);
+    file_put(&f);
+    disk_close(&d);
+    return ret;
+}
+
+static int print_file(const struct store_inode *ino, void *arg) {
+    (void)arg;
+    printf("%12" PRIu64 "  %s\n", ino->size, ino->name);
+    return ST_OK;
+}
+
+// Lists every file on the disk [or in snapshot snap, unless NULL] with its size
+int command_list(const char *snap) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDONLY) != 0)
+        return 1;
+    reader_enter(&d);
+    int ret;
+    if (snap) {
+        struct store_snap sn;
+        ret = snap_open(&d, snap, &sn);
+        if (ret == ST_NOENT)
+            printf("No snapshot %s\n", snap);
+        for (uint32_t i = 0; ret == ST_OK && i < sn.h.n_files; i++)
+            print_file(sn.ent[i].ino, NULL);
+        if (ret == ST_OK)
+            snap_close(&sn);
+    } else {
+        ret = op_list(&d, print_file, NULL);
+    }
+    disk_close(&d);
+    return ret;
+}
+
+static int print_entry(const struct store_dirent *e, void *arg) {
+    const bool *all = arg;
+    if (*all || !(e->flags & FLAG_HIDDEN))
+        printf("%s%s\n", e->name, e->flags & FLAG_DIRECTORY ? "/" : "");
+    return ST_OK;
+}
+
+/*
+Lists the entries of directory path [the root when NULL], hidden ones [names
+starting with '.'] only with all. A path naming a file lists just that file.
+*/
+int command_ls(const char *path, bool all) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDONLY) != 0)
+        return 1;
+    reader_enter(&d);
+    struct store_file dir;
+    int ret = dir_open(&d, path ? path : "/", &dir);
+    if (ret == ST_INVAL) {
+        struct store_inode ino;
+        ret = index_lookup(&d, path, &ino) == 0 ? ST_OK : ST_ERR;
+        if (ret == ST_OK)
+            printf("%s\n", ino.name);
+    } else if (ret == ST_NOENT) {
+        printf("%s does not exist\n", path);
+    } else if (ret == ST_OK) {
+        ret = dir_list(&d, &dir, print_entry, &all);
+        file_put(&dir);
+    }
+    disk_close(&d);
+    return ret;
+}
+
+/*
+Socket of the daemon serving the disk, --socket path or the disk name + ".sock".
+Returns 0 on success, 1 when the path doesn't fit
+*/
+int socket_path(int argc, char **argv, char *out, size_t cap) {
+    int i = search(argc, argv, "--socket", false);
+    int n;
+    if (i > 0 && i + 1 < argc)
+        n = snprintf(out, cap, "%s", argv[i+1]);
+    else
+        n = snprintf(out, cap, "%s.sock", config.disk_name);
+    return n < 0 || (size_t)n >= cap;
+}
+
+/*
+Same as command_write but done by the daemon listening on s, a file or stdin is
+handed over as an fd so the daemon moves the data itself. Replies once the
+write is committed, just like the direct path.
+*/
+int client_command_write(int s, const char *name, struct data_src *src, int compression, int key, bool append) {
+    struct proto_req rq = { .magic = PROTO_MAGIC, .op = append ? OP_APPEND : OP_WRITE, .flags = RQ_SYNC,
+                            .name_len = strlen(name) };
+    if (rq.name_len >= INODE_NAME) {
+        printf("Name %s is longer than %d chars\n", name, INODE_NAME - 1);
+        return 1;
+    }
+    if (compression == COMP_LZ4)
+        rq.flags |= RQ_LZ4;
+    else if (compression == COMP_NONE)
+        rq.flags |= RQ_RAW;
+    if (key >= 0) {
+        rq.flags |= RQ_KEY;
+        rq.off = key;
+    }
+    int fd = -1;
+    if (src->kind == D_STR)
+        rq.len = src->size;
+    else
+        fd = src->fd;
+    if (fd >= 0)
+        rq.flags |= RQ_FD;
+    struct proto_resp resp;
+    uint64_t t0 = now_ns();
+    if (client_call(s, &rq, name, fd, src->kind == D_STR ? src->mem : NULL, &resp) != 0) {
+        printf("Lost the connection to the daemon\n");
+        return 1;
+    }
+    if (resp.status != ST_OK) {
+        printf("Daemon could not write %s: %s\n", name, op_status_name(resp.status));
+        return 1;
+    }
+    printf("%s %" PRIu64 " bytes to %s in %.3f ms via daemon\n", append ? "Appended" : "Wrote", resp.len, name,
+           (now_ns() - t0) / 1e6);
+    return 0;
+}
+
+// command_read through the daemon, which writes straight into our stdout
+int client_command_read(int s, const char *name, uint64_t off, uint64_t len) {
+    struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_READ, .flags = RQ_FD, .name_len = strlen(name),
+                            .off = off, .len = len };
+    struct proto_resp resp;
+    if (rq.name_len >= INODE_NAME || client_call(s, &rq, name, STDOUT_FILENO, NULL, &resp) != 0) {
+        fprintf(stderr, "Lost the connection to the daemon\n");
+        return 1;
+    }
+    if (resp.status != ST_OK) {
+        fprintf(stderr, "Daemon could not read %s: %s\n", name, op_status_name(resp.status));
+        return 1;
+    }
+    return 0;
+}
+
+// command_list through the daemon
+int client_command_list(int s) {
+    struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_LIST };
+    struct proto_resp resp;
+    char *buf = NULL;
+    if (client_call(s, &rq, "", -1, NULL, &resp) != 0 || resp.status != ST_OK ||
+        !(buf = malloc(resp.len + 1)) || client_recv(s, buf, resp.len) != 0) {
+        printf("Daemon could not list files\n");
+        free(buf);
+        return 1;
+    }
+    for (uint64_t at = 0; at + sizeof(uint64_t) + 1 <= resp.len; ) {
+        struct store_inode ino = {0};
+        memcpy(&ino.size, buf + at, sizeof(uint64_t));
+        uint8_t name_len = buf[at + sizeof(uint64_t)];
+        at += sizeof(uint64_t) + 1;
+        if (name_len >= INODE_NAME || at + name_len > resp.len)
+            break;
+        memcpy(ino.name, buf + at, name_len);
+        at += name_len;
+        print_file(&ino, NULL);
+    }
+    free(buf);
+    return 0;
+}
+
+static int print_snapshot(const struct store_inode *ino, void *arg) {
+    struct snap_header h;
+    if (snap_info(arg, ino, &h) != 0)
+        return ST_ERR;
+    char when[32] = "?";
+    time_t t = h.created;
+    struct tm tm;
+    if (localtime_r(&t, &tm))
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%-24s %8" PRIu32 " files %14" PRIu64 " bytes  %s\n", ino->name, h.n_files, h.bytes, when);
+    return ST_OK;
+}
+
+// Lists the snapshots on the disk
+int command_snapshots() {
+    struct store_disk d;
+    if (open_disk(&d, O_RDONLY) != 0)
+        return 1;
+    reader_enter(&d);
+    int ret = op_list_snapshots(&d, print_snapshot, &d);
+    disk_close(&d);
+    return ret;
+}
+
+/*
+Takes snapshot name of every file on the disk, or deletes it [del], see snap.c.
+Only blocks nothing else points at are freed by a delete.
+*/
+int command_snapshot(const char *name, bool del) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDWR) != 0)
+        return 1;
+    uint64_t t_start = now_ns();
+    int st = del ? snap_delete(&d, name) : snap_create(&d, name);
+    if (st == ST_OK)
+        st = disk_commit(&d) == 0 ? ST_OK : ST_ERR;
+    uint64_t free_blocks = d.alloc.n_free;
+    disk_close(&d);
+    if (st == ST_NOENT)
+        printf("No snapshot %s\n", name);
+    if (st != ST_OK)
+        return 1;
+    if (del)
+        printf("Deleted snapshot %s, %" PRIu64 " blocks free\n", name, free_blocks);
+    else
+        printf("Took snapshot %s in %.3f ms\n", name, (now_ns() - t_start) / 1e6);
+    return 0;
+}
+
+// command_snapshot through the daemon
+int client_command_snapshot(int s, const char *name, bool del) {
+    struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_SNAPSHOT, .flags = RQ_SYNC, .name_len = strlen(name),
+                            .off = del };
+    struct proto_resp resp;
+    if (rq.name_len >= INODE_NAME) {
+        printf("Name %s is longer than %d chars\n", name, INODE_NAME - 1);
+        return 1;
+    }
+    if (client_call(s, &rq, name, -1, NULL, &resp) != 0) {
+        printf("Lost the connection to the daemon\n");
+        return 1;
+    }
+    if (resp.status != ST_OK) {
+        printf("Daemon could not %s snapshot %s: %s\n", del ? "delete" : "take", name, op_status_name(resp.status));
+        return 1;
+    }
+    printf("%s snapshot %s via daemon\n", del ? "Deleted" : "Took", name);
+    return 0;
+}
+
+// Makes dst a copy of src [as it is in snapshot snap, unless NULL] that shares its blocks, see snap_clone
+int command_clone(const char *src, const char *dst, const char *snap) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDWR) != 0)
+        return 1;
+    int st = snap_clone(&d, src, dst, snap);
+    if (st == ST_OK)
+        st = disk_commit(&d) == 0 ? ST_OK : ST_ERR;
+    disk_close(&d);
+    if (st == ST_NOENT)
+        printf("%s does not exist%s%s\n", src, snap ? " in snapshot " : "", snap ? snap : "");
+    if (st != ST_OK)
+        return 1;
+    printf("Cloned %s -> %s\n", src, dst);
+    return 0;
+}
+
+// command_clone through the daemon
+int client_command_clone(int s, const char *src, const char *dst, const char *snap) {
+    char data[2 * INODE_NAME];
+    int n = snprintf(data, sizeof(data), "%s%c%s", src, '\0', snap ? snap : "");
+    struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_CLONE, .flags = RQ_SYNC, .name_len = strlen(dst),
+                            .len = snap ? (uint64_t)n : strlen(src) };
+    struct proto_resp resp;
+    if (rq.name_len >= INODE_NAME || n < 0 || n >= (int)sizeof(data)) {
+        printf("Name too long\n");
+        return 1;
+    }
+    if (client_call(s, &rq, dst, -1, data, &resp) != 0) {
+        printf("Lost the connection to the daemon\n");
+        return 1;
+    }
+    if (resp.status != ST_OK) {
+        printf("Daemon could not clone %s: %s\n", src, op_status_name(resp.status));
+        return 1;
+    }
+    printf("Cloned %s -> %s via daemon\n", src, dst);
+    return 0;
+}
+
+/*
+Writes what changed from snapshot from to snapshot to [all of to when from is
+NULL] to stdout as a diff stream, store apply takes it in on another disk.
+Messages go to stderr.
+*/
+int command_diff(const char *from, const char *to) {
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "A diff stream is binary, send it to a file or pipe\n");
+        return 1;
+    }
+    struct store_disk d;
+    if (open_disk(&d, O_RDONLY) != 0)
+        return 1;
+    reader_enter(&d);
+    struct diff_stats ds = {0};
+    uint64_t t_start = now_ns();
+    int st = snap_diff(&d, from, to, 0, STDOUT_FILENO, &ds);
+    disk_close(&d);
+    if (st != ST_OK) {
+        fprintf(stderr, "Unable to diff snapshot %s\n", to);
+        return 1;
+    }
+    fprintf(stderr, "Diff %s..%s: %" PRIu64 " files, %" PRIu64 " deleted, %" PRIu64 " bytes in %.3f ms\n",
+            from ? from : "", to, ds.files, ds.deleted, ds.bytes, (now_ns() - t_start) / 1e6);
+    return 0;
+}
+
+// Applies the diff stream on stdin to the disk, see snap_apply
+int command_apply() {
+    struct store_disk d;
+    if (open_disk(&d, O_RDWR) != 0)
+        return 1;
+    struct diff_stats ds = {0};
+    uint64_t t_start = now_ns();
+    int st = snap_apply(&d, STDIN_FILENO, &ds);
+    if (st == ST_OK)
+        st = disk_commit(&d) == 0 ? ST_OK : ST_ERR;
+    disk_close(&d);
+    if (st != ST_OK) {
+        printf("Unable to apply the diff stream, files it finished are in\n");
+        return 1;
+    }
+    printf("Applied %" PRIu64 " files, %" PRIu64 " deleted, %" PRIu64 " bytes in %.3f ms, %" PRIu64
+           " blocks kept\n", ds.files, ds.deleted, ds.bytes, (now_ns() - t_start) / 1e6, ds.shared);
+    return 0;
+}
+
+// Imports a directory tree, a tar file or a list of paths on stdin ["-"], see import.c
+int command_import(const char *from) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDWR) != 0)
+        return 1;
+    struct import_stats is = {0};
+    uint64_t t_start = now_ns();
+    int st = import_run(&d, from, &is);
+    // a run that stopped part way still keeps the files it finished
+    if (disk_commit(&d) != 0)
+        st = ST_ERR;
+    disk_close(&d);
+    double secs = (now_ns() - t_start) / 1e9;
+    printf("Imported %" PRIu64 " files, %" PRIu64 " bytes in %.3f s (%.0f files/s, %.1f MB/s)", is.files,
+           is.bytes, secs, secs > 0 ? is.files / secs : 0.0, secs > 0 ? is.bytes / secs / (1 << 20) : 0.0);
+    if (is.skipped)
+        printf(", %" PRIu64 " skipped", is.skipped);
+    printf("\n");
+    if (st != ST_OK) {
+        printf("Import stopped: %s\n", op_status_name(st));
+        return 1;
+    }
+    return 0;
+}
+
+// Renames a file on the disk, keeping the name index in step
+int command_rename(const char *from, const char *to) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDWR) != 0)
+        return 1;
+    uint64_t t_start = now_ns();
+    int ret = index_rename(&d, from, to);
+    if (ret == 0)
+        ret = disk_commit(&d);
+    stats_op(SO_RENAME, now_ns() - t_start, 0, 0);
+    disk_close(&d);
+    if (ret == 0)
+        printf("Renamed %s -> %s\n", from, to);
+    return ret;
+}
+
+/*
+Removes the n files [or empty directories] in names, their blocks are free for
+new data and given back to the host filesystem once no reader is on them.
+A txn has to fit the journal, so a long list is committed in batches whenever
+it is getting full [journal_full]: a crash keeps the batches before it.
+Returns 0 if every one of them went
+*/
+int command_delete(char **names, int n) {
+    struct store_disk d;
+    if (open_disk(&d, O_RDWR) != 0)
+        return 1;
+    int ret = 0, gone = 0, batch = 0;
+    for (int i = 0; i < n; i++) {
+        int st = op_delete(&d, names[i]);
+        if (st == ST_NOENT)
+            printf("%s does not exist\n", names[i]);
+        batch += st == ST_OK;
+        ret |= st != ST_OK;
+        if (batch && (i + 1 == n || journal_full(&d))) {
+            if (disk_commit(&d) != 0) {
+                ret = 1;
+                break;
+            }
+            gone += batch;
+            batch = 0;
+        }
+    }
+    uint64_t free_blocks = d.alloc.n_free;
+    disk_close(&d);
+    if (gone)
+        printf("Deleted %d of %d, %" PRIu64 " blocks free\n", gone, n, free_blocks);
+    return ret;
+}
+
+// command_delete through the daemon, the last delete waits for the commit that takes the last of them
+int client_command_delete(int s, char **names, int n) {
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_DELETE, .flags = i + 1 == n ? RQ_SYNC : 0,
+                                .name_len = strlen(names[i]) };
+        struct proto_resp resp;
+        if (rq.name_len >= INODE_NAME) {
+            printf("Name %s is longer than %d chars\n", names[i], INODE_NAME - 1);
+            ret = 1;
+            continue;
+        }
+        if (client_call(s, &rq, names[i], -1, NULL, &resp) != 0) {
+            printf("Lost the connection to the daemon\n");
+            return 1;
+        }
+        if (resp.status != ST_OK) {
+            printf("Daemon could not delete %s: %s\n", names[i], op_status_name(resp.status));
+            ret = 1;
+        }
+    }
+    if (ret == 0)
+        printf("Deleted %d via daemon\n", n);
+    return ret;
+}
+
+/*
+Moves files spread over many short runs into one run each [see defrag.c], at
+rate bytes/s at most [0 for no cap]. A daemon on the disk [s >= 0] is handed
+the job and does it in between requests, else this command holds the disk
+until done and commits as it goes.
+*/
+int command_defrag(int s, uint64_t rate) {
+    if (s >= 0) {
+        struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_DEFRAG, .off = rate };
+        struct proto_resp resp;
+        if (client_call(s, &rq, "", -1, NULL, &resp) != 0 || resp.status != ST_OK) {
+            printf("Daemon could not start the defrag\n");
+            return 1;
+        }
+        printf("Daemon is defragmenting %s in between requests\n", config.disk_name);
+        return 0;
+    }
+    struct store_disk d;
+    if (load_keys() != 0 || open_disk(&d, O_RDWR) != 0)
+        return 1;
+    struct store_defrag df;
+    int ret = defrag_start(&df, rate);
+    while (ret == 0) {
+        int more = defrag_step(&df, &d);
+        if (more < 0 || (d.j.txn.n && disk_commit(&d) != 0)) {
+            printf("Defrag failed, files not moved yet stay where they are\n");
+            ret = 1;
+        } else if (more == 0) {
+            break;
+        } else if (df.next_at > now_ns()) {
+            uint64_t ns = df.next_at - now_ns();
+            nanosleep(&(struct timespec){ .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 }, NULL);
+        }
+    }
+    defrag_stop(&df, &d);
+    disk_close(&d);
+    return ret;
+}
+
+/*
+Prints what commands on the disk recorded [see stats.c], plus what a daemon
+serving it has recorded since it started
+--reset starts the numbers over
+*/
+int command_stats(int s, bool json, bool reset) {
+    if (reset) {
+        if (stats_reset(config.disk_name) != 0) {
+            printf("Unable to reset stats of %s\n", config.disk_name);
+            return 1;
+        }
+        printf("Stats of %s reset\n", config.disk_name);
+        return 0;
+    }
+    struct stats_file *f = malloc(sizeof(*f));
+    if (!f)
+        return 1;
+    int ret = stats_load(config.disk_name, f);
+    if (s >= 0) {
+        struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_STATS };
+        struct proto_resp resp;
+        struct store_stats *live = malloc(sizeof(*live));
+        if (!live || client_call(s, &rq, "", -1, NULL, &resp) != 0 || resp.status != ST_OK ||
+            resp.len != sizeof(*live) || client_recv(s, live, resp.len) != 0) {
+            printf("Daemon could not send its stats\n");
+            ret = 1;
+        } else {
+            stats_merge(&f->s, live);
+        }
+        free(live);
+    }
+    if (ret == 0)
+        stats_print(&f->s, f->since, json);
+    free(f);
+    return ret;
+}
+
+// Profile [enum inode_ratio] whose inode table comes closest to the one of sb
+static enum inode_ratio ratio_of(const struct store_super_block *sb) {
+    static const enum inode_ratio ratios[] = { LARGE, BALANCED, SMALL };
+    double had = (double)(sb->inode_end - sb->inode_start + 1) * sb->block * 1000 / (sb->disk_size - sb->block);
+    enum inode_ratio best = BALANCED;
+    double off = -1;
+    for (size_t i = 0; i < sizeof(ratios) / sizeof(*ratios); i++) {
+        double o = had > ratios[i] ? had - ratios[i] : ratios[i] - had;
+        if (off < 0 || o < off) {
+            best = ratios[i];
+            off = o;
+        }
+    }
+    return best;
+}
+
+// Takes whatever of the layout the config doesn't set [0 or -1] from sb
+static void layout_of(const struct store_super_block *sb, bool keep_packing) {
+    if (config.disk_size == 0)
+        config.disk_size = sb->disk_size;
+    if (config.block_size == 0)
+        config.block_size = sb->block;
+    if (config.compression < 0)
+        config.compression = sb->compression;
+    if (config.checksum < 0)
+        config.checksum = sb->checksum;
+    if (keep_packing)
+        config.no_packing = sb->pack_max == 0;
+    if (config.dedup < 0)
+        config.dedup = sb->dedup_blocks != 0;
+    if (config.encrypt < 0)
+        config.encrypt = sb->flags & FLAG_ENCRYPTED ? sb->key : 0;
+    if (config.usage[0] == '\0')
+        config.ratio = ratio_of(sb);
+}
+
+/*
+Formats <disk>.rewrite with the layout in config, taking what wasn't asked
+for from the disk, then copies every file over [see rewrite.c]. A daemon on
+the disk [s >= 0] is handed the copy and switches over itself once done.
+rate caps the copy at bytes/s, 0 for none
+*/
+int command_rewrite(int s, uint64_t rate, bool keep_packing) {
+    struct store_disk d;
+    // before the name changes to the new disk's
+    if (load_keys() != 0 || disk_take(&d, config.disk_name, O_RDONLY) != 0)
+        return 1;
+    struct store_super_block sb = d.sb;
+    // a snapshot's manifest points at blocks of this disk, there is nothing to copy it as
+    int snaps = snap_count(&d);
+    disk_close(&d);
+    if (snaps != 0) {
+        if (snaps > 0)
+            printf("%s has %d snapshots, delete them before a rewrite\n", config.disk_name, snaps);
+        return 1;
+    }
+    layout_of(&sb, keep_packing);
+
+    // a leftover from a rewrite that never finished is of no use
+    char disk[sizeof(config.disk_name)], to[PATH_MAX];
+    strcpy(disk, config.disk_name);
+    if (snprintf(to, sizeof(to), "%s.rewrite", disk) >= (int)sizeof(to)) {
+        printf("Disk path too long\n");
+        return 1;
+    }
+    unlink(to);
+    strcpy(config.disk_name, to);
+    int ret = command_init();
+    strcpy(config.disk_name, disk);
+    if (ret != 0)
+        return 1;
+
+    if (s >= 0) {
+        // the daemon may run somewhere else
+        char abs[PATH_MAX * 2], cwd[PATH_MAX];
+        if (to[0] == '/')
+            strcpy(abs, to);
+        else if (getcwd(cwd, sizeof(cwd)))
+            snprintf(abs, sizeof(abs), "%s/%s", cwd, to);
+        else
+            abs[0] = '\0';
+        if (abs[0] == '\0' || strlen(abs) >= PATH_MAX) {
+            printf("Unable to tell the daemon where %s is\n", to);
+            unlink(to);
+            return 1;
+        }
+        struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_REWRITE, .off = rate, .len = strlen(abs) };
+        struct proto_resp resp;
+        if (client_call(s, &rq, "", -1, abs, &resp) != 0 || resp.status != ST_OK) {
+            printf("Daemon could not start the rewrite\n");
+            unlink(to);
+            return 1;
+        }
+        printf("Daemon is copying %s into the new layout, it switches over once done\n", disk);
+        return 0;
+    }
+
+    if (open_disk(&d, O_RDWR) != 0) {
+        unlink(to);
+        return 1;
+    }
+    struct store_rewrite rw;
+    ret = rewrite_start(&rw, &d, to, rate);
+    while (ret == 0) {
+        int more = rewrite_step(&rw, &d);
+        if (more < 0) {
+            printf("Rewrite failed, %s is left as it was\n", disk);
+            rewrite_abort(&rw);
+            ret = 1;
+        } else if (more == 0) {
+            ret = rewrite_finish(&rw, disk);
+            break;
+        } else if (rw.next_at > now_ns()) {
+            uint64_t ns = rw.next_at - now_ns();
+            nanosleep(&(struct timespec){ .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 }, NULL);
+        }
+    }
+    if (ret != 0)
+        unlink(to);
+    disk_close(&d);
+    return ret;
+}
+
+// Takes [del deletes] snapshot name for a sync, through the daemon when s >= 0
+static int sync_snapshot(int s, struct store_disk *d, const char *name, bool del) {
+    if (s >= 0) {
+        struct proto_req rq = { .magic = PROTO_MAGIC, .op = OP_SNAPSHOT, .flags = RQ_SYNC,
+                                .name_len = strlen(name), .off = del };
+        struct proto_resp resp;
+        return client_call(s, &rq, name, -1, NULL, &resp) != 0 || resp.status != ST_OK;
+    }
+    int st = del ? snap_delete(d, name) : snap_create(d, name);
+    return st != ST_OK || disk_commit(d) != 0;
+}
+
+/*
+Brings target up to date with the disk, see sync.c. target is a disk file
+[formatted with this disk's layout when it isn't there], a directory [the disk
+of the same name in it], a pipe, or - for stdout. A pipe is assumed to get all
+of the last sync, full sends every file instead of what changed since then.
+With a daemon on the disk [s >= 0] it takes the snapshots, the diff reads them
+off the disk. Messages go to stderr when the stream goes to stdout.
+*/
+int command_sync(int s, const char *target, bool full) {
+    uint64_t t_start = now_ns();
+    bool out = strcmp(target, "-") == 0;
+    FILE *msg = out ? stderr : stdout;
+    if (out && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "A sync stream is binary, send it to a file or pipe\n");
+        return 1;
+    }
+    char path[PATH_MAX] = "-";
+    struct stat st_t, st_d;
+    if (!out) {
+        const char *base = strrchr(config.disk_name, '/');
+        bool dir = stat(target, &st_t) == 0 && S_ISDIR(st_t.st_mode);
+        int n = dir ? snprintf(path, sizeof(path), "%s/%s", target, base ? base + 1 : config.disk_name)
+                    : snprintf(path, sizeof(path), "%s", target);
+        if (n < 0 || n >= (int)sizeof(config.disk_name)) {
+            printf("Sync target path %s too long\n", target);
+            return 1;
+        }
+    }
+    bool exists = !out && stat(path, &st_t) == 0;
+    bool stream = out || (exists && (S_ISFIFO(st_t.st_mode) || S_ISCHR(st_t.st_mode)));
+    if (exists && stat(config.disk_name, &st_d) == 0 && st_d.st_dev == st_t.st_dev && st_d.st_ino == st_t.st_ino) {
+        printf("Can't sync %s onto itself\n", config.disk_name);
+        return 1;
+    }
+
+    // the daemon takes the snapshots, this only reads them [uncached, so it sees what the daemon committed]
+    struct store_disk d, t;
+    if ((s >= 0 ? load_keys() != 0 || disk_take(&d, config.disk_name, O_RDONLY) : open_disk(&d, O_RDWR)) != 0)
+        return 1;
+    if (!exists && !stream) {
+        char disk[sizeof(config.disk_name)];
+        strcpy(disk, config.disk_name);
+        // the target gets this disk's layout, whatever the config says
+        config.disk_size = 0;
+        config.block_size = 0;
+        config.compression = config.checksum = config.dedup = config.encrypt = -1;
+        config.usage[0] = '\0';
+        config.init_full = false;
+        layout_of(&d.sb, true);
+        strcpy(config.disk_name, path);
+        int ret = command_init();
+        strcpy(config.disk_name, disk);
+        if (ret != 0) {
+            printf("Unable to create sync target %s\n", path);
+            disk_close(&d);
+            return 1;
+        }
+    }
+    int fd = out ? STDOUT_FILENO : -1;
+    if (stream && !out && (fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+        perror("open sync target");
+    if ((stream && fd < 0) || (!stream && disk_open(&t, path, O_RDWR) != 0)) {
+        disk_close(&d);
+        return 1;
+    }
+
+    // sync snapshots are told apart by the target's absolute path
+    char key[PATH_MAX * 2], cwd[PATH_MAX];
+    if (out || path[0] == '/')
+        strcpy(key, path);
+    else
+        snprintf(key, sizeof(key), "%s/%s", getcwd(cwd, sizeof(cwd)) ? cwd : ".", path);
+    char old[INODE_NAME], next[INODE_NAME], from[INODE_NAME];
+    int ret = sync_names(&d, key, old, next);
+    strcpy(from, full ? "" : old);
+    if (ret == 0 && from[0] && !stream) {
+        int found = index_lookup_snapshot(&t, from, NULL);
+        if (found > 0)
+            fprintf(msg, "%s has no %s, sending everything\n", path, from);
+        if (found != 0)
+            from[0] = '\0';
+        ret = found < 0;
+    }
+    // a target built again from scratch lets go of the last sync first, files it replaces free their blocks
+    if (ret == 0 && !from[0] && old[0] && !stream) {
+        int st = snap_delete(&t, old);
+        ret = (st != ST_OK && st != ST_NOENT) || (st == ST_OK && disk_commit(&t) != 0);
+    }
+    if (ret == 0 && sync_snapshot(s, &d, next, false) != 0) {
+        fprintf(msg, "Unable to take snapshot %s\n", next);
+        ret = 1;
+    }
+    struct diff_stats ds = {0};
+    if (ret == 0) {
+        // reading alongside the daemon, from after the snapshot it just took
+        if (s >= 0)
+            reader_enter(&d);
+        ret = sync_send(&d, from[0] ? from : NULL, next, stream ? NULL : &t, fd, &ds) != ST_OK ||
+              (!stream && disk_commit(&t) != 0);
+        reader_exit(&d);
+        if (ret != 0) {
+            fprintf(msg, "Sync to %s failed, files it finished are in\n", path);
+            sync_snapshot(s, &d, next, true);
+        }
+    }
+    // the last sync isn't needed once the target has this one, the target dropped it already
+    if (ret == 0 && old[0] && sync_snapshot(s, &d, old, true) != 0)
+        fprintf(msg, "Unable to delete snapshot %s, it keeps its blocks\n", old);
+    if (!stream)
+        disk_close(&t);
+    else if (!out)
+        close(fd);
+    disk_close(&d);
+    if (ret != 0)
+        return 1;
+    fprintf(msg, "Synced %s -> %s%s: %" PRIu64 " files, %" PRIu64 " deleted, %" PRIu64 " bytes sent, %" PRIu64
+            " blocks kept in %.3f ms\n", config.disk_name, path, from[0] ? "" : " [all of it]", ds.files,
+            ds.deleted, ds.bytes, ds.shared, (now_ns() - t_start) / 1e6);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     // for(int i=0; i<argc;i++){
     //     printf("%s ", argv[i]);
     // }
     // goto ret;
+    int cmd = -1;
     config.populated = false;
+    config.checksum = CK_CRC32C;
+    config.cache_size = CACHE_DEFAULT;
     if (argc < 2) {
         usage(argv[0]);
         goto ret_failure;
     }
+    // a rewrite keeps whatever of the disk's layout isn't asked to change
+    bool rewrite = search(argc, argv, "rewrite", true) > 0;
+    if (rewrite)
+        config.compression = config.checksum = config.dedup = config.encrypt = -1;
+    int conf_ret = 0;
     // this should only happen when the user does `store init` or `store rewrite`
-    if (search(argc, argv, "init",true)>0 || search(argc, argv, "rewrite",true)>0 ) {
-        if (init_config(argc, argv)!= 0) {
+    if (search(argc, argv, "init",true)>0 || rewrite) {
+        if ((conf_ret = init_config(argc, argv))!= 0) {
             // thinking of not exiting
             // exit(RET_FAILURE);
             config.populated = false;
@@ -458,6 +1634,24 @@ int main(int argc, char **argv) {
             config.populated = true;
         }
     }
+    // the rest only take the disk name and [cache] table from a config
+    int co = search(argc, argv, "-co", false);
+    if (co < 0)
+        co = search(argc, argv, "--config", false);
+    if (!config.populated && search(argc, argv, "init", true) < 0 && co > 0 && co + 1 < argc &&
+        read_config(argv[co + 1]) == 0)
+        fill_config(argv[co + 1]);
+    // --key_file wins over [crypto] key_file, the keys are loaded when the disk is opened
+    int kf = search(argc, argv, "-kf", false);
+    if (kf < 0)
+        kf = search(argc, argv, "--key_file", false);
+    if (kf > 0 && kf + 1 < argc) {
+        if (strlen(argv[kf + 1]) >= sizeof(config.key_file)) {
+            printf("Key file path too long\n");
+            goto ret_failure;
+        }
+        strcpy(config.key_file, argv[kf + 1]);
+    }
     // init process flow
     if (search(argc, argv, "init", true) > 0) {
         printf("init\n");
@@ -470,54 +1664,525 @@ int main(int argc, char **argv) {
             print_config();
         printf("Disk %s initiated, can be used now\n", config.disk_name);
         goto ret;
-    } else if (search(argc, argv, "write", true) > 0) {
+    } else if ((cmd = search(argc, argv, "write", true)) > 0 || (cmd = search(argc, argv, "append", true)) > 0) {
         /*
-        Usage of write command
+        Usage of write|append command
         [] => Need at least one of these args
-        [options] => [-co config_path | -ds disk_name | --disk disk_name]
-        store write [options] [--file path | --data string]
+        [options] => [-co config_path | -ds disk_name | --disk disk_name | --socket path]
+        store write f_name [options] [--file path | --data string]
+        store append f_name [options] [--file path | --data string]
 
         Data source (exactly one):
         --file <path>     Read data from file
         --data <string>   Use literal string
         (none)            Read from stdin
+        When a daemon serves the disk the write goes through it.
         */
+        bool append = strcasecmp(argv[cmd], "append") == 0;
+        if (cmd + 1 >= argc || argv[cmd + 1][0] == '-') {
+            usage(argv[0]);
+            printf("File name not passed after %s\n", argv[cmd]);
+            goto ret_failure;
+        }
         if (!config.populated ){//|| !config.disk_name) {
             // the user hasn't passed in config with cmd we have to check for disk
             if (look_for_disk(argc, argv) != 0) {
                 // could not find disk
-                printf("Unable to lookup disk for write\n");
+                printf("Unable to lookup disk for %s\n", argv[cmd]);
                 goto ret_failure;
             }
         }
-        if (verify_disk() == 0) {
+        char sock[PATH_MAX];
+        int s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        if (s >= 0) {
+            printf("Disk file -> %s [daemon on %s]\n", config.disk_name, sock);
+        } else if (verify_disk() == 0) {
                 printf("Disk file -> %s\n", config.disk_name);
                 printf("Disk size -> %ld\n", config.disk_size);
         } else {
-            goto ret;
+            goto ret_failure;
         }
         // can write to disk, now we need to verify data, is it a file or string??
         uint64_t data_in_bytes = 0;
         enum data_in write_source = D_INV;
         data_in_bytes = verify_data(argc, argv, &write_source);
-        if (data_in_bytes==0 || write_source == D_INV) {
+        if ((data_in_bytes==0 && write_source != D_STD) || write_source == D_INV) {
             printf("Nothing to write\n");
             goto ret_failure;
-        } else {
+        } else if (data_in_bytes) {
             printf("Data to be written -> %zu bytes\n", data_in_bytes);
         }
         // data verified, check data size with available data space on disk
-        if (check_available_space(data_in_bytes) == -1) {
+        if (s < 0 && check_available_space(data_in_bytes) == -1) {
             printf("Data to be written is more than the space available\n");
             goto ret_failure;
+        }
+        struct data_src src = { .kind = write_source, .fd = STDIN_FILENO };
+        int i = -1;
+        if (write_source == D_FIL) {
+            i = search(argc, argv, "--file", false);
+            src.fd = open(argv[i+1], O_RDONLY);
+            if (src.fd < 0) {
+                printf("Unable to open file %s given by user\n", argv[i+1]);
+                goto ret_failure;
+            }
+        } else if (write_source == D_STR) {
+            i = search(argc, argv, "--data", false);
+            src.mem = argv[i+1];
+            src.size = data_in_bytes;
+            src.size_known = true;
+        }
+        // -cm on the write sets compression for this file only
+        int compression = -1;
+        if ((i = search(argc, argv, "-cm", false)) > 0 || (i = search(argc, argv, "--compression", false)) > 0) {
+            if (i + 1 >= argc || (compression = parse_compression(argv[i+1])) < 0) {
+                printf("Compression must be on|off|lz4\n");
+                goto ret_failure;
+            }
+        }
+        // -en the same for encryption, the key has to be in the key file [of the daemon, if there is one]
+        int key = -1;
+        if ((i = search(argc, argv, "-en", false)) > 0 || (i = search(argc, argv, "--encrypt", false)) > 0) {
+            if (i + 1 >= argc || (key = parse_key(argv[i+1])) < 0) {
+                printf("Encrypt must be a key id [1-255] or off\n");
+                goto ret_failure;
+            }
+        }
+        int ret;
+        if (s >= 0) {
+            ret = client_command_write(s, argv[cmd + 1], &src, compression, key, append);
+            close(s);
         } else {
-            printf("Writing data to disk\n");
-            // write call
-            goto ret;
+            ret = command_write(argv[cmd + 1], &src, compression, key, append);
         }
+        if (write_source == D_FIL)
+            close(src.fd);
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "read", true)) > 0) {
+        /*
+        store read f_name [options] [--offset bytes] [--length bytes] [--mmap | --pread] [--snapshot name]
+        File data goes to stdout, so messages go to stderr
+        --snapshot reads the file as it was in that snapshot, off the disk itself
+        */
+        if (cmd + 1 >= argc || argv[cmd + 1][0] == '-') {
+            usage(argv[0]);
+            fprintf(stderr, "File name not passed after read\n");
+            goto ret_failure;
+        }
+        // snapshots never change, they are read off the disk even with a daemon on it
+        int i = search(argc, argv, "--snapshot", false);
+        const char *snap = i > 0 && i + 1 < argc ? argv[i+1] : NULL;
+        char sock[PATH_MAX];
+        int s = -1;
+        if (look_for_disk(argc, argv) != 0 ||
+            (!snap && (s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1) < 0 &&
+             verify_disk() != 0)) {
+            fprintf(stderr, "Unable to lookup disk for read\n");
+            goto ret_failure;
+        }
+        uint64_t off = 0, len = UINT64_MAX;
+        enum read_mode mode = READ_AUTO;
+        if ((i = search(argc, argv, "--offset", false)) > 0 && i + 1 < argc)
+            off = parse_size(argv[i+1]);
+        if ((i = search(argc, argv, "--length", false)) > 0 && i + 1 < argc)
+            len = parse_size(argv[i+1]);
+        if (search(argc, argv, "--mmap", false) > 0)
+            mode = READ_MMAP;
+        else if (search(argc, argv, "--pread", false) > 0)
+            mode = READ_PREAD;
+        int ret;
+        if (s >= 0) {
+            ret = client_command_read(s, argv[cmd + 1], off, len);
+            close(s);
+        } else {
+            ret = command_read(argv[cmd + 1], off, len, mode, snap);
+        }
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "list", true)) > 0) {
+        // store list [options] [--snapshot name], every file [in that snapshot] with its size
+        int i = search(argc, argv, "--snapshot", false);
+        const char *snap = i > 0 && i + 1 < argc ? argv[i+1] : NULL;
+        char sock[PATH_MAX];
+        int s = -1;
+        if (look_for_disk(argc, argv) != 0 ||
+            (!snap && (s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1) < 0 &&
+             verify_disk() != 0)) {
+            printf("Unable to lookup disk for list\n");
+            goto ret_failure;
+        }
+        int ret;
+        if (s >= 0) {
+            ret = client_command_list(s);
+            close(s);
+        } else {
+            ret = command_list(snap);
+        }
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "ls", true)) > 0) {
+        // store ls [path] [options] [-a|--all], the entries of a directory, names ending in / are directories
+        const char *path = NULL;
+        bool all = false;
+        for (int i = cmd + 1; i < argc && !path; i++) {
+            if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--all") == 0)
+                all = true;
+            else if (argv[i][0] == '-')
+                i++;    // every other flag takes a value
+            else
+                path = argv[i];
+        }
+        all = all || search(argc, argv, "-a", false) > 0 || search(argc, argv, "--all", false) > 0;
+        if (look_for_disk(argc, argv) != 0 || verify_disk() != 0) {
+            printf("Unable to lookup disk for ls\n");
+            goto ret_failure;
+        }
+        if (command_ls(path, all) != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "daemon", true)) > 0) {
+        /*
+        store daemon [options] [--socket path]
+        Serves the disk until SIGINT/SIGTERM, see daemon.c. Commands on the
+        same disk find it on the socket [default disk name + ".sock"].
+        */
+        char sock[PATH_MAX];
+        if (look_for_disk(argc, argv) != 0 || verify_disk() != 0) {
+            printf("Unable to lookup disk for daemon\n");
+            goto ret_failure;
+        }
+        if (socket_path(argc, argv, sock, sizeof(sock)) != 0) {
+            printf("Socket path too long\n");
+            goto ret_failure;
+        }
+        // the daemon serves encrypted files with the keys loaded here
+        if (load_keys() != 0)
+            goto ret_failure;
+        if (daemon_run(config.disk_name, sock, config.cache_size, !config.no_readahead) != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "rename", true)) > 0) {
+        // store rename [options] old_name new_name, the options can go anywhere
+        const char *names[2];
+        int n = 0;
+        for (int i = cmd + 1; i < argc; i++) {
+            if (argv[i][0] == '-')
+                i++;    // every flag takes a value
+            else if (n < 2)
+                names[n++] = argv[i];
+            else
+                n = 3;  // one name too many
+        }
+        if (n != 2) {
+            usage(argv[0]);
+            printf("rename takes the old and the new name\n");
+            goto ret_failure;
+        }
+        if (look_for_disk(argc, argv) != 0 || verify_disk() != 0) {
+            printf("Unable to lookup disk for rename\n");
+            goto ret_failure;
+        }
+        if (command_rename(names[0], names[1]) != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "delete", true)) > 0) {
+        /*
+        store delete name... [options]
+        Removes the files [an empty directory too] and frees their blocks, the
+        host filesystem gets the space back. Goes through the daemon when one
+        serves the disk.
+        */
+        char **names = malloc(argc * sizeof(*names));
+        int n = 0;
+        for (int i = cmd + 1; names && i < argc; i++) {
+            if (argv[i][0] == '-')
+                i++;    // every flag takes a value
+            else
+                names[n++] = argv[i];
+        }
+        if (n == 0) {
+            usage(argv[0]);
+            printf("Nothing to delete, pass the names\n");
+            free(names);
+            goto ret_failure;
+        }
+        char sock[PATH_MAX];
+        int s = -1;
+        if (look_for_disk(argc, argv) != 0 ||
+            ((s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1) < 0 &&
+             verify_disk() != 0)) {
+            printf("Unable to lookup disk for delete\n");
+            free(names);
+            goto ret_failure;
+        }
+        int ret;
+        if (s >= 0) {
+            ret = client_command_delete(s, names, n);
+            close(s);
+        } else {
+            ret = command_delete(names, n);
+        }
+        free(names);
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "defrag", true)) > 0) {
+        /*
+        store defrag [options] [--rate bytes/s]
+        Moves files spread over many short runs into one run each. With a
+        daemon on the disk it goes on in between requests, else this command
+        holds the disk until done.
+        --rate caps the copy at bytes/s [KB|MB|GB], default 64MB, 0 for no cap
+        */
+        if (look_for_disk(argc, argv) != 0) {
+            printf("Unable to lookup disk for defrag\n");
+            goto ret_failure;
+        }
+        uint64_t rate = DEFRAG_RATE;
+        int i = search(argc, argv, "--rate", false);
+        if (i > 0 && i + 1 < argc)
+            rate = parse_size(argv[i+1]);
+        char sock[PATH_MAX];
+        int s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        if (s < 0 && verify_disk() != 0)
+            goto ret_failure;
+        int ret = command_defrag(s, rate);
+        if (s >= 0)
+            close(s);
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "rewrite", true)) > 0) {
+        /*
+        store rewrite [--disk disk_name | -dn disk_name] [-co config] [-ds size] [-cm ..] [-ck ..] [-pk ..] [-dd ..]
+                      [--rate bytes/s]
+        Copies the disk into a new one with the given size, profile [from the
+        config], block size, compression, checksum, packing and dedup, anything not
+        given is kept. Here -ds is the new size, like for init.
+        With a daemon on the disk it copies in the background while serving,
+        else this command copies and holds the disk until done.
+        --rate caps the copy at bytes/s [KB|MB|GB]
+        */
+        if (conf_ret != 0 && config.disk_size != 0)
+            goto ret_failure;
+        if (search(argc, argv, "--disk", false) > 0) {
+            if (look_for_disk(argc, argv) != 0)
+                goto ret_failure;
+        } else if (config.disk_name[0] == '\0') {
+            strcpy(config.disk_name, "store.disk");
+        }
+        uint64_t rate = 0;
+        int i = search(argc, argv, "--rate", false);
+        if (i > 0 && i + 1 < argc)
+            rate = parse_size(argv[i+1]);
+        bool keep_packing = co < 0 && search(argc, argv, "-pk", false) < 0 && search(argc, argv, "--packing", false) < 0;
+        char sock[PATH_MAX];
+        int s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        int ret = command_rewrite(s, rate, keep_packing);
+        if (s >= 0)
+            close(s);
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "snapshot", true)) > 0) {
+        /*
+        store snapshot name [options]            freezes every file on the disk as name
+        store snapshot --list [options]          snapshots with their files, bytes and time
+        store snapshot --delete name [options]   blocks nothing else points at are freed
+        Taking one only copies inodes and extents, see snap.c. Goes through the
+        daemon when one serves the disk.
+        */
+        if (look_for_disk(argc, argv) != 0) {
+            printf("Unable to lookup disk for snapshot\n");
+            goto ret_failure;
+        }
+        int i = search(argc, argv, "--delete", false);
+        bool del = i > 0;
+        const char *name = del ? (i + 1 < argc ? argv[i+1] : NULL) : (cmd + 1 < argc ? argv[cmd + 1] : NULL);
+        bool list = search(argc, argv, "--list", false) > 0;
+        if (!list && (!name || name[0] == '-')) {
+            usage(argv[0]);
+            printf("Snapshot name not passed\n");
+            goto ret_failure;
+        }
+        char sock[PATH_MAX];
+        int s = !list && socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        if (!list && s < 0 && verify_disk() != 0)
+            goto ret_failure;
+        int ret;
+        if (list)
+            ret = command_snapshots();
+        else if (s >= 0)
+            ret = client_command_snapshot(s, name, del);
+        else
+            ret = command_snapshot(name, del);
+        if (s >= 0)
+            close(s);
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "clone", true)) > 0) {
+        /*
+        store clone src dst [options] [--snapshot name]
+        dst gets src's contents [as they are in that snapshot] without a copy of
+        the data, the two share blocks until one of them is written
+        */
+        if (cmd + 2 >= argc || argv[cmd + 1][0] == '-' || argv[cmd + 2][0] == '-') {
+            usage(argv[0]);
+            goto ret_failure;
+        }
+        if (look_for_disk(argc, argv) != 0) {
+            printf("Unable to lookup disk for clone\n");
+            goto ret_failure;
+        }
+        int i = search(argc, argv, "--snapshot", false);
+        const char *snap = i > 0 && i + 1 < argc ? argv[i+1] : NULL;
+        char sock[PATH_MAX];
+        int s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        if (s < 0 && verify_disk() != 0)
+            goto ret_failure;
+        int ret;
+        if (s >= 0) {
+            ret = client_command_clone(s, argv[cmd + 1], argv[cmd + 2], snap);
+            close(s);
+        } else {
+            ret = command_clone(argv[cmd + 1], argv[cmd + 2], snap);
+        }
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "diff", true)) > 0) {
+        /*
+        store diff to [options] [--from name] > stream
+        Writes what changed between snapshots from and to [everything in to
+        without --from] as a diff stream, see store.h. Messages go to stderr.
+        */
+        if (cmd + 1 >= argc || argv[cmd + 1][0] == '-') {
+            usage(argv[0]);
+            fprintf(stderr, "Snapshot name not passed after diff\n");
+            goto ret_failure;
+        }
+        if (look_for_disk(argc, argv) != 0) {
+            fprintf(stderr, "Unable to lookup disk for diff\n");
+            goto ret_failure;
+        }
+        int i = search(argc, argv, "--from", false);
+        if (command_diff(i > 0 && i + 1 < argc ? argv[i+1] : NULL, argv[cmd + 1]) != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "apply", true)) > 0) {
+        /*
+        store apply [options] < stream
+        Brings the disk to the to snapshot of a diff stream, the disk must have
+        its from snapshot. The daemon has to be stopped first.
+        */
+        if (look_for_disk(argc, argv) != 0) {
+            printf("Unable to lookup disk for apply\n");
+            goto ret_failure;
+        }
+        char sock[PATH_MAX];
+        int s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        if (s >= 0) {
+            close(s);
+            printf("A daemon serves %s, stop it before applying\n", config.disk_name);
+            goto ret_failure;
+        }
+        if (verify_disk() != 0)
+            goto ret_failure;
+        if (isatty(STDIN_FILENO)) {
+            printf("Nothing to apply, send the diff stream on stdin\n");
+            goto ret_failure;
+        }
+        if (command_apply() != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "import", true)) > 0) {
+        /*
+        store import dir|tarball|- [options]
+        Writes every file under dir [or in the tar, or named on stdin with -]
+        into the disk in one run, see import.c. A compressed tar goes in as
+        gzip -dc x.tar.gz | store import /dev/stdin. The daemon has to be
+        stopped first.
+        */
+        if (cmd + 1 >= argc || (argv[cmd + 1][0] == '-' && argv[cmd + 1][1] != '\0')) {
+            usage(argv[0]);
+            printf("Nothing to import, pass a directory, a tar file or - for a list on stdin\n");
+            goto ret_failure;
+        }
+        if (look_for_disk(argc, argv) != 0) {
+            printf("Unable to lookup disk for import\n");
+            goto ret_failure;
+        }
+        char sock[PATH_MAX];
+        int s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        if (s >= 0) {
+            close(s);
+            printf("A daemon serves %s, stop it before importing\n", config.disk_name);
+            goto ret_failure;
+        }
+        if (verify_disk() != 0)
+            goto ret_failure;
+        if (strcmp(argv[cmd + 1], "-") == 0 && isatty(STDIN_FILENO)) {
+            printf("Nothing to import, send the paths on stdin\n");
+            goto ret_failure;
+        }
+        if (command_import(argv[cmd + 1]) != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "sync", true)) > 0) {
+        /*
+        store sync [options] [--to disk|dir|pipe|-] [--full]
+        Sends what changed since the last sync to the target [[sync] to in the
+        config without --to], see sync.c. A target disk that isn't there yet is
+        made with this disk's layout. --full sends every file.
+        */
+        if (look_for_disk(argc, argv) != 0) {
+            printf("Unable to lookup disk for sync\n");
+            goto ret_failure;
+        }
+        int i = search(argc, argv, "--to", false);
+        const char *to = i > 0 && i + 1 < argc ? argv[i+1] : config.sync_to;
+        if (to[0] == '\0') {
+            usage(argv[0]);
+            printf("Nowhere to sync to, pass --to or set [sync] to in the config\n");
+            goto ret_failure;
+        }
+        char sock[PATH_MAX];
+        int s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        if (s < 0 && verify_disk() != 0)
+            goto ret_failure;
+        int ret = command_sync(s, to, search(argc, argv, "--full", false) > 0);
+        if (s >= 0)
+            close(s);
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
+    } else if ((cmd = search(argc, argv, "stats", true)) > 0) {
+        // store stats [options] [--json] [--reset]
+        if (look_for_disk(argc, argv) != 0) {
+            printf("Unable to lookup disk for stats\n");
+            goto ret_failure;
+        }
+        char sock[PATH_MAX];
+        int s = socket_path(argc, argv, sock, sizeof(sock)) == 0 ? client_connect(sock) : -1;
+        int ret = command_stats(s, search(argc, argv, "--json", false) > 0, search(argc, argv, "--reset", false) > 0);
+        if (s >= 0)
+            close(s);
+        if (ret != 0)
+            goto ret_failure;
+        goto ret;
     }
 ret:
+    // whatever this run recorded goes into the disk's stats file, see stats.c
+    if (config.disk_name[0])
+        stats_save(config.disk_name);
     return EXIT_SUCCESS;
 ret_failure:
+    if (config.disk_name[0])
+        stats_save(config.disk_name);
     return EXIT_FAILURE;
 }
\ No newline at end of file
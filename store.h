@@ -10,9 +10,12 @@
 #include <string.h>
 #include <strings.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <sys/stat.h>
 // #include <sys/types.h>
 #include <sys/vfs.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "tomlc99/toml.h"
@@ -27,6 +30,29 @@
 +------------------+
 | inode table      |
 +------------------+
+| generations      |  64 bits per inode slot, sb.gen when it was last written
++------------------+
+
+[ block N+1..K ]
++------------------+
+| free-space bitmap|  1 bit per data block, 1 = used
++------------------+
+| checksum table   |  32 bits per data block, only with checksums on
++------------------+
+| reference counts |  16 bits per data block, owners besides the first
++------------------+
+| fingerprint index|  xxh64(block) -> block, one bucket per block, only with dedup on
++------------------+
+
+[ block K+1..J-1 ]
++------------------+
+| name index       |  hash(name) -> inode_id, one bucket per block
++------------------+
+
+[ block J..M-1 ]
++------------------+
+| journal          |  metadata block images, see journal.c
++------------------+
 
 [ block M..end ]
 +------------------+
@@ -34,16 +60,45 @@
 +------------------+
 */
 #define STORE_MAGIC 0x53544F52  // 'STOR'
+/*
+On disk layout version, moved on with every change older code can't read right.
+disk_open turns other versions away, a disk from before has to be made again
+  1  bitmap allocator after the inode table [sb.bitmap_start, end], inodes map
+     their data with extents, overflow extents in chained extent blocks
+  2  name index after the bitmap [sb.index_start, index_end]
+  3  metadata journal after the name index [sb.journal_start, journal_blocks]
+  4  LZ4 clusters: extents carry csize, inodes the bytes stored, n_extents
+     is 32 bits
+  5  sb_cksum, inode and extent block checksums, data checksum table after
+     the journal [sb.csum_start, csum_blocks]
+  6  inline and packed files [sb.pack_max, pack_blk, pack blocks]
+  7  a last block's checksum covers only the bytes before EOF [appends fill it
+     in place], inodes keep the append window in prealloc
+  8  dedup reference counts and fingerprint index [sb.refs_*, dedup_*]
+  9  reference counts on every disk [snapshots and clones share blocks],
+     snapshot inodes with their manifests
+ 10  inode generation table after the inode table [sb.gen_start, gen],
+     snapshot manifests carry each file's generation
+ 11  sb.key and inode key in what was reserved, encrypted blocks keep their
+     MACs in the checksum table
+ 12  sb.ino_next, the superblock grows by 8 bytes
+ 13  directories: the root directory in sb.root_dir [the spare word after
+     ino_next], directory inodes with B+tree entry blocks
+*/
+#define STORE_VERSION 13
 // feature flag bits
 #define FLAG_COMPRESSION  (1 << 0)  // LSB of the flag var
 #define FLAG_READ_ONLY    (1 << 1)  // This file is read only for cur user
 #define FLAG_HIDDEN       (1 << 2)  // This file is hidden, won't show up in cmds by default
 #define FLAG_ENCRYPTED    (1 << 3)  // Needs key to read/write to this file
 #define FLAG_DIRECTORY    (1 << 4)  // Is a dir
+#define FLAG_INLINE       (1 << 5)  // data lives in the inode, see pack.c
+#define FLAG_PACKED       (1 << 6)  // data lives in slots of a shared pack block
+#define FLAG_SNAPSHOT     (1 << 7)  // a snapshot, its data is the manifest, see snap.c
 
 struct store_super_block {
     uint32_t magic;           // Identity
-    uint16_t version;         // Something relating to config stuff
+    uint16_t version;         // STORE_VERSION the disk was formatted with
     uint16_t flags;           // features enabled BITS
     // [ON superblock only compression and Enc can be enabled disk-wide]
 
@@ -55,28 +110,132 @@ struct store_super_block {
 
     uint32_t data_start;      // block index
     uint8_t compression;      // ENUM compression
-    uint8_t checksum;         // ENUM cksum
-    uint16_t reserved;
-    uint64_t sb_cksum;        // Integrity
+    uint8_t checksum;         // enum store_checksum, for metadata and data blocks
+    uint16_t key;             // key id new files are encrypted with when FLAG_ENCRYPTED is set, see crypt.c
+    uint64_t inode_count;     // inode slots in the table
+    uint32_t bitmap_start;    // block index
+    uint32_t bitmap_end;      // block index
+    uint64_t data_blocks;     // blocks from data_start to end, one bitmap bit each
+    uint32_t index_start;     // block index
+    uint32_t index_end;       // block index
+    uint32_t journal_start;   // block index
+    uint32_t journal_blocks;  // incl. the journal super
+    uint32_t csum_start;      // block index of the data checksum table
+    uint32_t csum_blocks;     // 0 when checksums are off
+    uint32_t pack_max;        // files up to this many bytes are inlined/packed, 0 = every file gets blocks
+    uint64_t pack_blk;        // pack block new small files go to, 0 = none yet
+    uint32_t refs_start;      // block index of the reference counts
+    uint32_t refs_blocks;
+    uint32_t dedup_start;     // block index of the fingerprint index
+    uint32_t dedup_blocks;    // 0 when dedup is off
+    uint32_t gen_start;       // block index of the inode generations
+    uint32_t gen_blocks;
+    uint64_t gen;             // inodes written now get this, every snapshot moves it on
+    uint32_t ino_next;        // no free inode slot below it, 0 = not known, see inode_alloc
+    uint32_t root_dir;        // inode of the root directory "/"
+    uint64_t sb_cksum;        // Integrity, over everything above
+
+};
 
+// A run of contiguous data blocks belonging to a file
+struct store_extent {
+    uint64_t lblk;           // first block of the file this maps
+    uint64_t pblk;           // first block on disk
+    uint32_t count;          // how many blocks of the file
+    uint32_t csize;          // 0 = plain, else one LZ4 cluster of csize bytes at pblk
 };
 
 #define INODE_NAME 64           // Including /0
+#define INODE_EXTENTS 6         // extents kept in the inode, rest go to ext_block chain
+// bytes of data an inode holds in place of its extents
+#define INODE_INLINE (INODE_EXTENTS * sizeof(struct store_extent))
 // Inode struct
 struct store_inode {
-    uint32_t inode_id;
+    uint32_t inode_id;       // slot + 1, 0 when the slot is free
     uint32_t flags;
 
     char name[INODE_NAME];
     uint64_t size;           // logical size
-    uint64_t start_block;    // where data begins
-    uint64_t block_count;    // how many blocks
+    uint64_t block_count;    // how many blocks across all extents
+    uint64_t ext_block;      // first overflow extent block, 0 if none
+
+    uint32_t n_extents;      // total extents incl. overflow
+    uint8_t  compression;    // inherited or overridden, enum store_compression
+    uint8_t  data_cksum;     // data blocks are in the checksum table, enum store_checksum
+    uint8_t  prealloc;       // log2 of the last append window in blocks, 0 before the first
+    uint8_t  key;            // key id when FLAG_ENCRYPTED, see crypt.c
 
-    uint8_t  compression;    // inherited or overridden
-    uint8_t  reserved[7];
+    uint64_t checksum;       // over the inode with this field 0, 0 on free slots
 
-    uint64_t checksum;
+    union {
+        struct store_extent extents[INODE_EXTENTS];
+        char inline_data[INODE_INLINE];     // FLAG_INLINE
+        struct {
+            uint64_t pblk;
+            uint32_t slot;                  // first PACK_SLOT of the file in pblk
+            uint32_t n_slots;
+        } pack;                             // FLAG_PACKED
+    };
+};
+_Static_assert(sizeof(struct store_inode) == 256, "inode must stay 256 bytes");
 
+// Overflow extents, chained from inode.ext_block
+struct store_ext_block {
+    uint64_t next;           // next overflow block, 0 if last
+    uint32_t n;              // extents used in this block
+    uint32_t cksum;          // crc32c of the block with this field 0
+    struct store_extent extents[];
+};
+
+/*
+Directory blocks, the data of a FLAG_DIRECTORY inode, see dir.c
+A B+tree keyed by name_hash of the entry names, block 0 is the root. Leaves
+[level 0] hold store_dirent sorted by hash, index blocks store_dir_node.
+*/
+#define DIR_MAGIC 0x44495242    // 'DIRB'
+#define DIR_LEVELS 8            // deeper than any directory the inode table can fill
+struct store_dir_block {
+    uint32_t magic;
+    uint32_t cksum;          // crc32c of the block with this field 0
+    uint16_t level;          // 0 = leaf
+    uint16_t n;              // entries used
+    uint32_t reserved;
+};
+
+struct store_dirent {
+    uint64_t hash;           // name_hash of name
+    uint32_t inode_id;
+    uint32_t flags;          // FLAG_DIRECTORY and FLAG_HIDDEN of the inode
+    char name[INODE_NAME];   // last part of the path
+};
+
+struct store_dir_node {
+    uint64_t hash;           // lowest hash under the child, anything below goes to the first one
+    uint64_t lblk;           // child block of the directory
+};
+
+// Shared block small files are packed into, see pack.c
+#define PACK_MAGIC 0x5041434B   // 'PACK'
+#define PACK_SLOT 128           // bytes per slot
+struct store_pack_block {
+    uint32_t magic;
+    uint32_t cksum;          // crc32c of the block with this field 0
+    uint32_t used;           // slots files take, not counting the header's
+    uint32_t reserved;
+    uint64_t map[];          // 1 bit per slot, 1 = used, the first ones are this header
+};
+
+// sb.compression / inode.compression
+enum store_compression {
+    COMP_NONE = 0,
+    COMP_LZ4 = 1,
+};
+
+// sb.checksum
+enum store_checksum {
+    CK_NONE = 0,
+    CK_CRC32C = 1,
+    CK_XXH64 = 2,
 };
 
 // divide by 1000 for use [percentages]
@@ -91,22 +250,838 @@ enum data_in {
     D_INV = 0,
     D_STR = 1,
     D_FIL = 2,
-} data_in;
+    D_STD = 3,
+};
+
+// How bytes get from a data source into the disk file, best first
+enum xfer_method {
+    XM_COPY_RANGE,           // copy_file_range, file -> file inside the kernel
+    XM_SENDFILE,             // sendfile, for kernels/filesystems without the above
+    XM_SPLICE,               // splice, pipe -> file
+    XM_BUFFERED,             // read into an aligned buffer + pwrite
+    XM_MEMORY,               // data already in memory [--data]
+};
+
+// Where data for write/append comes from
+struct data_src {
+    enum data_in kind;
+    int fd;                  // D_FIL, D_STD
+    const char *mem;         // D_STR
+    uint64_t size;           // bytes to write when size_known
+    bool size_known;         // false for pipes/ttys, read until EOF
+    bool seekable;           // regular file, read with pread at off
+    off_t off;               // bytes consumed [file offset for regular files]
+    enum xfer_method method;
+    char *buf;               // WRITE_BUF bounce buffer, only for XM_BUFFERED
+};
+
+enum read_mode {
+    READ_AUTO,               // pread for small records, mmap for the rest
+    READ_MMAP,
+    READ_PREAD,
+};
+
+struct read_stats {
+    uint64_t bytes;
+    uint64_t syscalls;
+    uint64_t ns;
+    enum read_mode mode;     // what was actually used
+};
+
+struct write_stats {
+    uint64_t bytes;
+    uint64_t syscalls;
+    uint64_t ns;
+    enum xfer_method method;
+    uint64_t stored;         // bytes that went to disk, < bytes when compressed
+    uint64_t raw_clusters;   // clusters kept uncompressed, ratio too poor
+    uint64_t shared;         // blocks that were already on disk [dedup], not written
+};
 
 // config struct to populate from user [store.toml]
 struct store_config {
-    int                 compression;    // is compression enabled for all of disk
+    int                 compression;    // enum store_compression for all of disk
+    int                 checksum;       // enum store_checksum, CK_CRC32C unless set
     uint64_t            disk_size;      // size of disk file
     char                disk_name[256]; // name of disk file
     char                usage[16];      // to get inode ratio
     int                 block_size;     // to be given in SB, if not 4KB by default
     enum inode_ratio    ratio;          // computed from inode_ratio and config.usage
     bool                populated;      // True if config read else False
+    bool                init_full;      // write out the whole inode table at init
+    bool                no_packing;     // every file gets whole blocks, no inline/packed files
+    uint64_t            cache_size;     // block cache budget [cache] size, CACHE_DEFAULT unless set
+    bool                no_readahead;   // [cache] readahead = "off"
+    int                 dedup;          // 1 = dedup on, 0 = off [default]
+    char                sync_to[256];   // [sync] to, target of store sync without --to
+    int                 encrypt;        // key id for the whole disk on init, 0 = off, -1 = as the disk has it
+    char                key_file[256];  // [crypto] key_file or --key_file, "" = <disk>.keys if there is one
+};
+
+
+// Fingerprint index slot, a bucket is one block of these, see dedup.c
+struct dedup_entry {
+    uint64_t hash;           // xxh64 of a full data block
+    uint64_t pblk;           // 0 = empty
+};
+
+// Name index slot, a bucket is one block of these
+struct store_index_entry {
+    uint32_t hash;           // low 32 bits of name_hash
+    uint32_t inode_id;       // 0 = never used [ends a probe], INDEX_TOMB = deleted
+};
+#define INDEX_TOMB UINT32_MAX
+
+// Reference count change since alloc_mark, see dedup.c
+struct refs_change {
+    uint64_t pblk;
+    uint32_t count;
+    int32_t delta;           // +1 a new owner, -1 one let go
+};
+
+// In-memory free space summary, segment tree over bitmap words
+struct alloc_node {
+    uint32_t prefix;         // free blocks at the start of the range
+    uint32_t suffix;         // free blocks at the end of the range
+    uint32_t best;           // longest free run inside the range
+};
+
+struct store_alloc {
+    uint64_t n_blocks;       // data blocks tracked
+    uint64_t n_free;
+    uint64_t *map;           // bitmap, 1 = used, padding bits past n_blocks are set
+    uint64_t n_words;
+    uint64_t leaves;         // power of two >= n_words
+    struct alloc_node *tree; // 1-indexed heap, leaves at [leaves, 2*leaves)
+    uint8_t *dirty;          // one byte per bitmap block to flush
+    uint32_t map_blocks;
+    uint64_t *pend;          // (bit, count) pairs freed in the open txn
+    uint32_t n_pend;
+    uint32_t cap_pend;
+    uint64_t pend_blocks;
+    uint64_t *log;           // (bit, count) pairs allocated since alloc_mark
+    uint32_t n_log;
+    uint32_t cap_log;
+    uint32_t mark_pend;      // n_pend at alloc_mark
+    uint32_t kept;           // pend runs from the front the readers table holds on to, see alloc_retire
+    bool retired;            // alloc_retire ran for the open txn ...
+    uint64_t table_jseq;     // ... and the readers table had this jseq before, for a failed commit
+    struct refs_change *shared;  // reference count changes since alloc_mark
+    uint32_t n_shared;
+    uint32_t cap_shared;
+    bool logging;
+    bool log_lost;           // log ran out of memory, undo can't free everything
+    uint64_t claim_bit;      // run alloc_claim holds, free in the on-disk bitmap until kept
+    uint64_t claim;          // its blocks, 0 = none
+    bool no_punch;           // the disk file can't have holes punched, freed blocks stay allocated on the host
+};
+
+// Metadata block images of the open journal txn
+struct store_txn {
+    uint64_t *blk;           // home block of each image
+    char *img;               // n images of sb.block bytes
+    uint32_t n;
+    uint32_t cap;
+    uint32_t *slot;          // open addressing over blk, image index + 1
+    uint32_t n_slot;
+    bool over;               // an image didn't fit the journal, the txn can only be dropped
+};
+
+struct store_journal {
+    uint32_t head;           // journal block replay would start at
+    uint32_t tail;           // journal block the next txn goes to
+    uint64_t head_seq;       // seq of the txn at head
+    uint64_t seq;            // seq of the next txn
+    uint64_t boot;
+    uint64_t commits;
+    uint64_t ios;            // writes and syncs commits issued [a batch counts each write]
+    struct store_txn txn;
+};
+
+// Position in the data checksum table, see cksum.c
+struct cksum_cursor {
+    uint64_t tblk;           // table block in ent
+    uint32_t *ent;
+    bool dirty;
+    char *tail;              // a file's last block padded with zeroes past EOF
+    uint64_t pin_blk;        // checked against pin_sum instead of the table, 0 = none [see reader_open]
+    uint32_t pin_sum;
+};
+
+enum io_backend {
+    IO_AUTO,                 // io_uring if the kernel lets us, else IO_THREADS
+    IO_URING,
+    IO_THREADS,              // worker threads doing blocking pread/pwrite
+};
+
+// One pread/pwrite for the I/O engine, see io.c
+struct io_req {
+    int fd;
+    bool write;
+    void *buf;
+    size_t len;
+    off_t off;
+    ssize_t res;             // bytes moved or -errno once reaped
+    bool done;               // reaped, by whoever pushed it or by someone's io_run
+    void *arg;               // the caller's
+    struct io_req *next;     // IO_THREADS lists
+};
+
+// Submission/completion queue, one per thread doing I/O
+struct io_queue {
+    enum io_backend backend;
+    unsigned depth;          // requests queued + in flight at most
+    unsigned queued;         // pushed, not submitted yet
+    unsigned inflight;       // submitted, not reaped yet
+    uint64_t submits;        // batches handed to the kernel/workers
+    // IO_URING
+    int ring_fd;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_sz;
+    size_t cq_sz;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned tail;           // our sq tail, published on submit
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // IO_THREADS
+    pthread_t *th;
+    unsigned n_th;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t finished;
+    struct io_req *pend;     // pushed, ours until submit
+    struct io_req *pend_tail;
+    struct io_req *todo;     // submitted, workers take from here
+    struct io_req *done;
+    bool stop;
+};
+
+// What an operation came to, ops.c, also the status the daemon replies with
+enum op_status {
+    ST_OK = 0,
+    ST_ERR = 1,
+    ST_NOENT = 2,
+    ST_INVAL = 3,
+    ST_NOSPC = 4,
+};
+
+/*
+Daemon protocol, see daemon.c
+A request is the header, then name_len bytes of name, then for inline writes
+len bytes of data. The reply is the header, then len bytes for inline reads and
+lists. All fields are host order, both ends are on the same machine.
+*/
+#define PROTO_MAGIC 0x53545244  // 'STRD'
+enum proto_op {
+    OP_WRITE = 1,            // replace name with the data
+    OP_APPEND = 2,           // add the data to the end of name
+    OP_READ = 3,             // len bytes of name from off
+    OP_LIST = 4,             // every file: u64 size, u8 name_len, name
+    OP_STATS = 5,            // struct store_stats of the daemon since it started
+    OP_REWRITE = 6,          // copy the disk into the new disk file at the path that follows, off = bytes/s
+    OP_SNAPSHOT = 7,         // snapshot the disk as name, off = 1 deletes snapshot name instead
+    OP_CLONE = 8,            // clone the file named by the data into name, the data may go on with '\0' and a snapshot
+    OP_DELETE = 9,           // remove name [an empty directory too]
+    OP_DEFRAG = 10,          // start moving fragmented files into one run each, off = bytes/s
+};
+#define RQ_FD    (1 << 0)    // an fd rides along [SCM_RIGHTS], write source or read target
+#define RQ_SYNC  (1 << 1)    // reply once the change is committed, else once it is applied
+#define RQ_LZ4   (1 << 2)    // write with compression on for this file
+#define RQ_RAW   (1 << 3)    // write with compression off for this file
+#define RQ_KEY   (1 << 4)    // write encrypted with key off for this file, off = 0 stores it in the clear
+
+struct proto_req {
+    uint32_t magic;
+    uint8_t op;              // enum proto_op
+    uint8_t flags;           // RQ_*
+    uint16_t name_len;       // < INODE_NAME
+    uint64_t off;
+    uint64_t len;            // data bytes that follow, bytes to read
+};
+
+struct proto_resp {
+    uint32_t magic;
+    int32_t status;          // enum op_status
+    uint64_t len;            // bytes written or read, payload bytes that follow
+};
+
+// Block cache, see cache.c
+struct cache_slot {
+    uint64_t blk;
+    uint32_t frame;          // index + 1, 0 = empty slot
+    uint32_t reserved;
+};
+
+struct block_cache {
+    uint32_t n_frames;
+    char *data;              // n_frames blocks
+    uint64_t *frame_blk;     // disk block each frame holds, UINT64_MAX = none
+    uint8_t *ref;            // clock bits, set on hit
+    uint32_t hand;
+    struct cache_slot *table;
+    uint32_t mask;           // table slots - 1
+    bool readahead;
+    uint64_t last;           // block asked for last
+    uint64_t window;         // blocks read ahead on the next sequential miss
+    char *ra_buf;            // CACHE_RA_MAX + 1 blocks
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t ra_blocks;      // read ahead of being asked for
+};
+
+/*
+Operation stats, see stats.c
+Every op has a latency histogram in the style of HDR: buckets are exact below
+2^STATS_SUB_BITS ns, above that each power of two is cut into 2^STATS_SUB_BITS
+equal buckets, so any value is off by at most 1/32 wherever it lands.
+*/
+enum stat_op {
+    SO_INIT,                 // command_init
+    SO_VERIFY,               // verify_disk
+    SO_SPACE,                // check_available_space
+    SO_WRITE,                // op_write, replacing a file
+    SO_APPEND,               // op_write, adding to one
+    SO_READ,                 // data_read
+    SO_LIST,                 // op_list
+    SO_RENAME,               // command_rename
+    SO_COMMIT,               // disk_commit
+    SO_REWRITE,              // rewrite_step
+    SO_SNAPSHOT,             // snap_create
+    SO_CLONE,                // snap_clone
+    SO_DIFF,                 // snap_diff
+    SO_APPLY,                // snap_apply
+    SO_SYNC,                 // sync_send
+    SO_IMPORT,               // import_run
+    SO_DELETE,               // op_delete
+    SO_DEFRAG,               // defrag_step
+    SO_COUNT,
+};
+
+enum stat_ctr {
+    SC_CACHE_HITS,
+    SC_CACHE_MISSES,
+    SC_CACHE_EVICTIONS,
+    SC_ALLOC_CALLS,          // alloc_extent/alloc_at that got blocks
+    SC_ALLOC_BLOCKS,
+    SC_FREED_BLOCKS,
+    SC_JOURNAL_BLOCKS,       // block images committed
+    SC_DEDUP_BLOCKS,         // blocks written as another reference to one on disk
+    SC_PUNCHED_BLOCKS,       // freed blocks punched out of the disk file
+    SC_COUNT,
+};
+
+#define STATS_SUB_BITS 5
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+#define STATS_MAGIC 0x53544154  // 'STAT'
+
+struct stats_hist {
+    uint64_t count;
+    uint64_t ns;             // sum
+    uint64_t max;
+    uint64_t bytes;          // moved by the op
+    uint64_t syscalls;
+    uint64_t b[STATS_BUCKETS];
+};
+
+struct store_stats {
+    struct stats_hist op[SO_COUNT];
+    uint64_t ctr[SC_COUNT];
+};
+
+// What sits in the disk name + ".stats" file
+struct stats_file {
+    uint32_t magic;
+    uint32_t size;           // sizeof(struct stats_file), a different layout starts over
+    uint64_t since;          // CLOCK_REALTIME seconds of the first save
+    struct store_stats s;
+};
+
+// Open disk, everything a command needs to touch metadata and data
+/*
+In-memory view of the inode table, see inode_alloc. The table is read a group
+of INODE_GROUP slots at a time the first time an allocation gets to it, so a
+disk opens without touching the table and a busy one is scanned once per run.
+*/
+struct inode_map {
+    uint64_t *free;          // 1 bit per slot, 1 = free, only meaningful in loaded groups
+    uint32_t *group_free;    // free slots per group, INODE_UNLOADED until it is read
+    uint64_t groups;
+    uint64_t loaded;         // groups read so far
+    uint64_t n_free;         // free slots in them
+};
+
+/*
+Readers table, the disk name + ".readers" file every handle of the disk maps so
+readers in other threads and processes can go alongside the writer, see readers.c
+*/
+#define READERS_MAGIC 0x52445253    // 'RDRS'
+#define READER_SLOTS 256
+#define READER_STRIPES 4096         // version counters, metadata block % READER_STRIPES
+#define RETIRE_MAX 16384
+#define RETIRE_WAIT_MS 2000         // how long a commit waits on readers for room in the table
+#define LOCK_WAIT_MS 100            // how long a writer waits out a reader holding the lock to check the disk
+
+struct reader_slot {
+    uint64_t epoch;          // epoch the reader came in at, 0 = free
+    uint32_t pid;
+    uint32_t reserved[13];   // a cache line each
+};
+
+struct retired_run {
+    uint64_t bit;            // allocator bit of the first block
+    uint64_t count;
+    uint64_t epoch;          // readers from before this epoch may still read the blocks
 };
 
+struct reader_table {
+    uint32_t magic;
+    uint32_t size;           // sizeof(struct reader_table)
+    uint64_t epoch;          // bumped by every checkpoint, starts at 1
+    uint64_t dev;            // disk file the retired runs belong to ...
+    uint64_t ino;
+    uint64_t jseq;           // ... as of this journal seq
+    uint32_t n_retired;
+    uint32_t reserved;
+    uint32_t ver[READER_STRIPES];   // odd while a checkpoint writes blocks of the stripe
+    struct reader_slot slot[READER_SLOTS];
+    struct retired_run retired[RETIRE_MAX];
+};
+
+struct reader_state {
+    struct reader_table *t;  // NULL when the table can't be mapped, reads then go unguarded
+    int slot;                // slot + 1 while the handle reads, 0 = not reading
+    uint64_t seen;           // epoch the handle last refreshed its superblock and cache at
+    uint64_t held[READER_STRIPES / 64];  // writer, stripes made odd by reader_ckpt_begin
+};
+
+
+struct store_disk {
+    int fd;
+    struct store_super_block sb;
+    struct store_alloc alloc;
+    char *map;               // read-only map of the whole disk, see disk_map
+    struct store_journal j;
+    struct io_queue *io;     // opened on first use, see disk_io
+    struct block_cache *cache;   // NULL = uncached, see cache_init
+    struct inode_map imap;
+    struct reader_state rd;
+    struct dcache_slot *dcache;  // DCACHE_SLOTS, made on first use
+};
+
+/*
+Copy of a disk into a new layout while the disk stays in use, see rewrite.c.
+Old inode slots are copied in order, a file that changes once the cursor is past
+it is marked and copied again before the switch.
+*/
+struct store_rewrite {
+    bool active;
+    struct store_disk to;
+    char *path;              // new disk file, renamed over the old one at the end
+    int buf;                 // memfd a batch goes through
+    uint64_t rate;           // bytes/s, 0 = as fast as it goes
+    uint64_t next_at;        // now_ns() the next step may start
+    uint32_t next;           // next old inode slot to look at
+    uint32_t cur;            // old slot being copied, 0 if none
+    uint64_t off;            // bytes of cur copied so far
+    uint64_t *redo;          // 1 bit per old slot, changed after it was copied
+    uint32_t n_redo;
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t t_start;
+};
+
+/*
+Snapshot manifest, the data of a FLAG_SNAPSHOT inode, see snap.c
+The header, then for every file its generation [uint64, 0 = unknown], a copy
+of its inode [extents cut at EOF, ext_block 0] and its n_extents extents, or
+its bytes padded to 8 when it is packed.
+*/
+#define SNAP_MAGIC 0x534E4150   // 'SNAP'
+struct snap_header {
+    uint32_t magic;
+    uint32_t n_files;
+    uint64_t created;        // CLOCK_REALTIME seconds
+    uint64_t bytes;          // file bytes the snapshot holds
+    uint64_t gen;            // sb.gen it was taken at, files written since have a higher one
+};
+
+// One file of a loaded snapshot, pointing into its manifest
+struct snap_entry {
+    const struct store_inode *ino;
+    const struct store_extent *ext;
+    const char *data;        // FLAG_PACKED files' bytes, else NULL
+    uint64_t gen;            // of the inode when the snapshot was taken
+};
+
+struct store_snap {
+    struct store_inode ino;      // the snapshot's own inode
+    struct snap_header h;
+    char *buf;                   // manifest
+    struct snap_entry *ent;      // h.n_files, by name
+};
+
+/*
+Diff stream from one snapshot to another, see snap.c [store diff | store apply]
+The header, then records up to DIFF_END, each followed by name_len bytes of
+name and for DIFF_DATA by len bytes of data. Host order, like the daemon protocol.
+*/
+#define DIFF_MAGIC 0x53444946   // 'SDIF'
+#define DIFF_VERSION 1
+#define DIFF_MIRROR (1 << 0)    // full stream, apply deletes the files it doesn't name
+#define DIFF_REPLACE (1 << 1)   // apply deletes the from snapshot once it has to [store sync]
+enum diff_type {
+    DIFF_FILE = 1,           // name is new or changed, off = its size, its DIFF_DATA records follow
+    DIFF_DATA = 2,           // len bytes at off of the last DIFF_FILE, whatever isn't sent is as it was
+    DIFF_DELETE = 3,         // name is gone
+    DIFF_END = 4,
+};
+
+struct diff_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;          // DIFF_MIRROR, DIFF_REPLACE
+    uint64_t created;        // of the to snapshot
+    char from[INODE_NAME];   // "" for a full stream
+    char to[INODE_NAME];
+};
+
+struct diff_rec {
+    uint8_t type;            // enum diff_type
+    uint8_t compression;     // DIFF_FILE, the file's enum store_compression
+    uint16_t name_len;
+    uint8_t key;             // DIFF_FILE, the file's key id, 0 when it isn't encrypted
+    uint8_t reserved[3];
+    uint64_t off;
+    uint64_t len;
+};
+
+// What snap_diff sent or snap_apply took in
+struct diff_stats {
+    uint64_t files;
+    uint64_t deleted;
+    uint64_t bytes;          // DIFF_DATA bytes
+    uint64_t shared;         // blocks apply kept from the files they replaced
+};
+
+struct import_stats {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t skipped;        // unreadable, not a regular file or a name that doesn't fit
+};
+
+// A loaded inode plus all its extents
+struct store_file {
+    struct store_inode ino;
+    struct store_extent *ext;    // inline extents first, then overflow
+    uint32_t n_ext;
+    uint32_t cap;
+    uint64_t *chain;             // overflow extent blocks in order
+    uint32_t n_chain;
+    char *data;                  // bytes of a packed file read along with the inode, NULL = read when needed
+    uint64_t tail_blk;           // partial last block and its checksum as of the inode, 0 = none
+    uint32_t tail_sum;           // [both set by reader_open]
+};
+
+/*
+Path -> loaded directory for path resolution, per handle, see dir.c
+Direct mapped by name_hash of the path, f.ino.name is checked against it.
+*/
+#define DCACHE_SLOTS 1024
+struct dcache_slot {
+    uint64_t hash;
+    struct store_file f;     // f.ino.inode_id 0 = empty
+};
+
+/*
+Online defrag of a disk in use, see defrag.c. One file is moved at a time, into
+a run claimed for all of its blocks [alloc_claim].
+*/
+struct store_defrag {
+    bool active;
+    uint64_t rate;           // bytes/s, 0 = as fast as it goes
+    uint64_t next_at;        // now_ns() the next step may start
+    uint32_t next;           // next inode slot to look at
+    struct store_file f;     // file being moved as it was when picked, ino.inode_id 0 if none
+    uint64_t to;             // first block of the claimed run
+    uint64_t blocks;         // its length, every block of f
+    uint64_t done;           // blocks copied into it so far
+    uint32_t ext;            // where the copy is in f, extent ...
+    uint64_t in;             // ... and block within it
+    uint32_t *sums;          // checksums [MACs] of the run, NULL for a file without
+    char *buf;               // DEFRAG_BATCH bytes
+    uint64_t files;
+    uint64_t runs;           // runs the files moved were in
+    uint64_t bytes;
+    uint64_t skipped;        // no free run long enough, or a checksum didn't match
+    uint64_t changed;        // written or shared while being copied, left where they were
+    uint64_t t_start;
+};
+
+// disk.c
+uint64_t now_ns();
+int disk_open(struct store_disk *d, const char *path, int flags);
+void disk_close(struct store_disk *d);
+int disk_hold(const char *path);
+struct store_disk *disk_held(const char *path);
+int disk_take(struct store_disk *d, const char *path, int flags);
+void disk_release();
+int disk_write_meta(struct store_disk *d, off_t off, const void *buf, size_t len);
+int disk_write_sb(struct store_disk *d);
+int disk_commit(struct store_disk *d);
+int inode_read(struct store_disk *d, uint32_t id, struct store_inode *ino);
+int inode_write(struct store_disk *d, const struct store_inode *ino);
+uint32_t inode_alloc(struct store_disk *d);
+int inode_free(struct store_disk *d, uint32_t id);
+uint64_t *inode_gens(struct store_disk *d);
+int file_load(struct store_disk *d, uint32_t id, struct store_file *f);
+int file_add_extent(struct store_file *f, uint64_t pblk, uint64_t count, uint32_t csize);
+int file_grow(struct store_disk *d, struct store_file *f, uint64_t blocks);
+uint64_t file_reserve(struct store_disk *d, struct store_file *f, uint64_t blocks);
+int file_release(struct store_disk *d, struct store_file *f);
+int file_truncate(struct store_disk *d, struct store_file *f, uint64_t blocks);
+int file_store(struct store_disk *d, struct store_file *f);
+void file_put(struct store_file *f);
+uint64_t file_map(const struct store_file *f, uint64_t lblk, uint64_t *run);
+const struct store_extent *file_extent(const struct store_file *f, uint64_t lblk);
+uint64_t ext_blocks(const struct store_disk *d, const struct store_extent *e);
+struct io_queue *disk_io(struct store_disk *d);
+int disk_write_batch(struct store_disk *d, struct io_req *reqs, unsigned n);
+
+// alloc.c
+int alloc_load(struct store_disk *d);
+void alloc_free_mem(struct store_alloc *a);
+uint64_t alloc_extent(struct store_disk *d, uint64_t want, uint64_t goal, uint64_t *pblk);
+uint64_t alloc_at(struct store_disk *d, uint64_t goal, uint64_t want);
+int alloc_claim(struct store_disk *d, uint64_t count, uint64_t *pblk);
+void alloc_unclaim(struct store_disk *d, bool keep);
+void alloc_release(struct store_disk *d, uint64_t pblk, uint64_t count);
+int alloc_flush(struct store_disk *d);
+void alloc_settle(struct store_disk *d, bool committed);
+void alloc_mark(struct store_disk *d);
+int alloc_undo(struct store_disk *d);
+void alloc_keep(struct store_disk *d);
+bool alloc_owned(struct store_disk *d, uint64_t pblk);
+int alloc_retire(struct store_disk *d);
+void alloc_reclaim(struct store_disk *d);
+
+// readers.c
+int reader_attach(struct store_disk *d, const char *path, bool writer);
+void reader_detach(struct store_disk *d);
+void reader_enter(struct store_disk *d);
+void reader_exit(struct store_disk *d);
+int reader_read(struct store_disk *d, off_t off, void *buf, size_t len);
+int reader_open(struct store_disk *d, const char *name, struct store_file *f);
+uint64_t reader_oldest(struct store_disk *d);
+void reader_ckpt_begin(struct store_disk *d, const uint64_t *blks, uint32_t n);
+void reader_ckpt_end(struct store_disk *d);
+
+// dir.c
+bool dir_hidden(const char *name);
+int dir_init(struct store_disk *d);
+int dir_link(struct store_disk *d, const char *name, uint32_t id, uint32_t flags);
+int dir_unlink(struct store_disk *d, const char *name, uint32_t id);
+int dir_remove(struct store_disk *d, const struct store_inode *ino);
+int dir_open(struct store_disk *d, const char *path, struct store_file *f);
+int dir_list(struct store_disk *d, const struct store_file *dir, int (*fn)(const struct store_dirent *e, void *arg),
+             void *arg);
+void dcache_drop(struct store_disk *d);
+
+// journal.c
+uint64_t cksum64(uint64_t h, const void *buf, size_t len);
+int journal_recover(struct store_disk *d);
+int journal_commit(struct store_disk *d);
+void journal_abort(struct store_disk *d);
+bool journal_full(const struct store_disk *d);
+void journal_free_mem(struct store_disk *d);
+int disk_read_meta(struct store_disk *d, off_t off, void *buf, size_t len);
+
+// index.c
+uint64_t name_hash(const char *name);
+int index_lookup(struct store_disk *d, const char *name, struct store_inode *ino);
+int index_lookup_snapshot(struct store_disk *d, const char *name, struct store_inode *ino);
+int index_insert(struct store_disk *d, const char *name, uint32_t id);
+int index_remove(struct store_disk *d, const char *name, uint32_t id);
+int index_rename(struct store_disk *d, const char *from, const char *to);
+
+// cksum.c
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_impl();
+uint64_t xxh64(const void *buf, size_t len, uint64_t seed);
+uint64_t cksum_buf(int type, const void *buf, size_t len);
+uint64_t sb_cksum(const struct store_super_block *sb);
+uint64_t inode_cksum(const struct store_disk *d, const struct store_inode *ino);
+uint32_t block_cksum(const struct store_disk *d, const void *buf);
+int cksum_record(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, const char *p, uint64_t n,
+                 uint32_t tail);
+int cksum_verify(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, const char *p, uint64_t n,
+                 uint32_t tail);
+int cksum_put(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, const uint32_t *sums, uint64_t n);
+int cksum_check(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, const uint32_t *sums, uint64_t n);
+int cksum_get(struct store_disk *d, struct cksum_cursor *c, uint64_t pblk, uint32_t *sum);
+int cksum_cursor_flush(struct store_disk *d, struct cksum_cursor *c);
+void cksum_cursor_free(struct cksum_cursor *c);
+
+// crypt.c
+struct crypt_key;
+int crypt_load(const char *path);
+const struct crypt_key *crypt_key(uint8_t id);
+const struct crypt_key *crypt_file_key(const struct store_inode *ino, bool *missing);
+const char *crypt_impl();
+void crypt_blocks_to(const struct crypt_key *k, uint64_t pblk, const void *src, void *dst, uint64_t n,
+                     uint32_t block, bool enc, uint32_t *macs);
+void crypt_blocks(const struct crypt_key *k, uint64_t pblk, void *p, uint64_t n, uint32_t block, bool enc,
+                  uint32_t *macs);
+
+// pack.c
+uint32_t pack_capacity(uint32_t block);
+int pack_store(struct store_disk *d, struct store_inode *ino, const char *data, uint64_t len);
+int pack_free(struct store_disk *d, const struct store_inode *ino);
+const char *pack_data(struct store_disk *d, const struct store_inode *ino, char *blk);
+
+// cache.c
+int cache_init(struct store_disk *d, uint64_t bytes, bool readahead);
+void cache_free(struct store_disk *d);
+const char *cache_get(struct store_disk *d, uint64_t blk);
+int cache_read(struct store_disk *d, off_t off, void *buf, size_t len);
+void cache_update(struct store_disk *d, uint64_t blk, const void *buf);
+void cache_drop(struct store_disk *d, off_t off, uint64_t len);
+void cache_report(const struct store_disk *d);
+
+// stats.c
+void stats_op(enum stat_op op, uint64_t ns, uint64_t bytes, uint64_t syscalls);
+void stats_add(enum stat_ctr c, uint64_t n);
+void stats_snapshot(struct store_stats *out);
+void stats_merge(struct store_stats *into, const struct store_stats *s);
+void stats_opened(void);
+int stats_save(const char *disk_path);
+int stats_load(const char *disk_path, struct stats_file *out);
+int stats_reset(const char *disk_path);
+void stats_print(const struct store_stats *s, uint64_t since, bool json);
+const char *stats_op_name(enum stat_op op);
+
+// io.c
+const char *io_backend_name(enum io_backend b);
+int io_queue_init(struct io_queue *q, unsigned depth, enum io_backend backend);
+void io_queue_free(struct io_queue *q);
+int io_push(struct io_queue *q, struct io_req *r);
+int io_submit(struct io_queue *q);
+struct io_req *io_reap(struct io_queue *q, bool wait);
+int io_run(struct io_queue *q, struct io_req *reqs, unsigned n);
+
+// ops.c
+const char *op_status_name(int st);
+int op_write(struct store_disk *d, const char *name, struct data_src *src, bool append, int compression,
+             int key, struct write_stats *ws);
+int op_open(struct store_disk *d, const char *name, struct store_file *f);
+int op_delete(struct store_disk *d, const char *name);
+int op_list(struct store_disk *d, int (*fn)(const struct store_inode *ino, void *arg), void *arg);
+int op_list_snapshots(struct store_disk *d, int (*fn)(const struct store_inode *ino, void *arg), void *arg);
+
+// dedup.c
+uint32_t dedup_lookup(struct store_disk *d, uint64_t hash, uint64_t *cand, uint32_t max);
+int dedup_insert(struct store_disk *d, uint64_t hash, uint64_t pblk);
+uint32_t dedup_refs(struct store_disk *d, uint64_t pblk);
+int dedup_share(struct store_disk *d, uint64_t pblk, uint64_t count);
+int dedup_revert(struct store_disk *d, const struct refs_change *c);
+void dedup_release(struct store_disk *d, uint64_t pblk, uint64_t count);
+
+// snap.c
+int snap_create(struct store_disk *d, const char *name);
+int snap_delete(struct store_disk *d, const char *name);
+int snap_open(struct store_disk *d, const char *name, struct store_snap *s);
+void snap_close(struct store_snap *s);
+int snap_info(struct store_disk *d, const struct store_inode *ino, struct snap_header *h);
+const struct snap_entry *snap_find(const struct store_snap *s, const char *name);
+int snap_read(struct store_disk *d, const struct snap_entry *e, uint64_t off, uint64_t len, int out_fd,
+              struct read_stats *rs);
+int snap_count(struct store_disk *d);
+int snap_clone(struct store_disk *d, const char *src, const char *dst, const char *snap);
+int snap_diff(struct store_disk *d, const char *from, const char *to, uint16_t flags, int out_fd,
+              struct diff_stats *ds);
+int snap_apply(struct store_disk *d, int in_fd, struct diff_stats *ds);
+
+// sync.c
+int sync_names(struct store_disk *d, const char *target, char *prev, char *next);
+int sync_send(struct store_disk *d, const char *from, const char *to, struct store_disk *t, int out_fd,
+              struct diff_stats *ds);
+
+// import.c
+int import_run(struct store_disk *d, const char *from, struct import_stats *is);
+
+// rewrite.c
+int rewrite_start(struct store_rewrite *rw, const struct store_disk *from, const char *path, uint64_t rate);
+int rewrite_step(struct store_rewrite *rw, struct store_disk *from);
+void rewrite_touch(struct store_rewrite *rw, uint32_t id);
+void rewrite_forget(struct store_rewrite *rw, uint32_t id, const char *name);
+int rewrite_finish(struct store_rewrite *rw, const char *over);
+void rewrite_abort(struct store_rewrite *rw);
+
+// defrag.c
+int defrag_start(struct store_defrag *df, uint64_t rate);
+int defrag_step(struct store_defrag *df, struct store_disk *d);
+void defrag_stop(struct store_defrag *df, struct store_disk *d);
+
+// daemon.c
+int daemon_run(const char *disk_path, const char *sock_path, uint64_t cache_size, bool readahead);
+
+// client.c
+int client_connect(const char *sock_path);
+int client_call(int s, const struct proto_req *rq, const char *name, int fd, const void *data,
+                struct proto_resp *resp);
+int client_recv(int s, void *buf, size_t len);
+int client_write(int s, const char *name, const void *data, uint64_t len, int op, int flags);
+int client_read(int s, const char *name, uint64_t off, void *buf, uint64_t len, uint64_t *got);
+
+// lz4.c
+size_t lz4_compress(const void *src, size_t n, void *dst, size_t cap);
+ssize_t lz4_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+// data.c
+int data_src_open(struct data_src *src);
+int data_write(struct store_disk *d, struct store_file *f, uint64_t pos, struct data_src *src,
+               struct write_stats *ws);
+const char *xfer_name(enum xfer_method m);
+int disk_map(struct store_disk *d);
+int data_read(struct store_disk *d, struct store_file *f, uint64_t off, uint64_t len, int out_fd,
+              enum read_mode mode, struct read_stats *rs);
 
 // Other Macros
 #define PATH_MAX 512
+#define INIT_BATCH (1 << 20)    // bytes per pwrite while formatting the inode table
+#define INODE_GROUP (INIT_BATCH / sizeof(struct store_inode))  // slots read at a time by inode_alloc
+#define INODE_UNLOADED UINT32_MAX
+#define WRITE_BUF (4 << 20)     // bounce buffer when the kernel can't copy for us
+#define STREAM_CHUNK (1 << 20)  // first allocation for a stream of unknown size
+#define STREAM_CHUNK_MAX (64 << 20)
+#define XFER_MAX (1 << 30)      // max bytes per copy syscall
+#define APPEND_WINDOW_MAX (8 << 20) // most an append reserves past EOF
+#define READ_SMALL (64 << 10)   // reads up to this size skip mmap
+#define READ_BUF (1 << 20)      // bounce buffer for pread reads
+#define JOURNAL_MAX 16384       // journal blocks at most
+#define CLUSTER (64 << 10)      // bytes compressed as one unit, multiple of the block size
+#define CLUSTER_SKIP 8          // incompressible clusters in a row before we stop trying every one
+#define CACHE_DEFAULT (32 << 20) // block cache budget unless [cache] size says otherwise
+#define CACHE_BYPASS (64 << 10) // metadata reads bigger than this skip the cache
+#define CACHE_RA_MAX 64         // blocks read ahead at most
+#define IO_DEPTH 32             // requests in flight per I/O queue
+#define IO_THREADS_MAX 8        // workers per queue for the thread backend
+#define COMMIT_MS 2             // longest an applied but unsynced daemon write waits for its commit
+#define DEDUP_RATIO 1           // data blocks per fingerprint index entry
+#define DEDUP_CAND 4            // fingerprint matches checked per block at most
+#define REWRITE_BATCH (8 << 20) // most a rewrite step copies
+#define DIFF_CHUNK (8 << 20)    // most one DIFF_DATA record carries
+#define REWRITE_SCAN 4096       // inode slots a rewrite step looks at most
+#define DEFRAG_BATCH (2 << 20)  // most a defrag step copies
+#define DEFRAG_RUN (8 << 20)    // files whose runs are this long on average are left alone
+#define DEFRAG_RATE (64 << 20)  // bytes/s store defrag copies at unless --rate says otherwise
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <signal.h>
+
+/*
+Sync
+Keeps a target up to date with the disk by shipping snapshot diffs [snap.c].
+Every sync takes a snapshot sync.<target>.<n> here and sends the diff from the
+one before [the whole snapshot as a DIFF_MIRROR stream when there is none, or
+the target lost it], the target applies it, takes the same snapshot and drops
+the one before [DIFF_REPLACE], which goes here too once the target has the new
+one. A disk keeps one sync snapshot per target.
+Only what changed goes across: files whose inode generation is the same in
+both snapshots are skipped without a look at their extents, the others send
+the blocks that map differently, so a 1MB change to a 1GB disk sends ~1MB.
+A target disk takes the stream while it is being made: the diff runs in a
+thread writing into a pipe, apply reads from it and writes each file in large
+data_write batches, committing whole files before the journal fills. A pipe
+target just gets the stream, store apply on the other end takes it in.
+*/
+
+#define SYNC_PIPE (1 << 20)    // pipe buffer between diff and apply, reads stay ahead of writes
+
+struct last_sync {
+    char prefix[16];         // sync.<hash of the target>.
+    uint64_t seq;            // 0 = none
+};
+
+static int note_sync(const struct store_inode *ino, void *arg) {
+    struct last_sync *l = arg;
+    size_t n = strlen(l->prefix);
+    if (strncmp(ino->name, l->prefix, n) == 0) {
+        uint64_t seq = strtoull(ino->name + n, NULL, 10);
+        if (seq > l->seq)
+            l->seq = seq;
+    }
+    return ST_OK;
+}
+
+/*
+Names of the last sync snapshot for target on the disk [prev, "" if there is
+none] and of the one to take now [next], both INODE_NAME bytes. target is the
+key the sync snapshots are told apart by, the target's real path.
+Returns 0 on success else 1
+*/
+int sync_names(struct store_disk *d, const char *target, char *prev, char *next) {
+    struct last_sync l = {0};
+    snprintf(l.prefix, sizeof(l.prefix), "sync.%08" PRIx32 ".", (uint32_t)xxh64(target, strlen(target), 0));
+    if (op_list_snapshots(d, note_sync, &l) != ST_OK)
+        return 1;
+    prev[0] = '\0';
+    if (l.seq)
+        snprintf(prev, INODE_NAME, "%s%" PRIu64, l.prefix, l.seq);
+    snprintf(next, INODE_NAME, "%s%" PRIu64, l.prefix, l.seq + 1);
+    return 0;
+}
+
+struct sender {
+    struct store_disk *d;
+    const char *from;
+    const char *to;
+    int fd;                  // write end of the pipe, closed once the stream is out
+    struct diff_stats ds;
+    int st;
+};
+
+static void *send_thread(void *arg) {
+    struct sender *s = arg;
+    // apply giving up closes the pipe, the diff gets EPIPE instead of the signal
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    s->st = snap_diff(s->d, s->from, s->to, s->from ? DIFF_REPLACE : DIFF_MIRROR, s->fd, &s->ds);
+    close(s->fd);
+    return NULL;
+}
+
+/*
+Sends the diff from snapshot from [NULL for all of to, as a mirror] to snapshot
+to of d, applied on t while it is made when t isn't NULL, else written to
+out_fd. ds gets what the target took in [what was sent for out_fd].
+Returns an enum op_status, t isn't committed
+*/
+int sync_send(struct store_disk *d, const char *from, const char *to, struct store_disk *t, int out_fd,
+              struct diff_stats *ds) {
+    uint64_t t_start = now_ns();
+    int st;
+    if (!t) {
+        st = snap_diff(d, from, to, from ? DIFF_REPLACE : DIFF_MIRROR, out_fd, ds);
+        stats_op(SO_SYNC, now_ns() - t_start, ds->bytes, 0);
+        return st;
+    }
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) != 0) {
+        perror("pipe");
+        return ST_ERR;
+    }
+    // a small pipe would have the two sides take turns
+    fcntl(p[1], F_SETPIPE_SZ, SYNC_PIPE);
+    struct sender s = { .d = d, .from = from, .to = to, .fd = p[1] };
+    pthread_t th;
+    if (pthread_create(&th, NULL, send_thread, &s) != 0) {
+        printf("Unable to start the diff\n");
+        close(p[0]);
+        close(p[1]);
+        return ST_ERR;
+    }
+    st = snap_apply(t, p[0], ds);
+    close(p[0]);
+    pthread_join(th, NULL);
+    if (st == ST_OK && s.st != ST_OK)
+        st = s.st;
+    stats_op(SO_SYNC, now_ns() - t_start, ds->bytes, 0);
+    return st;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Command line checks, run from the repo root after make [make test does both].
+# Each one runs ./store against a scratch disk and compares what comes out.
+set -u
+DISK=${TMPDIR:-/tmp}/store_cli_test.disk
+fails=0
+
+# check what expected actual
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1: expected '$2', got '$3'"
+        fails=$((fails + 1))
+    fi
+}
+
+fresh() {
+    rm -f "$DISK"
+    ./store init -dn "$DISK" -ds 64MB > /dev/null
+}
+
+# rename takes its names from around the options, not from right after it
+fresh
+echo hello | ./store write a --disk "$DISK" > /dev/null
+./store rename --disk "$DISK" a b > /dev/null
+check "rename with --disk before the names" hello "$(./store read b --disk "$DISK")"
+check "rename leaves no old name" 1 "$(./store read a --disk "$DISK" > /dev/null 2>&1; echo $?)"
+./store rename b -ds "$DISK" c > /dev/null
+check "rename with -ds between the names" hello "$(./store read c -ds "$DISK")"
+check "rename with one name fails" 1 "$(./store rename c -ds "$DISK" > /dev/null 2>&1; echo $?)"
+
+rm -f "$DISK" "$DISK".*
+[ "$fails" -eq 0 ]